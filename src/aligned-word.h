@@ -25,14 +25,19 @@ struct AlignedWord {
   std::int64_t start_time;
   std::int64_t duration;
   std::string word_symbol;
+  /// Id of word_symbol in the model's word symbols, negative if unknown, e.g.
+  /// for words the formatter produced. Not part of the comparison.
+  std::int64_t word_id;
 
   AlignedWord(std::chrono::milliseconds start_time,
-              std::chrono::milliseconds duration, std::string word_symbol)
+              std::chrono::milliseconds duration, std::string word_symbol,
+              std::int64_t word_id = -1)
       : start_time{start_time.count()},
         duration{duration.count()},
-        word_symbol{word_symbol} {};
+        word_symbol{word_symbol},
+        word_id{word_id} {};
 
-  AlignedWord() : start_time{0}, duration{0}, word_symbol{""} {}
+  AlignedWord() : start_time{0}, duration{0}, word_symbol{""}, word_id{-1} {}
 
   bool operator!=(const AlignedWord& other) const {
     return !(start_time == other.start_time && duration == other.duration &&
@@ -0,0 +1,46 @@
+// Copyright 2021 Tiro ehf.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "src/api/google-conversion.h"
+
+#include <string>
+
+namespace tiro_speech {
+
+void ConvertRecognizeRequest(google::cloud::speech::v1::RecognizeRequest* from,
+                             tiro::speech::v1alpha::RecognizeRequest* to) {
+  using google::cloud::speech::v1::RecognitionAudio;
+
+  if (from->has_config()) {
+    to->mutable_config()->ParseFromString(from->config().SerializeAsString());
+  }
+
+  if (from->has_audio()) {
+    switch (from->audio().audio_source_case()) {
+      case RecognitionAudio::kContent:
+        // Swapping the strings works regardless of which arenas the two
+        // messages live on, since the string objects stay with their owners.
+        to->mutable_audio()->mutable_content()->swap(
+            *from->mutable_audio()->mutable_content());
+        break;
+      case RecognitionAudio::kUri:
+        to->mutable_audio()->set_uri(from->audio().uri());
+        break;
+      default:
+        to->mutable_audio();
+        break;
+    }
+  }
+}
+
+}  // namespace tiro_speech
@@ -0,0 +1,35 @@
+// Copyright 2021 Tiro ehf.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef TIRO_SPEECH_SRC_API_GOOGLE_CONVERSION_H_
+#define TIRO_SPEECH_SRC_API_GOOGLE_CONVERSION_H_
+
+#include "google/cloud/speech/v1/cloud_speech.pb.h"
+#include "proto/tiro/speech/v1alpha/speech.pb.h"
+
+namespace tiro_speech {
+
+/**
+ * Convert a Google Cloud Speech API RecognizeRequest to a
+ * tiro.speech.v1alpha.RecognizeRequest.
+ *
+ * The inline audio content is moved, not copied, so \p from is left without
+ * audio content. Only the (small) config message goes through serialization,
+ * which is possible since the two APIs are wire compatible.
+ */
+void ConvertRecognizeRequest(google::cloud::speech::v1::RecognizeRequest* from,
+                             tiro::speech::v1alpha::RecognizeRequest* to);
+
+}  // namespace tiro_speech
+
+#endif  // TIRO_SPEECH_SRC_API_GOOGLE_CONVERSION_H_
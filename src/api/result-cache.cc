@@ -0,0 +1,279 @@
+// Copyright 2021 Tiro ehf.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "src/api/result-cache.h"
+
+#include <fmt/format.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+#include <openssl/sha.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <limits>
+#include <random>
+#include <string_view>
+#include <system_error>
+#include <tuple>
+#include <vector>
+
+#include "src/logging.h"
+
+namespace tiro_speech {
+
+namespace {
+
+/// Feed \p data into \p ctx, prefixed with its length so that adjacent fields
+/// can't be confused with each other.
+void UpdateField(SHA256_CTX* ctx, std::string_view data) {
+  const std::uint64_t size = data.size();
+  SHA256_Update(ctx, &size, sizeof size);
+  SHA256_Update(ctx, data.data(), data.size());
+}
+
+std::string ToHex(const unsigned char* digest, std::size_t size) {
+  static constexpr char kHexDigits[] = "0123456789abcdef";
+  std::string hex(2 * size, '\0');
+  for (std::size_t i = 0; i < size; ++i) {
+    hex[2 * i] = kHexDigits[digest[i] >> 4];
+    hex[2 * i + 1] = kHexDigits[digest[i] & 0xf];
+  }
+  return hex;
+}
+
+/// Evict down to this fraction of the limit, so we don't evict on every insert
+constexpr double kDiskEvictionTarget = 0.9;
+
+/// Unique among threads and processes, including other servers sharing the
+/// directory
+std::string TempFileSuffix() {
+  thread_local std::mt19937_64 rng{std::random_device{}()};
+  return fmt::format(".tmp.{}.{:016x}", ::getpid(), rng());
+}
+
+}  // namespace
+
+RecognizeResultCache::RecognizeResultCache(
+    const RecognizeResultCacheOptions& opts)
+    : opts_{opts}, disk_cache_dir_{opts.disk_cache_dir} {
+  if (!disk_cache_dir_.empty()) {
+    std::filesystem::create_directories(disk_cache_dir_);
+    disk_usage_bytes_ = EvictDisk(
+        opts_.disk_max_megabytes > 0
+            ? static_cast<std::uintmax_t>(opts_.disk_max_megabytes) << 20
+            : std::numeric_limits<std::uintmax_t>::max());
+  }
+  TIRO_SPEECH_INFO(
+      "Caching Recognize results (max-entries={}, disk-cache-dir='{}')",
+      opts_.max_entries, opts_.disk_cache_dir);
+}
+
+std::string RecognizeResultCache::Key(
+    const RecognizeRequest& request,
+    const std::string& model_fingerprint) const {
+  using tiro::speech::v1alpha::RecognitionAudio;
+  if (request.audio().audio_source_case() == RecognitionAudio::kUri &&
+      !opts_.cache_uri_requests) {
+    return "";
+  }
+
+  // Field order in the serialized config is stable, but map ordering is not
+  // unless we ask for it.
+  std::string config_bytes;
+  {
+    google::protobuf::io::StringOutputStream os{&config_bytes};
+    google::protobuf::io::CodedOutputStream coded_os{&os};
+    coded_os.SetSerializationDeterministic(true);
+    request.config().SerializeToCodedStream(&coded_os);
+  }
+
+  SHA256_CTX ctx;
+  SHA256_Init(&ctx);
+  UpdateField(&ctx, opts_.version_tag);
+  UpdateField(&ctx, model_fingerprint);
+  UpdateField(&ctx, config_bytes);
+  switch (request.audio().audio_source_case()) {
+    case RecognitionAudio::kContent:
+      UpdateField(&ctx, "content");
+      UpdateField(&ctx, request.audio().content());
+      break;
+    case RecognitionAudio::kUri:
+      UpdateField(&ctx, "uri");
+      UpdateField(&ctx, request.audio().uri());
+      break;
+    default:
+      return "";
+  }
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+  SHA256_Final(digest, &ctx);
+  return ToHex(digest, SHA256_DIGEST_LENGTH);
+}
+
+bool RecognizeResultCache::Lookup(const std::string& key,
+                                  RecognizeResponse* response) {
+  std::shared_ptr<const RecognizeResponse> cached = LookupMemory(key);
+  if (cached == nullptr && !disk_cache_dir_.empty()) {
+    cached = LookupDisk(key);
+    if (cached != nullptr) {
+      InsertMemory(key, cached);
+    }
+  }
+  if (cached == nullptr) {
+    misses_++;
+    TIRO_SPEECH_DEBUG("Result cache miss for {}", key);
+    return false;
+  }
+  hits_++;
+  TIRO_SPEECH_DEBUG("Result cache hit for {}", key);
+  response->CopyFrom(*cached);
+  return true;
+}
+
+void RecognizeResultCache::Insert(const std::string& key,
+                                  const RecognizeResponse& response) {
+  if (!disk_cache_dir_.empty()) {
+    InsertDisk(key, response);
+  }
+  InsertMemory(key, std::make_shared<const RecognizeResponse>(response));
+}
+
+std::shared_ptr<const RecognizeResultCache::RecognizeResponse>
+RecognizeResultCache::LookupMemory(const std::string& key) {
+  std::lock_guard<std::mutex> lock{mutex_};
+  auto it = index_.find(key);
+  if (it == index_.end()) {
+    return nullptr;
+  }
+  lru_.splice(lru_.begin(), lru_, it->second);
+  return it->second->second;
+}
+
+void RecognizeResultCache::InsertMemory(
+    const std::string& key, std::shared_ptr<const RecognizeResponse> response) {
+  if (opts_.max_entries <= 0) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock{mutex_};
+  if (auto it = index_.find(key); it != index_.end()) {
+    it->second->second = std::move(response);
+    lru_.splice(lru_.begin(), lru_, it->second);
+    return;
+  }
+  lru_.emplace_front(key, std::move(response));
+  index_[key] = lru_.begin();
+  while (lru_.size() > static_cast<std::size_t>(opts_.max_entries)) {
+    index_.erase(lru_.back().first);
+    lru_.pop_back();
+  }
+}
+
+std::shared_ptr<const RecognizeResultCache::RecognizeResponse>
+RecognizeResultCache::LookupDisk(const std::string& key) {
+  std::ifstream is{disk_cache_dir_ / (key + ".pb"), std::ios::binary};
+  if (!is) {
+    return nullptr;
+  }
+  auto response = std::make_shared<RecognizeResponse>();
+  if (!response->ParseFromIstream(&is)) {
+    TIRO_SPEECH_WARN("Ignoring corrupt result cache entry {}", key);
+    return nullptr;
+  }
+  // The modification time doubles as the last use, for eviction
+  using FileClock = std::filesystem::file_time_type::clock;
+  std::error_code ec;
+  std::filesystem::last_write_time(disk_cache_dir_ / (key + ".pb"),
+                                   FileClock::now(), ec);
+  return response;
+}
+
+void RecognizeResultCache::InsertDisk(const std::string& key,
+                                      const RecognizeResponse& response) {
+  // Write to a temporary file first and rename, so concurrent readers (and
+  // other servers sharing the directory) never see a partial entry.
+  const std::filesystem::path path = disk_cache_dir_ / (key + ".pb");
+  std::filesystem::path tmp_path = path;
+  tmp_path += TempFileSuffix();
+  {
+    std::ofstream os{tmp_path, std::ios::binary | std::ios::trunc};
+    if (!os || !response.SerializeToOstream(&os)) {
+      TIRO_SPEECH_WARN("Could not write result cache entry to {}",
+                       tmp_path.string());
+      return;
+    }
+  }
+  std::error_code ec;
+  const std::uintmax_t size = std::filesystem::file_size(tmp_path, ec);
+  std::filesystem::rename(tmp_path, path, ec);
+  if (ec) {
+    TIRO_SPEECH_WARN("Could not write result cache entry to {}: {}",
+                     path.string(), ec.message());
+    std::filesystem::remove(tmp_path, ec);
+    return;
+  }
+
+  if (opts_.disk_max_megabytes <= 0) {
+    return;
+  }
+  const std::uintmax_t max_bytes =
+      static_cast<std::uintmax_t>(opts_.disk_max_megabytes) << 20;
+  std::lock_guard<std::mutex> lock{disk_mutex_};
+  disk_usage_bytes_ += size;
+  if (disk_usage_bytes_ > max_bytes) {
+    disk_usage_bytes_ = EvictDisk(kDiskEvictionTarget * max_bytes);
+  }
+}
+
+std::uintmax_t RecognizeResultCache::EvictDisk(std::uintmax_t target_bytes) {
+  // (last use, size, path) of each entry
+  std::vector<std::tuple<std::filesystem::file_time_type, std::uintmax_t,
+                         std::filesystem::path>>
+      entries;
+  std::uintmax_t total_bytes = 0;
+  std::error_code ec;
+  for (const auto& dir_entry :
+       std::filesystem::directory_iterator{disk_cache_dir_, ec}) {
+    if (dir_entry.path().extension() != ".pb") {
+      continue;
+    }
+    const std::uintmax_t size = dir_entry.file_size(ec);
+    const auto mtime = dir_entry.last_write_time(ec);
+    if (ec) {
+      // Most likely removed by another server in the meantime
+      ec.clear();
+      continue;
+    }
+    entries.emplace_back(mtime, size, dir_entry.path());
+    total_bytes += size;
+  }
+  if (total_bytes <= target_bytes) {
+    return total_bytes;
+  }
+
+  std::sort(entries.begin(), entries.end());
+  std::size_t n_removed = 0;
+  for (const auto& [mtime, size, path] : entries) {
+    if (total_bytes <= target_bytes) {
+      break;
+    }
+    if (std::filesystem::remove(path, ec)) {
+      n_removed++;
+    }
+    total_bytes -= size;
+  }
+  TIRO_SPEECH_DEBUG("Removed {} result cache entries from disk", n_removed);
+  return total_bytes;
+}
+
+}  // namespace tiro_speech
@@ -0,0 +1,142 @@
+// Copyright 2021 Tiro ehf.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef TIRO_SPEECH_SRC_API_RESULT_CACHE_H_
+#define TIRO_SPEECH_SRC_API_RESULT_CACHE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include "proto/tiro/speech/v1alpha/speech.pb.h"
+#include "src/options.h"
+#include "src/utils.h"
+
+namespace tiro_speech {
+
+struct RecognizeResultCacheOptions {
+  int max_entries = 0;
+  std::string disk_cache_dir = "";
+  int disk_max_megabytes = 1024;
+  bool cache_uri_requests = false;
+  std::string version_tag = "";
+
+  void Register(OptionsItf* opts) {
+    opts->Register("max-entries", &max_entries,
+                   "Max number of Recognize responses kept in memory. 0 "
+                   "disables the in-memory tier.");
+    opts->Register("disk-cache-dir", &disk_cache_dir,
+                   "Directory where Recognize responses are persisted. Empty "
+                   "disables the on-disk tier.");
+    opts->Register("disk-max-megabytes", &disk_max_megabytes,
+                   "Max size of the on-disk tier. The least recently used "
+                   "entries are removed when it grows larger. 0 means no "
+                   "limit.");
+    opts->Register("cache-uri-requests", &cache_uri_requests,
+                   "Also cache requests with audio given as a URI. Only "
+                   "enable this if the content behind a URI never changes.");
+    opts->Register("version-tag", &version_tag,
+                   "Arbitrary tag that is part of every cache key. Model "
+                   "files are already part of the key, so this is only "
+                   "needed to invalidate entries for other reasons.");
+  }
+
+  bool Enabled() const { return max_entries > 0 || !disk_cache_dir.empty(); }
+};
+
+/** \class RecognizeResultCache
+ * \brief Content addressed cache of Recognize responses
+ *
+ * Entries are keyed by a SHA-256 digest of everything that affects the result:
+ * the version tag, the model fingerprint, the recognition config
+ * (punctuation, word offsets, alternatives, diarization, ...) and the audio
+ * content. Requests with a URI are keyed by the URI itself and only cached if
+ * RecognizeResultCacheOptions::cache_uri_requests is set.
+ *
+ * There are two tiers, an in-memory LRU and an optional directory of
+ * serialized responses, which survives restarts and can be shared between
+ * servers. Entries found on disk are promoted to the in-memory tier. The
+ * directory is kept below RecognizeResultCacheOptions::disk_max_megabytes by
+ * removing the entries that were used least recently.
+ *
+ * Thread safe.
+ */
+class RecognizeResultCache : no_copy_or_move {
+ public:
+  using RecognizeRequest = tiro::speech::v1alpha::RecognizeRequest;
+  using RecognizeResponse = tiro::speech::v1alpha::RecognizeResponse;
+
+  explicit RecognizeResultCache(const RecognizeResultCacheOptions& opts);
+
+  /**
+   * Compute the cache key for \p request to a model with the fingerprint \p
+   * model_fingerprint. Returns an empty string if the request shouldn't be
+   * cached.
+   */
+  std::string Key(const RecognizeRequest& request,
+                  const std::string& model_fingerprint) const;
+
+  /**
+   * Look up \p key and copy the stored response into \p response. Returns
+   * false on a miss, in which case \p response is untouched.
+   */
+  bool Lookup(const std::string& key, RecognizeResponse* response);
+
+  void Insert(const std::string& key, const RecognizeResponse& response);
+
+  std::uint64_t Hits() const { return hits_; }
+  std::uint64_t Misses() const { return misses_; }
+
+ private:
+  using Entry =
+      std::pair<std::string, std::shared_ptr<const RecognizeResponse>>;
+
+  std::shared_ptr<const RecognizeResponse> LookupMemory(const std::string& key);
+  void InsertMemory(const std::string& key,
+                    std::shared_ptr<const RecognizeResponse> response);
+
+  std::shared_ptr<const RecognizeResponse> LookupDisk(const std::string& key);
+  void InsertDisk(const std::string& key, const RecognizeResponse& response);
+
+  /**
+   * Remove the least recently used entries on disk until they take up at most
+   * \p target_bytes. Returns the size of the remaining entries. Other servers
+   * may write to the directory too, so this looks at all of its entries.
+   */
+  std::uintmax_t EvictDisk(std::uintmax_t target_bytes);
+
+  const RecognizeResultCacheOptions opts_;
+  const std::filesystem::path disk_cache_dir_;
+
+  std::mutex mutex_;
+  // Most recently used entry in front
+  std::list<Entry> lru_;
+  std::unordered_map<std::string, std::list<Entry>::iterator> index_;
+
+  std::mutex disk_mutex_;
+  // Estimated size of the on-disk tier, resynced on each eviction
+  std::uintmax_t disk_usage_bytes_ = 0;
+
+  std::atomic<std::uint64_t> hits_ = 0;
+  std::atomic<std::uint64_t> misses_ = 0;
+};
+
+}  // namespace tiro_speech
+
+#endif  // TIRO_SPEECH_SRC_API_RESULT_CACHE_H_
@@ -22,16 +22,26 @@
 #include <online2/onlinebin-util.h>
 #include <readerwriterqueue.h>
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <deque>
+#include <functional>
+#include <future>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <string>
+#include <thread>
 #include <utility>
+#include <vector>
 
 #include "google/rpc/code.pb.h"
 #include "google/rpc/error_details.pb.h"
 #include "google/rpc/status.pb.h"
 #include "proto/tiro/speech/v1alpha/speech.grpc.pb.h"
 #include "src/aligned-word.h"
+#include "src/api/google-conversion.h"
 #include "src/api/utils.h"
 #include "src/api/validation.h"
 #include "src/audio/audio-source.h"
@@ -39,7 +49,10 @@
 #include "src/audio/ffmpeg-wrapper.h"
 #include "src/base.h"
 #include "src/diarization.h"
+#include "src/itn/formatter.h"
+#include "src/itn/punctuation.h"
 #include "src/logging.h"
+#include "src/queue.h"
 #include "src/recognizer.h"
 #include "src/utils.h"
 #include "src/vad.h"
@@ -123,38 +136,331 @@ void TagSpeaker(
   }
 }
 
+/// A chunk of audio for a worker. \c flush is set for the last chunk. The
+/// waveform is shared by all workers reading the chunk.
+struct AudioChunk {
+  std::shared_ptr<const Vector> waveform;
+  bool flush;
+};
+
+/// Feeds a worker, std::nullopt marks the end of input
+using ChunkQueue = ThreadSafeQueue<std::optional<AudioChunk>>;
+using FeatureQueue = ThreadSafeQueue<std::optional<kaldi::Matrix<float>>>;
+
+/**
+ * Copy the frames of \p features that are ready, starting at
+ * \p num_frames_taken, and update it.
+ */
+kaldi::Matrix<float> TakeNewFrames(kaldi::OnlineFeatureInterface* features,
+                                   std::int32_t* num_frames_taken) {
+  kaldi::Matrix<float> frames(features->NumFramesReady() - *num_frames_taken,
+                              features->Dim(), kaldi::kUndefined);
+  for (std::int32_t row = 0; row < frames.NumRows(); ++row) {
+    kaldi::SubVector<float> frame{frames, row};
+    features->GetFrame(*num_frames_taken + row, &frame);
+  }
+  *num_frames_taken += frames.NumRows();
+  return frames;
+}
+
+std::int32_t SpeakerCount(std::int32_t min_speaker_count) {
+  return min_speaker_count > 2 ? min_speaker_count : 2;
+}
+
+/**
+ * Recognize all audio in \p audio_src and add the alternatives to \p result.
+ * The audio source has to be opened already.
+ */
+grpc::Status RecognizeAudioSource(
+    const KaldiModel& model,
+    const tiro::speech::v1alpha::RecognitionConfig& config,
+    AudioSourceItf& audio_src,
+    tiro::speech::v1alpha::SpeechRecognitionResult* res) {
+  Recognizer utt_recognizer{model};
+
+  // Audio is read on this thread and fanned out to separate workers for
+  // recognition and diarization, so the latency is close to the slower of the
+  // two instead of their sum. We only join the diarization worker right before
+  // the speaker tags are needed.
+  //
+  // If the diarization MFCCs can be derived from the ASR features, the
+  // diarizer is fed those by the decoding worker instead of the audio, so the
+  // framing and FFTs are only computed once.
+  //
+  // The queues are declared before the futures, so they outlive the workers
+  // on every path out of this function: the futures of std::async join their
+  // threads when destroyed. They are bounded, so a slow worker holds back the
+  // reader instead of the whole audio piling up in memory. A worker that
+  // throws closes the queues it reads from, so nobody blocks pushing to it.
+  constexpr std::size_t kMaxQueuedChunks = 64;
+  const bool share_features = model.diarization_feature_transform.has_value();
+  ChunkQueue decoder_queue{kMaxQueuedChunks};
+  ChunkQueue diarizer_queue{kMaxQueuedChunks};
+  FeatureQueue diarizer_feature_queue{kMaxQueuedChunks};
+
+  // Not valid if diarization not enabled
+  std::future<std::vector<DiarizationSegment>> diarization;
+
+  if (model.diarization_info != nullptr &&
+      config.diarization_config().enable_speaker_diarization()) {
+    diarization = std::async(std::launch::async, [&]() {
+      try {
+        std::unique_ptr<XvectorDiarizationDecoder> diarizer;
+        if (share_features) {
+          diarizer = std::make_unique<XvectorDiarizationDecoder>(
+              *model.diarization_info, *model.diarization_feature_transform);
+          while (std::optional<kaldi::Matrix<float>> feats =
+                     diarizer_feature_queue.blocking_pop()) {
+            diarizer->AcceptFeatures(*feats);
+          }
+        } else {
+          diarizer = std::make_unique<XvectorDiarizationDecoder>(
+              *model.diarization_info);
+          while (std::optional<AudioChunk> chunk =
+                     diarizer_queue.blocking_pop()) {
+            diarizer->AcceptWaveform(config.sample_rate_hertz(),
+                                     *chunk->waveform);
+          }
+        }
+        diarizer->InputFinished();
+        return diarizer->Compute(
+            SpeakerCount(config.diarization_config().min_speaker_count()));
+      } catch (...) {
+        diarizer_feature_queue.close();
+        diarizer_queue.close();
+        throw;
+      }
+    });
+    std::future<void> decoding = std::async(std::launch::async, [&]() {
+      std::int32_t num_frames_shared = 0;
+      try {
+        while (std::optional<AudioChunk> chunk =
+                   decoder_queue.blocking_pop()) {
+          utt_recognizer.Decode(*chunk->waveform, chunk->flush);
+          if (share_features) {
+            diarizer_feature_queue.push(TakeNewFrames(
+                utt_recognizer.InputFeature(), &num_frames_shared));
+          }
+        }
+      } catch (...) {
+        decoder_queue.close();
+        diarizer_feature_queue.push(std::nullopt);
+        throw;
+      }
+      diarizer_feature_queue.push(std::nullopt);
+    });
+
+    auto end_input = [&]() {
+      decoder_queue.push(std::nullopt);
+      diarizer_queue.push(std::nullopt);
+    };
+    try {
+      while (audio_src.HasMoreChunks()) {
+        auto chunk = audio_src.NextChunk();
+        if (chunk.Dim() > 0) {
+          AudioChunk audio_chunk{std::make_shared<const Vector>(chunk),
+                                 !audio_src.HasMoreChunks()};
+          if (!share_features) {
+            diarizer_queue.push(audio_chunk);
+          }
+          if (!decoder_queue.push(std::move(audio_chunk))) {
+            // Decoding failed, decoding.get() reports why
+            break;
+          }
+        }
+      }
+    } catch (...) {
+      end_input();
+      throw;
+    }
+    end_input();
+    decoding.get();
+  } else {
+    while (audio_src.HasMoreChunks()) {
+      auto chunk = audio_src.NextChunk();
+      if (chunk.Dim() > 0) {
+        utt_recognizer.Decode(chunk, /* flush */ !audio_src.HasMoreChunks());
+      }
+    }
+  }
+  utt_recognizer.Finalize();
+
+  std::vector<AlignedWord> first_alignments;
+  std::vector<std::string> transcripts;
+  const int max_alternatives =
+      config.max_alternatives() == 0 ? 1 : config.max_alternatives();
+  if (!utt_recognizer.GetResults(
+          max_alternatives, &first_alignments, &transcripts,
+          /* end_of_utt */ true,
+          /* punctuate */ config.enable_automatic_punctuation())) {
+    TIRO_SPEECH_WARN("Could not get transcripts.");
+  }
+
+  if (transcripts.empty()) {
+    TIRO_SPEECH_ERROR("Couldn't generate transcripts.");
+    return grpc::Status{grpc::StatusCode::INTERNAL, "Something bad happened."};
+  }
+
+  using tiro::speech::v1alpha::SpeechRecognitionAlternative;
+
+  if (config.enable_word_time_offsets()) {
+    if (first_alignments.empty()) {
+      TIRO_SPEECH_WARN("Couldn't get word alignment.");
+      return grpc::Status{grpc::StatusCode::INTERNAL,
+                          "Something bad happened."};
+    }
+    SpeechRecognitionAlternative* first_alternative = res->add_alternatives();
+    for (const auto& ali : first_alignments) {
+      first_alternative->set_transcript(transcripts[0]);
+      auto* word = first_alternative->add_words();
+      Convert(ali, word);
+    }
+    if (diarization.valid()) {
+      TagSpeaker(*model.diarization_info, diarization.get(),
+                 first_alternative);
+    }
+  }
+
+  for (auto it =
+           transcripts.cbegin() + (config.enable_word_time_offsets() ? 1 : 0);
+       it != transcripts.end(); ++it) {
+    SpeechRecognitionAlternative* alt = res->add_alternatives();
+    alt->set_transcript(*it);
+  }
+
+  return grpc::Status::OK;
+}
+
 }  // namespace
 
+SpeechService::RpcMetrics::RpcMetrics()
+    : duration_seconds{
+          {0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0, 30.0, 60.0, 300.0, 900.0}} {}
+
+void SpeechService::RpcMetrics::Observe(
+    std::chrono::steady_clock::time_point start, const grpc::Status& status) {
+  duration_seconds.Observe(
+      std::chrono::duration<double>{std::chrono::steady_clock::now() - start}
+          .count());
+  if (status.error_code() == grpc::StatusCode::INVALID_ARGUMENT) {
+    rejected.Add();
+  }
+}
+
 grpc::Status SpeechService::Recognize(grpc::ServerContext* context,
                                       const RecognizeRequest* request,
                                       RecognizeResponse* response) {
+  const auto start = std::chrono::steady_clock::now();
+  std::string cache_key;
+  const auto model =
+      models_.find({request->config().language_code(), "generic"});
+  if (result_cache_ != nullptr && model != models_.end()) {
+    cache_key = result_cache_->Key(*request, model->second->fingerprint);
+    if (!cache_key.empty() && result_cache_->Lookup(cache_key, response)) {
+      recognize_metrics_.Observe(start, grpc::Status::OK);
+      return grpc::Status::OK;
+    }
+  }
+
+  grpc::Status status = RecognizeUncached(*request, response);
+  if (status.ok() && !cache_key.empty()) {
+    result_cache_->Insert(cache_key, *response);
+  }
+  recognize_metrics_.Observe(start, status);
+  return status;
+}
+
+grpc::Status SpeechService::RecognizeUncached(const RecognizeRequest& request,
+                                              RecognizeResponse* response) {
   using tiro::speech::v1alpha::RecognitionAudio;
+  using tiro::speech::v1alpha::SpeechRecognitionResult;
   try {
-    grpc::Status stat = ErrorVecToStatus(Validate(*request, &models_));
+    grpc::Status stat = ErrorVecToStatus(Validate(request, &models_));
     if (!stat.ok()) {
       return stat;
     }
 
     std::shared_ptr<const KaldiModel> model =
-        models_.at({request->config().language_code(), "generic"});
-    Recognizer utt_recognizer{*model};
+        models_.at({request.config().language_code(), "generic"});
+
+    const int num_channels =
+        std::max(request.config().audio_channel_count(), 1);
+    if (num_channels > 1 &&
+        request.config().enable_separate_recognition_per_channel()) {
+      std::vector<std::unique_ptr<AudioSourceItf>> channel_srcs;
+      switch (request.audio().audio_source_case()) {
+        case RecognitionAudio::kContent: {
+          channel_srcs = CreateAudioSourcesPerChannel(
+              AudioSourceInfo{AudioSourceInfo::Type::kContent,
+                              Convert(request.config().encoding()),
+                              request.config().sample_rate_hertz(),
+                              num_channels},
+              request.audio().content());
+          break;
+        }
+        case RecognitionAudio::kUri: {
+          channel_srcs = CreateAudioSourcesPerChannelFromUri(
+              AudioSourceInfo{AudioSourceInfo::Type::kUri,
+                              Convert(request.config().encoding()),
+                              request.config().sample_rate_hertz(),
+                              num_channels},
+              request.audio().uri());
+          break;
+        }
+        default:
+          TIRO_SPEECH_ERROR("This shouldn't happen");
+          throw std::logic_error{""};
+      }
+
+      // Each channel gets its own Recognizer on a separate worker
+      std::vector<SpeechRecognitionResult> channel_results(
+          channel_srcs.size());
+      std::vector<std::future<grpc::Status>> channel_statuses;
+      channel_statuses.reserve(channel_srcs.size());
+      for (std::size_t ch = 0; ch < channel_srcs.size(); ++ch) {
+        channel_statuses.push_back(
+            std::async(std::launch::async, [&, ch]() -> grpc::Status {
+              channel_srcs[ch]->Open();
+              return RecognizeAudioSource(*model, request.config(),
+                                          *channel_srcs[ch],
+                                          &channel_results[ch]);
+            }));
+      }
+      grpc::Status status = grpc::Status::OK;
+      for (auto& channel_status : channel_statuses) {
+        if (grpc::Status ch_status = channel_status.get();
+            !ch_status.ok() && status.ok()) {
+          status = ch_status;
+        }
+      }
+      if (!status.ok()) {
+        return status;
+      }
+      for (std::size_t ch = 0; ch < channel_results.size(); ++ch) {
+        channel_results[ch].set_channel_tag(ch + 1);
+        response->add_results()->Swap(&channel_results[ch]);
+      }
+      return grpc::Status::OK;
+    }
 
     std::unique_ptr<AudioSourceItf> audio_src{nullptr};
-    switch (request->audio().audio_source_case()) {
+    switch (request.audio().audio_source_case()) {
       case RecognitionAudio::kContent: {
         audio_src = std::make_unique<ContentAudioSource>(
             AudioSourceInfo{AudioSourceInfo::Type::kContent,
-                            Convert(request->config().encoding()),
-                            request->config().sample_rate_hertz()},
-            request->audio().content(), request->config().sample_rate_hertz());
+                            Convert(request.config().encoding()),
+                            request.config().sample_rate_hertz(),
+                            num_channels},
+            request.audio().content(), request.config().sample_rate_hertz());
         break;
       }
       case RecognitionAudio::kUri: {
         audio_src = CreateAudioSourceFromUri(
             AudioSourceInfo{AudioSourceInfo::Type::kUri,
-                            Convert(request->config().encoding()),
-                            request->config().sample_rate_hertz()},
-            request->audio().uri());
+                            Convert(request.config().encoding()),
+                            request.config().sample_rate_hertz(),
+                            num_channels},
+            request.audio().uri());
         break;
       }
       default:
@@ -162,85 +468,9 @@ grpc::Status SpeechService::Recognize(grpc::ServerContext* context,
         throw std::logic_error{""};
     }
 
-    // Left empty if diarization not enabled
-    std::vector<DiarizationSegment> diarization_decisions;
-
     audio_src->Open();
-    if (model->diarization_info != nullptr &&
-        request->config().diarization_config().enable_speaker_diarization()) {
-      // This is a bit little ugly
-      XvectorDiarizationDecoder diarizer{*model->diarization_info};
-      while (audio_src->HasMoreChunks()) {
-        auto chunk = audio_src->NextChunk();
-        if (chunk.Dim() > 0) {
-          utt_recognizer.Decode(chunk, /* flush */ !audio_src->HasMoreChunks());
-          diarizer.AcceptWaveform(request->config().sample_rate_hertz(), chunk);
-        }
-      }
-      diarizer.InputFinished();
-      std::int32_t speaker_count =
-          request->config().diarization_config().min_speaker_count() > 2
-              ? request->config().diarization_config().min_speaker_count()
-              : 2;
-      diarization_decisions = diarizer.Compute(speaker_count);
-    } else {
-      while (audio_src->HasMoreChunks()) {
-        auto chunk = audio_src->NextChunk();
-        if (chunk.Dim() > 0) {
-          utt_recognizer.Decode(chunk, /* flush */ !audio_src->HasMoreChunks());
-        }
-      }
-    }
-    utt_recognizer.Finalize();
-
-    std::vector<AlignedWord> first_alignments;
-    std::vector<std::string> transcripts;
-    const int max_alternatives = request->config().max_alternatives() == 0
-                                     ? 1
-                                     : request->config().max_alternatives();
-    if (!utt_recognizer.GetResults(
-            max_alternatives, &first_alignments, &transcripts,
-            /* end_of_utt */ true,
-            /* punctuate */ request->config().enable_automatic_punctuation())) {
-      TIRO_SPEECH_WARN("Could not get transcripts.");
-    }
-
-    if (transcripts.empty()) {
-      TIRO_SPEECH_ERROR("Couldn't generate transcripts.");
-      return grpc::Status{grpc::StatusCode::INTERNAL,
-                          "Something bad happened."};
-    }
-
-    using tiro::speech::v1alpha::SpeechRecognitionAlternative;
-    using tiro::speech::v1alpha::SpeechRecognitionResult;
-
-    SpeechRecognitionResult* res = response->add_results();
-    if (request->config().enable_word_time_offsets()) {
-      if (first_alignments.empty()) {
-        TIRO_SPEECH_WARN("Couldn't get word alignment.");
-        return grpc::Status{grpc::StatusCode::INTERNAL,
-                            "Something bad happened."};
-      }
-      SpeechRecognitionAlternative* first_alternative = res->add_alternatives();
-      for (const auto& ali : first_alignments) {
-        first_alternative->set_transcript(transcripts[0]);
-        auto* word = first_alternative->add_words();
-        Convert(ali, word);
-      }
-      if (model->diarization_info != nullptr) {
-        TagSpeaker(*model->diarization_info, diarization_decisions,
-                   first_alternative);
-      }
-    }
-
-    for (auto it = transcripts.cbegin() +
-                   (request->config().enable_word_time_offsets() ? 1 : 0);
-         it != transcripts.end(); ++it) {
-      SpeechRecognitionAlternative* alt = res->add_alternatives();
-      alt->set_transcript(*it);
-    }
-
-    return grpc::Status::OK;
+    return RecognizeAudioSource(*model, request.config(), *audio_src,
+                                response->add_results());
   } catch (const AudioSourceError& ex) {
     TIRO_SPEECH_DEBUG("Caught AudioSourceError");
     return grpc::Status{grpc::StatusCode::INVALID_ARGUMENT,
@@ -290,16 +520,325 @@ class ChunkConverter {
   kaldi::LinearResample resampler_;
 };
 
-grpc::Status RunStreamingProcessor(
+using RecognizeStream =
     grpc::ServerReaderWriter<tiro::speech::v1alpha::StreamingRecognizeResponse,
-                             tiro::speech::v1alpha::StreamingRecognizeRequest>*
-        stream,
+                             tiro::speech::v1alpha::StreamingRecognizeRequest>;
+
+/// Reads the next chunk of audio into its argument, returns false when there is
+/// no more audio.
+using ChunkReader = std::function<bool(std::string*)>;
+
+/// Writes a response to the client, returns false if the stream is broken.
+using ResponseWriter = std::function<bool(
+    const tiro::speech::v1alpha::StreamingRecognizeResponse&)>;
+
+bool ReadAudioContent(RecognizeStream* stream, std::string* chunk) {
+  tiro::speech::v1alpha::StreamingRecognizeRequest req;
+  if (!stream->Read(&req) || req.audio_content().empty() ||
+      req.audio_content() == "END") {
+    return false;
+  }
+  chunk->swap(*req.mutable_audio_content());
+  return true;
+}
+
+/**
+ * Punctuates the final results of a stream in order on its own thread, and
+ * writes each of them again as a revision of the unpunctuated result that was
+ * already written. The decoding thread never waits for the punctuation model.
+ *
+ * Since results are punctuated one after another, this keeps the punctuation
+ * left context of the stream instead of the Recognizer.
+ */
+class DeferredPunctuator : no_copy_or_move {
+ public:
+  DeferredPunctuator(std::shared_ptr<itn::ElectraPunctuator> punctuator,
+                     ResponseWriter write)
+      : punctuator_{std::move(punctuator)}, write_{std::move(write)} {
+    worker_ = std::thread{&DeferredPunctuator::Run, this};
+  }
+
+  ~DeferredPunctuator() { Finish(); }
+
+  /**
+   * Queue the final result \p result, whose best hypothesis consists of
+   * \p words, to be punctuated.
+   */
+  void Add(tiro::speech::v1alpha::StreamingRecognitionResult result,
+           std::vector<AlignedWord> words) {
+    jobs_.push(std::optional<Job>{Job{std::move(result), std::move(words)}});
+  }
+
+  /**
+   * Wait until all queued results have been punctuated and written.
+   *
+   * \return false if writing a result failed
+   */
+  bool Finish() {
+    if (worker_.joinable()) {
+      jobs_.push(std::optional<Job>{});
+      worker_.join();
+    }
+    return !write_failed_;
+  }
+
+ private:
+  struct Job {
+    tiro::speech::v1alpha::StreamingRecognitionResult result;
+    std::vector<AlignedWord> words;
+  };
+
+  void Run() {
+    std::vector<std::string> left_context;
+    std::vector<int> left_context_pieces;
+    while (std::optional<Job> job = jobs_.blocking_pop()) {
+      if (write_failed_ || job->words.empty() ||
+          job->result.alternatives_size() == 0) {
+        continue;
+      }
+      try {
+        std::vector<std::string> words;
+        std::vector<std::int64_t> word_ids;
+        for (const AlignedWord& word : job->words) {
+          words.push_back(word.word_symbol);
+          word_ids.push_back(word.word_id);
+        }
+        std::vector<int> next_left_context_pieces;
+        std::vector<std::string> punctuated = punctuator_->PunctuateWithContext(
+            words, left_context, left_context_pieces, &next_left_context_pieces,
+            /* capitalize */ true, word_ids);
+        if (left_context.empty()) {
+          itn::Capitalize(punctuated.at(0));
+        }
+
+        auto* alt = job->result.mutable_alternatives(0);
+        alt->set_transcript(Join(punctuated, " "));
+        if (alt->words_size() == static_cast<int>(punctuated.size())) {
+          for (int idx = 0; idx < alt->words_size(); ++idx) {
+            alt->mutable_words(idx)->set_word(punctuated[idx]);
+          }
+        }
+        job->result.set_revision(job->result.revision() + 1);
+
+        left_context = std::move(punctuated);
+        left_context_pieces = std::move(next_left_context_pieces);
+
+        tiro::speech::v1alpha::StreamingRecognizeResponse res;
+        *res.add_results() = std::move(job->result);
+        if (!write_(res)) {
+          TIRO_SPEECH_DEBUG(
+              "Write failed. Client may have killed the connection");
+          write_failed_ = true;
+        }
+      } catch (const std::exception& e) {
+        // The unpunctuated result has already been written
+        TIRO_SPEECH_WARN("Deferred punctuation failed: {}", e.what());
+      }
+    }
+  }
+
+  std::shared_ptr<itn::ElectraPunctuator> punctuator_;
+  ResponseWriter write_;
+  ThreadSafeQueue<std::optional<Job>> jobs_;
+  std::atomic<bool> write_failed_{false};
+  std::thread worker_;
+};
+
+/**
+ * Diarizes a stream on its own thread, and tags the words of each final result
+ * with speakers once the audio up to its end has been diarized. Tagged results
+ * are handed to \p revise in order. Like DeferredPunctuator, this keeps
+ * x-vector extraction and clustering, whose cost grows with the length of the
+ * stream, off the decoding thread.
+ *
+ * The diarizer sees all audio, so its frames are relative to the start of the
+ * stream like result offsets.
+ *
+ * The queue is bounded, so the decoding thread waits if diarization falls far
+ * behind. Results that have queued up meanwhile are tagged together, with a
+ * single clustering, and each clustering only revisits the latest segments,
+ * see XvectorClusteringOptions::streaming_window_segments. If the tagger is
+ * destroyed without Finish(), e.g. because the stream was cancelled, pending
+ * results are dropped.
+ */
+class DeferredSpeakerTagger : no_copy_or_move {
+ public:
+  /// Returns false if the revised result couldn't be written
+  using ResultReviser =
+      std::function<bool(tiro::speech::v1alpha::StreamingRecognitionResult,
+                         std::vector<AlignedWord>)>;
+
+  DeferredSpeakerTagger(const XvectorDiarizationDecoderInfo& info,
+                        int sample_rate, int num_speakers,
+                        ResultReviser revise)
+      : info_{info},
+        diarizer_{info, info.opts.max_segment_frames > 0
+                            ? info.opts.max_segment_frames
+                            : kDefaultMaxSegmentFrames},
+        sample_rate_{sample_rate},
+        num_speakers_{num_speakers},
+        revise_{std::move(revise)},
+        jobs_{kMaxQueuedJobs} {
+    worker_ = std::thread{&DeferredSpeakerTagger::Run, this};
+  }
+
+  ~DeferredSpeakerTagger() {
+    cancelled_ = true;
+    Finish();
+  }
+
+  void AcceptWaveform(const Vector& waveform) {
+    Job job;
+    job.waveform = waveform;
+    jobs_.push(std::optional<Job>{std::move(job)});
+  }
+
+  /**
+   * Queue the final result \p result, whose best hypothesis consists of
+   * \p words, to be tagged once the audio accepted so far has been diarized.
+   */
+  void Add(tiro::speech::v1alpha::StreamingRecognitionResult result,
+           std::vector<AlignedWord> words) {
+    Job job;
+    job.result = std::move(result);
+    job.words = std::move(words);
+    jobs_.push(std::optional<Job>{std::move(job)});
+  }
+
+  /**
+   * Wait until all queued results have been tagged and handed on.
+   *
+   * \return false if writing a result failed
+   */
+  bool Finish() {
+    if (worker_.joinable()) {
+      jobs_.push(std::optional<Job>{});
+      worker_.join();
+    }
+    return !write_failed_;
+  }
+
+ private:
+  /// Either audio for the diarizer, or a result to tag
+  struct Job {
+    Vector waveform;
+    std::optional<tiro::speech::v1alpha::StreamingRecognitionResult> result;
+    std::vector<AlignedWord> words;
+  };
+
+  /// About 10 s with the usual 10 ms frame shift
+  static constexpr std::int32_t kDefaultMaxSegmentFrames = 1000;
+  /// Chunks are usually about 100 ms
+  static constexpr std::size_t kMaxQueuedJobs = 128;
+
+  void Run() {
+    // The diarizer may be in an inconsistent state after an error, so it isn't
+    // used again
+    bool diarizer_failed = false;
+    bool done = false;
+    std::vector<Job> results;
+    while (!done) {
+      // Wait for the next result, and take any results queued behind it along
+      // with the audio in between, so they share one clustering
+      results.clear();
+      std::optional<Job> job = jobs_.blocking_pop();
+      do {
+        if (!job.has_value()) {
+          done = true;
+          break;
+        }
+        if (cancelled_ || write_failed_) {
+          continue;
+        }
+        if (job->result.has_value()) {
+          results.push_back(std::move(*job));
+        } else if (!diarizer_failed) {
+          try {
+            diarizer_.AcceptWaveform(sample_rate_, job->waveform);
+          } catch (const std::exception& e) {
+            TIRO_SPEECH_WARN("Deferred speaker tagging failed: {}", e.what());
+            diarizer_failed = true;
+          }
+        }
+      } while (!results.empty() && jobs_.try_pop(&job));
+      if (results.empty() || cancelled_) {
+        continue;
+      }
+
+      if (!diarizer_failed) {
+        try {
+          diarizer_.FlushSegment();
+          const std::vector<DiarizationSegment> segments = diarizer_.Compute(
+              num_speakers_,
+              info_.opts.clustering_opts.streaming_window_segments);
+          for (Job& result : results) {
+            if (result.result->alternatives_size() > 0) {
+              TagSpeaker(info_, segments,
+                         result.result->mutable_alternatives(0));
+            }
+          }
+        } catch (const std::exception& e) {
+          // The untagged results have already been written, but they are still
+          // handed on below in case they are also to be punctuated
+          TIRO_SPEECH_WARN("Deferred speaker tagging failed: {}", e.what());
+          diarizer_failed = true;
+        }
+      }
+      for (Job& result : results) {
+        if (write_failed_ || cancelled_) {
+          break;
+        }
+        if (!revise_(std::move(*result.result), std::move(result.words))) {
+          TIRO_SPEECH_DEBUG(
+              "Write failed. Client may have killed the connection");
+          write_failed_ = true;
+        }
+      }
+    }
+  }
+
+  const XvectorDiarizationDecoderInfo& info_;
+  XvectorDiarizationDecoder diarizer_;
+  const int sample_rate_;
+  const int num_speakers_;
+  ResultReviser revise_;
+  ThreadSafeQueue<std::optional<Job>> jobs_;
+  std::atomic<bool> write_failed_{false};
+  std::atomic<bool> cancelled_{false};
+  std::thread worker_;
+};
+
+/**
+ * Recognize a single channel of audio, as read by \p read_chunk, and write
+ * results with \p unsynchronized_write. If \p channel_tag is positive all
+ * results are tagged with it.
+ */
+grpc::Status RunStreamingProcessor(
+    const ChunkReader& read_chunk, const ResponseWriter& unsynchronized_write,
     const tiro::speech::v1alpha::StreamingRecognitionConfig& streaming_config,
-    const KaldiModel& recognizer_model) {
+    const KaldiModel& recognizer_model, int channel_tag = 0) {
   using tiro::speech::v1alpha::StreamingRecognitionResult;
   using tiro::speech::v1alpha::StreamingRecognizeRequest;
   using tiro::speech::v1alpha::StreamingRecognizeResponse;
 
+  // Results may also be written by the deferred punctuator's thread
+  std::mutex write_mutex;
+  const ResponseWriter write = [&](const StreamingRecognizeResponse& res) {
+    std::lock_guard<std::mutex> lock{write_mutex};
+    return unsynchronized_write(res);
+  };
+
+  std::unique_ptr<DeferredPunctuator> deferred_punctuator;
+  if (streaming_config.deferred_punctuation() &&
+      streaming_config.config().enable_automatic_punctuation() &&
+      recognizer_model.punctuator != nullptr) {
+    deferred_punctuator = std::make_unique<DeferredPunctuator>(
+        recognizer_model.punctuator, write);
+  }
+  const bool punctuate =
+      streaming_config.config().enable_automatic_punctuation() &&
+      deferred_punctuator == nullptr;
+
   kaldi::OnlineIvectorExtractorAdaptationState adaptation_state{
       recognizer_model.initial_adaptation_state};
 
@@ -311,9 +850,36 @@ grpc::Status RunStreamingProcessor(
   bool more_data = true;
   bool end_of_single_utterance = false;
   std::vector<AlignedWord> left_context{};
+  std::vector<int> left_context_pieces{};
+
+  // Speaker tags are only added to final results, in a revision. If the result
+  // is also to be punctuated, the tagged result goes on to the deferred
+  // punctuator, so the client gets a single revision with both.
+  const auto& diarization_config =
+      streaming_config.config().diarization_config();
+  std::unique_ptr<DeferredSpeakerTagger> speaker_tagger;
+  if (recognizer_model.diarization_info != nullptr &&
+      diarization_config.enable_speaker_diarization() &&
+      streaming_config.config().enable_word_time_offsets()) {
+    speaker_tagger = std::make_unique<DeferredSpeakerTagger>(
+        *recognizer_model.diarization_info, model_sample_rate,
+        SpeakerCount(diarization_config.min_speaker_count()),
+        [&](StreamingRecognitionResult result, std::vector<AlignedWord> words) {
+          if (deferred_punctuator != nullptr) {
+            deferred_punctuator->Add(std::move(result), std::move(words));
+            return true;
+          }
+          result.set_revision(result.revision() + 1);
+          StreamingRecognizeResponse res;
+          *res.add_results() = std::move(result);
+          return write(res);
+        });
+  }
 
+  // If \p words isn't null it is set to the words of the best hypothesis
   auto add_results = [&](Recognizer& recognizer, bool is_final, int offset,
-                         StreamingRecognizeResponse& res) -> grpc::Status {
+                         StreamingRecognizeResponse& res,
+                         std::vector<AlignedWord>* words) -> grpc::Status {
     std::vector<AlignedWord> best_aligned;
     std::vector<std::string> transcripts;
     int max_alternatives = streaming_config.config().max_alternatives() == 0
@@ -322,15 +888,20 @@ grpc::Status RunStreamingProcessor(
 
     if (recognizer.GetResults(
             is_final ? max_alternatives : 1, &best_aligned, &transcripts,
-            /* end_of_utt */ is_final,
-            /* punctuate */
-            streaming_config.config().enable_automatic_punctuation())) {
+            /* end_of_utt */ is_final, punctuate)) {
       StreamingRecognitionResult result{};
       result.set_is_final(is_final);
+      result.set_result_index(result_index);
+      if (channel_tag > 0) {
+        result.set_channel_tag(channel_tag);
+      }
 
       if (transcripts.empty()) {
         return grpc::Status{grpc::StatusCode::INTERNAL, "Unexpected failure."};
       }
+      if (words != nullptr) {
+        *words = best_aligned;
+      }
       if (streaming_config.config().enable_word_time_offsets()) {
         if (best_aligned.empty()) {
           TIRO_SPEECH_DEBUG(
@@ -357,8 +928,18 @@ grpc::Status RunStreamingProcessor(
 
   milliseconds processed_time{0};
 
+  // Non-speech audio is never decoded. It is either skipped at the start of a
+  // segment, which we keep track of in vad_offset, or it ends the segment once
+  // the gate closes. Skipped audio that turns out to precede speech is released
+  // by the gate as pre-roll and decoded after all.
+  VadGate vad_gate{CreateVadEngine(recognizer_model), model_sample_rate,
+                   recognizer_model.config.vad_config};
+  milliseconds skipped_time{0};
+  milliseconds reported_skipped_time{0};
+
   while (result_index++, more_data && !end_of_single_utterance) {
-    Recognizer recognizer{recognizer_model, adaptation_state, left_context};
+    Recognizer recognizer{recognizer_model, adaptation_state, left_context,
+                          left_context_pieces};
 
     milliseconds segment_time{0};
     auto last_interim_result_time = std::chrono::system_clock::now();
@@ -366,15 +947,13 @@ grpc::Status RunStreamingProcessor(
     std::string last_transcript = "";
     bool endpoint_detected = false;
 
-    Vad vad{kDefaultSampleRate, 30};
+    vad_gate.Close();
     milliseconds vad_offset{0};
     bool speech_started = false;
 
-    StreamingRecognizeRequest req;
+    std::string chunk;
     while (!endpoint_detected) {
-      more_data = stream->Read(&req) && !(req.audio_content().empty() ||
-                                          req.audio_content() == "END");
-      std::string chunk = *req.mutable_audio_content();
+      more_data = read_chunk(&chunk);
 
       if (!more_data) {
         TIRO_SPEECH_DEBUG("No more data in queue.");
@@ -385,57 +964,66 @@ grpc::Status RunStreamingProcessor(
           milliseconds{1000 * n_samples / sample_rate};
       segment_time += chunk_time;
 
-      Vector waveform = chunk_converter.ToWaveform(chunk, more_data);
+      const Vector converted = chunk_converter.ToWaveform(chunk, more_data);
+      if (speaker_tagger != nullptr) {
+        speaker_tagger->AcceptWaveform(converted);
+      }
 
-      if (!speech_started) {
-        if ((speech_started = vad.HasSpeech(waveform))) {
-          TIRO_SPEECH_DEBUG("Skipped {} ms of audio because of VAD",
-                            vad_offset.count());
-          // TODO(rkjaran): pad start of next segment with silence... correctly
-          // Vector padded_waveform{waveform.Dim() + 2048};
-          // padded_waveform.Range(2048, waveform.Dim()).CopyFromVec(waveform);
-          // waveform.Resize(padded_waveform.Dim());
-          // waveform.CopyFromVec(padded_waveform);
-        } else {
+      Vector waveform;
+      if (!vad_gate.Accept(converted, &waveform)) {
+        skipped_time += chunk_time;
+        if (!speech_started) {
           vad_offset += chunk_time;
+          continue;
         }
+        TIRO_SPEECH_DEBUG("Ending segment because of VAD");
+        break;
       }
 
-      if (speech_started) {
-        recognizer.Decode(waveform, !more_data);
-        endpoint_detected = recognizer.HasEndpoint();
-
-        if (streaming_config.interim_results() && !endpoint_detected) {
-          auto now = std::chrono::system_clock::now();
-          if (recognizer.NumFramesDecoded() > 0 &&
-              now - last_interim_result_time > 350ms) {
-            // TODO(rkjaran): use GetResults and send a time aligned response
-            StreamingRecognizeResponse res;
-
-            // XXX: the inefficient way of doing this... We should be checking
-            //      the decoder traceback
-            // TODO(rkjaran): Cleanup the Recognizer interface so that we can
-            //                efficiently check for updates in the traceback.
-            std::string cur_transcript = recognizer.GetBestHypothesis(false);
-            if (cur_transcript != last_transcript) {
-              last_transcript = std::move(cur_transcript);
-              const auto offset =
-                  duration_cast<milliseconds>(vad_offset + processed_time)
-                      .count();
-              grpc::Status status =
-                  add_results(recognizer, /* is_final */ false, offset, res);
-              if (!status.ok()) {
-                return status;
-              }
-              if (res.results_size() > 0) {
-                if (!stream->Write(res)) {
-                  TIRO_SPEECH_DEBUG(
-                      "Write failed. Client may have killed the connection");
-                  return grpc::Status::CANCELLED;
-                }
+      if (!speech_started) {
+        speech_started = true;
+        const milliseconds preroll_time{
+            1000 * vad_gate.ReleasedPrerollSamples() / model_sample_rate};
+        vad_offset -= preroll_time;
+        skipped_time -= preroll_time;
+        TIRO_SPEECH_DEBUG("Skipped {} ms of audio because of VAD",
+                          vad_offset.count());
+      }
+
+      recognizer.Decode(waveform, !more_data);
+      endpoint_detected = recognizer.HasEndpoint();
+
+      if (streaming_config.interim_results() && !endpoint_detected) {
+        auto now = std::chrono::system_clock::now();
+        if (recognizer.NumFramesDecoded() > 0 &&
+            now - last_interim_result_time > 350ms) {
+          // TODO(rkjaran): use GetResults and send a time aligned response
+          StreamingRecognizeResponse res;
+
+          // XXX: the inefficient way of doing this... We should be checking
+          //      the decoder traceback
+          // TODO(rkjaran): Cleanup the Recognizer interface so that we can
+          //                efficiently check for updates in the traceback.
+          std::string cur_transcript = recognizer.GetBestHypothesis(false);
+          if (cur_transcript != last_transcript) {
+            last_transcript = std::move(cur_transcript);
+            const auto offset =
+                duration_cast<milliseconds>(vad_offset + processed_time)
+                    .count();
+            grpc::Status status =
+                add_results(recognizer, /* is_final */ false, offset, res,
+                            /* words */ nullptr);
+            if (!status.ok()) {
+              return status;
+            }
+            if (res.results_size() > 0) {
+              if (!write(res)) {
+                TIRO_SPEECH_DEBUG(
+                    "Write failed. Client may have killed the connection");
+                return grpc::Status::CANCELLED;
               }
-              last_interim_result_time = now;
             }
+            last_interim_result_time = now;
           }
         }
       }
@@ -452,18 +1040,27 @@ grpc::Status RunStreamingProcessor(
       const auto offset =
           duration_cast<milliseconds>(vad_offset + processed_time).count();
 
-      if (grpc::Status status =
-              add_results(recognizer, /* is_final */ true, offset, res);
+      std::vector<AlignedWord> words;
+      if (grpc::Status status = add_results(recognizer, /* is_final */ true,
+                                            offset, res, &words);
           !status.ok()) {
         return status;
       }
 
       TIRO_SPEECH_DEBUG("Left context is now {}", recognizer.GetLeftContext());
       left_context = recognizer.GetLeftContext();
+      left_context_pieces = recognizer.GetLeftContextPieces();
 
-      if (!stream->Write(res)) {
+      if (!write(res)) {
         return grpc::Status::CANCELLED;
       }
+      if (res.results_size() > 0) {
+        if (speaker_tagger != nullptr) {
+          speaker_tagger->Add(res.results(0), std::move(words));
+        } else if (deferred_punctuator != nullptr) {
+          deferred_punctuator->Add(res.results(0), std::move(words));
+        }
+      }
 
       if (streaming_config.single_utterance()) {
         TIRO_SPEECH_DEBUG(
@@ -474,24 +1071,151 @@ grpc::Status RunStreamingProcessor(
         StreamingRecognizeResponse res;
         res.set_speech_event_type(
             StreamingRecognizeResponse::END_OF_SINGLE_UTTERANCE);
-        if (!stream->Write(res)) {
+        if (!write(res)) {
           return grpc::Status::CANCELLED;
         }
       }
     }
 
     processed_time += segment_time;
+
+    // Pre-roll released in a later segment can make skipped_time shrink, which
+    // a counter can't follow, so only increases are reported.
+    if (skipped_time > reported_skipped_time) {
+      recognizer_model.metrics->vad_skipped_audio_seconds.Add(
+          std::chrono::duration<double>{skipped_time - reported_skipped_time}
+              .count());
+      reported_skipped_time = skipped_time;
+    }
   }
 
+  TIRO_SPEECH_DEBUG("VAD skipped decoding {} ms of {} ms of audio",
+                    skipped_time.count(), processed_time.count());
+  // The speaker tagger hands results on to the deferred punctuator, so it has
+  // to finish first
+  if (speaker_tagger != nullptr && !speaker_tagger->Finish()) {
+    return grpc::Status::CANCELLED;
+  }
+  if (deferred_punctuator != nullptr && !deferred_punctuator->Finish()) {
+    return grpc::Status::CANCELLED;
+  }
   return grpc::Status::OK;
 }
 
+/**
+ * Recognize each channel in a separate processor thread. The calling thread
+ * reads from \p stream and hands each processor its own channel. Results are
+ * tagged with the channel number, starting from 1.
+ *
+ * Reading stops as soon as any processor is done, e.g. after a single
+ * utterance or a failed write, and the others then stop at their next chunk.
+ * The status is that of the first processor that failed.
+ */
+grpc::Status RunMultichannelStreamingProcessor(
+    RecognizeStream* stream,
+    const tiro::speech::v1alpha::StreamingRecognitionConfig& streaming_config,
+    const KaldiModel& recognizer_model, int num_channels) {
+  // Each chunk is a single request's worth of audio, usually about 100 ms
+  constexpr std::size_t kMaxQueuedChunks = 64;
+  using ChannelQueue = ThreadSafeQueue<std::optional<std::string>>;
+  std::deque<ChannelQueue> queues;
+  for (int ch = 0; ch < num_channels; ++ch) {
+    queues.emplace_back(kMaxQueuedChunks);
+  }
+  // Set by a processor when it returns, and by the reader if that made it
+  // stop early, so the other processors stop too
+  std::atomic<bool> processor_done = false;
+  std::atomic<bool> stop_processors = false;
+
+  // Only a single write may be outstanding on a gRPC stream
+  std::mutex write_mutex;
+  auto write =
+      [&](const tiro::speech::v1alpha::StreamingRecognizeResponse& res) {
+        std::lock_guard<std::mutex> lock{write_mutex};
+        return stream->Write(res);
+      };
+
+  std::vector<std::future<grpc::Status>> processors;
+  processors.reserve(num_channels);
+  for (int ch = 0; ch < num_channels; ++ch) {
+    processors.push_back(std::async(std::launch::async, [&, ch]() {
+      grpc::Status status;
+      try {
+        status = RunStreamingProcessor(
+            [&queue = queues[ch], &stop_processors](std::string* chunk) {
+              if (stop_processors) {
+                return false;
+              }
+              std::optional<std::string> next = queue.blocking_pop();
+              if (!next.has_value()) {
+                return false;
+              }
+              *chunk = std::move(*next);
+              return true;
+            },
+            write, streaming_config, recognizer_model, ch + 1);
+      } catch (const std::exception& e) {
+        TIRO_SPEECH_WARN("Channel {} failed: {}", ch + 1, e.what());
+        status = grpc::Status{grpc::StatusCode::INTERNAL,
+                              "Unknown error in StreamingRecognize."};
+      }
+      processor_done = true;
+      queues[ch].close();
+      return status;
+    }));
+  }
+
+  std::string content;
+  std::string pending;
+  std::vector<std::string> channel_chunks;
+  bool reading = true;
+  while (reading && !processor_done && ReadAudioContent(stream, &content)) {
+    pending += content;
+    channel_chunks.assign(num_channels, std::string{});
+    const std::size_t consumed =
+        SplitLinear16Channels(pending, num_channels, &channel_chunks);
+    pending.erase(0, consumed);
+    for (int ch = 0; ch < num_channels && reading; ++ch) {
+      if (!channel_chunks[ch].empty()) {
+        reading = queues[ch].push(
+            std::optional<std::string>{std::move(channel_chunks[ch])});
+      }
+    }
+  }
+  if (!reading || processor_done) {
+    stop_processors = true;
+  }
+  // Processors that are still running either pop this or see stop_processors
+  // first. A push to a full queue returns once its processor closes it.
+  for (auto& queue : queues) {
+    queue.push(std::optional<std::string>{});
+  }
+
+  grpc::Status status = grpc::Status::OK;
+  for (auto& processor : processors) {
+    if (grpc::Status ch_status = processor.get();
+        !ch_status.ok() && status.ok()) {
+      status = ch_status;
+    }
+  }
+  return status;
+}
+
 }  // namespace
 
 grpc::Status SpeechService::StreamingRecognize(
     grpc::ServerContext* context,
     grpc::ServerReaderWriter<StreamingRecognizeResponse,
                              StreamingRecognizeRequest>* stream) {
+  const auto start = std::chrono::steady_clock::now();
+  grpc::Status status = StreamingRecognizeUnobserved(stream);
+  streaming_recognize_metrics_.Observe(start, status);
+  return status;
+}
+
+grpc::Status SpeechService::StreamingRecognizeUnobserved(
+    grpc::ServerReaderWriter<StreamingRecognizeResponse,
+                             StreamingRecognizeRequest>* stream) {
   using tiro::speech::v1alpha::StreamingRecognitionConfig;
   try {
     // Read config from first request (or return error)
@@ -516,9 +1240,43 @@ grpc::Status SpeechService::StreamingRecognize(
     StreamingRecognitionConfig streaming_config{
         *req.mutable_streaming_config()};
 
-    return RunStreamingProcessor(
-        stream, streaming_config,
-        *models_.at({streaming_config.config().language_code(), "generic"}));
+    const KaldiModel& model =
+        *models_.at({streaming_config.config().language_code(), "generic"});
+    ScopedGaugeIncrement active_stream{&model.metrics->active_streams};
+    const int num_channels =
+        std::max(streaming_config.config().audio_channel_count(), 1);
+    auto write = [stream](const StreamingRecognizeResponse& res) {
+      return stream->Write(res);
+    };
+
+    if (num_channels == 1) {
+      return RunStreamingProcessor(
+          [stream](std::string* chunk) {
+            return ReadAudioContent(stream, chunk);
+          },
+          write, streaming_config, model);
+    }
+
+    if (!streaming_config.config().enable_separate_recognition_per_channel()) {
+      std::string pending;
+      return RunStreamingProcessor(
+          [stream, num_channels, &pending](std::string* chunk) {
+            std::string content;
+            chunk->clear();
+            while (chunk->empty()) {
+              if (!ReadAudioContent(stream, &content)) {
+                return false;
+              }
+              pending += content;
+              pending.erase(0, MixDownLinear16(pending, num_channels, chunk));
+            }
+            return true;
+          },
+          write, streaming_config, model);
+    }
+
+    return RunMultichannelStreamingProcessor(stream, streaming_config, model,
+                                             num_channels);
 
   } catch (const std::exception& ex) {
     TIRO_SPEECH_WARN("Unhandled exception: {}", ex.what());
@@ -532,20 +1290,60 @@ void SpeechService::RegisterModel(
   models_[std::move(model_id)] = model;
 }
 
+void SpeechService::EnableResultCache(const RecognizeResultCacheOptions& opts) {
+  result_cache_ = std::make_unique<RecognizeResultCache>(opts);
+}
+
+void SpeechService::RegisterMetrics(MetricsRegistry* registry) const {
+  for (const auto& [method, metrics] :
+       {std::pair{"Recognize", &recognize_metrics_},
+        std::pair{"StreamingRecognize", &streaming_recognize_metrics_}}) {
+    const MetricsRegistry::Labels labels{{"method", method}};
+    registry->Register("tiro_speech_rpc_duration_seconds",
+                       "Duration of RPCs, including streaming ones.",
+                       metrics->duration_seconds, labels);
+    registry->Register("tiro_speech_rpc_rejected_total",
+                       "Number of RPCs rejected as invalid.",
+                       metrics->rejected, labels);
+  }
+
+  if (result_cache_ != nullptr) {
+    const RecognizeResultCache* cache = result_cache_.get();
+    registry->Register("tiro_speech_result_cache_hits_total",
+                       "Number of Recognize requests served from the cache.",
+                       MetricType::kCounter,
+                       [cache] { return static_cast<double>(cache->Hits()); });
+    registry->Register(
+        "tiro_speech_result_cache_misses_total",
+        "Number of cacheable Recognize requests not found in the cache.",
+        MetricType::kCounter,
+        [cache] { return static_cast<double>(cache->Misses()); });
+  }
+
+  for (const auto& [model_id, model] : models_) {
+    model->RegisterMetrics(model_id.language_code, registry);
+  }
+}
+
 grpc::Status GoogleCloudSpeechProxy::Recognize(grpc::ServerContext* context,
                                                const RecognizeRequest* request,
                                                RecognizeResponse* response) {
   assert(speech_service_ != nullptr);
   TIRO_SPEECH_INFO("Forwarding Google Cloud Speech API Recognize request");
-  // This is a bit more expensive than we want, but blindly casting it will
-  // simply cause a segfault
-  tiro::speech::v1alpha::RecognizeRequest converted_req;
-  converted_req.ParseFromString(request->SerializeAsString());
+  // Blindly casting the request will simply cause a segfault, so we convert
+  // it. The request is owned by gRPC and isn't used after this handler
+  // returns, so we can move the (possibly huge) audio content out of it
+  // instead of copying it.
+  google::protobuf::Arena arena;
+  auto* converted_req = google::protobuf::Arena::CreateMessage<
+      tiro::speech::v1alpha::RecognizeRequest>(&arena);
+  ConvertRecognizeRequest(const_cast<RecognizeRequest*>(request),
+                          converted_req);
 
   // Close your eyes, dangerous cast coming up! We can do this because the
   // serialized messages are compatible.
   return speech_service_->Recognize(
-      context, &converted_req,
+      context, converted_req,
       reinterpret_cast<tiro::speech::v1alpha::RecognizeResponse*>(response));
 }
 
@@ -26,9 +26,12 @@
 
 #include "google/cloud/speech/v1/cloud_speech.grpc.pb.h"
 #include "proto/tiro/speech/v1alpha/speech.grpc.pb.h"
+#include "src/api/result-cache.h"
 #include "src/audio/audio-source.h"
 #include "src/base.h"
+#include "src/histogram.h"
 #include "src/kaldi-model.h"
+#include "src/metrics.h"
 #include "src/recognizer.h"
 #include "src/utils.h"
 
@@ -55,8 +58,48 @@ class SpeechService final : public tiro::speech::v1alpha::Speech::Service {
   void RegisterModel(ModelId model_id,
                      const std::shared_ptr<const KaldiModel>& model);
 
+  /**
+   * Serve repeated Recognize requests from a cache instead of decoding them
+   * again.
+   */
+  void EnableResultCache(const RecognizeResultCacheOptions& opts);
+
+  /// Returns nullptr if the result cache isn't enabled
+  const RecognizeResultCache* ResultCache() const {
+    return result_cache_.get();
+  }
+
+  /**
+   * Register the metrics of the service and of all registered models with \p
+   * registry. Call this after all models are registered and the result cache
+   * is enabled.
+   */
+  void RegisterMetrics(MetricsRegistry* registry) const;
+
  private:
+  /// Metrics of a single RPC method
+  struct RpcMetrics {
+    RpcMetrics();
+
+    void Observe(std::chrono::steady_clock::time_point start,
+                 const grpc::Status& status);
+
+    Histogram duration_seconds;
+    /// Requests that failed with INVALID_ARGUMENT
+    Counter rejected;
+  };
+
+  grpc::Status RecognizeUncached(const RecognizeRequest& request,
+                                 RecognizeResponse* response);
+
+  grpc::Status StreamingRecognizeUnobserved(
+      grpc::ServerReaderWriter<StreamingRecognizeResponse,
+                               StreamingRecognizeRequest>* stream);
+
   KaldiModelMap models_;
+  std::unique_ptr<RecognizeResultCache> result_cache_;
+  RpcMetrics recognize_metrics_;
+  RpcMetrics streaming_recognize_metrics_;
 };
 
 class GoogleCloudSpeechProxy final
@@ -72,6 +72,18 @@ MessageValidationStatus Validate(
                         "range [1;30]");
   }
 
+  // Field 'audio_channel_count':
+  if (!in_range(config.audio_channel_count(), 0, kMaxAudioChannelCount)) {
+    errors.emplace_back("audio_channel_count",
+                        fmt::format("Valid values for field "
+                                    "'audio_channel_count' are in range "
+                                    "[0;{}], where 0 means a single channel",
+                                    kMaxAudioChannelCount));
+  }
+
+  // Field 'enable_separate_recognition_per_channel': Ignored for single channel
+  //                                                   audio
+
   // Field 'speech_contexts':  Nothing to check
   // Field 'enable_word_time_offsets': Should always be supported
   // Field 'metadata': Nothing to check
@@ -173,6 +185,7 @@ MessageValidationStatus Validate(
 
         // Field 'streaming_config.single_utterance': No checks needed.
         // Field 'streaming_config.interim_results': No checks needed.
+        // Field 'streaming_config.deferred_punctuation': No checks needed.
       }
       break;
     case StreamingRecognizeRequest::kAudioContent:
@@ -24,6 +24,9 @@
 
 namespace tiro_speech {
 
+/// Upper bound on RecognitionConfig.audio_channel_count
+constexpr int kMaxAudioChannelCount = 8;
+
 /** \brief vector of pairs {field, error message}. Empty vector is a valid
  *         message.
  */
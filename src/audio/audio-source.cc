@@ -23,15 +23,73 @@
 #include <functional>
 #include <memory>
 #include <numeric>
+#include <sstream>
+#include <stdexcept>
 #include <string_view>
+#include <utility>
 
 #include "src/audio/audio.h"
+#include "src/audio/range-fetcher.h"
 #include "src/base.h"
 #include "src/logging.h"
 #include "src/utils.h"
 
 namespace tiro_speech {
 
+namespace {
+
+/**
+ * Parse the WAV header, if any, at the start of LINEAR16 \p bytes. Throws
+ * AudioSourceError if it is malformed or doesn't describe 16-bit PCM with the
+ * channel count and sample rate of \p info.
+ *
+ * \return false if \p bytes doesn't start with a WAV header
+ */
+bool ParseLinear16WavHeader(const AudioSourceInfo& info,
+                            std::string_view bytes, WavHeader* header_out) {
+  WavHeader header;
+  try {
+    if (!ParseWavHeader(bytes, &header)) {
+      return false;
+    }
+  } catch (const std::invalid_argument& e) {
+    throw AudioSourceError{e.what()};
+  }
+  if (header.format_tag != kWavFormatPcm || header.bits_per_sample != 16) {
+    throw AudioSourceError{"Only 16-bit PCM WAV files are supported"};
+  }
+  if (header.num_channels != std::max(info.num_channels, 1)) {
+    throw AudioSourceError{
+        fmt::format("WAV file has {} channels, expected {}",
+                    header.num_channels, std::max(info.num_channels, 1))};
+  }
+  if (header.sample_rate_hertz != info.sample_rate_hertz) {
+    throw AudioSourceError{
+        fmt::format("WAV file has a sample rate of {} Hz, expected {} Hz",
+                    header.sample_rate_hertz, info.sample_rate_hertz)};
+  }
+  *header_out = header;
+  return true;
+}
+
+/**
+ * Strip the WAV header, if any, from fetched LINEAR16 \p content, leaving
+ * only the samples. See ParseLinear16WavHeader().
+ */
+void StripWavHeader(const AudioSourceInfo& info, std::string* content) {
+  WavHeader header;
+  if (!ParseLinear16WavHeader(info, *content, &header)) {
+    return;
+  }
+  // Chunks after the data, e.g. LIST, aren't audio either
+  const std::size_t data_size =
+      std::min(header.data_size, content->size() - header.data_offset);
+  content->erase(header.data_offset + data_size);
+  content->erase(0, header.data_offset);
+}
+
+}  // namespace
+
 ContentAudioSource::ContentAudioSource(const AudioSourceInfo& info,
                                        const Bytes& content,
                                        int target_sample_rate)
@@ -40,7 +98,14 @@ ContentAudioSource::ContentAudioSource(const AudioSourceInfo& info,
     switch (info.encoding) {
       // Supported encodings
       case AudioEncoding::LINEAR16: {
-        Linear16BytesToWaveVector(content, &data_);
+        if (info.num_channels > 1) {
+          Matrix channels;
+          Linear16BytesToWaveMatrix(content, info.num_channels, &channels);
+          data_.Resize(channels.NumCols());
+          data_.AddRowSumMat(1.0f / channels.NumRows(), channels, 0.0f);
+        } else {
+          Linear16BytesToWaveVector(content, &data_);
+        }
         // TODO(rkjaran): Have the above fn do the resampling, similar to Mp3...
         if (info.sample_rate_hertz != target_sample_rate) {
           Vector new_data;
@@ -65,6 +130,11 @@ ContentAudioSource::ContentAudioSource(const AudioSourceInfo& info,
   }
 }
 
+ContentAudioSource::ContentAudioSource(Vector&& waveform, int sample_rate)
+    : target_sample_rate_{sample_rate} {
+  data_.Swap(&waveform);
+}
+
 void ContentAudioSource::Open() {
   // Do nothing...
   return;
@@ -382,13 +452,340 @@ int StreamingUriAudioSource::TotalChunks() const {
   return n_samples / chunk_size_in_elem_;
 }
 
+ParallelUriAudioSource::ParallelUriAudioSource(const AudioSourceInfo& info,
+                                               std::string uri,
+                                               int target_sample_rate,
+                                               int max_connections,
+                                               std::int64_t min_range_size)
+    : uri_{std::move(uri)},
+      encoding_{info.encoding},
+      source_sample_rate_{info.sample_rate_hertz},
+      num_channels_{info.num_channels},
+      target_sample_rate_{target_sample_rate},
+      max_connections_{max_connections},
+      min_range_size_{min_range_size} {
+  switch (encoding_) {
+    case AudioEncoding::LINEAR16:
+      [[fallthrough]];
+    case AudioEncoding::MP3:
+      [[fallthrough]];
+    case AudioEncoding::FLAC:
+      break;
+    default:
+      throw AudioSourceError{
+          "Unsupported encoding for ParallelUriAudioSource"};
+  }
+}
+
+void ParallelUriAudioSource::Open() {
+  if (opened_) {
+    return;
+  }
+  try {
+    RangeFetcher fetcher{uri_};
+    if (!fetcher.SupportsRanges() && encoding_ != AudioEncoding::LINEAR16) {
+      TIRO_SPEECH_DEBUG("'{}' doesn't support range requests, streaming it",
+                        uri_);
+      impl_ = std::make_unique<StreamingUriAudioSource>(
+          AudioSourceInfo{AudioSourceInfo::Type::kUri, encoding_,
+                          source_sample_rate_, num_channels_},
+          uri_, target_sample_rate_);
+      impl_->Open();
+      opened_ = true;
+      return;
+    }
+
+    const std::int64_t size = fetcher.Size();
+    stream_buf_ = std::make_unique<RangeStreamBuf>(
+        std::move(fetcher), max_connections_, min_range_size_);
+    stream_ = std::make_unique<std::istream>(stream_buf_.get());
+    // Rethrows the av::AvError of a failed fetch
+    stream_->exceptions(std::ios::badbit);
+    if (encoding_ == AudioEncoding::LINEAR16) {
+      OpenLinear16();
+      if (data_bytes_left_ < 0 && size > 0) {
+        total_samples_ = size / (2 * std::max(num_channels_, 1));
+      }
+    } else {
+      decoder_ = std::make_unique<av::Decoder>(
+          encoding_ == AudioEncoding::MP3 ? av::Codec::kMp3 : av::Codec::kFlac,
+          *stream_, decoded_, target_sample_rate_);
+    }
+    opened_ = true;
+  } catch (const tiro_speech::av::AvError& e) {
+    TIRO_SPEECH_WARN("Rethrowing AvError as an AudioSourceError");
+    throw AudioSourceError{e.what()};
+  }
+}
+
+void ParallelUriAudioSource::OpenLinear16() {
+  // Whatever follows the header, if any, is audio
+  pending_.resize(kMaxWavHeaderSize);
+  stream_->read(pending_.data(), pending_.size());
+  pending_.resize(stream_->gcount());
+
+  const int frame_bytes = 2 * std::max(num_channels_, 1);
+  WavHeader header;
+  if (ParseLinear16WavHeader(
+          AudioSourceInfo{AudioSourceInfo::Type::kUri, encoding_,
+                          source_sample_rate_, num_channels_},
+          pending_, &header)) {
+    pending_.erase(0, header.data_offset);
+    if (header.data_size <= pending_.size()) {
+      pending_.resize(header.data_size);
+      data_bytes_left_ = 0;
+    } else {
+      data_bytes_left_ = header.data_size - pending_.size();
+    }
+    total_samples_ = header.data_size / frame_bytes;
+  }
+  input_finished_ = data_bytes_left_ == 0 ||
+                    stream_->peek() == std::istream::traits_type::eof();
+
+  if (source_sample_rate_ != target_sample_rate_) {
+    // Same filter as ResampleWaveForm()
+    resampler_ = std::make_unique<kaldi::LinearResample>(
+        source_sample_rate_, target_sample_rate_,
+        0.99f * 0.5f * std::min(source_sample_rate_, target_sample_rate_), 6);
+  }
+}
+
+void ParallelUriAudioSource::NextLinear16Chunk() {
+  const std::size_t frame_bytes = 2 * std::max(num_channels_, 1);
+  const std::size_t chunk_bytes = kChunkSizeInSamples * frame_bytes;
+  if (pending_.size() < chunk_bytes && !input_finished_) {
+    std::int64_t wanted = chunk_bytes - pending_.size();
+    if (data_bytes_left_ >= 0) {
+      wanted = std::min(wanted, data_bytes_left_);
+    }
+    const std::size_t n_pending = pending_.size();
+    pending_.resize(n_pending + wanted);
+    stream_->read(&pending_[n_pending], wanted);
+    pending_.resize(n_pending + stream_->gcount());
+    if (data_bytes_left_ >= 0) {
+      data_bytes_left_ -= stream_->gcount();
+    }
+    input_finished_ = data_bytes_left_ == 0 ||
+                      stream_->peek() == std::istream::traits_type::eof();
+  }
+
+  // A trailing partial frame is dropped
+  const std::size_t n_bytes =
+      std::min(chunk_bytes, pending_.size() / frame_bytes * frame_bytes);
+  const std::string bytes = pending_.substr(0, n_bytes);
+  pending_.erase(0, n_bytes);
+  no_more_chunks_ = input_finished_ && pending_.size() < frame_bytes;
+
+  Vector waveform;
+  if (num_channels_ > 1) {
+    Matrix channels;
+    Linear16BytesToWaveMatrix(bytes, num_channels_, &channels);
+    waveform.Resize(channels.NumCols());
+    waveform.AddRowSumMat(1.0f / channels.NumRows(), channels, 0.0f);
+  } else {
+    Linear16BytesToWaveVector(bytes, &waveform);
+  }
+  if (resampler_ != nullptr) {
+    resampler_->Resample(waveform, /* flush */ no_more_chunks_, &chunk_);
+  } else {
+    chunk_.Swap(&waveform);
+  }
+}
+
+void ParallelUriAudioSource::NextDecodedChunk() {
+  const std::size_t chunk_bytes = 2 * kChunkSizeInSamples;
+  while (!input_finished_ && pending_.size() < chunk_bytes) {
+    if (!decoder_->PartialDecode(decoded_)) {
+      decoder_->Flush(decoded_);
+      input_finished_ = true;
+    }
+    // Move the decoded samples out, so the stream doesn't keep all of them
+    pending_ += decoded_.str();
+    decoded_.str("");
+  }
+
+  const std::size_t n_bytes = std::min(chunk_bytes, pending_.size() / 2 * 2);
+  const std::string bytes = pending_.substr(0, n_bytes);
+  pending_.erase(0, n_bytes);
+  no_more_chunks_ = input_finished_ && pending_.size() < 2;
+  Linear16BytesToWaveVector(bytes, &chunk_);
+}
+
+const AudioSourceItf::Vector& ParallelUriAudioSource::Full() {
+  Open();
+  if (impl_ != nullptr) {
+    return impl_->Full();
+  }
+  std::vector<Vector> chunks;
+  int dim = 0;
+  while (HasMoreChunks()) {
+    chunks.emplace_back(NextChunk());
+    dim += chunks.back().Dim();
+  }
+  full_.Resize(dim, kaldi::kUndefined);
+  int offset = 0;
+  for (const Vector& chunk : chunks) {
+    full_.Range(offset, chunk.Dim()).CopyFromVec(chunk);
+    offset += chunk.Dim();
+  }
+  return full_;
+}
+
+bool ParallelUriAudioSource::HasMoreChunks() const {
+  if (impl_ != nullptr) {
+    return impl_->HasMoreChunks();
+  }
+  return opened_ && !no_more_chunks_;
+}
+
+const AudioSourceItf::SubVector ParallelUriAudioSource::NextChunk() {
+  if (!opened_) {
+    throw AudioSourceError{"ParallelUriAudioSource hasn't been opened"};
+  }
+  if (impl_ != nullptr) {
+    return impl_->NextChunk();
+  }
+  try {
+    if (encoding_ == AudioEncoding::LINEAR16) {
+      NextLinear16Chunk();
+    } else {
+      NextDecodedChunk();
+    }
+  } catch (const tiro_speech::av::AvError& e) {
+    TIRO_SPEECH_WARN("Rethrowing AvError as an AudioSourceError");
+    throw AudioSourceError{e.what()};
+  }
+  n_seen_elements_ += chunk_.Dim();
+  return chunk_.Range(0, chunk_.Dim());
+}
+
+int ParallelUriAudioSource::ChunksSeen() const {
+  if (impl_ != nullptr) {
+    return impl_->ChunksSeen();
+  }
+  return n_seen_elements_ / kChunkSizeInSamples;
+}
+
+int ParallelUriAudioSource::TotalChunks() const {
+  if (impl_ != nullptr) {
+    return impl_->TotalChunks();
+  }
+  if (total_samples_ < 0) {
+    return -1;
+  }
+  return total_samples_ * target_sample_rate_ / source_sample_rate_ /
+         kChunkSizeInSamples;
+}
+
+std::chrono::milliseconds ParallelUriAudioSource::TimePassed() const {
+  if (impl_ != nullptr) {
+    return impl_->TimePassed();
+  }
+  return std::chrono::milliseconds{1000 * n_seen_elements_ /
+                                   target_sample_rate_};
+}
+
 std::unique_ptr<AudioSourceItf> CreateAudioSourceFromUri(
     const AudioSourceInfo& info, const std::string& uri) {
   if (info.type != AudioSourceInfo::Type::kUri) {
     return nullptr;
   }
 
-  return std::make_unique<StreamingUriAudioSource>(info, uri);
+  switch (info.encoding) {
+    case AudioEncoding::LINEAR16:
+      [[fallthrough]];
+    case AudioEncoding::MP3:
+      [[fallthrough]];
+    case AudioEncoding::FLAC:
+      return std::make_unique<ParallelUriAudioSource>(info, uri);
+    default:
+      return std::make_unique<StreamingUriAudioSource>(info, uri);
+  }
+}
+
+namespace {
+
+std::vector<std::unique_ptr<AudioSourceItf>> SplitIntoChannelSources(
+    Matrix* channels, int sample_rate, int target_sample_rate) {
+  std::vector<std::unique_ptr<AudioSourceItf>> sources;
+  sources.reserve(channels->NumRows());
+  for (int ch = 0; ch < channels->NumRows(); ++ch) {
+    Vector waveform{channels->Row(ch)};
+    if (sample_rate != target_sample_rate) {
+      Vector resampled;
+      ResampleWaveForm(sample_rate, waveform, target_sample_rate, &resampled);
+      waveform.Swap(&resampled);
+    }
+    sources.push_back(std::make_unique<ContentAudioSource>(
+        std::move(waveform), target_sample_rate));
+  }
+  return sources;
+}
+
+}  // namespace
+
+std::vector<std::unique_ptr<AudioSourceItf>> CreateAudioSourcesPerChannel(
+    const AudioSourceInfo& info, const ContentAudioSource::Bytes& content,
+    int target_sample_rate) {
+  Matrix channels;
+  try {
+    switch (info.encoding) {
+      case AudioEncoding::LINEAR16:
+        Linear16BytesToWaveMatrix(content, info.num_channels, &channels);
+        return SplitIntoChannelSources(&channels, info.sample_rate_hertz,
+                                       target_sample_rate);
+      case AudioEncoding::MP3:
+        [[fallthrough]];
+      case AudioEncoding::FLAC:
+        CodedBytesToWaveMatrix(info.encoding, content, info.num_channels,
+                               &channels, target_sample_rate);
+        return SplitIntoChannelSources(&channels, target_sample_rate,
+                                       target_sample_rate);
+      default:
+        throw AudioSourceError{"Unsupported encoding"};
+    }
+  } catch (const av::AvError& ex) {
+    throw AudioSourceError{"Could not process audio content"};
+  }
+}
+
+std::vector<std::unique_ptr<AudioSourceItf>>
+CreateAudioSourcesPerChannelFromUri(const AudioSourceInfo& info,
+                                    const std::string& uri,
+                                    int target_sample_rate) {
+  if (info.type != AudioSourceInfo::Type::kUri) {
+    return {};
+  }
+  try {
+    RangeFetcher fetcher{uri};
+    if (fetcher.SupportsRanges() || info.encoding == AudioEncoding::LINEAR16) {
+      std::string content = fetcher.Fetch();
+      const AudioSourceInfo content_info{AudioSourceInfo::Type::kContent,
+                                         info.encoding, info.sample_rate_hertz,
+                                         info.num_channels};
+      if (info.encoding == AudioEncoding::LINEAR16) {
+        StripWavHeader(content_info, &content);
+      }
+      return CreateAudioSourcesPerChannel(content_info, content,
+                                          target_sample_rate);
+    }
+
+    std::stringstream ss;
+    av::IoContextDecoder<av::UrlIoContext> decoder{
+        av::Codec::kUnknown, av::UrlIoContext{uri}, ss, target_sample_rate,
+        info.num_channels};
+    while (decoder.PartialDecode(ss))
+      ;
+    decoder.Flush(ss);
+
+    Matrix channels;
+    Linear16BytesToWaveMatrix(ss.str(), info.num_channels, &channels);
+    return SplitIntoChannelSources(&channels, target_sample_rate,
+                                   target_sample_rate);
+  } catch (const av::AvError& e) {
+    TIRO_SPEECH_WARN("Rethrowing AvError as an AudioSourceError");
+    throw AudioSourceError{e.what()};
+  }
 }
 
 bool IsUriSupported(const std::string_view uri) {
@@ -1,16 +1,22 @@
 #ifndef TIRO_SPEECH_SRC_AUDIO_AUDIO_SOURCE_H_
 #define TIRO_SPEECH_SRC_AUDIO_AUDIO_SOURCE_H_
 
+#include <feat/resample.h>
 #include <matrix/kaldi-vector.h>
 
 #include <chrono>
+#include <cstdint>
 #include <exception>
+#include <istream>
 #include <memory>
+#include <sstream>
 #include <string>
 #include <string_view>
+#include <vector>
 
 #include "src/audio/audio.h"
 #include "src/audio/ffmpeg-wrapper.h"
+#include "src/audio/range-fetcher.h"
 #include "src/utils.h"
 
 namespace tiro_speech {
@@ -27,6 +33,8 @@ struct AudioSourceInfo {
   const Type type = Type::kNoType;
   AudioEncoding encoding = AudioEncoding::ENCODING_UNSPECIFIED;
   int sample_rate_hertz = 0;
+  /// Channels in the source, single channel sources mix down to mono
+  int num_channels = 1;
 };
 
 // TODO(rkjaran): Split up AudioSourceItf into two classes,
@@ -108,9 +116,17 @@ class AudioSourceItf {
  */
 class ContentAudioSource : public AudioSourceItf {
  public:
+  /**
+   * Multichannel content is mixed down to a single channel.
+   */
   explicit ContentAudioSource(const AudioSourceInfo& info, const Bytes& content,
                               int target_sample_rate = 16000);
 
+  /**
+   * Wrap an already decoded waveform at \p sample_rate.
+   */
+  ContentAudioSource(Vector&& waveform, int sample_rate);
+
   void Open() override;
   const Vector& Full() override { return data_; };
   bool HasMoreChunks() const override;
@@ -241,6 +257,75 @@ class StreamingUriAudioSource : public AudioSourceItf {
   std::unique_ptr<av::IoContextDecoder<av::UrlIoContext>> decoder_ = nullptr;
 };
 
+/** \class ParallelUriAudioSource
+ *
+ * Audio source for a remote file that is decoded as it is downloaded. If the
+ * resource supports range requests, ranges of \p min_range_size bytes are
+ * fetched ahead of the decoder with up to \p max_connections concurrent
+ * connections (see RangeStreamBuf), so only that many ranges are held in memory
+ * at a time. LINEAR16 resources that don't support range requests are read
+ * sequentially.
+ *
+ * Remote MP3 and FLAC resources that don't support range requests, e.g. live
+ * streams, are handed over to a StreamingUriAudioSource instead.
+ */
+class ParallelUriAudioSource : public AudioSourceItf {
+ public:
+  ParallelUriAudioSource(const AudioSourceInfo& info, std::string uri,
+                         int target_sample_rate = 16000,
+                         int max_connections = 4,
+                         std::int64_t min_range_size = 1 << 20);
+
+  void Open() override;
+  const Vector& Full() override;
+  bool HasMoreChunks() const override;
+  const SubVector NextChunk() override;
+  bool IsStreamed() const override { return true; }
+  int ChunksSeen() const override;
+  /// Only known for LINEAR16, returns -1 otherwise
+  int TotalChunks() const override;
+  std::chrono::milliseconds TimePassed() const override;
+
+ private:
+  constexpr static int kChunkSizeInSamples = 2048;
+
+  const std::string uri_;
+  const AudioEncoding encoding_;
+  const int source_sample_rate_;
+  const int num_channels_;
+  const int target_sample_rate_;
+  const int max_connections_;
+  const std::int64_t min_range_size_;
+  bool opened_ = false;
+  bool no_more_chunks_ = false;
+  std::int64_t n_seen_elements_ = 0;
+  Vector chunk_;
+  Vector full_;
+
+  // Set instead of the members below for resources that are streamed without
+  // range requests
+  std::unique_ptr<AudioSourceItf> impl_ = nullptr;
+
+  std::unique_ptr<RangeStreamBuf> stream_buf_ = nullptr;
+  std::unique_ptr<std::istream> stream_ = nullptr;
+  /// Bytes read from stream_, or decoded, that haven't been returned yet
+  std::string pending_;
+  bool input_finished_ = false;
+
+  // MP3 and FLAC
+  std::ostringstream decoded_;
+  std::unique_ptr<av::Decoder> decoder_ = nullptr;
+
+  // LINEAR16
+  std::int64_t total_samples_ = -1;
+  std::int64_t data_bytes_left_ = -1;
+  std::unique_ptr<kaldi::LinearResample> resampler_ = nullptr;
+
+  void OpenLinear16();
+  void NextLinear16Chunk();
+  void NextDecodedChunk();
+};
+
 /**
  * \brief Creates an audio source from a URI, throwing AudioSourceError if the
  *        URI is malformed or URI scheme is not supported.
@@ -261,7 +346,8 @@ class StreamingUriAudioSource : public AudioSourceItf {
  *  }
  * \endcode
  *
- * This will create a HttpAudioSource for a LINEAR 16 PCM file through HTTP.
+ * This will create a ParallelUriAudioSource for a LINEAR 16 PCM file through
+ * HTTP.
  */
 std::unique_ptr<AudioSourceItf> CreateAudioSourceFromUri(
     const AudioSourceInfo& info, const std::string& uri);
@@ -289,6 +375,28 @@ std::unique_ptr<AudioSourceItf> CreateAudioSourceFromUri(
 std::unique_ptr<AudioSourceItf> CreateAudioSource(
     const AudioSourceInfo& info, const ContentAudioSource::Bytes& content);
 
+/**
+ * \brief Create one audio source per channel from a content byte buffer.
+ *
+ * The content is decoded in full and each channel of \p info.num_channels gets
+ * its own ContentAudioSource, so the returned sources can be read from
+ * separate threads.
+ */
+std::vector<std::unique_ptr<AudioSourceItf>> CreateAudioSourcesPerChannel(
+    const AudioSourceInfo& info, const ContentAudioSource::Bytes& content,
+    int target_sample_rate = kDefaultSampleRate);
+
+/**
+ * \brief Create one audio source per channel from a URI.
+ *
+ * Same as CreateAudioSourcesPerChannel(), except the resource is fetched in
+ * full first, using parallel range requests if supported.
+ */
+std::vector<std::unique_ptr<AudioSourceItf>>
+CreateAudioSourcesPerChannelFromUri(const AudioSourceInfo& info,
+                                    const std::string& uri,
+                                    int target_sample_rate = kDefaultSampleRate);
+
 /**
  * Check whether URI (i.e. the scheme part) is supported by
  * \a CreateAudioSourceFromUri
@@ -15,14 +15,43 @@
 
 #include <feat/resample.h>
 
+#include <cstdint>
 #include <fstream>
+#include <istream>
 #include <sstream>
+#include <stdexcept>
+#include <streambuf>
 #include <string>
 
 #include "src/audio/ffmpeg-wrapper.h"
 
 namespace tiro_speech {
 
+namespace {
+
+/// Read only stream buffer over memory owned by someone else. Used instead of
+/// std::istringstream, which copies its input.
+class MemoryStreamBuf : public std::streambuf {
+ public:
+  explicit MemoryStreamBuf(const std::string& bytes) {
+    char* data = const_cast<char*>(bytes.data());
+    setg(data, data, data + bytes.size());
+  }
+};
+
+constexpr int kWavFormatExtensible = 0xfffe;
+
+std::uint32_t ReadLittleEndian(std::string_view bytes, std::size_t pos,
+                               int num_bytes) {
+  std::uint32_t value = 0;
+  for (int idx = num_bytes - 1; idx >= 0; --idx) {
+    value = (value << 8) | static_cast<unsigned char>(bytes[pos + idx]);
+  }
+  return value;
+}
+
+}  // namespace
+
 void Linear16BytesToWaveVector(const std::string& bytes, Vector* wavevector) {
   int num_samples = bytes.size() / 2;
   assert(wavevector != nullptr);
@@ -61,7 +90,8 @@ void CodedBytesToWaveVector(AudioEncoding encoding, const std::string& bytes,
         throw std::runtime_error{"Unsupported or unspecified AudioEncoding"};
     }
   }();
-  std::istringstream input{bytes};
+  MemoryStreamBuf input_buf{bytes};
+  std::istream input{&input_buf};
   std::ostringstream output{};
   tiro_speech::av::Decoder decoder{codec, input, output,
                                    target_sample_rate_hertz};
@@ -71,6 +101,84 @@ void CodedBytesToWaveVector(AudioEncoding encoding, const std::string& bytes,
   Linear16BytesToWaveVector(output.str(), wavevector);
 }
 
+void Linear16BytesToWaveMatrix(const std::string& bytes, int num_channels,
+                               Matrix* wavematrix) {
+  assert(wavematrix != nullptr);
+  assert(num_channels > 0);
+  const int num_frames = bytes.size() / (2 * num_channels);
+  wavematrix->Resize(num_channels, num_frames, kaldi::kUndefined);
+  const int16_t* data_ptr = reinterpret_cast<const int16_t*>(bytes.data());
+  for (int i = 0; i < num_frames; i++) {
+    for (int ch = 0; ch < num_channels; ch++) {
+      (*wavematrix)(ch, i) = *data_ptr++;
+    }
+  }
+}
+
+void CodedBytesToWaveMatrix(AudioEncoding encoding, const std::string& bytes,
+                            int num_channels, Matrix* wavematrix,
+                            int target_sample_rate_hertz) {
+  using namespace tiro_speech::av;
+
+  const Codec codec = [encoding]() {
+    switch (encoding) {
+      case AudioEncoding::MP3:
+        return Codec::kMp3;
+      case AudioEncoding::FLAC:
+        return Codec::kFlac;
+      default:
+        throw std::runtime_error{"Unsupported or unspecified AudioEncoding"};
+    }
+  }();
+  MemoryStreamBuf input_buf{bytes};
+  std::istream input{&input_buf};
+  std::ostringstream output{};
+  tiro_speech::av::Decoder decoder{codec, input, output,
+                                   target_sample_rate_hertz, num_channels};
+  while (decoder.PartialDecode()) {
+  };
+  decoder.Flush();
+  Linear16BytesToWaveMatrix(output.str(), num_channels, wavematrix);
+}
+
+std::size_t SplitLinear16Channels(std::string_view bytes, int num_channels,
+                                  std::vector<std::string>* channels) {
+  assert(channels != nullptr);
+  assert(num_channels > 0);
+  const std::size_t frame_size = 2 * num_channels;
+  const std::size_t num_frames = bytes.size() / frame_size;
+  channels->resize(num_channels);
+  for (int ch = 0; ch < num_channels; ch++) {
+    std::string& channel = (*channels)[ch];
+    const std::size_t offset = channel.size();
+    channel.resize(offset + 2 * num_frames);
+    for (std::size_t i = 0; i < num_frames; i++) {
+      channel[offset + 2 * i] = bytes[i * frame_size + 2 * ch];
+      channel[offset + 2 * i + 1] = bytes[i * frame_size + 2 * ch + 1];
+    }
+  }
+  return num_frames * frame_size;
+}
+
+std::size_t MixDownLinear16(std::string_view bytes, int num_channels,
+                            std::string* mono) {
+  assert(mono != nullptr);
+  assert(num_channels > 0);
+  const std::size_t num_frames = bytes.size() / (2 * num_channels);
+  const int16_t* in_ptr = reinterpret_cast<const int16_t*>(bytes.data());
+  const std::size_t offset = mono->size();
+  mono->resize(offset + 2 * num_frames);
+  int16_t* out_ptr = reinterpret_cast<int16_t*>(&(*mono)[offset]);
+  for (std::size_t i = 0; i < num_frames; i++) {
+    int32_t sum = 0;
+    for (int ch = 0; ch < num_channels; ch++) {
+      sum += *in_ptr++;
+    }
+    *out_ptr++ = static_cast<int16_t>(sum / num_channels);
+  }
+  return num_frames * 2 * num_channels;
+}
+
 void Mp3BytesToWaveVector(const std::string& bytes, Vector* wavevector,
                           int target_sample_rate_hertz) {
   CodedBytesToWaveVector(AudioEncoding::MP3, bytes, wavevector,
@@ -86,12 +194,69 @@ void ResampleWaveForm(float orig_freq, const Vector& wave, float new_freq,
   resampler.Resample(wave, true, new_wave);
 }
 
+bool ParseWavHeader(std::string_view bytes, WavHeader* header) {
+  if (bytes.size() < 12 || bytes.substr(0, 4) != "RIFF" ||
+      bytes.substr(8, 4) != "WAVE") {
+    return false;
+  }
+  bool has_fmt = false;
+  std::size_t pos = 12;
+  while (pos + 8 <= bytes.size()) {
+    const std::string_view chunk_id = bytes.substr(pos, 4);
+    const std::size_t chunk_size = ReadLittleEndian(bytes, pos + 4, 4);
+    pos += 8;
+    if (chunk_id == "data") {
+      if (!has_fmt) {
+        throw std::invalid_argument{"WAV data chunk before fmt chunk"};
+      }
+      header->data_offset = pos;
+      header->data_size = chunk_size;
+      return true;
+    }
+    if (chunk_id == "fmt ") {
+      if (chunk_size < 16 || pos + chunk_size > bytes.size()) {
+        throw std::invalid_argument{"Truncated WAV fmt chunk"};
+      }
+      header->format_tag = ReadLittleEndian(bytes, pos, 2);
+      header->num_channels = ReadLittleEndian(bytes, pos + 2, 2);
+      header->sample_rate_hertz = ReadLittleEndian(bytes, pos + 4, 4);
+      header->bits_per_sample = ReadLittleEndian(bytes, pos + 14, 2);
+      if (header->format_tag == kWavFormatExtensible) {
+        if (chunk_size < 40) {
+          throw std::invalid_argument{"Truncated WAV fmt chunk"};
+        }
+        // The sub format GUID starts with the actual format tag
+        header->format_tag = ReadLittleEndian(bytes, pos + 24, 2);
+      }
+      has_fmt = true;
+    }
+    // Chunks are padded to an even size
+    pos += chunk_size + chunk_size % 2;
+  }
+  throw std::invalid_argument{"WAV header ends before the data chunk"};
+}
+
 bool HasRiffHeader(std::istream& is) {
   is.exceptions(std::ios::failbit | std::ios::badbit);
   std::string riff(4, '\0');
   is.read(&riff[0], 4);
   if (riff != "RIFF") return false;
-  is.seekg(44);
+
+  // The header is of variable size, so read enough to cover it and then seek
+  // to the start of the data
+  std::string header_bytes(kMaxWavHeaderSize, '\0');
+  is.exceptions(std::ios::badbit);
+  is.seekg(0);
+  is.read(&header_bytes[0], header_bytes.size());
+  header_bytes.resize(is.gcount());
+  is.clear();
+  is.exceptions(std::ios::failbit | std::ios::badbit);
+
+  WavHeader header;
+  if (!ParseWavHeader(header_bytes, &header)) {
+    return false;
+  }
+  is.seekg(header.data_offset);
   return true;
 }
 
@@ -14,9 +14,13 @@
 #ifndef TIRO_SPEECH_SRC_AUDIO_AUDIO_H_
 #define TIRO_SPEECH_SRC_AUDIO_AUDIO_H_
 
+#include <matrix/kaldi-matrix.h>
 #include <matrix/kaldi-vector.h>
 
+#include <cstddef>
 #include <string>
+#include <string_view>
+#include <vector>
 
 #include "src/base.h"
 
@@ -24,6 +28,7 @@ namespace tiro_speech {
 
 using Vector = kaldi::Vector<float>;
 using VectorBase = kaldi::VectorBase<float>;
+using Matrix = kaldi::Matrix<float>;
 
 // NOTE: This is copied from the Protobuf definition for
 //       tiro.speech.v1alpha.RecognitionConfig.AudioEncoding
@@ -54,9 +59,73 @@ void CodedBytesToWaveVector(AudioEncoding encoding, const std::string& bytes,
                             Vector* wavevector,
                             int target_sample_rate_hertz = kDefaultSampleRate);
 
+/**
+ * Convert an interleaved multichannel LINEAR16 RAW PCM binary blob to a Kaldi
+ * matrix with one row per channel (the same layout as kaldi::WaveData).
+ * Trailing bytes that don't make up a whole sample frame are ignored.
+ */
+void Linear16BytesToWaveMatrix(const std::string& bytes, int num_channels,
+                               Matrix* wavematrix);
+
+/**
+ * Decode \p bytes to a matrix with one row per channel. The decoded audio is
+ * remixed to \p num_channels channels if the coded stream has a different
+ * channel count.
+ */
+void CodedBytesToWaveMatrix(AudioEncoding encoding, const std::string& bytes,
+                            int num_channels, Matrix* wavematrix,
+                            int target_sample_rate_hertz = kDefaultSampleRate);
+
+/**
+ * Split interleaved LINEAR16 samples into one byte buffer per channel.
+ * \p channels is resized to \p num_channels and each buffer is appended to.
+ * Trailing bytes that don't make up a whole sample frame are ignored, it is up
+ * to the caller to carry those over to the next call.
+ *
+ * \return the number of bytes consumed from \p bytes
+ */
+std::size_t SplitLinear16Channels(std::string_view bytes, int num_channels,
+                                  std::vector<std::string>* channels);
+
+/**
+ * Average interleaved LINEAR16 channels into a single channel.
+ *
+ * \return the number of bytes consumed from \p bytes, see
+ *         SplitLinear16Channels()
+ */
+std::size_t MixDownLinear16(std::string_view bytes, int num_channels,
+                            std::string* mono);
+
 void ResampleWaveForm(float orig_freq, const Vector& wave, float new_freq,
                       Vector* new_wave);
 
+/// Format tag of integer PCM in a WAV fmt chunk
+constexpr int kWavFormatPcm = 1;
+/// Headers with more than this in chunks before the data aren't supported
+constexpr std::size_t kMaxWavHeaderSize = 1 << 16;
+
+struct WavHeader {
+  /// Format tag of the fmt chunk, or the sub format of WAVE_FORMAT_EXTENSIBLE
+  int format_tag;
+  int num_channels;
+  int sample_rate_hertz;
+  int bits_per_sample;
+  /// Position and size of the data chunk's contents. The size is as declared
+  /// in the header, which streaming writers often leave at 0 or 0xffffffff.
+  std::size_t data_offset;
+  std::size_t data_size;
+};
+
+/**
+ * Parse the RIFF (WAVE) header at the start of \p bytes, skipping chunks other
+ * than fmt and data, such as LIST and fact.
+ *
+ * \return false if \p bytes doesn't start with a RIFF header. Throws
+ *         std::invalid_argument if the header is malformed, or ends before the
+ *         start of the data chunk.
+ */
+bool ParseWavHeader(std::string_view bytes, WavHeader* header);
+
 /**
  * Returns true if RIFF (WAVE) header found in stream, position in stream will
  * be at the start of the data section (i.e. end of header).
@@ -29,8 +29,12 @@ std::string AvLibraryError::StrError(AvLibraryError::ErrnumT errnum) const {
 
 SampleConverter::SampleConverter() : SampleConverter{kDefaultSampleRate} {}
 
-SampleConverter::SampleConverter(int sample_rate_hertz) {
-  out_frame_->channel_layout = AV_CH_LAYOUT_MONO;
+SampleConverter::SampleConverter(int sample_rate_hertz, int num_channels) {
+  if (num_channels < 1) {
+    throw AvError{"SampleConverter needs at least one output channel"};
+  }
+  out_frame_->channel_layout = av_get_default_channel_layout(num_channels);
+  out_frame_->channels = num_channels;
   out_frame_->format = AV_SAMPLE_FMT_S16;
   out_frame_->sample_rate = sample_rate_hertz;
   out_frame_->nb_samples = 9254797;
@@ -94,10 +98,19 @@ void Decoder::PartialDecodeImpl(Packet& packet, std::ostream& os, bool flush) {
 }
 
 namespace {
-/// Write out_frame to stream in standard format
+/// Write out_frame to stream in standard format, i.e. with interleaved
+/// channels
 void WriteFrame(Frame& out_frame, std::ostream& os) {
-  int sample_size = CallRet(&av_get_bytes_per_sample,
-                            static_cast<AVSampleFormat>(out_frame->format));
+  const auto sample_fmt = static_cast<AVSampleFormat>(out_frame->format);
+  int sample_size = CallRet(&av_get_bytes_per_sample, sample_fmt);
+
+  if (!av_sample_fmt_is_planar(sample_fmt)) {
+    // Packed formats have all channels interleaved in data[0]
+    os.write(reinterpret_cast<char*>(out_frame->data[0]),
+             static_cast<std::streamsize>(sample_size) * out_frame->channels *
+                 out_frame->nb_samples);
+    return;
+  }
 
   for (int i = 0; i < out_frame->nb_samples; ++i) {
     for (int ch = 0; ch < out_frame->channels; ++ch) {
@@ -436,10 +436,16 @@ class SampleConverter final : no_copy_or_move {
   using OutputStream = std::basic_ostream<OutputSampleT>;
   using InputStream = std::basic_istream<InputSampleT>;
 
-  // TODO(rkjaran): Support different target formats and sample rates.
+  // TODO(rkjaran): Support different target formats.
   SampleConverter();
 
-  explicit SampleConverter(int sample_rate_hertz);
+  /** Create a converter producing interleaved S16 samples
+   *
+   * \param[in] sample_rate_hertz  Output sample rate
+   * \param[in] num_channels       Number of output channels, input with a
+   *                               different channel count is remixed.
+   */
+  explicit SampleConverter(int sample_rate_hertz, int num_channels = 1);
 
   /** Initialize the converter with input info from \param codec_ctx
    *
@@ -470,7 +476,9 @@ class SampleConverter final : no_copy_or_move {
    */
   Frame& Flush();
 
-  int OutputSampleRate() const { return kDefaultSampleRate; };
+  int OutputSampleRate() const { return out_frame_->sample_rate; };
+
+  int OutputNumChannels() const { return out_frame_->channels; };
 
   AVSampleFormat OutputSampleFmt() const {
     return static_cast<AVSampleFormat>(out_frame_->format);
@@ -532,11 +540,26 @@ class IoContext final {
 
 class UrlIoContext final {
  public:
-  explicit UrlIoContext(const std::string& url) {
+  explicit UrlIoContext(const std::string& url) : UrlIoContext{url, 0, 0} {}
+
+  /** Open \p url for reading the byte range [\p offset; \p end_offset)
+   *
+   * An \p end_offset of 0 reads until the end of the resource. Ranges are only
+   * honoured by protocols that support them, i.e. HTTP(S) when the server
+   * accepts ranges.
+   */
+  UrlIoContext(const std::string& url, std::int64_t offset,
+               std::int64_t end_offset) {
     AVDictionary* options = nullptr;
     av_dict_set_int(&options, "multiple_requests", 1, 0);
     av_dict_set_int(&options, "reconnect", 1, 0);
     av_dict_set_int(&options, "icy", 0, 0);
+    if (offset > 0) {
+      av_dict_set_int(&options, "offset", offset, 0);
+    }
+    if (end_offset > 0) {
+      av_dict_set_int(&options, "end_offset", end_offset, 0);
+    }
     CallRet(&avio_open2, &ptr_, url.c_str(), AVIO_FLAG_READ,
             static_cast<const AVIOInterruptCB*>(nullptr), &options);
     TIRO_SPEECH_DEBUG("Did not understand {} opts", av_dict_count(options));
@@ -558,6 +581,35 @@ class UrlIoContext final {
 
   AVIOContext* get() const noexcept { return ptr_; }
 
+  /// Size of the resource in bytes, or a negative number if unknown
+  std::int64_t Size() const { return avio_size(ptr_); }
+
+  /// True if the resource supports seeking, e.g. HTTP with Accept-Ranges
+  bool IsSeekable() const {
+    return (ptr_->seekable & AVIO_SEEKABLE_NORMAL) != 0;
+  }
+
+  /** Read up to \p size bytes into \p buf, blocking until \p size bytes have
+   *  been read or the end of the resource is reached.
+   *
+   * \return number of bytes read
+   */
+  std::int64_t Read(char* buf, std::int64_t size) {
+    std::int64_t n_read = 0;
+    while (n_read < size) {
+      constexpr std::array<int, 1> normal_flow_errors{AVERROR_EOF};
+      int ret = CallRet2(
+          cbegin(normal_flow_errors), cend(normal_flow_errors), &avio_read,
+          ptr_, reinterpret_cast<unsigned char*>(buf + n_read),
+          static_cast<int>(std::min<std::int64_t>(size - n_read, 1 << 20)));
+      if (ret == AVERROR_EOF || ret == 0) {
+        break;
+      }
+      n_read += ret;
+    }
+    return n_read;
+  }
+
   ~UrlIoContext() noexcept {
     if (ptr_ != nullptr) {
       CallRet(&avio_closep, &ptr_);
@@ -612,7 +664,8 @@ class IoContextDecoder final {
 
  public:
   IoContextDecoder(Codec codec, IoContextT&& io_ctx, std::ostream& os,
-                   int target_sample_rate_hertz = kDefaultSampleRate);
+                   int target_sample_rate_hertz = kDefaultSampleRate,
+                   int target_num_channels = 1);
 
   /** Decode bytes and possibly write them to \a os
    *
@@ -677,7 +730,8 @@ class IoContextDecoder final {
 template <class IoContextT>
 IoContextDecoder<IoContextT>::IoContextDecoder(Codec codec, IoContextT&& io_ctx,
                                                std::ostream& os,
-                                               int target_sample_rate_hertz)
+                                               int target_sample_rate_hertz,
+                                               int target_num_channels)
     : io_ctx_{std::move(io_ctx)},
       fmt_ctx_{},
       codec_ctx_{std::move(([&]() -> CodecContext {
@@ -703,7 +757,7 @@ IoContextDecoder<IoContextT>::IoContextDecoder(Codec codec, IoContextT&& io_ctx,
       })())},
       os_{os},
       target_sample_rate_{target_sample_rate_hertz},
-      sample_converter_{target_sample_rate_} {}
+      sample_converter_{target_sample_rate_, target_num_channels} {}
 
 template <class IoContextT>
 bool IoContextDecoder<IoContextT>::PartialDecode(std::ostream& os) {
@@ -781,13 +835,13 @@ class Decoder final : no_copy_or_move {
       : Decoder{codec, is, os, kDefaultSampleRate} {}
 
   Decoder(Codec codec, std::istream& is, std::ostream& os,
-          int target_sample_rate_hertz)
+          int target_sample_rate_hertz, int target_num_channels = 1)
       : packet_{},
         frame_{},
         inbuf_{is},
         parser_{codec},
         os_{os},
-        sample_converter_{target_sample_rate_hertz},
+        sample_converter_{target_sample_rate_hertz, target_num_channels},
         avio_ctx_{inbuf_} {
     auto* fmt_ctx = fmt_ctx_.get();
     fmt_ctx->pb = avio_ctx_.get();
@@ -0,0 +1,174 @@
+// Copyright 2021 Tiro ehf.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "src/audio/range-fetcher.h"
+
+#include <algorithm>
+#include <future>
+#include <limits>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "src/logging.h"
+
+namespace tiro_speech {
+
+std::vector<ByteRange> SplitIntoByteRanges(std::int64_t size, int max_ranges,
+                                           std::int64_t min_range_size) {
+  if (size <= 0) {
+    return {};
+  }
+  const std::int64_t n_ranges = std::clamp<std::int64_t>(
+      size / std::max<std::int64_t>(min_range_size, 1), 1, max_ranges);
+  const std::int64_t range_size = (size + n_ranges - 1) / n_ranges;
+
+  std::vector<ByteRange> ranges;
+  ranges.reserve(n_ranges);
+  for (std::int64_t begin = 0; begin < size; begin += range_size) {
+    ranges.emplace_back(begin, std::min(begin + range_size, size));
+  }
+  return ranges;
+}
+
+RangeFetcher::RangeFetcher(std::string uri)
+    : uri_{std::move(uri)},
+      probe_io_ctx_{uri_},
+      size_{probe_io_ctx_.Size()},
+      seekable_{probe_io_ctx_.IsSeekable()} {
+  TIRO_SPEECH_DEBUG("Resource '{}' has size {} and is {}seekable", uri_, size_,
+                    seekable_ ? "" : "not ");
+}
+
+std::string RangeFetcher::Fetch(int max_connections,
+                                std::int64_t min_range_size) {
+  if (fetched_) {
+    throw av::AvError{"RangeFetcher::Fetch() can only be called once"};
+  }
+  fetched_ = true;
+
+  std::string bytes;
+  if (!SupportsRanges()) {
+    constexpr std::int64_t kReadSize = 1 << 16;
+    std::int64_t n_read = 0;
+    for (;;) {
+      const std::int64_t wanted =
+          std::max<std::int64_t>(size_ - n_read, kReadSize);
+      bytes.resize(n_read + wanted);
+      const std::int64_t n = probe_io_ctx_.Read(&bytes[n_read], wanted);
+      n_read += n;
+      if (n < wanted) {
+        break;
+      }
+    }
+    bytes.resize(n_read);
+    return bytes;
+  }
+
+  const std::vector<ByteRange> ranges =
+      SplitIntoByteRanges(size_, max_connections, min_range_size);
+  TIRO_SPEECH_DEBUG("Fetching '{}' in {} ranges", uri_, ranges.size());
+  bytes.resize(size_);
+  char* data = bytes.data();
+  auto check_read = [](std::int64_t n_read, const ByteRange& range) {
+    if (n_read != range.second - range.first) {
+      throw av::AvError{"Short read for byte range request"};
+    }
+  };
+
+  std::vector<std::future<void>> range_fetches;
+  range_fetches.reserve(ranges.size());
+  for (std::size_t i = 1; i < ranges.size(); ++i) {
+    range_fetches.push_back(std::async(std::launch::async, [&, i]() {
+      const auto [begin, end] = ranges[i];
+      av::UrlIoContext io_ctx{uri_, begin, end};
+      check_read(io_ctx.Read(data + begin, end - begin), ranges[i]);
+    }));
+  }
+
+  // The probing connection is already reading from the start of the resource
+  check_read(probe_io_ctx_.Read(data, ranges[0].second), ranges[0]);
+  for (auto& range_fetch : range_fetches) {
+    range_fetch.get();
+  }
+
+  return bytes;
+}
+
+RangeStreamBuf::RangeStreamBuf(RangeFetcher fetcher, int max_connections,
+                               std::int64_t range_size)
+    : fetcher_{std::move(fetcher)},
+      max_connections_{std::max(max_connections, 1)} {
+  if (fetcher_.fetched_) {
+    throw av::AvError{"RangeFetcher has already been read from"};
+  }
+  fetcher_.fetched_ = true;
+  if (fetcher_.SupportsRanges()) {
+    ranges_ = SplitIntoByteRanges(fetcher_.size_,
+                                  std::numeric_limits<int>::max(), range_size);
+    TIRO_SPEECH_DEBUG("Streaming '{}' in {} ranges", fetcher_.uri_,
+                      ranges_.size());
+    FetchAhead();
+  }
+}
+
+void RangeStreamBuf::FetchAhead() {
+  while (fetches_.size() < static_cast<std::size_t>(max_connections_) &&
+         next_range_ < ranges_.size()) {
+    const auto [begin, end] = ranges_[next_range_];
+    // The probing connection is already reading from the start of the resource
+    const bool use_probe = next_range_ == 0;
+    auto fetch_range = [this, begin = begin, end = end, use_probe]() {
+      std::string bytes(end - begin, '\0');
+      std::int64_t n_read;
+      if (use_probe) {
+        n_read = fetcher_.probe_io_ctx_.Read(bytes.data(), end - begin);
+      } else {
+        av::UrlIoContext io_ctx{fetcher_.uri_, begin, end};
+        n_read = io_ctx.Read(bytes.data(), end - begin);
+      }
+      if (n_read != end - begin) {
+        throw av::AvError{"Short read for byte range request"};
+      }
+      return bytes;
+    };
+    fetches_.push_back(std::async(std::launch::async, fetch_range));
+    next_range_++;
+  }
+}
+
+RangeStreamBuf::int_type RangeStreamBuf::underflow() {
+  if (gptr() < egptr()) {
+    return traits_type::to_int_type(*gptr());
+  }
+  if (fetcher_.SupportsRanges()) {
+    if (fetches_.empty()) {
+      return traits_type::eof();
+    }
+    std::future<std::string> fetch = std::move(fetches_.front());
+    fetches_.pop_front();
+    current_ = fetch.get();
+    FetchAhead();
+  } else {
+    constexpr std::int64_t kReadSize = 1 << 16;
+    current_.resize(kReadSize);
+    current_.resize(fetcher_.probe_io_ctx_.Read(current_.data(), kReadSize));
+  }
+  if (current_.empty()) {
+    return traits_type::eof();
+  }
+  setg(current_.data(), current_.data(), current_.data() + current_.size());
+  return traits_type::to_int_type(*gptr());
+}
+
+}  // namespace tiro_speech
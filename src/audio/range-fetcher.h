@@ -0,0 +1,133 @@
+// Copyright 2021 Tiro ehf.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef TIRO_SPEECH_SRC_AUDIO_RANGE_FETCHER_H_
+#define TIRO_SPEECH_SRC_AUDIO_RANGE_FETCHER_H_
+
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <streambuf>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "src/audio/ffmpeg-wrapper.h"
+
+namespace tiro_speech {
+
+/// Byte range [first; second)
+using ByteRange = std::pair<std::int64_t, std::int64_t>;
+
+/**
+ * Split [0; \p size) into at most \p max_ranges contiguous ranges of roughly
+ * equal size, none of them (except when \p size is smaller) shorter than \p
+ * min_range_size.
+ */
+std::vector<ByteRange> SplitIntoByteRanges(std::int64_t size, int max_ranges,
+                                           std::int64_t min_range_size);
+
+/** \class RangeFetcher
+ * \brief Downloads a remote resource using parallel range requests if possible
+ *
+ * Construction opens a connection to the resource which is used to find out
+ * whether it has a known size and supports range requests (for HTTP this means
+ * Content-Length and Accept-Ranges: bytes). That connection is reused for
+ * reading the first range.
+ *
+ * Example usage:
+ * \code
+ *   RangeFetcher fetcher{"https://example.com/long-podcast.mp3"};
+ *   if (fetcher.SupportsRanges()) {
+ *     std::string bytes = fetcher.Fetch();
+ *   }
+ * \endcode
+ */
+class RangeFetcher {
+ public:
+  /**
+   * Throws av::AvError if the resource can't be opened.
+   */
+  explicit RangeFetcher(std::string uri);
+
+  /// Size in bytes, or a negative number if unknown
+  std::int64_t Size() const { return size_; }
+
+  /// True if we know the size and can request byte ranges
+  bool SupportsRanges() const { return seekable_ && size_ > 0; }
+
+  /**
+   * Fetch the whole resource. If SupportsRanges() the resource is split into
+   * ranges of at least \p min_range_size bytes and up to \p max_connections are
+   * fetched concurrently, each directly into its own slice of the returned
+   * buffer, otherwise it is read sequentially.
+   *
+   * Can only be called once. Throws av::AvError on failure.
+   */
+  std::string Fetch(int max_connections = 4,
+                    std::int64_t min_range_size = 1 << 20);
+
+ private:
+  std::string uri_;
+  av::UrlIoContext probe_io_ctx_;
+  std::int64_t size_;
+  bool seekable_;
+  bool fetched_ = false;
+
+  friend class RangeStreamBuf;
+};
+
+/** \class RangeStreamBuf
+ * \brief Stream buffer that reads a remote resource in order, with ranges
+ *        fetched ahead of the reader
+ *
+ * If the resource supports range requests it is split into ranges of \p
+ * range_size bytes, and up to \p max_connections of the ranges following the
+ * one being read are fetched concurrently. So at most that many ranges are held
+ * in memory at a time, however long the resource is, and reading can start as
+ * soon as the first range has arrived. Other resources are read sequentially.
+ *
+ * Fetch errors are thrown as av::AvError from the reading stream, if its
+ * exception mask includes std::ios::badbit.
+ *
+ * Example usage:
+ * \code
+ *   RangeStreamBuf buf{RangeFetcher{"https://example.com/long-podcast.mp3"}};
+ *   std::istream is{&buf};
+ *   is.exceptions(std::ios::badbit);
+ * \endcode
+ */
+class RangeStreamBuf : public std::streambuf {
+ public:
+  explicit RangeStreamBuf(RangeFetcher fetcher, int max_connections = 4,
+                          std::int64_t range_size = 1 << 20);
+
+ protected:
+  int_type underflow() override;
+
+ private:
+  /// Start fetching ranges until max_connections_ are in flight
+  void FetchAhead();
+
+  RangeFetcher fetcher_;
+  const int max_connections_;
+  std::vector<ByteRange> ranges_;
+  std::size_t next_range_ = 0;
+  // Destroyed before fetcher_, which the first of them reads from
+  std::deque<std::future<std::string>> fetches_;
+  std::string current_;
+};
+
+}  // namespace tiro_speech
+
+#endif  // TIRO_SPEECH_SRC_AUDIO_RANGE_FETCHER_H_
@@ -11,11 +11,19 @@
 // WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
 // See the License for the specific language governing permissions and
 // limitations under the License.
+#include <fmt/format.h>
+#include <unicode/unistr.h>
+
+#include <algorithm>
+#include <chrono>
 #include <cstdlib>
 #include <exception>
 #include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <map>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include "src/itn/punctuation.h"
@@ -26,6 +34,115 @@
 using namespace tiro_speech;
 using namespace tiro_speech::itn;
 
+namespace {
+
+constexpr std::string_view kPunctuationChars = ",.?";
+
+/** The punctuation character \p word ends with, or '\0' */
+char TrailingPunctuation(const std::string& word) {
+  if (!word.empty() &&
+      kPunctuationChars.find(word.back()) != std::string_view::npos) {
+    return word.back();
+  }
+  return '\0';
+}
+
+struct PunctuationCounts {
+  int true_positives = 0;
+  int false_positives = 0;
+  int false_negatives = 0;
+};
+
+void PrintScores(const std::string& label, const PunctuationCounts& counts) {
+  const auto ratio = [](int num, int den) {
+    return den == 0 ? 0.0 : static_cast<double>(num) / den;
+  };
+  const double precision =
+      ratio(counts.true_positives,
+            counts.true_positives + counts.false_positives);
+  const double recall = ratio(counts.true_positives,
+                              counts.true_positives + counts.false_negatives);
+  const double f1 = precision + recall == 0.0
+                        ? 0.0
+                        : 2 * precision * recall / (precision + recall);
+  fmt::print("  {:<8} precision {:.3f} recall {:.3f} F1 {:.3f}\n", label,
+             precision, recall, f1);
+}
+
+/**
+ * Punctuate each line of \p reference with punctuation removed and the words
+ * lowercased, and print per character and overall F1 of the punctuation
+ * compared to the reference, along with the latency per line.
+ */
+void Evaluate(const std::string& name, ElectraPunctuator* punctuator,
+              const std::vector<std::vector<std::string>>& reference) {
+  std::map<char, PunctuationCounts> counts;
+  std::vector<double> latencies_ms;
+  for (const std::vector<std::string>& reference_words : reference) {
+    std::vector<std::string> words;
+    words.reserve(reference_words.size());
+    for (std::string word : reference_words) {
+      if (TrailingPunctuation(word) != '\0') {
+        word.pop_back();
+      }
+      std::string lowercased;
+      icu::UnicodeString::fromUTF8(word).toLower().toUTF8String(lowercased);
+      words.push_back(std::move(lowercased));
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    const std::vector<std::string> punctuated = punctuator->Punctuate(words);
+    latencies_ms.push_back(std::chrono::duration<double, std::milli>(
+                               std::chrono::steady_clock::now() - start)
+                               .count());
+
+    for (std::size_t idx = 0;
+         idx < punctuated.size() && idx < reference_words.size(); ++idx) {
+      const char predicted = TrailingPunctuation(punctuated[idx]);
+      const char expected = TrailingPunctuation(reference_words[idx]);
+      if (predicted != '\0' && predicted == expected) {
+        counts[predicted].true_positives++;
+        continue;
+      }
+      if (predicted != '\0') {
+        counts[predicted].false_positives++;
+      }
+      if (expected != '\0') {
+        counts[expected].false_negatives++;
+      }
+    }
+  }
+
+  fmt::print("{}:\n", name);
+  PunctuationCounts overall;
+  for (char c : kPunctuationChars) {
+    const PunctuationCounts& c_counts = counts[c];
+    PrintScores(std::string(1, c), c_counts);
+    overall.true_positives += c_counts.true_positives;
+    overall.false_positives += c_counts.false_positives;
+    overall.false_negatives += c_counts.false_negatives;
+  }
+  PrintScores("overall", overall);
+
+  if (latencies_ms.empty()) {
+    return;
+  }
+  std::sort(latencies_ms.begin(), latencies_ms.end());
+  double total_ms = 0;
+  for (double latency_ms : latencies_ms) {
+    total_ms += latency_ms;
+  }
+  const auto percentile = [&latencies_ms](double p) {
+    return latencies_ms[static_cast<std::size_t>(p *
+                                                 (latencies_ms.size() - 1))];
+  };
+  fmt::print(
+      "  latency per line: mean {:.2f} ms, p50 {:.2f} ms, p95 {:.2f} ms\n",
+      total_ms / latencies_ms.size(), percentile(0.5), percentile(0.95));
+}
+
+}  // namespace
+
 int main(int argc, char* argv[]) {
   try {
     const char* usage =
@@ -38,13 +155,27 @@ int main(int argc, char* argv[]) {
         "file/traced_electra.pt \\\n"
         "       "
         "--word-piece.vocab=external/clarin_electra_punctuation_vocab/file/"
-        "vocab.txt";
+        "vocab.txt\n\n"
+        "With --eval-reference, the punctuation of a punctuated reference text "
+        "is\nremoved and restored, and F1 and latency are reported instead.";
     ParseOptions po{usage};
 
     bool do_capitalize = false;
     po.Register("capitalize", &do_capitalize, "Also do basic capitalization.");
 
+    std::string eval_reference_filename;
+    po.Register("eval-reference", &eval_reference_filename,
+                "Punctuated reference text, one or more sentences per line. "
+                "If set, evaluate the model on it instead of punctuating "
+                "stdin.");
+    std::string eval_quantized_model_filename;
+    po.Register("eval-quantized-model", &eval_quantized_model_filename,
+                "Dynamically quantized variant of --pytorch-jit-model to "
+                "compare with in evaluation.");
+
     ElectraPunctuatorConfig punctuator_opts{};
+    // Lines are punctuated one at a time, so there are no batches to wait for
+    punctuator_opts.max_batch_delay_us = 0;
     punctuator_opts.Register(&po);
 
     po.Read(argc, argv);
@@ -61,6 +192,41 @@ int main(int argc, char* argv[]) {
       return EXIT_FAILURE;
     }
 
+    if (!eval_reference_filename.empty()) {
+      std::ifstream reference_stream{eval_reference_filename};
+      if (!reference_stream) {
+        TIRO_SPEECH_ERROR("Could not open {}", eval_reference_filename);
+        return EXIT_FAILURE;
+      }
+      std::vector<std::vector<std::string>> reference;
+      for (std::string line; std::getline(reference_stream, line);) {
+        std::vector<std::string> words;
+        for (auto w : Split(line)) {
+          if (!w.empty()) {
+            words.emplace_back(w);
+          }
+        }
+        if (!words.empty()) {
+          reference.push_back(std::move(words));
+        }
+      }
+
+      {
+        ElectraPunctuator punctuator{punctuator_opts};
+        Evaluate(punctuator_opts.pytorch_jit_model_filename, &punctuator,
+                 reference);
+      }
+      if (!eval_quantized_model_filename.empty()) {
+        ElectraPunctuatorConfig quantized_opts = punctuator_opts;
+        quantized_opts.pytorch_jit_model_filename =
+            eval_quantized_model_filename;
+        quantized_opts.quantized = true;
+        ElectraPunctuator punctuator{quantized_opts};
+        Evaluate(eval_quantized_model_filename, &punctuator, reference);
+      }
+      return EXIT_SUCCESS;
+    }
+
     ElectraPunctuator punctuator{punctuator_opts};
 
     for (std::string line; std::getline(std::cin, line);) {
@@ -19,12 +19,17 @@
 
 #include <algorithm>
 #include <cstdint>
+#include <limits>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
+#include <stdexcept>
 #include <string>
+#include <utility>
 #include <vector>
 
-#include "src/plda-scoring-utils.h"
-
 namespace tiro_speech {
 
 kaldi::nnet3::Nnet ReadInferenceNnet(const std::string &filename,
@@ -40,229 +45,413 @@ kaldi::nnet3::Nnet ReadInferenceNnet(const std::string &filename,
   return nnet;
 }
 
+namespace {
+
+/// A chunk of the features of a segment
+struct XvectorChunk {
+  std::size_t segment;
+  std::int32_t start;
+  std::int32_t num_rows;
+};
+
+/**
+ * Copy \p chunk to the middle of \p padded, repeating its first and last rows
+ * on either side.
+ */
+void CopyPadded(const kaldi::MatrixBase<float> &chunk,
+                kaldi::MatrixBase<float> *padded) {
+  const std::int32_t num_rows = chunk.NumRows();
+  const std::int32_t left_context = (padded->NumRows() - num_rows) / 2;
+  const std::int32_t right_context =
+      padded->NumRows() - num_rows - left_context;
+  for (std::int32_t i = 0; i < left_context; i++) {
+    padded->Row(i).CopyFromVec(chunk.Row(0));
+  }
+  for (std::int32_t i = 0; i < right_context; i++) {
+    padded->Row(padded->NumRows() - i - 1)
+        .CopyFromVec(chunk.Row(num_rows - 1));
+  }
+  padded->Range(left_context, num_rows, 0, chunk.NumCols()).CopyFromMat(chunk);
+}
+
+}  // namespace
+
 XvectorNnet::Xvector XvectorNnet::Compute(
     const kaldi::MatrixBase<float> &features, float window_seconds,
     float period_seconds) const {
-  std::int32_t num_rows = features.NumRows();
-  std::int32_t feat_dim = features.NumCols();
-  std::int32_t this_chunk_size = chunk_size_;
-
-  if (num_rows < chunk_size_ || chunk_size_ == -1) {
-    this_chunk_size = num_rows;
-  }
-
-  std::int32_t num_chunks =
-      std::ceil(num_rows / static_cast<float>(this_chunk_size));
-
-  Xvector xvector_avg{xvector_dim_, kaldi::kSetZero};
-  float tot_weight = 0.0;
-
-  // Iterate over the feature chunks.
-  for (std::int32_t chunk_indx = 0; chunk_indx < num_chunks; chunk_indx++) {
-    // If we're nearing the end of the input, we may need to shift the
-    // offset back so that we can get this_chunk_size frames of input to
-    // the nnet.
-    std::int32_t offset =
-        std::min(this_chunk_size, num_rows - chunk_indx * this_chunk_size);
-    kaldi::SubMatrix<float> sub_features{features, chunk_indx * this_chunk_size,
-                                         offset, 0, feat_dim};
-    kaldi::Vector<float> xvector;
-    tot_weight += offset;
-
-    // Pad input if the offset is less than the minimum chunk size
-    if (offset < min_chunk_size_) {
-      kaldi::Matrix<float> padded_features{min_chunk_size_, feat_dim};
-      std::int32_t left_context = (min_chunk_size_ - offset) / 2;
-      std::int32_t right_context = min_chunk_size_ - offset - left_context;
-      for (std::int32_t i = 0; i < left_context; i++) {
-        padded_features.Row(i).CopyFromVec(sub_features.Row(0));
+  return std::move(ComputeBatch({&features})[0]);
+}
+
+std::vector<XvectorNnet::Xvector> XvectorNnet::ComputeBatch(
+    const std::vector<const kaldi::MatrixBase<float> *> &segments) const {
+  // Chunks grouped by their length after padding. Chunks shorter than the
+  // minimum chunk size are padded to it.
+  std::map<std::int32_t, std::vector<XvectorChunk>> chunks_by_len;
+  std::vector<float> tot_weights(segments.size(), 0.0f);
+  for (std::size_t segment = 0; segment < segments.size(); ++segment) {
+    const std::int32_t num_rows = segments[segment]->NumRows();
+    const std::int32_t this_chunk_size =
+        num_rows < chunk_size_ || chunk_size_ == -1 ? num_rows : chunk_size_;
+    for (std::int32_t start = 0; start < num_rows; start += this_chunk_size) {
+      const std::int32_t chunk_rows =
+          std::min(this_chunk_size, num_rows - start);
+      chunks_by_len[std::max(chunk_rows, min_chunk_size_)].push_back(
+          XvectorChunk{segment, start, chunk_rows});
+      tot_weights[segment] += chunk_rows;
+    }
+  }
+
+  std::vector<Xvector> xvectors(segments.size(),
+                                Xvector{xvector_dim_, kaldi::kSetZero});
+  for (const auto &[num_frames, chunks] : chunks_by_len) {
+    for (std::size_t begin = 0; begin < chunks.size();
+         begin += max_batch_size_) {
+      const std::size_t end =
+          std::min(chunks.size(), begin + max_batch_size_);
+      const std::int32_t feat_dim = segments[chunks[begin].segment]->NumCols();
+      kaldi::Matrix<float> input((end - begin) * num_frames, feat_dim,
+                                 kaldi::kUndefined);
+      for (std::size_t idx = begin; idx < end; ++idx) {
+        const XvectorChunk &chunk = chunks[idx];
+        const std::int32_t row = (idx - begin) * num_frames;
+        kaldi::SubMatrix<float> padded{input, row, num_frames, 0, feat_dim};
+        CopyPadded(kaldi::SubMatrix<float>{*segments[chunk.segment],
+                                           chunk.start, chunk.num_rows, 0,
+                                           feat_dim},
+                   &padded);
       }
-      for (std::int32_t i = 0; i < right_context; i++) {
-        padded_features.Row(min_chunk_size_ - i - 1)
-            .CopyFromVec(sub_features.Row(offset - 1));
+
+      kaldi::Matrix<float> output;
+      RunNnetComputation(end - begin, input, &output);
+      for (std::size_t idx = begin; idx < end; ++idx) {
+        xvectors[chunks[idx].segment].AddVec(chunks[idx].num_rows,
+                                             output.Row(idx - begin));
       }
-      padded_features.Range(left_context, offset, 0, feat_dim)
-          .CopyFromMat(sub_features);
-      RunNnetComputation(padded_features, &xvector);
-    } else {
-      RunNnetComputation(sub_features, &xvector);
     }
-    xvector_avg.AddVec(offset, xvector);
   }
-  xvector_avg.Scale(1.0 / tot_weight);
 
-  return xvector_avg;
+  for (std::size_t segment = 0; segment < segments.size(); ++segment) {
+    if (tot_weights[segment] > 0) {
+      xvectors[segment].Scale(1.0 / tot_weights[segment]);
+    }
+  }
+  return xvectors;
 }
 
 void XvectorNnet::RunNnetComputation(const kaldi::MatrixBase<float> &features,
                                      kaldi::Vector<float> *xvector) const {
+  kaldi::Matrix<float> output;
+  RunNnetComputation(1, features, &output);
+  xvector->Resize(output.NumCols());
+  xvector->CopyFromVec(output.Row(0));
+}
+
+void XvectorNnet::RunNnetComputation(std::int32_t num_sequences,
+                                     const kaldi::MatrixBase<float> &input,
+                                     kaldi::Matrix<float> *output) const {
+  std::shared_ptr<const kaldi::nnet3::NnetComputation> computation =
+      GetComputation(num_sequences, input.NumRows() / num_sequences);
+  kaldi::nnet3::Nnet *nnet_to_update = nullptr;  // we're not doing any update.
+  kaldi::nnet3::NnetComputer computer(kaldi::nnet3::NnetComputeOptions(),
+                                      *computation, nnet_, nnet_to_update);
+  kaldi::CuMatrix<float> input_feats_cu(input);
+  computer.AcceptInput("input", &input_feats_cu);
+  computer.Run();
+  kaldi::CuMatrix<float> cu_output;
+  computer.GetOutputDestructive("output", &cu_output);
+  output->Resize(cu_output.NumRows(), cu_output.NumCols(), kaldi::kUndefined);
+  cu_output.CopyToMat(output);
+}
+
+std::shared_ptr<const kaldi::nnet3::NnetComputation>
+XvectorNnet::GetComputation(std::int32_t num_sequences,
+                            std::int32_t num_frames) const {
+  const std::pair<std::int32_t, std::int32_t> key{num_sequences, num_frames};
+  {
+    std::shared_lock<std::shared_mutex> lock{computations_mutex_};
+    if (auto it = computations_.find(key); it != computations_.end()) {
+      return it->second;
+    }
+  }
+
+  // Sequence n is in rows [n * num_frames, (n + 1) * num_frames) of the input
+  // and in row n of the output.
   kaldi::nnet3::ComputationRequest request;
   request.need_model_derivative = false;
   request.store_component_stats = false;
-  request.inputs.push_back(
-      kaldi::nnet3::IoSpecification("input", 0, features.NumRows()));
+  kaldi::nnet3::IoSpecification input_spec;
+  input_spec.name = "input";
+  input_spec.has_deriv = false;
   kaldi::nnet3::IoSpecification output_spec;
   output_spec.name = "output";
   output_spec.has_deriv = false;
-  output_spec.indexes.resize(1);
+  for (std::int32_t n = 0; n < num_sequences; ++n) {
+    for (std::int32_t t = 0; t < num_frames; ++t) {
+      input_spec.indexes.emplace_back(n, t, 0);
+    }
+    output_spec.indexes.emplace_back(n, 0, 0);
+  }
+  request.inputs.resize(1);
+  request.inputs[0].Swap(&input_spec);
   request.outputs.resize(1);
   request.outputs[0].Swap(&output_spec);
-  std::shared_ptr<const kaldi::nnet3::NnetComputation> computation(
-      compiler_.Compile(request));
-  kaldi::nnet3::Nnet *nnet_to_update = nullptr;  // we're not doing any update.
-  kaldi::nnet3::NnetComputer computer(kaldi::nnet3::NnetComputeOptions(),
-                                      *computation, nnet_, nnet_to_update);
-  kaldi::CuMatrix<float> input_feats_cu(features);
-  computer.AcceptInput("input", &input_feats_cu);
-  computer.Run();
-  kaldi::CuMatrix<float> cu_output;
-  computer.GetOutputDestructive("output", &cu_output);
-  xvector->Resize(cu_output.NumCols());
-  xvector->CopyFromVec(cu_output.Row(0));
+
+  std::unique_lock<std::shared_mutex> lock{computations_mutex_};
+  if (auto it = computations_.find(key); it != computations_.end()) {
+    return it->second;
+  }
+  while (!computations_order_.empty() &&
+         computations_.size() >= computations_capacity_) {
+    computations_.erase(computations_order_.front());
+    computations_order_.pop_front();
+  }
+  computations_order_.push_back(key);
+  return computations_[key] = compiler_.Compile(request);
 }
 
 std::vector<std::pair<std::int32_t, std::int32_t>> SegmentByVad(
     const kaldi::Vector<float> &voiced, float silence_proportion) {
-  auto &A = voiced;
-  auto N = voiced.Dim();
-  kaldi::Vector<float> S(N);
-  kaldi::Vector<float> E(N + 1);
-
-  for (auto n = 0; n < N; ++n) {
-    if (A(n) == 0) {
-      if (n > 0 && !kaldi::ApproxEqual(A(n - 1), 0)) {
-        E(n) = 1;
-      }
+  // Runs of voiced frames
+  std::vector<std::pair<std::int32_t, std::int32_t>> voiced_segments;
+  std::int32_t num_nonsil_frames = 0;
+  for (std::int32_t n = 0; n < voiced.Dim(); ++n) {
+    if (kaldi::ApproxEqual(voiced(n), 0)) {
+      continue;
+    }
+    if (voiced_segments.empty() || voiced_segments.back().second != n) {
+      voiced_segments.emplace_back(n, n + 1);
     } else {
-      if (n == 0 || kaldi::ApproxEqual(A(n - 1), 0)) {
-        S(n) = 1;
-      }
+      voiced_segments.back().second = n + 1;
     }
+    num_nonsil_frames++;
+  }
+
+  // Segments are padded with silence by moving their starts back, one frame
+  // per segment at a time in segment order, until they contain about
+  // silence_proportion silence or meet the previous segment. The padding of
+  // each segment is computed directly instead of frame by frame: after k
+  // full rounds segment i has been padded with min(gap_i, k) frames.
+  const std::int32_t target_segment_frames =
+      num_nonsil_frames / (1.0 - silence_proportion);
+  const std::int32_t num_padding_frames =
+      target_segment_frames - num_nonsil_frames;
+  std::vector<std::int32_t> gaps;
+  gaps.reserve(voiced_segments.size());
+  std::int32_t max_gap = 0;
+  for (std::size_t i = 0; i < voiced_segments.size(); ++i) {
+    gaps.push_back(voiced_segments[i].first -
+                   (i == 0 ? 0 : voiced_segments[i - 1].second));
+    max_gap = std::max(max_gap, gaps.back());
   }
-  if (!kaldi::ApproxEqual(A(N - 1), 0)) {
-    E(N) = 1;
+  auto padding_after_rounds = [&gaps](std::int32_t rounds) {
+    std::int64_t padding = 0;
+    for (std::int32_t gap : gaps) {
+      padding += std::min(gap, rounds);
+    }
+    return padding;
+  };
+  // Number of full rounds, i.e. the largest k with padding <= target
+  std::int32_t lo = 0, hi = max_gap;
+  while (lo < hi) {
+    const std::int32_t mid = lo + (hi - lo + 1) / 2;
+    if (padding_after_rounds(mid) <= num_padding_frames) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  const std::int32_t rounds = lo;
+  std::int64_t remaining = num_padding_frames - padding_after_rounds(rounds);
+  for (std::size_t i = 0; i < voiced_segments.size(); ++i) {
+    std::int32_t padding = std::min(gaps[i], rounds);
+    if (remaining > 0 && gaps[i] > rounds) {
+      padding++;
+      remaining--;
+    }
+    voiced_segments[i].first -= padding;
   }
+  return voiced_segments;
+}
 
-  std::int32_t num_nonsil_frames = 0;
-  bool in_segment;
+namespace {
 
-  std::vector<std::int32_t> active_frames;
-  for (std::int32_t n = 0; n <= N; ++n) {
-    if (n < N && kaldi::ApproxEqual(S(n), 1)) {
-      in_segment = true;
-      active_frames.push_back(n);
-    }
-    if (kaldi::ApproxEqual(E(n), 1)) {
-      in_segment = false;
+// SegmentByVad() pads segments so that they contain about 20% silence. When
+// segmenting incrementally we do the same for each segment, on both sides.
+constexpr float kSegmentPaddingRatio = 0.2f / (1.0f - 0.2f) / 2.0f;
+
+/**
+ * Cluster all of \p xvectors at once, using a dense score matrix.
+ */
+std::vector<std::int32_t> ClusterXvectorsDense(
+    const kaldi::PldaScorer &plda_scorer,
+    const std::vector<kaldi::Vector<float>> &xvectors, int num_speakers) {
+  if (xvectors.size() < 2) {
+    return std::vector<std::int32_t>(xvectors.size(), 1);
+  }
+  kaldi::Matrix<float> plda_scores = plda_scorer.Score(xvectors);
+  plda_scores.Scale(-1);
+
+  const float max_spk_fraction = 1.0;
+  const float first_pass_max_utterances =
+      std::numeric_limits<std::int16_t>::max();
+
+  std::vector<std::int32_t> spk_ids;
+  if (1.0 / num_speakers <= max_spk_fraction && max_spk_fraction <= 1.0) {
+    AgglomerativeCluster(plda_scores, std::numeric_limits<float>::max(),
+                         num_speakers, first_pass_max_utterances,
+                         max_spk_fraction, &spk_ids);
+  } else {
+    AgglomerativeCluster(plda_scores, std::numeric_limits<float>::max(),
+                         num_speakers, first_pass_max_utterances, 1.0,
+                         &spk_ids);
+  }
+  return spk_ids;
+}
+
+/**
+ * Rename the clusters in \p spk_ids so that they agree as much as possible
+ * with \p prev_spk_ids, the ids from an earlier clustering of a prefix of the
+ * same segments.
+ */
+std::vector<std::int32_t> StabilizeSpeakerIds(
+    const std::vector<std::int32_t> &prev_spk_ids,
+    const std::vector<std::int32_t> &spk_ids) {
+  // Count how often each new cluster coincides with each old one, and greedily
+  // map clusters to their most common old id.
+  std::map<std::pair<std::int32_t, std::int32_t>, std::int32_t> overlaps;
+  for (std::size_t i = 0; i < prev_spk_ids.size() && i < spk_ids.size(); ++i) {
+    overlaps[{spk_ids[i], prev_spk_ids[i]}]++;
+  }
+  std::vector<std::pair<std::int32_t, std::pair<std::int32_t, std::int32_t>>>
+      by_count;
+  for (const auto &[ids, count] : overlaps) {
+    by_count.emplace_back(count, ids);
+  }
+  std::sort(by_count.rbegin(), by_count.rend());
+
+  std::map<std::int32_t, std::int32_t> renamed;
+  std::set<std::int32_t> used;
+  for (const auto &[count, ids] : by_count) {
+    const auto [new_id, old_id] = ids;
+    if (renamed.count(new_id) == 0 && used.count(old_id) == 0) {
+      renamed[new_id] = old_id;
+      used.insert(old_id);
     }
-    if (n < N) {
-      if (in_segment) {
-        num_nonsil_frames++;
+  }
+  // Clusters that don't match an old one keep their id if it's free
+  for (std::int32_t new_id : spk_ids) {
+    if (renamed.count(new_id) == 0) {
+      std::int32_t id = new_id;
+      while (used.count(id) != 0) {
+        id++;
       }
+      renamed[new_id] = id;
+      used.insert(id);
     }
   }
 
-  std::int32_t target_segment_frames =
-      num_nonsil_frames / (1.0 - silence_proportion);
-  std::int32_t num_segment_frames = num_nonsil_frames;
-  while (num_segment_frames < target_segment_frames) {
-    bool changed = false;
-    for (std::size_t i = 0; i < active_frames.size(); ++i) {
-      auto n = active_frames[i];
-      if (kaldi::ApproxEqual(E(n), 1) && n < N &&
-          !kaldi::ApproxEqual(S(n), 1)) {
-        E(n) = 0;
-        E(n + 1) = 1;
-        active_frames[i] = n + 1;
-        num_segment_frames++;
-        changed = true;
-      }
-      if (n < N && kaldi::ApproxEqual(S(n), 1) && n > 0 &&
-          !kaldi::ApproxEqual(E(n), 1)) {
-        S(n) = 0;
-        S(n - 1) = 1;
-        active_frames[i] = n - 1;
-        num_segment_frames++;
-        changed = true;
-      }
-      if (num_segment_frames == target_segment_frames) {
-        break;
+  std::vector<std::int32_t> stable_spk_ids;
+  stable_spk_ids.reserve(spk_ids.size());
+  for (std::int32_t new_id : spk_ids) {
+    stable_spk_ids.push_back(renamed[new_id]);
+  }
+  return stable_spk_ids;
+}
+
+}  // namespace
+
+std::vector<std::int32_t> ClusterXvectors(
+    const kaldi::PldaScorer &plda_scorer,
+    const std::vector<kaldi::Vector<float>> &xvectors, int num_speakers,
+    const XvectorClusteringOptions &opts) {
+  if (opts.window_segments <= 0 ||
+      xvectors.size() <= static_cast<std::size_t>(opts.window_segments)) {
+    return ClusterXvectorsDense(plda_scorer, xvectors, num_speakers);
+  }
+
+  // First pass: cluster windows of consecutive segments on their own. Windows
+  // are of equal size so the last one isn't tiny.
+  const std::size_t num_windows =
+      (xvectors.size() + opts.window_segments - 1) / opts.window_segments;
+  const std::size_t window_size =
+      (xvectors.size() + num_windows - 1) / num_windows;
+  std::vector<kaldi::Vector<float>> centroids;
+  std::vector<std::int32_t> centroid_idxs(xvectors.size());
+  for (std::size_t begin = 0; begin < xvectors.size(); begin += window_size) {
+    const std::size_t end = std::min(xvectors.size(), begin + window_size);
+    const std::vector<kaldi::Vector<float>> window{xvectors.begin() + begin,
+                                                   xvectors.begin() + end};
+    const std::vector<std::int32_t> cluster_ids =
+        ClusterXvectorsDense(plda_scorer, window, opts.window_clusters);
+
+    // Each cluster is represented by its mean x-vector in the second pass
+    std::map<std::int32_t, std::int32_t> cluster_centroid;
+    for (std::size_t idx = begin; idx < end; ++idx) {
+      const std::int32_t cluster_id = cluster_ids[idx - begin];
+      if (cluster_centroid.count(cluster_id) == 0) {
+        cluster_centroid[cluster_id] = centroids.size();
+        centroids.emplace_back(xvectors[idx].Dim());
       }
+      centroid_idxs[idx] = cluster_centroid[cluster_id];
+    }
+    std::vector<float> counts(centroids.size());
+    for (std::size_t idx = begin; idx < end; ++idx) {
+      centroids[centroid_idxs[idx]].AddVec(1.0, xvectors[idx]);
+      counts[centroid_idxs[idx]]++;
     }
-    if (!changed) {
-      break;
+    for (const auto &[cluster_id, centroid_idx] : cluster_centroid) {
+      centroids[centroid_idx].Scale(1.0 / counts[centroid_idx]);
     }
   }
 
-  std::vector<std::pair<std::int32_t, std::int32_t>> voiced_segments;
-  for (std::int32_t n = 0; n < N; ++n) {
-    assert(!(E(n) == 1 && S(n) != 1));
-    if (S(n) == 1) {
-      std::int32_t p;
-      for (p = n + 1; p < N && !kaldi::ApproxEqual(E(p), 1); ++p) {
-        assert(S(p) == 0);
-      }
-      assert(E(p) == 1);
-      voiced_segments.emplace_back(n, p);
-      if (p < N && kaldi::ApproxEqual(S(p), 1)) {
-        n = p - 1;
-      } else {
-        n = p;
-      }
-    }
+  // Second pass: cluster the window clusters into speakers
+  const std::vector<std::int32_t> centroid_spk_ids =
+      ClusterXvectorsDense(plda_scorer, centroids, num_speakers);
+  std::vector<std::int32_t> spk_ids;
+  spk_ids.reserve(xvectors.size());
+  for (std::int32_t centroid_idx : centroid_idxs) {
+    spk_ids.push_back(centroid_spk_ids[centroid_idx]);
   }
-  return voiced_segments;
+  return spk_ids;
 }
 
 std::vector<DiarizationSegment> ComputeXvectorDiarization(
     const XvectorDiarizationDecoderInfo &info,
     const kaldi::Matrix<float> &feats, int num_speakers) {
-  std::int32_t num_rows = feats.NumRows();
   std::int32_t feat_dim = feats.NumCols();
 
   kaldi::Vector<float> voiced;
   kaldi::ComputeVadEnergy(info.opts.vad_opts, feats, &voiced);
 
-  kaldi::Matrix<float> cmvn_feat(feats.NumRows(), feats.NumCols(),
-                                 kaldi::kUndefined);
-  kaldi::SlidingWindowCmn(info.opts.cmn_opts, feats, &cmvn_feat);
-
   const auto segmentation = SegmentByVad(voiced);
   // TODO(rkjaran): Create overlapping segments. "The speaker boundary between
   // two overlapping segments by different speakers is placed at the midpoint
   // between the end of the first segment and the start of the second
   // segment." from make_rttm.pyq
 
-  std::vector<kaldi::Vector<float>> xvectors;
+  std::vector<kaldi::SubMatrix<float>> segment_feats;
+  segment_feats.reserve(segmentation.size());
   for (auto [start, end] : segmentation) {
-    xvectors.push_back(info.xvector_nnet.Compute(
-        kaldi::SubMatrix<float>(feats, start, end - start, 0, feat_dim)));
+    segment_feats.emplace_back(feats, start, end - start, 0, feat_dim);
+  }
+  std::vector<const kaldi::MatrixBase<float> *> segment_ptrs;
+  for (const auto &segment : segment_feats) {
+    segment_ptrs.push_back(&segment);
   }
+  const std::vector<kaldi::Vector<float>> xvectors =
+      info.xvector_nnet.ComputeBatch(segment_ptrs);
 
+  if (segmentation.empty()) {
+    return {};
+  }
   if (segmentation.size() < 2) {
     return {
         DiarizationSegment{1, segmentation[0].first, segmentation[0].second}};
   }
 
-  kaldi::Matrix<float> plda_scores =
-      kaldi::ScorePlda(info.opts.plda_opts, kaldi::Plda{info.plda},
-                       info.whitening_matrix, info.centering_vector, xvectors);
-  plda_scores.Scale(-1);
-
-  const float max_spk_fraction = 1.0;
-  const float first_pass_max_utterances =
-      std::numeric_limits<std::int16_t>::max();
-
-  std::vector<std::int32_t> spk_ids;
-  if (1.0 / num_speakers <= max_spk_fraction && max_spk_fraction <= 1.0) {
-    AgglomerativeCluster(plda_scores, std::numeric_limits<float>::max(),
-                         num_speakers, first_pass_max_utterances,
-                         max_spk_fraction, &spk_ids);
-  } else {
-    AgglomerativeCluster(plda_scores, std::numeric_limits<float>::max(),
-                         num_speakers, first_pass_max_utterances, 1.0,
-                         &spk_ids);
-  }
+  const std::vector<std::int32_t> spk_ids =
+      ClusterXvectors(*info.plda_scorer, xvectors, num_speakers,
+                      info.opts.clustering_opts);
 
   std::vector<DiarizationSegment> diarization_segments;
   for (std::size_t idx = 0; idx < spk_ids.size(); ++idx) {
@@ -272,27 +461,244 @@ std::vector<DiarizationSegment> ComputeXvectorDiarization(
   return diarization_segments;
 }
 
+namespace {
+
+// Waveforms are fed to the features in pieces of at most this many frames, so
+// that we never fall behind by more than that
+constexpr std::int32_t kMaxFramesPerPiece = 100;
+
+kaldi::MfccOptions BoundedMfccOptions(
+    const XvectorDiarizationDecoderOptions &opts,
+    std::int32_t max_segment_frames) {
+  kaldi::MfccOptions mfcc_opts = opts.mfcc_opts;
+  if (max_segment_frames > 0) {
+    // Enough to extract a padded segment of max length once the VAD has
+    // decided on the frames of its right padding
+    mfcc_opts.frame_opts.max_feature_vectors =
+        max_segment_frames * (1.0f + 2 * kSegmentPaddingRatio) +
+        2 * opts.vad_opts.vad_frames_context + 2 * kMaxFramesPerPiece;
+  }
+  return mfcc_opts;
+}
+
+}  // namespace
+
+XvectorDiarizationDecoder::XvectorDiarizationDecoder(
+    const XvectorDiarizationDecoderInfo &info)
+    : XvectorDiarizationDecoder{info, info.opts.max_segment_frames} {}
+
+XvectorDiarizationDecoder::XvectorDiarizationDecoder(
+    const XvectorDiarizationDecoderInfo &info, std::int32_t max_segment_frames)
+    : info_{info},
+      max_segment_frames_{max_segment_frames},
+      mfcc_{std::make_unique<kaldi::OnlineMfcc>(
+          BoundedMfccOptions(info.opts, max_segment_frames))},
+      online_features_{mfcc_.get()} {}
+
+XvectorDiarizationDecoder::XvectorDiarizationDecoder(
+    const XvectorDiarizationDecoderInfo &info,
+    kaldi::Matrix<float> feature_transform)
+    : info_{info},
+      max_segment_frames_{info.opts.max_segment_frames},
+      derived_features_{std::make_unique<OnlineDerivedFeature>(
+          std::move(feature_transform),
+          info.opts.mfcc_opts.frame_opts.frame_shift_ms / 1000.0f,
+          BoundedMfccOptions(info.opts, max_segment_frames_)
+              .frame_opts.max_feature_vectors)},
+      online_features_{derived_features_.get()} {}
+
 void XvectorDiarizationDecoder::AcceptWaveform(
     float sample_freq, const kaldi::VectorBase<float> &waveform) {
-  online_features_.AcceptWaveform(sample_freq, waveform);
+  if (mfcc_ == nullptr) {
+    throw std::logic_error{
+        "AcceptWaveform() called on a decoder that is fed features"};
+  }
+  if (max_segment_frames_ <= 0) {
+    AcceptWaveformPiece(sample_freq, waveform);
+    return;
+  }
+  const std::int32_t piece_samples =
+      kMaxFramesPerPiece * sample_freq * FrameShiftInSeconds();
+  for (std::int32_t offset = 0; offset < waveform.Dim();
+       offset += piece_samples) {
+    AcceptWaveformPiece(
+        sample_freq,
+        waveform.Range(offset, std::min(piece_samples,
+                                        waveform.Dim() - offset)));
+  }
+}
+
+void XvectorDiarizationDecoder::AcceptWaveformPiece(
+    float sample_freq, const kaldi::VectorBase<float> &waveform) {
+  mfcc_->AcceptWaveform(sample_freq, waveform);
+  ProcessReadyFrames();
+}
+
+void XvectorDiarizationDecoder::AcceptFeatures(
+    const kaldi::MatrixBase<float> &feats) {
+  if (derived_features_ == nullptr) {
+    throw std::logic_error{
+        "AcceptFeatures() called on a decoder that computes its own features"};
+  }
+  for (std::int32_t offset = 0; offset < feats.NumRows();
+       offset += kMaxFramesPerPiece) {
+    derived_features_->AcceptFeatures(feats.RowRange(
+        offset, std::min(kMaxFramesPerPiece, feats.NumRows() - offset)));
+    ProcessReadyFrames();
+  }
 }
 
 void XvectorDiarizationDecoder::InputFinished() {
-  online_features_.InputFinished();
+  if (mfcc_ != nullptr) {
+    mfcc_->InputFinished();
+  } else {
+    derived_features_->InputFinished();
+  }
+  input_finished_ = true;
+  ProcessReadyFrames();
+  FlushSegment();
+}
+
+void XvectorDiarizationDecoder::FlushSegment() {
+  if (segment_start_ >= 0) {
+    pending_segment_.emplace(segment_start_, num_frames_decided_);
+    segment_start_ = -1;
+  }
+  if (pending_segment_.has_value()) {
+    ExtractPendingSegment(num_frames_decided_);
+  }
+}
+
+void XvectorDiarizationDecoder::ProcessReadyFrames() {
+  const std::int32_t num_frames_ready = online_features_->NumFramesReady();
+  kaldi::Vector<float> feat{online_features_->Dim()};
+  for (std::int32_t frame = log_energies_.size(); frame < num_frames_ready;
+       ++frame) {
+    online_features_->GetFrame(frame, &feat);
+    // Like ComputeVadEnergy() we assume the first coefficient is log energy
+    log_energies_.push_back(feat(0));
+    log_energy_sum_ += feat(0);
+  }
+  if (num_frames_ready == 0) {
+    return;
+  }
+
+  // Same as ComputeVadEnergy() except the threshold is relative to the mean
+  // energy of the frames so far, instead of all frames.
+  const kaldi::VadEnergyOptions &vad_opts = info_.opts.vad_opts;
+  const float energy_threshold =
+      vad_opts.vad_energy_threshold +
+      vad_opts.vad_energy_mean_scale * log_energy_sum_ / num_frames_ready;
+  const std::int32_t context = vad_opts.vad_frames_context;
+  const std::int32_t num_frames_decidable =
+      input_finished_ ? num_frames_ready : num_frames_ready - context;
+  for (; num_frames_decided_ < num_frames_decidable; ++num_frames_decided_) {
+    const std::int32_t t = num_frames_decided_;
+    std::int32_t num_count = 0, den_count = 0;
+    for (std::int32_t t2 = std::max(t - context, 0);
+         t2 <= std::min(t + context, num_frames_ready - 1); ++t2) {
+      den_count++;
+      if (log_energies_[t2] > energy_threshold) {
+        num_count++;
+      }
+    }
+    AcceptVadDecision(
+        t, num_count >= den_count * vad_opts.vad_proportion_threshold);
+  }
+}
+
+void XvectorDiarizationDecoder::AcceptVadDecision(std::int32_t frame,
+                                                  bool voiced) {
+  if (voiced) {
+    if (pending_segment_.has_value()) {
+      ExtractPendingSegment(frame);
+    }
+    if (segment_start_ < 0) {
+      segment_start_ = frame;
+    } else if (max_segment_frames_ > 0 &&
+               frame - segment_start_ >= max_segment_frames_) {
+      pending_segment_.emplace(segment_start_, frame);
+      ExtractPendingSegment(frame);
+      segment_start_ = frame;
+    }
+    return;
+  }
+
+  if (segment_start_ >= 0) {
+    pending_segment_.emplace(segment_start_, frame);
+    segment_start_ = -1;
+  }
+  if (pending_segment_.has_value()) {
+    const auto [start, end] = *pending_segment_;
+    const std::int32_t padding = kSegmentPaddingRatio * (end - start);
+    if (frame + 1 >= end + padding) {
+      ExtractPendingSegment(frame + 1);
+    }
+  }
+}
+
+void XvectorDiarizationDecoder::ExtractPendingSegment(std::int32_t end_limit) {
+  const auto [voiced_start, voiced_end] = *pending_segment_;
+  pending_segment_.reset();
+  const std::int32_t padding =
+      kSegmentPaddingRatio * (voiced_end - voiced_start);
+  const std::int32_t start = std::max(
+      voiced_start - padding, segments_.empty() ? 0 : segments_.back().second);
+  const std::int32_t end = std::min(voiced_end + padding, end_limit);
+  if (end <= start) {
+    return;
+  }
+
+  kaldi::Matrix<float> feats(end - start, online_features_->Dim(),
+                             kaldi::kUndefined);
+  for (std::int32_t frame = start; frame < end; ++frame) {
+    kaldi::SubVector<float> feat{feats, frame - start};
+    online_features_->GetFrame(frame, &feat);
+  }
+  xvectors_.push_back(info_.xvector_nnet.Compute(feats));
+  segments_.emplace_back(start, end);
 }
 
 std::vector<DiarizationSegment> XvectorDiarizationDecoder::Compute(
-    int num_speakers) {
-  kaldi::Matrix<float> feats(online_features_.NumFramesReady(),
-                             online_features_.Dim());
-  // just get all available frames
-  for (std::int32_t frame_idx = 0;
-       frame_idx < online_features_.NumFramesReady(); ++frame_idx) {
-    kaldi::SubVector<float> feat{feats, frame_idx};
-    online_features_.GetFrame(frame_idx, &feat);
+    int num_speakers, std::int32_t max_segments) {
+  // Segments before the window keep their speakers, but there have to be
+  // speakers for them from an earlier call
+  std::size_t window_start = 0;
+  if (max_segments > 0 &&
+      segments_.size() > static_cast<std::size_t>(max_segments)) {
+    window_start =
+        std::min(segments_.size() - max_segments, prev_spk_ids_.size());
+  }
+
+  std::vector<std::int32_t> spk_ids;
+  if (segments_.size() == 1) {
+    spk_ids = {1};
+  } else if (window_start == 0 && segments_.size() > 1) {
+    spk_ids = StabilizeSpeakerIds(
+        prev_spk_ids_, ClusterXvectors(*info_.plda_scorer, xvectors_,
+                                       num_speakers,
+                                       info_.opts.clustering_opts));
+  } else if (segments_.size() > 1) {
+    const std::vector<kaldi::Vector<float>> window{
+        xvectors_.begin() + window_start, xvectors_.end()};
+    const std::vector<std::int32_t> window_prev_spk_ids{
+        prev_spk_ids_.begin() + window_start, prev_spk_ids_.end()};
+    const std::vector<std::int32_t> window_spk_ids = StabilizeSpeakerIds(
+        window_prev_spk_ids,
+        ClusterXvectors(*info_.plda_scorer, window, num_speakers,
+                        info_.opts.clustering_opts));
+    spk_ids.assign(prev_spk_ids_.begin(), prev_spk_ids_.begin() + window_start);
+    spk_ids.insert(spk_ids.end(), window_spk_ids.begin(),
+                   window_spk_ids.end());
   }
+  prev_spk_ids_ = spk_ids;
 
-  return ComputeXvectorDiarization(info_, feats, num_speakers);
+  std::vector<DiarizationSegment> diarization_segments;
+  for (std::size_t idx = 0; idx < spk_ids.size(); ++idx) {
+    diarization_segments.push_back(DiarizationSegment{
+        spk_ids[idx], segments_[idx].first, segments_[idx].second});
+  }
+  return diarization_segments;
 }
 
 kaldi::Matrix<float> WaveformToMfcc(const kaldi::MfccOptions &mfcc_opts,
@@ -24,12 +24,21 @@
 #include <nnet3/nnet-utils.h>
 #include <util/common-utils.h>
 
+#include <algorithm>
 #include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
 #include <string>
 #include <utility>
 #include <vector>
 
 #include "src/options.h"
+#include "src/plda-scoring-utils.h"
+#include "src/shared-features.h"
 
 namespace tiro_speech {
 
@@ -41,6 +50,7 @@ struct XvectorNnetOptions {
   std::string extract_config_rxfilename = "exp/xvector_nnet_1a/extract.config";
   std::int32_t chunk_size = -1;
   std::int32_t min_chunk_size = 100;
+  std::int32_t max_batch_size = 32;
 
   kaldi::nnet3::NnetSimpleComputationOptions nnet_opts;
   kaldi::nnet3::CachingOptimizingCompilerOptions compiler_opts;
@@ -54,11 +64,23 @@ struct XvectorNnetOptions {
         "Extracts xvectors from specified chunk-size, and averages.");
     opts->Register("min-chunk-size", &min_chunk_size,
                    "Minimum chunk-size allowed when extracting xvectors.");
+    opts->Register("max-batch-size", &max_batch_size,
+                   "Max number of equal length chunks in a single nnet "
+                   "computation.");
     nnet_opts.Register(opts);
     compiler_opts.Register(opts);
   }
 };
 
+/** \class XvectorNnet
+ * \brief X-vector extractor that may be shared between threads
+ *
+ * Chunks of equal length, from one or more segments, are run through the
+ * network together as a single multi-sequence computation. Compiled
+ * computations are cached per batch shape, so after warm-up extraction only
+ * takes a shared lock. When the cache is full the oldest computation is
+ * evicted.
+ */
 class XvectorNnet {
  public:
   using Xvector = kaldi::Vector<float>;
@@ -67,24 +89,76 @@ class XvectorNnet {
       : nnet_{ReadInferenceNnet(opts.nnet_rxfilename,
                                 opts.extract_config_rxfilename)},
         compiler_{nnet_, opts.nnet_opts.optimize_config, opts.compiler_opts},
+        computations_capacity_{opts.compiler_opts.cache_capacity},
         xvector_dim_{nnet_.OutputDim("output")},
         chunk_size_{opts.chunk_size},
-        min_chunk_size_{opts.min_chunk_size} {}
+        min_chunk_size_{opts.min_chunk_size},
+        max_batch_size_{std::max(opts.max_batch_size, 1)} {}
+
+  std::int32_t InputDim() const { return nnet_.InputDim("input"); }
 
-  // Not const because of caching
   Xvector Compute(const kaldi::MatrixBase<float> &features,
                   float window_seconds = 1.5f,
                   float period_seconds = 0.75f) const;
 
+  /**
+   * Compute an x-vector for each of \p segments, batching chunks of equal
+   * length across segments.
+   */
+  std::vector<Xvector> ComputeBatch(
+      const std::vector<const kaldi::MatrixBase<float> *> &segments) const;
+
   void RunNnetComputation(const kaldi::MatrixBase<float> &features,
                           kaldi::Vector<float> *xvector) const;
 
+  /**
+   * Run \p num_sequences sequences of equal length, stacked in \p input,
+   * through the network. Row n of \p output is the output for sequence n.
+   */
+  void RunNnetComputation(std::int32_t num_sequences,
+                          const kaldi::MatrixBase<float> &input,
+                          kaldi::Matrix<float> *output) const;
+
  private:
+  std::shared_ptr<const kaldi::nnet3::NnetComputation> GetComputation(
+      std::int32_t num_sequences, std::int32_t num_frames) const;
+
   kaldi::nnet3::Nnet nnet_;
+  // Only used while holding a unique lock on computations_mutex_
   mutable kaldi::nnet3::CachingOptimizingCompiler compiler_;
+  mutable std::shared_mutex computations_mutex_;
+  // Compiled computations keyed by {num sequences, num frames}
+  mutable std::map<std::pair<std::int32_t, std::int32_t>,
+                   std::shared_ptr<const kaldi::nnet3::NnetComputation>>
+      computations_;
+  // Keys of computations_ in the order they were added
+  mutable std::deque<std::pair<std::int32_t, std::int32_t>>
+      computations_order_;
+  std::size_t computations_capacity_;
   std::int32_t xvector_dim_;
   std::int32_t chunk_size_;
   std::int32_t min_chunk_size_;
+  std::int32_t max_batch_size_;
+};
+
+struct XvectorClusteringOptions {
+  std::int32_t window_segments = 0;
+  std::int32_t window_clusters = 8;
+  std::int32_t streaming_window_segments = 100;
+
+  void Register(OptionsItf *opts) {
+    opts->Register("window-segments", &window_segments,
+                   "If > 0, first cluster windows of this many consecutive "
+                   "segments on their own, and then cluster the window "
+                   "clusters. This bounds the memory and time used for long "
+                   "recordings.");
+    opts->Register("window-clusters", &window_clusters,
+                   "Number of clusters per window in the first pass.");
+    opts->Register("streaming-window-segments", &streaming_window_segments,
+                   "If > 0, streaming diarization only reclusters this many "
+                   "of the latest segments for each result. Earlier "
+                   "segments keep their speakers.");
+  }
 };
 
 struct XvectorDiarizationDecoderOptions {
@@ -92,6 +166,8 @@ struct XvectorDiarizationDecoderOptions {
   kaldi::MfccOptions mfcc_opts;
   kaldi::SlidingWindowCmnOptions cmn_opts;
   XvectorNnetOptions xvector_nnet_opts;
+  XvectorClusteringOptions clustering_opts;
+  std::int32_t max_segment_frames = 0;
 
   kaldi::PldaConfig plda_opts;
   std::string plda_filename;
@@ -115,6 +191,13 @@ struct XvectorDiarizationDecoderOptions {
     ParseOptions xvector_po{"xvector", opts};
     xvector_nnet_opts.Register(&xvector_po);
 
+    ParseOptions clustering_po{"cluster", opts};
+    clustering_opts.Register(&clustering_po);
+    opts->Register("max-segment-frames", &max_segment_frames,
+                   "If > 0, split speech segments longer than this. This "
+                   "also bounds the number of feature frames kept in memory "
+                   "by the incremental decoder.");
+
     ParseOptions plda_po{"plda", opts};
     plda_opts.Register(&plda_po);
     opts->Register("plda", &plda_filename, "PLDA model.");
@@ -131,12 +214,16 @@ struct XvectorDiarizationDecoderInfo {
   kaldi::Plda plda;
   kaldi::Vector<float> centering_vector;
   kaldi::Matrix<float> whitening_matrix;
+  // Precomputed from the above
+  std::unique_ptr<const kaldi::PldaScorer> plda_scorer;
 
   explicit XvectorDiarizationDecoderInfo(XvectorDiarizationDecoderOptions opts_)
       : opts{std::move(opts_)}, xvector_nnet{opts.xvector_nnet_opts}, plda{} {
     ReadKaldiObject(opts.plda_filename, &plda);
     kaldi::ReadKaldiObject(opts.centering_vector_filename, &centering_vector);
     kaldi::ReadKaldiObject(opts.whitening_matrix_filename, &whitening_matrix);
+    plda_scorer = std::make_unique<kaldi::PldaScorer>(
+        opts.plda_opts, plda, whitening_matrix, centering_vector);
   }
 };
 
@@ -154,6 +241,16 @@ struct DiarizationSegment {
   std::int32_t end_frame;
 };
 
+/**
+ * Cluster \p xvectors into \p num_speakers speakers.
+ *
+ * \returns the speaker id of each x-vector
+ */
+std::vector<std::int32_t> ClusterXvectors(
+    const kaldi::PldaScorer &plda_scorer,
+    const std::vector<kaldi::Vector<float>> &xvectors, int num_speakers,
+    const XvectorClusteringOptions &opts = {});
+
 /**
  * Compute speaker identities for each feature frame in \p feats
  */
@@ -161,27 +258,98 @@ std::vector<DiarizationSegment> ComputeXvectorDiarization(
     const XvectorDiarizationDecoderInfo &info,
     const kaldi::Matrix<float> &feats, int num_speakers);
 
+/** \class XvectorDiarizationDecoder
+ * \brief Incremental x-vector diarization
+ *
+ * Frames are classified with an online version of the energy VAD as audio
+ * arrives. X-vectors are extracted for each speech segment as soon as it is
+ * complete, so only PLDA scoring and clustering are left for Compute().
+ *
+ * For long recordings set \c max_segment_frames, which bounds the features
+ * kept in memory, and \c clustering_opts.window_segments, which bounds the
+ * size of the score matrices.
+ */
 class XvectorDiarizationDecoder {
  public:
-  explicit XvectorDiarizationDecoder(const XvectorDiarizationDecoderInfo &info)
-      : info_{info}, online_features_{info.opts.mfcc_opts} {}
+  explicit XvectorDiarizationDecoder(const XvectorDiarizationDecoderInfo &info);
+
+  /**
+   * Decoder that splits speech segments longer than \p max_segment_frames,
+   * instead of the value in \p info. Streams of unknown length need this to
+   * bound the features kept in memory.
+   */
+  XvectorDiarizationDecoder(const XvectorDiarizationDecoderInfo &info,
+                            std::int32_t max_segment_frames);
+
+  /**
+   * Decoder that is fed the features of another front-end with AcceptFeatures()
+   * instead of waveforms. \p feature_transform maps those features to the
+   * MFCCs in \p info, see MfccDerivation().
+   */
+  XvectorDiarizationDecoder(const XvectorDiarizationDecoderInfo &info,
+                            kaldi::Matrix<float> feature_transform);
 
   void AcceptWaveform(float sample_freq,
                       const kaldi::VectorBase<float> &waveform);
+
+  /**
+   * Accept the next frames of features, only for decoders constructed with a
+   * feature transform.
+   */
+  void AcceptFeatures(const kaldi::MatrixBase<float> &feats);
+
   void InputFinished();
 
+  /**
+   * End the current speech segment, if any, and extract its x-vector so that
+   * it is included in the next call to Compute(). This is for streaming, where
+   * speaker tags are needed before input is finished.
+   */
+  void FlushSegment();
+
   float FrameShiftInSeconds() const {
-    return online_features_.FrameShiftInSeconds();
+    return online_features_->FrameShiftInSeconds();
   }
 
   /**
-   * Compute speaker identities for each feature frame in \p feats
+   * Compute speaker identities for the segments seen so far. May be called
+   * repeatedly, speaker ids are kept stable between calls where possible.
+   *
+   * If \p max_segments is positive only that many of the latest segments are
+   * reclustered, and earlier segments keep the speakers from the last call.
+   * This keeps the cost of each call bounded for long streams.
    */
-  std::vector<DiarizationSegment> Compute(int num_speakers);
+  std::vector<DiarizationSegment> Compute(int num_speakers,
+                                          std::int32_t max_segments = 0);
 
  private:
+  void ProcessReadyFrames();
+  void AcceptVadDecision(std::int32_t frame, bool voiced);
+  void ExtractPendingSegment(std::int32_t end_limit);
+  void AcceptWaveformPiece(float sample_freq,
+                           const kaldi::VectorBase<float> &waveform);
+
   const XvectorDiarizationDecoderInfo &info_;
-  kaldi::OnlineMfcc online_features_;
+  const std::int32_t max_segment_frames_;
+  // Only one of these is set, depending on whether we compute our own MFCCs
+  std::unique_ptr<kaldi::OnlineMfcc> mfcc_;
+  std::unique_ptr<OnlineDerivedFeature> derived_features_;
+  kaldi::OnlineFeatureInterface *online_features_;
+  bool input_finished_ = false;
+
+  // Online energy VAD
+  std::vector<float> log_energies_;
+  double log_energy_sum_ = 0.0;
+  std::int32_t num_frames_decided_ = 0;
+
+  // Start of the current run of voiced frames, or -1
+  std::int32_t segment_start_ = -1;
+  // Ended segment that we're waiting for right padding for
+  std::optional<std::pair<std::int32_t, std::int32_t>> pending_segment_;
+
+  std::vector<std::pair<std::int32_t, std::int32_t>> segments_;
+  std::vector<kaldi::Vector<float>> xvectors_;
+  std::vector<std::int32_t> prev_spk_ids_;
 };
 
 /**
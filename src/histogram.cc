@@ -0,0 +1,76 @@
+// Copyright 2021 Tiro ehf.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "src/histogram.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <utility>
+
+namespace tiro_speech {
+
+std::size_t ThisThreadMetricShard() {
+  static std::atomic<std::size_t> next_shard{0};
+  thread_local const std::size_t shard =
+      next_shard.fetch_add(1, std::memory_order_relaxed) % kNumMetricShards;
+  return shard;
+}
+
+void AtomicAdd(std::atomic<double>& target, double value) {
+  double current = target.load(std::memory_order_relaxed);
+  while (!target.compare_exchange_weak(current, current + value,
+                                       std::memory_order_relaxed)) {
+  }
+}
+
+Histogram::Histogram(std::vector<double> upper_bounds)
+    : upper_bounds_{std::move(upper_bounds)} {
+  if (!std::is_sorted(upper_bounds_.cbegin(), upper_bounds_.cend())) {
+    throw std::invalid_argument{"Histogram bucket bounds must be sorted"};
+  }
+  if (upper_bounds_.size() > kMaxBuckets) {
+    throw std::invalid_argument{"Too many histogram buckets"};
+  }
+  for (Shard& shard : shards_) {
+    for (auto& count : shard.counts) {
+      count.store(0, std::memory_order_relaxed);
+    }
+    shard.sum.store(0.0, std::memory_order_relaxed);
+  }
+}
+
+void Histogram::Observe(double value) {
+  const auto bucket =
+      std::lower_bound(upper_bounds_.cbegin(), upper_bounds_.cend(), value) -
+      upper_bounds_.cbegin();
+  Shard& shard = shards_[ThisThreadMetricShard()];
+  shard.counts[bucket].fetch_add(1, std::memory_order_relaxed);
+  AtomicAdd(shard.sum, value);
+}
+
+Histogram::Snapshot Histogram::Get() const {
+  Snapshot snapshot{upper_bounds_, {}, 0.0, 0};
+  snapshot.cumulative_counts.reserve(upper_bounds_.size() + 1);
+  for (std::size_t bucket = 0; bucket <= upper_bounds_.size(); ++bucket) {
+    for (const Shard& shard : shards_) {
+      snapshot.count += shard.counts[bucket].load(std::memory_order_relaxed);
+    }
+    snapshot.cumulative_counts.push_back(snapshot.count);
+  }
+  for (const Shard& shard : shards_) {
+    snapshot.sum += shard.sum.load(std::memory_order_relaxed);
+  }
+  return snapshot;
+}
+
+}  // namespace tiro_speech
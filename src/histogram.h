@@ -0,0 +1,81 @@
+// Copyright 2021 Tiro ehf.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef TIRO_SPEECH_SRC_HISTOGRAM_H_
+#define TIRO_SPEECH_SRC_HISTOGRAM_H_
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace tiro_speech {
+
+/// Metrics keep separate state for each of this many shards, and a thread only
+/// updates the state of its own shard, so threads don't contend for it.
+constexpr std::size_t kNumMetricShards = 16;
+
+/**
+ * The shard of the calling thread, in [0, kNumMetricShards).
+ */
+std::size_t ThisThreadMetricShard();
+
+/**
+ * Add \p value to \p target, without ordering constraints.
+ */
+void AtomicAdd(std::atomic<double>& target, double value);
+
+/** \class Histogram
+ * \brief Thread safe counts of observed values in fixed buckets
+ *
+ * Like Prometheus histograms the bucket counts are cumulative: bucket \c i
+ * counts the values that are at most \c upper_bounds[i], and a last implicit
+ * bucket counts all values.
+ *
+ * Observe() is lock free and only touches the calling thread's shard.
+ */
+class Histogram {
+ public:
+  static constexpr std::size_t kMaxBuckets = 31;
+
+  struct Snapshot {
+    std::vector<double> upper_bounds;
+    std::vector<std::uint64_t> cumulative_counts;
+    double sum;
+    std::uint64_t count;
+  };
+
+  /**
+   * \p upper_bounds has to be sorted in increasing order, and have at most
+   * kMaxBuckets bounds.
+   */
+  explicit Histogram(std::vector<double> upper_bounds);
+
+  void Observe(double value);
+
+  Snapshot Get() const;
+
+ private:
+  struct alignas(64) Shard {
+    std::array<std::atomic<std::uint64_t>, kMaxBuckets + 1> counts;
+    std::atomic<double> sum;
+  };
+
+  const std::vector<double> upper_bounds_;
+  std::array<Shard, kNumMetricShards> shards_;
+};
+
+}  // namespace tiro_speech
+
+#endif  // TIRO_SPEECH_SRC_HISTOGRAM_H_
@@ -14,6 +14,7 @@
 #include "src/itn/converters.h"
 
 #include <cassert>
+#include <utility>
 
 #include "src/itn/timing-weight.h"
 #include "src/recognizer.h"
@@ -155,67 +156,125 @@ std::int64_t StartTimeFromTimingWeight(const fst::TimingWeight& w) {
 std::int64_t DurationFromTimingWeight(const fst::TimingWeight& w) {
   return static_cast<std::int64_t>(w.Value2().Value() - w.Value1().Value());
 }
-}  // namespace
 
-std::vector<AlignedWord> Convert(const fst::VectorFst<fst::TimingArc>& fst) {
-  std::vector<AlignedWord> word_alis{};
+/**
+ * Collects word alignments from the arcs of a linear byte FST, in order.
+ *
+ * Each arc with a space on the output ends a word, which gets the product of
+ * the timing weights seen since the previous one.
+ */
+class WordAlignmentBuilder {
+ public:
+  void Accept(fst::TimingArc::Label olabel, const fst::TimingWeight& weight) {
+    if (weight != fst::TimingWeight::One()) {
+      if (current_weight_ == fst::TimingWeight::One()) {
+        current_weight_ = weight;
+      } else {
+        current_weight_ = fst::Times(current_weight_, weight);
+      }
+    }
+
+    // A space begins a new ali
+    if (olabel == ' ') {
+      current_ali_.start_time = StartTimeFromTimingWeight(current_weight_);
+      current_ali_.duration = DurationFromTimingWeight(current_weight_);
+      word_alis_.push_back(current_ali_);
+
+      // Handle case when current weight is One. To fix cases when
+      // multiword-to-multiword mappings cause the weight on the first word to
+      // be delayed we just look ahead until we find a weight not on a ' ' and
+      // use that as the weight for this word alignment.
+      if (current_weight_ == fst::TimingWeight::One()) {
+        last_ali_missing_time_ = true;
+      }
+
+      current_ali_ = AlignedWord{};
+      current_weight_ = fst::TimingWeight::One();
+    } else {
+      if (olabel != 0) {
+        current_ali_.word_symbol.append(1, olabel);
+      }
+
+      // Assume the current weight is the "missing" weight for above and reset
+      // it.
+      if (last_ali_missing_time_ &&
+          current_weight_ != fst::TimingWeight::One()) {
+        word_alis_.back().start_time =
+            StartTimeFromTimingWeight(current_weight_);
+        word_alis_.back().duration = DurationFromTimingWeight(current_weight_);
+        current_weight_ = fst::TimingWeight::One();
+        last_ali_missing_time_ = false;
+      }
+    }
+  }
 
-  AlignedWord current_ali{};
-  auto current_weight = fst::TimingWeight::One();
+  std::vector<AlignedWord> WordAlignments() && { return std::move(word_alis_); }
 
-  bool last_ali_missing_time = false;
+ private:
+  std::vector<AlignedWord> word_alis_{};
+  AlignedWord current_ali_{};
+  fst::TimingWeight current_weight_ = fst::TimingWeight::One();
+  bool last_ali_missing_time_ = false;
+};
 
+}  // namespace
+
+std::vector<AlignedWord> Convert(const fst::VectorFst<fst::TimingArc>& fst) {
+  WordAlignmentBuilder builder;
   for (fst::StateIterator siter(fst); !siter.Done(); siter.Next()) {
     auto state_id = siter.Value();
     for (fst::ArcIterator aiter(fst, state_id); !aiter.Done(); aiter.Next()) {
       // NOTE: fst should be linear so there should only be at most one arc from
       //   each state.
       const auto& arc = aiter.Value();
+      builder.Accept(arc.olabel, arc.weight);
+    }
+  }
+  return std::move(builder).WordAlignments();
+}
 
-      if (arc.weight != fst::TimingWeight::One()) {
-        if (current_weight == fst::TimingWeight::One()) {
-          current_weight = arc.weight;
-        } else {
-          current_weight = fst::Times(current_weight, arc.weight);
-        }
-      }
+std::vector<AlignedWord> Convert(const fst::StdFst& fst,
+                                 const std::vector<AlignedWord>& word_alis,
+                                 std::vector<std::size_t>* input_ends) {
+  WordAlignmentBuilder builder;
+  if (input_ends != nullptr) {
+    input_ends->clear();
+  }
+
+  // Position of the next input byte, as laid out by ConvertToByteFst()
+  std::size_t word_idx = 0;
+  std::size_t byte_idx = 0;
 
-      // A space begins a new ali
-      if (arc.olabel == ' ') {
-        current_ali.start_time = StartTimeFromTimingWeight(current_weight);
-        current_ali.duration = DurationFromTimingWeight(current_weight);
-        word_alis.push_back(current_ali);
-
-        // Handle case when current weight is One. To fix cases when
-        // multiword-to-multiword mappings cause the weight on the first word to
-        // be delayed we just look ahead until we find a weight not on a ' ' and
-        // use that as the weight for this word alignment.
-        if (current_weight == fst::TimingWeight::One()) {
-          last_ali_missing_time = true;
-        }
-
-        current_ali = AlignedWord{};
-        current_weight = fst::TimingWeight::One();
+  auto state_id = fst.Start();
+  while (state_id != fst::kNoStateId) {
+    fst::ArcIterator<fst::StdFst> aiter(fst, state_id);
+    if (aiter.Done()) {
+      break;
+    }
+    // NOTE: fst should be linear so we only follow the first arc
+    const auto& arc = aiter.Value();
+
+    // Only the separator after each word carries its timing
+    auto weight = fst::TimingWeight::One();
+    if (arc.ilabel != 0 && word_idx < word_alis.size()) {
+      const auto& ali = word_alis[word_idx];
+      if (byte_idx == ali.word_symbol.size()) {
+        weight = fst::TimingWeight(ali.start_time,
+                                   ali.start_time + ali.duration);
+        ++word_idx;
+        byte_idx = 0;
       } else {
-        if (arc.olabel != 0) {
-          current_ali.word_symbol.append(1, arc.olabel);
-        }
-
-        // Assume the current weight is the "missing" weight for above and reset
-        // it.
-        if (last_ali_missing_time &&
-            current_weight != fst::TimingWeight::One()) {
-          word_alis.back().start_time =
-              StartTimeFromTimingWeight(current_weight);
-          word_alis.back().duration = DurationFromTimingWeight(current_weight);
-          current_weight = fst::TimingWeight::One();
-          last_ali_missing_time = false;
-        }
+        ++byte_idx;
       }
     }
-  }
 
-  return word_alis;
+    builder.Accept(arc.olabel, weight);
+    if (arc.olabel == ' ' && input_ends != nullptr) {
+      input_ends->push_back(word_idx);
+    }
+    state_id = arc.nextstate;
+  }
+  return std::move(builder).WordAlignments();
 }
 
 }  // namespace tiro_speech::itn
@@ -16,6 +16,7 @@
 
 #include <fst/fst.h>
 
+#include <cstddef>
 #include <string>
 #include <vector>
 
@@ -74,6 +75,23 @@ fst::VectorFst<fst::StdArc> ConvertToTropicalByteFst(
  */
 std::vector<AlignedWord> Convert(const fst::VectorFst<fst::TimingArc>& fst);
 
+/**
+ * Convert from a linear byte-to-byte FST over the bytes of \p word_alis to a
+ * vector of word alignments
+ *
+ * \p fst is e.g. the shortest path through ConvertToTropicalByteFst(word_alis)
+ * composed with a rewrite FST. The result is the same as from Convert() on
+ * ConvertToByteFst(word_alis) composed with \p fst mapped to TimingArc, but
+ * the timing is tracked while walking the path instead of by composition: each
+ * input separator carries the timing of the word it ends.
+ *
+ * If \p input_ends isn't null it's set to the number of words of \p word_alis
+ * consumed when each output word was ended.
+ */
+std::vector<AlignedWord> Convert(
+    const fst::StdFst& fst, const std::vector<AlignedWord>& word_alis,
+    std::vector<std::size_t>* input_ends = nullptr);
+
 /**
  * Walk an acyclic FST whose olabels are bytes and convert the output labels to
  * a string.
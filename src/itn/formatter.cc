@@ -19,13 +19,20 @@
 #include <unicode/unistr.h>
 
 #include <algorithm>
+#include <map>
+#include <numeric>
+#include <utility>
 
 #include "src/logging.h"
+#include "src/utils.h"
 
 namespace tiro_speech::itn {
 
 namespace {
 
+// Separates the words in the byte strings given to the rewrite FST
+constexpr char kSeparator = ' ';
+
 /**
  * Use FST to format
  *
@@ -57,6 +64,111 @@ void Optimize(fst::MutableFst<Arc>* ifst) {
   *ifst = std::move(fst_det);
 }
 
+/**
+ * Create an acceptor of the input strings for which \p rewrite_fst has a path
+ * that doesn't only copy its input, i.e. the inputs it may rewrite.
+ *
+ * Each state of \p rewrite_fst gets two copies: one reached by copying arcs
+ * only and one reached after the first arc with different input and output
+ * labels. Only the latter can be final.
+ */
+fst::VectorFst<fst::StdArc> CreateTriggerAcceptor(
+    const fst::StdFst& rewrite_fst) {
+  using Arc = fst::StdArc;
+  using StateId = Arc::StateId;
+
+  fst::VectorFst<Arc> trigger_fst;
+  if (rewrite_fst.Start() == fst::kNoStateId) {
+    return trigger_fst;
+  }
+  const StateId num_states = fst::CountStates(rewrite_fst);
+  trigger_fst.AddStates(2 * num_states);
+  trigger_fst.SetStart(rewrite_fst.Start());
+
+  for (fst::StateIterator<fst::StdFst> siter{rewrite_fst}; !siter.Done();
+       siter.Next()) {
+    const StateId state = siter.Value();
+    const StateId rewritten_state = state + num_states;
+    if (rewrite_fst.Final(state) != Arc::Weight::Zero()) {
+      trigger_fst.SetFinal(rewritten_state, Arc::Weight::One());
+    }
+    for (fst::ArcIterator<fst::StdFst> aiter{rewrite_fst, state};
+         !aiter.Done(); aiter.Next()) {
+      const Arc& arc = aiter.Value();
+      const StateId rewritten_next = arc.nextstate + num_states;
+      trigger_fst.AddArc(rewritten_state,
+                         Arc{arc.ilabel, arc.ilabel, rewritten_next});
+      trigger_fst.AddArc(
+          state, Arc{arc.ilabel, arc.ilabel,
+                     arc.ilabel == arc.olabel ? arc.nextstate
+                                              : rewritten_next});
+    }
+  }
+
+  // Drops the copying states from which no rewrite is reachable
+  fst::Connect(&trigger_fst);
+  return trigger_fst;
+}
+
+/**
+ * Copy the states of the lazy FST \p ifst that are reachable from its start
+ * into a VectorFst, with arcs sorted by input label. Returns nullptr if there
+ * are more than \p max_states of them.
+ */
+std::unique_ptr<fst::StdVectorFst> ExpandFst(const fst::StdFst& ifst,
+                                             fst::StdArc::StateId max_states) {
+  using Arc = fst::StdArc;
+  using StateId = Arc::StateId;
+
+  auto ofst = std::make_unique<fst::StdVectorFst>();
+  if (ifst.Start() == fst::kNoStateId) {
+    return ofst;
+  }
+  std::map<StateId, StateId> expanded;
+  std::vector<StateId> queue{ifst.Start()};
+  expanded[ifst.Start()] = ofst->AddState();
+  ofst->SetStart(0);
+  while (!queue.empty()) {
+    const StateId state = queue.back();
+    queue.pop_back();
+    const StateId ostate = expanded[state];
+    ofst->SetFinal(ostate, ifst.Final(state));
+    for (fst::ArcIterator<fst::StdFst> aiter{ifst, state}; !aiter.Done();
+         aiter.Next()) {
+      Arc arc = aiter.Value();
+      auto [it, inserted] = expanded.emplace(arc.nextstate, ofst->NumStates());
+      if (inserted) {
+        if (ofst->NumStates() >= max_states) {
+          return nullptr;
+        }
+        ofst->AddState();
+        queue.push_back(arc.nextstate);
+      }
+      arc.nextstate = it->second;
+      ofst->AddArc(ostate, arc);
+    }
+  }
+  fst::ArcSort(ofst.get(), fst::ILabelCompare<Arc>{});
+  return ofst;
+}
+
+/// \p fst has to be sorted by input label and deterministic
+fst::StdArc::StateId NextState(const fst::StdVectorFst& fst,
+                               fst::StdArc::StateId state,
+                               fst::StdArc::Label label) {
+  if (fst.NumArcs(state) == 0) {
+    return fst::kNoStateId;
+  }
+  fst::ArcIterator<fst::StdVectorFst> aiter{fst, state};
+  const fst::StdArc* begin = &aiter.Value();
+  const fst::StdArc* end = begin + fst.NumArcs(state);
+  const fst::StdArc* arc = std::lower_bound(
+      begin, end, label, [](const fst::StdArc& arc, fst::StdArc::Label label) {
+        return arc.ilabel < label;
+      });
+  return arc != end && arc->ilabel == label ? arc->nextstate : fst::kNoStateId;
+}
+
 }  // namespace
 
 LookAheadFormatter::LookAheadFormatter(const LookAheadFormatterConfig& opts) {
@@ -90,17 +202,226 @@ std::vector<AlignedWord> LookAheadFormatter::FormatWords(
   return Convert(timing_byte_fst);
 }
 
-Formatter::Formatter(const FormatterConfig& opts) {
+Formatter::Formatter(const FormatterConfig& opts) : opts_{opts} {
   rewrite_fst_.reset(fst::StdFst::Read(opts.rewrite_fst_filename));
   if (rewrite_fst_ == nullptr) {
     throw std::runtime_error{
         fmt::format("Could not read rewrite FST from file '{}'",
                     opts.rewrite_fst_filename)};
   }
+
+  // Determinized up front so that MayRewrite() doesn't touch the state cache
+  // of a lazy FST, which would need a lock. It could blow up, hence the cap.
+  trigger_fst_ = ExpandFst(
+      fst::DeterminizeFst<Arc>{
+          fst::RmEpsilonFst<Arc>{CreateTriggerAcceptor(*rewrite_fst_)}},
+      opts_.trigger_max_states);
+  if (trigger_fst_ == nullptr) {
+    TIRO_SPEECH_WARN(
+        "Inputs that may be rewritten have more than {} states, so all inputs "
+        "will be formatted",
+        opts_.trigger_max_states);
+  }
+}
+
+bool Formatter::MayRewrite(const std::vector<AlignedWord>& words) const {
+  // Same bytes as ConvertToTropicalByteFst()
+  std::string bytes;
+  for (const auto& word : words) {
+    bytes += word.word_symbol;
+    bytes += kSeparator;
+  }
+  return MayRewriteBytes(bytes);
+}
+
+bool Formatter::MayRewriteBytes(const std::string& bytes) const {
+  if (trigger_fst_ == nullptr) {
+    return true;
+  }
+  Arc::StateId state = trigger_fst_->Start();
+  for (const unsigned char byte : bytes) {
+    if (state == fst::kNoStateId) {
+      return false;
+    }
+    state = NextState(*trigger_fst_, state, byte);
+  }
+  return state != fst::kNoStateId &&
+         trigger_fst_->Final(state) != Arc::Weight::Zero();
+}
+
+std::vector<std::string> Formatter::FormatAlternatives(
+    const std::vector<std::vector<std::string>>& alternatives) const {
+  using StateId = Arc::StateId;
+  // Ends alternative idx in alternatives_fst, out of the range of bytes
+  constexpr Arc::Label first_alternative_label = 256;
+
+  std::vector<std::string> formatted(alternatives.size());
+
+  // Prefix tree of the bytes of the alternatives that may be rewritten. Each
+  // ends with an arc labelled with its index, with no output.
+  fst::VectorFst<Arc> alternatives_fst;
+  const StateId root = alternatives_fst.AddState();
+  const StateId end = alternatives_fst.AddState();
+  alternatives_fst.SetStart(root);
+  alternatives_fst.SetFinal(end, Arc::Weight::One());
+  std::map<std::pair<StateId, Arc::Label>, StateId> children;
+  std::size_t num_rewritable = 0;
+  for (std::size_t idx = 0; idx < alternatives.size(); ++idx) {
+    std::string bytes;
+    for (const auto& word : alternatives[idx]) {
+      bytes += word;
+      bytes += kSeparator;
+    }
+    if (!MayRewriteBytes(bytes)) {
+      formatted[idx] = Join(alternatives[idx], " ");
+      continue;
+    }
+    num_rewritable++;
+    StateId state = root;
+    for (const unsigned char byte : bytes) {
+      auto [child, inserted] = children.try_emplace({state, byte}, 0);
+      if (inserted) {
+        child->second = alternatives_fst.AddState();
+        alternatives_fst.AddArc(state, Arc{byte, byte, child->second});
+      }
+      state = child->second;
+    }
+    const auto label = static_cast<Arc::Label>(first_alternative_label + idx);
+    alternatives_fst.AddArc(state, Arc{label, 0, end});
+  }
+  if (num_rewritable == 0) {
+    return formatted;
+  }
+
+  fst::ArcSort(&alternatives_fst, fst::OLabelCompare<Arc>{});
+  fst::VectorFst<Arc> candidates_fst;
+  fst::Compose(alternatives_fst, *rewrite_fst_, &candidates_fst);
+  if (candidates_fst.Start() == fst::kNoStateId) {
+    TIRO_SPEECH_WARN("Rewrite FST rejected all alternatives");
+    for (std::size_t idx = 0; idx < alternatives.size(); ++idx) {
+      formatted[idx] = Join(alternatives[idx], " ");
+    }
+    return formatted;
+  }
+  if (!fst::TopSort(&candidates_fst)) {
+    // The rewrite FST loops, so fall back to formatting one at a time
+    for (std::size_t idx = 0; idx < alternatives.size(); ++idx) {
+      if (!formatted[idx].empty() || alternatives[idx].empty()) {
+        continue;
+      }
+      std::vector<AlignedWord> words;
+      for (const auto& word : alternatives[idx]) {
+        words.push_back({{}, {}, word});
+      }
+      std::vector<std::string> formatted_words;
+      for (const auto& word : FormatWords(words)) {
+        formatted_words.push_back(word.word_symbol);
+      }
+      formatted[idx] = Join(formatted_words, " ");
+    }
+    return formatted;
+  }
+
+  // Best path from the start to each state and from each state to a final
+  // state. The best path for an alternative is the best one through one of
+  // the arcs with its label.
+  const StateId num_states = candidates_fst.NumStates();
+  std::vector<Arc::Weight> forward(num_states, Arc::Weight::Zero());
+  std::vector<Arc> forward_arc(num_states);  // nextstate is the previous state
+  std::vector<Arc::Weight> backward(num_states, Arc::Weight::Zero());
+  std::vector<Arc> backward_arc(num_states, Arc{0, 0, fst::kNoStateId});
+  forward[candidates_fst.Start()] = Arc::Weight::One();
+  for (StateId state = 0; state < num_states; ++state) {
+    for (fst::ArcIterator<fst::VectorFst<Arc>> aiter{candidates_fst, state};
+         !aiter.Done(); aiter.Next()) {
+      const Arc& arc = aiter.Value();
+      const Arc::Weight weight = fst::Times(forward[state], arc.weight);
+      if (weight.Value() < forward[arc.nextstate].Value()) {
+        forward[arc.nextstate] = weight;
+        forward_arc[arc.nextstate] = Arc{arc.ilabel, arc.olabel, state};
+      }
+    }
+  }
+  for (StateId state = num_states - 1; state >= 0; --state) {
+    backward[state] = candidates_fst.Final(state);
+    for (fst::ArcIterator<fst::VectorFst<Arc>> aiter{candidates_fst, state};
+         !aiter.Done(); aiter.Next()) {
+      const Arc& arc = aiter.Value();
+      const Arc::Weight weight =
+          fst::Times(arc.weight, backward[arc.nextstate]);
+      if (weight.Value() < backward[state].Value()) {
+        backward[state] = weight;
+        backward_arc[state] = arc;
+      }
+    }
+  }
+
+  std::vector<Arc::Weight> best(alternatives.size(), Arc::Weight::Zero());
+  std::vector<std::pair<StateId, StateId>> best_arc(alternatives.size());
+  for (StateId state = 0; state < num_states; ++state) {
+    for (fst::ArcIterator<fst::VectorFst<Arc>> aiter{candidates_fst, state};
+         !aiter.Done(); aiter.Next()) {
+      const Arc& arc = aiter.Value();
+      if (arc.ilabel < first_alternative_label) {
+        continue;
+      }
+      const std::size_t idx = arc.ilabel - first_alternative_label;
+      const Arc::Weight weight = fst::Times(
+          fst::Times(forward[state], arc.weight), backward[arc.nextstate]);
+      if (weight.Value() < best[idx].Value()) {
+        best[idx] = weight;
+        best_arc[idx] = {state, arc.nextstate};
+      }
+    }
+  }
+
+  for (std::size_t idx = 0; idx < alternatives.size(); ++idx) {
+    if (!formatted[idx].empty()) {
+      continue;
+    }
+    if (best[idx] == Arc::Weight::Zero()) {
+      formatted[idx] = Join(alternatives[idx], " ");
+      continue;
+    }
+    std::string prefix;
+    for (StateId state = best_arc[idx].first; state != candidates_fst.Start();
+         state = forward_arc[state].nextstate) {
+      if (forward_arc[state].olabel != 0) {
+        prefix += static_cast<char>(forward_arc[state].olabel);
+      }
+    }
+    std::string& output = formatted[idx];
+    output.assign(prefix.rbegin(), prefix.rend());
+    for (StateId state = best_arc[idx].second;
+         backward_arc[state].nextstate != fst::kNoStateId;
+         state = backward_arc[state].nextstate) {
+      if (backward_arc[state].olabel != 0) {
+        output += static_cast<char>(backward_arc[state].olabel);
+      }
+    }
+    while (!output.empty() && output.back() == kSeparator) {
+      output.pop_back();
+    }
+  }
+  return formatted;
 }
 
 std::vector<AlignedWord> Formatter::FormatWords(
     const std::vector<AlignedWord>& words) const {
+  return FormatWords(words, nullptr);
+}
+
+std::vector<AlignedWord> Formatter::FormatWords(
+    const std::vector<AlignedWord>& words,
+    std::vector<std::size_t>* input_ends) const {
+  if (!MayRewrite(words)) {
+    if (input_ends != nullptr) {
+      input_ends->resize(words.size());
+      std::iota(input_ends->begin(), input_ends->end(), 1);
+    }
+    return words;
+  }
+
   auto words_byte_fst = ConvertToTropicalByteFst(words);
 
   fst::ArcSort(&words_byte_fst, fst::OLabelCompare<Arc>{});
@@ -110,16 +431,80 @@ std::vector<AlignedWord> Formatter::FormatWords(
   fst::VectorFst<Arc> formatted_words_fst;
   fst::ShortestPath(formatted_candidates_fst, &formatted_words_fst);
 
-  fst::TimingFst formatted_time_fst{};
-  fst::ArcMap(formatted_words_fst, &formatted_time_fst,
-              fst::WeightConvertMapper<Arc, fst::TimingArc>{});
+  // The input side of the path is the bytes of words, so the timing can be
+  // read off it directly
+  return Convert(formatted_words_fst, words, input_ends);
+}
 
-  fst::TimingFst timing_symbol_fst = ConvertToByteFst(words);
-  fst::TimingFst timing_byte_fst{};
-  fst::ArcSort(&timing_symbol_fst, fst::OLabelCompare<fst::TimingArc>{});
-  fst::Compose(timing_symbol_fst, formatted_time_fst, &timing_byte_fst);
+std::vector<AlignedWord> IncrementalFormatter::FormatWords(
+    const std::vector<AlignedWord>& words) {
+  std::size_t num_unchanged = 0;
+  while (num_unchanged < words.size() && num_unchanged < words_.size() &&
+         !(words[num_unchanged] != words_[num_unchanged])) {
+    ++num_unchanged;
+  }
 
-  return Convert(timing_byte_fst);
+  std::size_t start = ReformatStart(num_unchanged);
+  std::size_t input_start = start == 0 ? 0 : input_ends_[start - 1];
+  std::vector<std::size_t> tail_ends;
+  std::vector<AlignedWord> tail = formatter_.FormatWords(
+      {words.begin() + input_start, words.end()}, &tail_ends);
+
+  // The left context should come out unchanged again, otherwise the cut isn't
+  // clean and we reformat everything
+  bool context_unchanged = tail.size() >= context_words_;
+  for (std::size_t k = 0; k < context_words_ && context_unchanged; ++k) {
+    context_unchanged =
+        tail_ends[k] == k + 1 &&
+        tail[k].word_symbol == words[input_start + k].word_symbol;
+  }
+  if (start > 0 && !context_unchanged) {
+    TIRO_SPEECH_DEBUG("Left context changed, reformatting whole hypothesis");
+    start = 0;
+    input_start = 0;
+    tail = formatter_.FormatWords(words, &tail_ends);
+  }
+
+  formatted_.resize(start);
+  formatted_.insert(formatted_.end(), tail.begin(), tail.end());
+  input_ends_.resize(start);
+  for (std::size_t input_end : tail_ends) {
+    input_ends_.push_back(input_start + input_end);
+  }
+  words_ = words;
+  return formatted_;
+}
+
+void IncrementalFormatter::Reset() {
+  words_.clear();
+  formatted_.clear();
+  input_ends_.clear();
+}
+
+std::size_t IncrementalFormatter::ReformatStart(
+    std::size_t num_unchanged) const {
+  // Find the last cut in formatted_ that is followed by context_words_
+  // unchanged input words, and preceded by context_words_ formatted words that
+  // are plain copies of their input words.
+  for (std::size_t cut = formatted_.size(); cut > context_words_; --cut) {
+    const std::size_t input_cut = input_ends_[cut - 1];
+    if (input_cut + context_words_ > num_unchanged ||
+        input_cut < context_words_) {
+      continue;
+    }
+    const std::size_t start = cut - context_words_;
+    const std::size_t input_start = input_cut - context_words_;
+    bool copied = start == 0 || input_ends_[start - 1] == input_start;
+    for (std::size_t k = 0; k < context_words_ && copied; ++k) {
+      copied = input_ends_[start + k] == input_start + k + 1 &&
+               formatted_[start + k].word_symbol ==
+                   words_[input_start + k].word_symbol;
+    }
+    if (copied) {
+      return start;
+    }
+  }
+  return 0;
 }
 
 void Capitalize(std::string& str) {
@@ -17,6 +17,8 @@
 #include <fmt/format.h>
 #include <fst/fstlib.h>
 
+#include <algorithm>
+#include <cstddef>
 #include <memory>
 #include <string>
 #include <utility>
@@ -83,6 +85,9 @@ class LookAheadFormatter {
 
 struct FormatterConfig {
   std::string rewrite_fst_filename = "";
+  bool incremental_interim_results = true;
+  int incremental_context_words = 4;
+  int trigger_max_states = 1 << 20;
 
   void Register(OptionsItf* opts) {
     opts->Register("lexicon-fst", &ignored_string, "DEPRECATED Ignored.");
@@ -95,6 +100,17 @@ struct FormatterConfig {
         "\n - "
         "output labels corresponding to a given input label appear before the "
         "next input label.");
+    opts->Register("incremental-interim-results", &incremental_interim_results,
+                   "Only reformat the part of a streaming interim result that "
+                   "changed since the previous one. Final results are always "
+                   "formatted as a whole.");
+    opts->Register("incremental-context-words", &incremental_context_words,
+                   "Number of unchanged words on each side of the reformatted "
+                   "part of an interim result, for rules with context.");
+    opts->Register("trigger-max-states", &trigger_max_states,
+                   "Max number of states of the automaton of inputs that may "
+                   "be rewritten, which is determinized when the rewrite FST "
+                   "is loaded. If it is larger, all inputs are formatted.");
   }
 
  private:
@@ -112,6 +128,8 @@ class Formatter {
 
   explicit Formatter(const FormatterConfig& opts);
 
+  const FormatterConfig& Options() const { return opts_; }
+
   /**
    * Format a vector of aligned words
    *
@@ -120,8 +138,91 @@ class Formatter {
   std::vector<AlignedWord> FormatWords(
       const std::vector<AlignedWord>& words) const;
 
+  /**
+   * Same as above, but also sets \p input_ends to the number of words of \p
+   * words each formatted word ends after.
+   */
+  std::vector<AlignedWord> FormatWords(
+      const std::vector<AlignedWord>& words,
+      std::vector<std::size_t>* input_ends) const;
+
+  /**
+   * Whether the rewrite FST can change \p words at all
+   *
+   * This is conservative: if it returns true the words may still come out
+   * unchanged, but if it returns false FormatWords() returns \p words as is
+   * without composing anything. It only walks a precomputed automaton of the
+   * inputs that trigger a rewrite, so it's cheap compared to FormatWords(),
+   * and takes no locks.
+   */
+  bool MayRewrite(const std::vector<AlignedWord>& words) const;
+
+  /**
+   * Format alternative transcripts, e.g. the n-best of a lattice
+   *
+   * Each alternative is a sequence of words, and the corresponding formatted
+   * transcript has its words separated by spaces. All alternatives are merged
+   * into a single prefix tree and composed with the rewrite FST once, instead
+   * of running FormatWords() on each. No timing is kept.
+   */
+  std::vector<std::string> FormatAlternatives(
+      const std::vector<std::vector<std::string>>& alternatives) const;
+
  private:
+  /**
+   * Same as MayRewrite() for the words as they're given to the rewrite FST.
+   */
+  bool MayRewriteBytes(const std::string& bytes) const;
+
+  FormatterConfig opts_;
   std::unique_ptr<fst::StdFst> rewrite_fst_;
+
+  // Deterministic acceptor of all inputs that rewrite_fst_ can map to
+  // something else, with arcs sorted by input label. Null if it has more than
+  // FormatterConfig::trigger_max_states states.
+  std::unique_ptr<const fst::StdVectorFst> trigger_fst_;
+};
+
+/**
+ * Formatting of a growing hypothesis, e.g. the interim results of a stream
+ *
+ * Formatting the whole hypothesis on every interim result makes the cost
+ * quadratic in the length of the utterance. This keeps the formatted words
+ * from the previous call for the prefix that hasn't changed and only
+ * reformats the rest. The reformatted part starts with \c context_words words
+ * that came out unchanged from the previous call, as left context, and the
+ * kept part ends at least \c context_words words before the first changed
+ * word, as right context. Rules that look further than that may be applied
+ * differently than by Formatter::FormatWords(), which is why this is only
+ * meant for interim results.
+ */
+class IncrementalFormatter {
+ public:
+  IncrementalFormatter(const Formatter& formatter, int context_words)
+      : formatter_{formatter},
+        context_words_{static_cast<std::size_t>(std::max(context_words, 0))} {}
+
+  std::vector<AlignedWord> FormatWords(const std::vector<AlignedWord>& words);
+
+  /**
+   * Forget the previous hypothesis, e.g. at the start of a new utterance.
+   */
+  void Reset();
+
+ private:
+  /**
+   * Index into formatted_ of the first word to reformat if \p num_unchanged
+   * words of the previous hypothesis are unchanged, or 0 if everything should
+   * be reformatted.
+   */
+  std::size_t ReformatStart(std::size_t num_unchanged) const;
+
+  const Formatter& formatter_;
+  const std::size_t context_words_;
+  std::vector<AlignedWord> words_;
+  std::vector<AlignedWord> formatted_;
+  // Number of words_ consumed by each formatted word
+  std::vector<std::size_t> input_ends_;
 };
 
 void Capitalize(std::string& str);
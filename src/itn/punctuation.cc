@@ -14,8 +14,18 @@
 
 #include "src/itn/punctuation.h"
 
+#include <ATen/Context.h>
+#include <ATen/Parallel.h>
+#include <torch/csrc/jit/passes/freeze_module.h>
 #include <unicode/unistr.h>
 
+#include <algorithm>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+
 #include "src/itn/formatter.h"
 #include "src/logging.h"
 
@@ -58,71 +68,377 @@ bool ShouldCapitalizeNext(char character) {
   }
 }
 
+/**
+ * Load the model for inference only, with the execution settings in \p opts.
+ */
+torch::jit::Module LoadModule(const ElectraPunctuatorConfig& opts) {
+  if (opts.inter_op_threads > 0) {
+    static std::once_flag inter_op_threads_set;
+    std::call_once(inter_op_threads_set, [&opts] {
+      try {
+        at::set_num_interop_threads(opts.inter_op_threads);
+      } catch (const std::exception& e) {
+        TIRO_SPEECH_WARN("Could not set the number of inter-op threads: {}",
+                         e.what());
+      }
+    });
+  }
+
+  if (opts.quantized) {
+    // FBGEMM is the faster engine on x86, QNNPACK is for ARM
+    const std::vector<at::QEngine>& engines =
+        at::globalContext().supportedQEngines();
+    if (std::find(engines.cbegin(), engines.cend(), at::QEngine::FBGEMM) !=
+        engines.cend()) {
+      at::globalContext().setQEngine(at::QEngine::FBGEMM);
+    } else if (!engines.empty()) {
+      at::globalContext().setQEngine(engines.back());
+    } else {
+      throw std::runtime_error{"libtorch supports no quantized engine"};
+    }
+  }
+
+  torch::jit::Module module = torch::jit::load(opts.pytorch_jit_model_filename);
+  module.eval();
+  if (opts.freeze_module) {
+    module = torch::jit::freeze_module(module);
+  }
+  return module;
+}
+
+/**
+ * Append the punctuation character of each label in \p labels to the
+ * corresponding word in \p words, and capitalize words that follow the end of
+ * a sentence if \p capitalize is set.
+ */
+std::vector<std::string> AddPunctuation(const std::vector<std::string>& words,
+                                        const std::vector<int>& labels,
+                                        bool capitalize,
+                                        bool capitalize_first) {
+  std::vector<std::string> output_words = words;
+  bool capitalize_next = capitalize_first;
+  for (std::size_t idx = 0; idx < output_words.size(); ++idx) {
+    if (capitalize) {
+      if (capitalize_next) {
+        Capitalize(output_words[idx]);
+      }
+      capitalize_next = ShouldCapitalizeNext(labels[idx]);
+    }
+    output_words[idx] += IdToChar(labels[idx]);
+  }
+  return output_words;
+}
+
 }  // namespace
 
-std::vector<std::string> ElectraPunctuator::Punctuate(
-    const std::vector<std::string>& words, bool capitalize) {
-  std::vector<std::string> word_pieces = tokenizer_.Tokenize(words);
+ElectraPunctuator::ElectraPunctuator(
+    const ElectraPunctuatorConfig& opts,
+    std::shared_ptr<const fst::SymbolTable> word_syms)
+    : opts_{opts},
+      module_{LoadModule(opts)},
+      tokenizer_{opts.word_piece_opts},
+      word_syms_{std::move(word_syms)},
+      batch_sizes_{{1.0, 2.0, 4.0, 8.0, 16.0, 32.0, 64.0}},
+      queue_wait_ms_{{0.5, 1.0, 2.0, 5.0, 10.0, 20.0, 50.0, 100.0}} {
+  if (word_syms_ != nullptr) {
+    std::vector<std::vector<WordPieceTokenizer::Id>> pieces(
+        word_syms_->AvailableKey());
+    for (const auto& item : *word_syms_) {
+      if (item.Label() >= 0 &&
+          static_cast<std::size_t>(item.Label()) < pieces.size()) {
+        tokenizer_.TokenizeToIds(item.Symbol(), &pieces[item.Label()]);
+      }
+    }
+    word_syms_pieces_begin_.reserve(pieces.size() + 1);
+    for (const auto& symbol_pieces : pieces) {
+      word_syms_pieces_begin_.push_back(word_syms_pieces_.size());
+      word_syms_pieces_.insert(word_syms_pieces_.end(), symbol_pieces.cbegin(),
+                               symbol_pieces.cend());
+    }
+    word_syms_pieces_begin_.push_back(word_syms_pieces_.size());
+    TIRO_SPEECH_INFO("Tokenized {} word symbols into {} word pieces",
+                     word_syms_->NumSymbols(), word_syms_pieces_.size());
+  }
+  worker_ = std::thread{&ElectraPunctuator::ProcessBatches, this};
+}
 
-  std::vector<int> input_ids{};
-  input_ids.push_back(cls_token_id_);
-  for (auto id : tokenizer_.TokensToIds(word_pieces)) {
-    input_ids.push_back(id);
+ElectraPunctuator::~ElectraPunctuator() {
+  {
+    std::lock_guard<std::mutex> lock{mutex_};
+    stopped_ = true;
   }
-  input_ids.push_back(sep_token_id_);
+  cond_.notify_all();
+  worker_.join();
+}
 
-  torch::Tensor input_ids_tensor = torch::from_blob(
-      input_ids.data(), {1, static_cast<int>(input_ids.size())},
-      torch::TensorOptions{at::kInt});
+std::future<std::vector<int>> ElectraPunctuator::Predict(
+    std::vector<int> input_ids) {
+  std::future<std::vector<int>> result;
+  {
+    std::lock_guard<std::mutex> lock{mutex_};
+    Request& request = pending_.emplace_back(
+        Request{std::move(input_ids), std::chrono::steady_clock::now(), {}});
+    result = request.label_ids.get_future();
+  }
+  cond_.notify_all();
+  return result;
+}
 
-  auto output = module_.forward({input_ids_tensor}).toTuple();
+std::vector<int> ElectraPunctuator::PredictLabels(
+    const std::vector<int>& piece_ids) {
+  const std::size_t num_pieces = piece_ids.size();
+  // Leave room for CLS and SEP
+  const auto window =
+      static_cast<std::size_t>(std::max(opts_.max_sequence_length - 2, 1));
+  const auto overlap = std::min(
+      static_cast<std::size_t>(std::max(opts_.window_overlap, 0)), window - 1);
+  const std::size_t stride = window - overlap;
 
-  // The predictions for each word piece are the same. So blindly appending the
-  // predicted punctuation character to each word results in this:
-  // "þú ert mitt sólsk, ##in, mitt eina sólsk. ##in. þú gleð ##ur mig þegar
-  // heimilin grá ##nar"
-  torch::Tensor pred_ids_tensor =
-      torch::argmax(output->elements()[0].toTensor(), 2, true).flatten();
+  // The last window ends at the last piece, so all windows have the same
+  // length and can share a forward pass
+  std::vector<std::size_t> starts{0};
+  while (starts.back() + window < num_pieces) {
+    starts.push_back(std::min(starts.back() + stride, num_pieces - window));
+  }
+  if (starts.size() > 1) {
+    TIRO_SPEECH_DEBUG("Punctuating {} word pieces in {} windows", num_pieces,
+                      starts.size());
+  }
 
-  std::vector<int> punctuation;
+  std::vector<std::future<std::vector<int>>> results;
+  for (std::size_t start : starts) {
+    const std::size_t end = std::min(start + window, num_pieces);
+    std::vector<int> input_ids;
+    input_ids.reserve(end - start + 2);
+    input_ids.push_back(opts_.cls_token_id);
+    input_ids.insert(input_ids.end(), piece_ids.begin() + start,
+                     piece_ids.begin() + end);
+    input_ids.push_back(opts_.sep_token_id);
+    results.push_back(Predict(std::move(input_ids)));
+  }
 
-  for (std::size_t idx = 0; idx < word_pieces.size(); ++idx) {
-    // First and last element are special tokens
-    int char_id = pred_ids_tensor[idx + 1].item<int>();
-    if (!tokenizer_.IsSubword(word_pieces[idx])) {
-      punctuation.push_back(char_id);
+  // Each piece gets its label from the window it's closest to the center of,
+  // i.e. the overlap of consecutive windows is split in the middle
+  std::vector<int> labels(num_pieces);
+  for (std::size_t idx = 0; idx < starts.size(); ++idx) {
+    const std::vector<int> window_labels = results[idx].get();
+    const std::size_t begin =
+        idx == 0 ? 0 : (starts[idx] + starts[idx - 1] + window) / 2;
+    const std::size_t end = idx + 1 == starts.size()
+                                ? num_pieces
+                                : (starts[idx + 1] + starts[idx] + window) / 2;
+    for (std::size_t piece = begin; piece < end; ++piece) {
+      // The first label is for CLS
+      labels[piece] = window_labels[piece - starts[idx] + 1];
     }
   }
+  return labels;
+}
 
-  std::vector<std::string> output_words = words;
-  bool capitalize_next = false;
-  for (std::size_t idx = 0; idx < output_words.size(); ++idx) {
-    if (capitalize) {
-      if (capitalize_next) {
-        Capitalize(output_words[idx]);
+void ElectraPunctuator::ProcessBatches() {
+  // All forward passes run on this thread, and the OpenMP thread count is per
+  // thread
+  if (opts_.intra_op_threads > 0) {
+    at::set_num_threads(opts_.intra_op_threads);
+  }
+  const std::chrono::microseconds max_delay{opts_.max_batch_delay_us};
+  const auto max_batch_size =
+      static_cast<std::size_t>(std::max(opts_.max_batch_size, 1));
+  while (true) {
+    std::vector<Request> batch;
+    {
+      std::unique_lock<std::mutex> lock{mutex_};
+      cond_.wait(lock, [this] { return stopped_ || !pending_.empty(); });
+      if (pending_.empty()) {
+        return;
+      }
+      // Give other requests a chance to add their sequences to this batch
+      cond_.wait_for(lock, max_delay, [&] {
+        return stopped_ || pending_.size() >= max_batch_size;
+      });
+      while (!pending_.empty() && batch.size() < max_batch_size) {
+        batch.push_back(std::move(pending_.front()));
+        pending_.pop_front();
+      }
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    for (const Request& request : batch) {
+      queue_wait_ms_.Observe(
+          std::chrono::duration<double, std::milli>{start - request.enqueued}
+              .count());
+    }
+
+    // Without an attention mask the padding would change the predictions, so
+    // then only sequences of the same length are run together
+    std::vector<std::vector<Request*>> groups;
+    if (opts_.attention_mask) {
+      std::vector<Request*>& group = groups.emplace_back();
+      for (Request& request : batch) {
+        group.push_back(&request);
+      }
+    } else {
+      std::map<std::size_t, std::vector<Request*>> by_length;
+      for (Request& request : batch) {
+        by_length[request.input_ids.size()].push_back(&request);
+      }
+      for (auto& [length, group] : by_length) {
+        groups.push_back(std::move(group));
+      }
+    }
+
+    for (const std::vector<Request*>& group : groups) {
+      try {
+        RunBatch(group);
+      } catch (const std::exception& e) {
+        TIRO_SPEECH_ERROR("Punctuation forward pass failed: {}", e.what());
+        for (Request* request : group) {
+          request->label_ids.set_exception(std::current_exception());
+        }
       }
-      capitalize_next = ShouldCapitalizeNext(punctuation[idx]);
     }
-    output_words[idx] += IdToChar(punctuation[idx]);
   }
+}
 
-  return output_words;
+void ElectraPunctuator::RunBatch(const std::vector<Request*>& requests) {
+  const auto batch_size = static_cast<std::int64_t>(requests.size());
+  std::int64_t max_length = 0;
+  for (const Request* request : requests) {
+    max_length = std::max(max_length,
+                          static_cast<std::int64_t>(request->input_ids.size()));
+  }
+
+  torch::Tensor input_ids = torch::full({batch_size, max_length},
+                                        opts_.pad_token_id, torch::kInt);
+  torch::Tensor attention_mask =
+      torch::zeros({batch_size, max_length}, torch::kInt);
+  for (std::int64_t row = 0; row < batch_size; ++row) {
+    const std::vector<int>& ids = requests[row]->input_ids;
+    const auto length = static_cast<std::int64_t>(ids.size());
+    input_ids[row].narrow(0, 0, length).copy_(torch::from_blob(
+        const_cast<int*>(ids.data()), {length}, torch::kInt));
+    attention_mask[row].narrow(0, 0, length).fill_(1);
+  }
+  batch_sizes_.Observe(batch_size);
+  TIRO_SPEECH_DEBUG("Punctuating a batch of {} sequences of at most {} tokens",
+                    batch_size, max_length);
+
+  std::vector<torch::jit::IValue> inputs{input_ids};
+  if (opts_.attention_mask) {
+    inputs.emplace_back(attention_mask);
+  }
+  torch::NoGradGuard no_grad;
+  auto output = module_.forward(inputs).toTuple();
+  torch::Tensor label_ids = torch::argmax(output->elements()[0].toTensor(), 2)
+                                .to(torch::kInt)
+                                .contiguous();
+
+  for (std::int64_t row = 0; row < batch_size; ++row) {
+    const int* row_label_ids = label_ids[row].data_ptr<int>();
+    requests[row]->label_ids.set_value(std::vector<int>(
+        row_label_ids, row_label_ids + requests[row]->input_ids.size()));
+  }
 }
 
-std::vector<std::string> ElectraPunctuator::PunctuateWithContext(
+void ElectraPunctuator::AppendWordPieceIds(
+    const std::string& word, std::int64_t word_id,
+    std::vector<int>* piece_ids) const {
+  if (word_syms_ != nullptr) {
+    const std::int64_t label = word_id >= 0 ? word_id : word_syms_->Find(word);
+    if (label >= 0 &&
+        static_cast<std::size_t>(label) + 1 < word_syms_pieces_begin_.size()) {
+      piece_ids->insert(
+          piece_ids->end(),
+          word_syms_pieces_.cbegin() + word_syms_pieces_begin_[label],
+          word_syms_pieces_.cbegin() + word_syms_pieces_begin_[label + 1]);
+      return;
+    }
+  }
+  // Mostly words the formatter rewrote, e.g. numbers
+  std::vector<WordPieceTokenizer::Id> word_piece_ids;
+  tokenizer_.TokenizeToIds(word, &word_piece_ids);
+  piece_ids->insert(piece_ids->end(), word_piece_ids.cbegin(),
+                    word_piece_ids.cend());
+}
+
+std::vector<int> ElectraPunctuator::PredictWordLabels(
     const std::vector<std::string>& words,
-    const std::vector<std::string>& left_context, bool capitalize) {
-  // The use of the left context is very limited right now
-  std::vector<std::string> punctuated = Punctuate(words, capitalize);
-  if (!capitalize || left_context.empty()) {
-    return punctuated;
+    const std::vector<std::int64_t>& word_ids,
+    const std::vector<int>& left_context_pieces,
+    std::vector<int>* next_left_context_pieces) {
+  // Never let the context take more than half of a window
+  const auto max_context = static_cast<std::size_t>(std::max(
+      std::min(opts_.max_left_context_pieces,
+               (opts_.max_sequence_length - 2) / 2),
+      0));
+  std::size_t context_start =
+      left_context_pieces.size() -
+      std::min(left_context_pieces.size(), max_context);
+  // Don't start the context in the middle of a word
+  while (context_start < left_context_pieces.size() &&
+         tokenizer_.IsSubword(left_context_pieces[context_start])) {
+    ++context_start;
+  }
+
+  std::vector<int> piece_ids(left_context_pieces.cbegin() + context_start,
+                             left_context_pieces.cend());
+  const std::size_t num_context_pieces = piece_ids.size();
+  std::vector<std::size_t> word_starts{};
+  word_starts.reserve(words.size() + 1);
+  for (std::size_t idx = 0; idx < words.size(); ++idx) {
+    word_starts.push_back(piece_ids.size());
+    AppendWordPieceIds(words[idx],
+                       idx < word_ids.size() ? word_ids[idx] : -1,
+                       &piece_ids);
   }
+  word_starts.push_back(piece_ids.size());
 
-  if (ShouldCapitalizeNext(left_context.back().back())) {
-    Capitalize(punctuated.at(0));
+  if (next_left_context_pieces != nullptr) {
+    next_left_context_pieces->assign(
+        piece_ids.cend() - std::min(piece_ids.size(), max_context),
+        piece_ids.cend());
   }
 
-  return punctuated;
+  std::vector<int> labels(words.size(), 0);
+  if (piece_ids.size() == num_context_pieces) {
+    return labels;
+  }
+
+  // The predictions for each word piece are the same. So blindly appending the
+  // predicted punctuation character to each word results in this:
+  // "þú ert mitt sólsk, ##in, mitt eina sólsk. ##in. þú gleð ##ur mig þegar
+  // heimilin grá ##nar"
+  const std::vector<int> pred_ids = PredictLabels(piece_ids);
+  for (std::size_t idx = 0; idx < words.size(); ++idx) {
+    // Words without pieces, i.e. empty ones, get no punctuation
+    if (word_starts[idx] < word_starts[idx + 1]) {
+      labels[idx] = pred_ids[word_starts[idx]];
+    }
+  }
+  return labels;
+}
+
+std::vector<std::string> ElectraPunctuator::Punctuate(
+    const std::vector<std::string>& words, bool capitalize,
+    const std::vector<std::int64_t>& word_ids) {
+  return AddPunctuation(words, PredictWordLabels(words, word_ids, {}, nullptr),
+                        capitalize, /* capitalize_first */ false);
+}
+
+std::vector<std::string> ElectraPunctuator::PunctuateWithContext(
+    const std::vector<std::string>& words,
+    const std::vector<std::string>& left_context,
+    const std::vector<int>& left_context_pieces,
+    std::vector<int>* next_left_context_pieces, bool capitalize,
+    const std::vector<std::int64_t>& word_ids) {
+  const bool capitalize_first =
+      capitalize && !left_context.empty() && !left_context.back().empty() &&
+      ShouldCapitalizeNext(left_context.back().back());
+  return AddPunctuation(
+      words,
+      PredictWordLabels(words, word_ids, left_context_pieces,
+                        next_left_context_pieces),
+      capitalize, capitalize_first);
 }
 
 }  // namespace tiro_speech::itn
@@ -14,59 +14,220 @@
 #ifndef TIRO_SPEECH_SRC_ITN_PUNCTUATION_H_
 #define TIRO_SPEECH_SRC_ITN_PUNCTUATION_H_
 
+#include <fst/symbol-table.h>
 #include <torch/script.h>
 
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include "src/histogram.h"
 #include "src/itn/wordpiece.h"
 #include "src/options.h"
+#include "src/utils.h"
 
 namespace tiro_speech::itn {
 
 struct ElectraPunctuatorConfig {
   std::string pytorch_jit_model_filename = "";
+  bool quantized = false;
   int cls_token_id = 2;
   int sep_token_id = 0;
+  int pad_token_id = 1;
+  bool attention_mask = false;
+  int max_batch_size = 16;
+  int max_batch_delay_us = 5000;
+  int max_sequence_length = 512;
+  int window_overlap = 128;
+  int max_left_context_pieces = 32;
+  bool freeze_module = true;
+  int intra_op_threads = 0;
+  int inter_op_threads = 0;
   WordPieceTokenizerConfig word_piece_opts{};
 
   void Register(OptionsItf* opts) {
     opts->Register("pytorch-jit-model", &pytorch_jit_model_filename,
                    "Traced PyTorch/TorchScript model");
+    opts->Register("quantized", &quantized,
+                   "The model is dynamically quantized, i.e. its linear "
+                   "layers are int8. Selects a quantized engine the CPU "
+                   "supports.");
     opts->Register("cls-token-id", &cls_token_id, "CLS token id");
     opts->Register("sep-token-id", &sep_token_id, "SEP token id");
+    opts->Register("pad-token-id", &pad_token_id, "PAD token id");
+    opts->Register("attention-mask", &attention_mask,
+                   "The model takes an attention mask as its second input, so "
+                   "sequences of different lengths can be padded into one "
+                   "batch. Otherwise only sequences of the same length share "
+                   "a forward pass.");
+    opts->Register("max-batch-size", &max_batch_size,
+                   "Max number of sequences in a single forward pass.");
+    opts->Register("max-batch-delay-us", &max_batch_delay_us,
+                   "How long to wait for sequences from other requests before "
+                   "running a forward pass.");
+    opts->Register("max-sequence-length", &max_sequence_length,
+                   "Max number of tokens, including CLS and SEP, the model "
+                   "takes. Longer inputs are split into overlapping windows.");
+    opts->Register("window-overlap", &window_overlap,
+                   "Number of word pieces shared by consecutive windows of a "
+                   "long input. Each piece is labelled by the window where it "
+                   "is closest to the center.");
+    opts->Register("max-left-context-pieces", &max_left_context_pieces,
+                   "Max number of word pieces from the previous segment of a "
+                   "stream the model sees before the words it punctuates. "
+                   "Capped at half of max-sequence-length.");
+    opts->Register("freeze-module", &freeze_module,
+                   "Freeze the model at load time, i.e. inline its parameters "
+                   "and attributes as constants so more of it can be folded "
+                   "and fused.");
+    opts->Register("intra-op-threads", &intra_op_threads,
+                   "Number of threads libtorch uses within an operator of "
+                   "the model. 0 keeps the libtorch default, which is one per "
+                   "core.");
+    opts->Register("inter-op-threads", &inter_op_threads,
+                   "Number of threads libtorch uses to run operators in "
+                   "parallel. This is process wide and can only be set once. "
+                   "0 keeps the libtorch default.");
 
     ParseOptions word_piece_po{"word-piece", opts};
     word_piece_opts.Register(&word_piece_po);
   };
 };
 
-class ElectraPunctuator {
+/** \class ElectraPunctuator
+ * \brief Punctuation with an ELECTRA token classifier
+ *
+ * A single punctuator is shared by all requests to a model. Sequences from
+ * concurrent callers are collected into batches, which are run by a single
+ * worker thread, so many short results don't each run a tiny forward pass. A
+ * batch is run as soon as it has \c max_batch_size sequences or \c
+ * max_batch_delay_us after its first sequence arrived.
+ */
+class ElectraPunctuator : no_copy_or_move {
  public:
-  explicit ElectraPunctuator(const ElectraPunctuatorConfig& opts)
-      : module_{torch::jit::load(opts.pytorch_jit_model_filename)},
-        tokenizer_{opts.word_piece_opts},
-        cls_token_id_{opts.cls_token_id},
-        sep_token_id_{opts.sep_token_id} {}
+  /**
+   * If \p word_syms is given, e.g. the word symbols of a recognizer, its words
+   * are tokenized up front, and only words that aren't in it are tokenized
+   * when punctuating.
+   */
+  explicit ElectraPunctuator(
+      const ElectraPunctuatorConfig& opts,
+      std::shared_ptr<const fst::SymbolTable> word_syms = nullptr);
+
+  ~ElectraPunctuator();
 
   /**
    * Automatically predict and add punctuation to the ends of words.
    *
-   * @note This can't be const since jit::Module::forward isn't. But it is
-   *       probably thread-safe for the models we're using.
+   * Blocks until the batch containing \p words has been processed. Thread
+   * safe.
+   *
+   * \p word_ids is either empty or has the id of each of \p words in the word
+   * symbols given to the constructor, e.g. from a lattice. Those words are
+   * then not looked up in the symbol table. Negative ids mean unknown.
    */
-  std::vector<std::string> Punctuate(const std::vector<std::string>& words,
-                                     bool capitalize = false);
+  std::vector<std::string> Punctuate(
+      const std::vector<std::string>& words, bool capitalize = false,
+      const std::vector<std::int64_t>& word_ids = {});
 
+  /**
+   * Punctuate \p words as the continuation of an earlier segment, e.g. the
+   * previous final result of a stream.
+   *
+   * The model sees at most \c max_left_context_pieces word pieces from the end
+   * of \p left_context_pieces before \p words, but only \p words are
+   * punctuated. The first word is capitalized if \p left_context, the
+   * punctuated words of the earlier segment, ends a sentence. If \p
+   * next_left_context_pieces isn't null, it is set to the left context pieces
+   * for the segment after this one. \p word_ids is as for Punctuate().
+   */
   std::vector<std::string> PunctuateWithContext(
       const std::vector<std::string>& words,
-      const std::vector<std::string>& left_context, bool capitalize = false);
+      const std::vector<std::string>& left_context,
+      const std::vector<int>& left_context_pieces,
+      std::vector<int>* next_left_context_pieces, bool capitalize = false,
+      const std::vector<std::int64_t>& word_ids = {});
+
+  /**
+   * Number of sequences in each forward pass.
+   */
+  const Histogram& BatchSizeHistogram() const { return batch_sizes_; }
+
+  /**
+   * Milliseconds each sequence waited for its forward pass to start.
+   */
+  const Histogram& QueueWaitHistogram() const { return queue_wait_ms_; }
 
  private:
+  struct Request {
+    std::vector<int> input_ids;
+    std::chrono::steady_clock::time_point enqueued;
+    std::promise<std::vector<int>> label_ids;
+  };
+
+  /**
+   * Queue \p input_ids for the next batch. The result is the predicted label
+   * id for each of them.
+   */
+  std::future<std::vector<int>> Predict(std::vector<int> input_ids);
+
+  /**
+   * Predicted label id for each word piece in \p piece_ids, which may be
+   * longer than the model takes.
+   */
+  std::vector<int> PredictLabels(const std::vector<int>& piece_ids);
+
+  /**
+   * Predicted label id for each word in \p words, with the model also seeing
+   * the tail of \p left_context_pieces before them.
+   */
+  std::vector<int> PredictWordLabels(
+      const std::vector<std::string>& words,
+      const std::vector<std::int64_t>& word_ids,
+      const std::vector<int>& left_context_pieces,
+      std::vector<int>* next_left_context_pieces);
+
+  /**
+   * Append the word piece ids of \p word to \p piece_ids. Uses the
+   * pre-tokenized word symbols if \p word is one of them. If \p word_id isn't
+   * negative it is taken to be the id of \p word in them.
+   */
+  void AppendWordPieceIds(const std::string& word, std::int64_t word_id,
+                          std::vector<int>* piece_ids) const;
+
+  void ProcessBatches();
+
+  /**
+   * Run a single forward pass on \p requests, padding them to the same
+   * length.
+   */
+  void RunBatch(const std::vector<Request*>& requests);
+
+  const ElectraPunctuatorConfig opts_;
   torch::jit::Module module_;
   WordPieceTokenizer tokenizer_;
-  int cls_token_id_;
-  int sep_token_id_;
+
+  // Word pieces of each word symbol, those of symbol i are
+  // word_syms_pieces_[word_syms_pieces_begin_[i]:word_syms_pieces_begin_[i+1]]
+  std::shared_ptr<const fst::SymbolTable> word_syms_;
+  std::vector<std::uint32_t> word_syms_pieces_begin_;
+  std::vector<int> word_syms_pieces_;
+
+  Histogram batch_sizes_;
+  Histogram queue_wait_ms_;
+
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::deque<Request> pending_;
+  bool stopped_ = false;
+  std::thread worker_;
 };
 
 }  // namespace tiro_speech::itn
@@ -15,7 +15,10 @@
 
 #include <fmt/format.h>
 
+#include <algorithm>
 #include <fstream>
+#include <map>
+#include <stdexcept>
 #include <string>
 #include <string_view>
 
@@ -36,48 +39,112 @@ WordPieceTokenizer::WordPieceTokenizer(const WordPieceTokenizerConfig& opts)
     const Id id = vocab_.size() - 1;
     vocab_map_[std::move(line)] = id;
   }
+  if (auto it = vocab_map_.find(unk_token_); it != vocab_map_.end()) {
+    unk_id_ = it->second;
+  }
+
+  // Like looking pieces up in vocab_map_, a later duplicate wins
+  std::vector<std::map<unsigned char, std::uint32_t>> children(2);
+  std::vector<std::int64_t> ids(2, -1);
+  const auto insert = [&children, &ids](std::uint32_t node,
+                                        std::string_view piece, Id id) {
+    if (piece.empty()) {
+      return;
+    }
+    for (unsigned char byte : piece) {
+      auto [it, inserted] = children[node].emplace(byte, children.size());
+      if (inserted) {
+        children.emplace_back();
+        ids.push_back(-1);
+      }
+      node = it->second;
+    }
+    ids[node] = id;
+  };
+  for (Id id = 0; id < vocab_.size(); ++id) {
+    const std::string_view piece = vocab_[id];
+    insert(kWordRoot, piece, id);
+    if (IsSubword(piece)) {
+      insert(kSuffixRoot, piece.substr(2), id);
+    }
+  }
+
+  trie_ids_ = std::move(ids);
+  trie_edges_begin_.reserve(children.size() + 1);
+  for (const auto& node_children : children) {
+    trie_edges_begin_.push_back(trie_edge_bytes_.size());
+    for (const auto [byte, child] : node_children) {
+      trie_edge_bytes_.push_back(byte);
+      trie_edge_targets_.push_back(child);
+    }
+  }
+  trie_edges_begin_.push_back(trie_edge_bytes_.size());
+}
+
+bool WordPieceTokenizer::NextTrieNode(std::uint32_t node, unsigned char byte,
+                                      std::uint32_t* next) const {
+  const auto begin = trie_edge_bytes_.cbegin() + trie_edges_begin_[node];
+  const auto end = trie_edge_bytes_.cbegin() + trie_edges_begin_[node + 1];
+  const auto it = std::lower_bound(begin, end, byte);
+  if (it == end || *it != byte) {
+    return false;
+  }
+  *next = trie_edge_targets_[it - trie_edge_bytes_.cbegin()];
+  return true;
+}
+
+bool WordPieceTokenizer::MatchWordPieces(std::string_view word,
+                                         std::vector<Id>* ids) const {
+  const std::size_t num_ids = ids->size();
+  std::size_t start = 0;
+  while (start < word.size()) {
+    std::uint32_t node = start == 0 ? kWordRoot : kSuffixRoot;
+    std::int64_t longest_id = -1;
+    std::size_t longest_end = start;
+    for (std::size_t pos = start;
+         pos < word.size() &&
+         NextTrieNode(node, static_cast<unsigned char>(word[pos]), &node);
+         ++pos) {
+      if (trie_ids_[node] >= 0) {
+        longest_id = trie_ids_[node];
+        longest_end = pos + 1;
+      }
+    }
+    if (longest_id < 0) {
+      ids->resize(num_ids);
+      return false;
+    }
+    ids->push_back(longest_id);
+    start = longest_end;
+  }
+  return true;
+}
+
+void WordPieceTokenizer::TokenizeToIds(std::string_view word,
+                                       std::vector<Id>* ids) const {
+  if (static_cast<int>(word.size()) > max_input_chars_per_word_ ||
+      !MatchWordPieces(word, ids)) {
+    if (!unk_id_) {
+      throw std::out_of_range{
+          fmt::format("Unknown token '{}' not in vocabulary", unk_token_)};
+    }
+    ids->push_back(*unk_id_);
+  }
 }
 
 std::vector<WordPieceTokenizer::WordPieceToken> WordPieceTokenizer::Tokenize(
     const std::vector<WordToken>& words) const {
   std::vector<WordPieceToken> word_pieces{};
+  std::vector<Id> ids{};
   for (const auto& token : words) {
-    if (static_cast<int>(token.size()) > max_input_chars_per_word_) {
+    ids.clear();
+    if (static_cast<int>(token.size()) > max_input_chars_per_word_ ||
+        !MatchWordPieces(token, &ids)) {
       word_pieces.push_back(unk_token_);
       continue;
     }
-
-    bool is_bad = false;
-    std::size_t start_char = 0;
-    std::vector<WordPieceToken> sub_tokens{};
-    while (start_char < token.size()) {
-      std::size_t end_char = token.size();
-      std::string current_substr = "";
-      while (start_char < end_char) {
-        std::string substr = token.substr(start_char, end_char - start_char);
-        if (start_char > 0) {
-          substr = "##" + substr;
-        }
-        if (vocab_map_.count(substr) == 1) {
-          current_substr = substr;
-          break;
-        }
-        end_char -= 1;
-      }
-      if (current_substr.empty()) {
-        is_bad = true;
-        break;
-      }
-      sub_tokens.push_back(current_substr);
-      start_char = end_char;
-    }
-
-    if (is_bad) {
-      word_pieces.push_back(unk_token_);
-    } else {
-      for (const auto& piece : sub_tokens) {
-        word_pieces.push_back(piece);
-      }
+    for (Id id : ids) {
+      word_pieces.push_back(vocab_[id]);
     }
   }
 
@@ -106,10 +173,11 @@ std::vector<WordPieceTokenizer::WordToken> WordPieceTokenizer::Merge(
 
 std::vector<WordPieceTokenizer::Id> WordPieceTokenizer::TokenizeToIds(
     const std::vector<WordToken>& words) const {
-  // TODO(rkjaran): This will probably be used more frequently than Tokenize so
-  //                we should implement it the other way around if performance
-  //                is a problem.
-  return TokensToIds(Tokenize(words));
+  std::vector<Id> ids{};
+  for (const auto& word : words) {
+    TokenizeToIds(word, &ids);
+  }
+  return ids;
 }
 
 std::vector<WordPieceTokenizer::WordPieceToken> WordPieceTokenizer::IdsToTokens(
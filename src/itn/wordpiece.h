@@ -14,7 +14,10 @@
 #ifndef TIRO_SPEECH_SRC_ITN_WORDPIECE_H_
 #define TIRO_SPEECH_SRC_ITN_WORDPIECE_H_
 
+#include <cstdint>
+#include <optional>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
 
@@ -53,6 +56,13 @@ class WordPieceTokenizer {
       const std::vector<WordToken>& words) const;
   std::vector<Id> TokenizeToIds(const std::vector<WordToken>& words) const;
 
+  /**
+   * Tokenize a single word and append the ids of its word pieces to \p ids,
+   * or the id of the unknown token if it can't be tokenized. Doesn't allocate
+   * unless \p ids has to grow.
+   */
+  void TokenizeToIds(std::string_view word, std::vector<Id>* ids) const;
+
   /**
    * Merge subwords into words
    */
@@ -60,6 +70,7 @@ class WordPieceTokenizer {
       const std::vector<WordPieceToken>& word_pieces) const;
 
   bool IsSubword(const std::string_view token) const;
+  bool IsSubword(Id id) const { return IsSubword(vocab_.at(id)); }
 
   /**
    * Convert between tokens and IDs and vice versa.
@@ -70,11 +81,33 @@ class WordPieceTokenizer {
   std::vector<Id> TokensToIds(const std::vector<WordPieceToken>& tokens) const;
 
  private:
+  static constexpr std::uint32_t kWordRoot = 0;
+  static constexpr std::uint32_t kSuffixRoot = 1;
+
+  /**
+   * Greedy longest match of \p word against the vocabulary. Appends the ids of
+   * the word pieces to \p ids and returns true, or leaves \p ids unchanged and
+   * returns false if the word can't be split into pieces from the vocabulary.
+   */
+  bool MatchWordPieces(std::string_view word, std::vector<Id>* ids) const;
+
+  bool NextTrieNode(std::uint32_t node, unsigned char byte,
+                    std::uint32_t* next) const;
+
   const std::string unk_token_;
   const int max_input_chars_per_word_;
 
   std::vector<WordPieceToken> vocab_;
   std::unordered_map<WordPieceToken, Id> vocab_map_;
+  std::optional<Id> unk_id_;
+
+  // The vocabulary as a byte trie, with the edges of each node stored
+  // contiguously and sorted by byte. Word initial pieces are under kWordRoot
+  // and "##" continuation pieces, without the "##", under kSuffixRoot.
+  std::vector<std::uint32_t> trie_edges_begin_;
+  std::vector<unsigned char> trie_edge_bytes_;
+  std::vector<std::uint32_t> trie_edge_targets_;
+  std::vector<std::int64_t> trie_ids_;  // -1 if no piece ends at the node
 };
 
 }  // namespace tiro_speech::itn
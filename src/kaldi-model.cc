@@ -16,16 +16,42 @@
 #include <nnet3/nnet-utils.h>
 
 #include <filesystem>
+#include <string>
 #include <system_error>
+#include <vector>
 
 #include "src/itn/formatter.h"
 #include "src/logging.h"
 #include "src/options.h"
+#include "src/recognizer.h"
 #include "src/scoped-chdir.h"
 #include "src/utils.h"
 
 namespace tiro_speech {
 
+namespace {
+
+/**
+ * Absolute path, size and modification time of \p filename, or an empty
+ * string if it isn't a regular file, e.g. a Kaldi pipe or an empty option.
+ */
+std::string FileFingerprint(const std::string& filename) {
+  std::error_code ec;
+  const std::filesystem::path path = std::filesystem::absolute(filename, ec);
+  if (filename.empty() || ec || !std::filesystem::is_regular_file(path, ec)) {
+    return "";
+  }
+  const auto size = std::filesystem::file_size(path, ec);
+  const auto mtime = std::filesystem::last_write_time(path, ec);
+  if (ec) {
+    return "";
+  }
+  return fmt::format("{}:{}:{};", path.string(), size,
+                     mtime.time_since_epoch().count());
+}
+
+}  // namespace
+
 void KaldiModelConfig::Check() const {
   bool error_occured = false;
   if (nnet3_rxfilename.empty()) {
@@ -62,11 +88,27 @@ void KaldiModelConfig::Check() const {
         "diarization.nnet_rxfilename");
   }
 
+  if (vad_config.engine_opts.engine == "nnet" &&
+      nnet_vad_config.pytorch_jit_model_filename.empty()) {
+    error_occured = true;
+    TIRO_SPEECH_ERROR(
+        "Flag vad.engine=nnet set but missing vad.nnet.pytorch-jit-model");
+  }
+
   if (error_occured) {
     TIRO_SPEECH_FATAL("Got invalid configuration for KaldiModel.");
   }
 }
 
+ModelMetrics::ModelMetrics()
+    : decode_real_time_factor{{0.01, 0.02, 0.05, 0.1, 0.2, 0.5, 1.0, 2.0}},
+      format_real_time_factor{{0.001, 0.002, 0.005, 0.01, 0.02, 0.05, 0.1}},
+      punctuate_real_time_factor{{0.001, 0.002, 0.005, 0.01, 0.02, 0.05, 0.1}},
+      format_seconds{{0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25}},
+      punctuate_seconds{{0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25}},
+      lattice_states{{100.0, 300.0, 1000.0, 3000.0, 10000.0, 30000.0,
+                      100000.0, 300000.0}} {}
+
 KaldiModel::KaldiModel(const KaldiModelConfig& config)
     : decoding_graph{fst::ReadFstKaldiGeneric(config.fst_rxfilename)},
       word_syms{fst::SymbolTable::ReadText(config.word_syms_rxfilename)},
@@ -79,7 +121,8 @@ KaldiModel::KaldiModel(const KaldiModelConfig& config)
                          config.word_boundary_rxfilename},
       feature_info{feature_config},
       initial_adaptation_state{feature_info.ivector_extractor_info},
-      config{config} {
+      config{config},
+      metrics{std::make_shared<ModelMetrics>()} {
   if (!config.initial_ivector_rxfilename.empty()) {
     TIRO_SPEECH_INFO(
         "Using non-zero i-vector (rxfn == '{}') to initial i-vector "
@@ -109,8 +152,8 @@ KaldiModel::KaldiModel(const KaldiModelConfig& config)
 
   if (!config.punctuator_config.pytorch_jit_model_filename.empty() &&
       !config.punctuator_config.word_piece_opts.vocab_filename.empty()) {
-    punctuator =
-        std::make_shared<itn::ElectraPunctuator>(config.punctuator_config);
+    punctuator = std::make_shared<itn::ElectraPunctuator>(
+        config.punctuator_config, word_syms);
   }
 
   if (config.formatter_enabled &&
@@ -121,6 +164,34 @@ KaldiModel::KaldiModel(const KaldiModelConfig& config)
   if (config.diarization_enabled) {
     diarization_info = std::make_shared<XvectorDiarizationDecoderInfo>(
         config.xvector_diarization_config);
+    if (config.diarization_share_features) {
+      diarization_feature_transform = MfccDerivation(
+          feature_info, config.xvector_diarization_config.mfcc_opts);
+      if (!diarization_feature_transform.has_value()) {
+        TIRO_SPEECH_INFO(
+            "Diarization MFCCs can't be derived from the ASR features, they "
+            "will be computed separately");
+      }
+    }
+  }
+
+  if (config.vad_config.engine_opts.engine == "nnet") {
+    nnet_vad_model = std::make_shared<NnetVadModel>(
+        config.nnet_vad_config, GetSampleRate(feature_info),
+        config.vad_config.engine_opts.frame_len_ms);
+  }
+
+  fingerprint = config.language_code + ";";
+  for (const std::string& filename :
+       {config.nnet3_rxfilename, config.fst_rxfilename,
+        config.word_syms_rxfilename, config.align_lexicon_rxfilename,
+        config.const_arpa_rxfilename, config.initial_ivector_rxfilename,
+        config.word_boundary_rxfilename,
+        config.punctuator_config.pytorch_jit_model_filename,
+        config.punctuator_config.word_piece_opts.vocab_filename,
+        config.formatter_config.rewrite_fst_filename,
+        config.nnet_vad_config.pytorch_jit_model_filename}) {
+    fingerprint += FileFingerprint(filename);
   }
 }
 
@@ -143,7 +214,66 @@ std::shared_ptr<KaldiModel> KaldiModel::Read(
   po.ReadConfigFile("main.conf");  // Standard name for model config files.
   po.PrintConfig(std::cerr);
 
-  return std::make_shared<KaldiModel>(model_config);
+  auto model = std::make_shared<KaldiModel>(model_config);
+  // Other options, e.g. decoder beams, also affect the results
+  model->fingerprint += FileFingerprint("main.conf");
+  return model;
+}
+
+void KaldiModel::RegisterMetrics(const std::string& name,
+                                 MetricsRegistry* registry) const {
+  const MetricsRegistry::Labels labels{{"model", name}};
+  registry->Register("tiro_speech_active_streams",
+                     "Number of open streaming recognition requests.",
+                     metrics->active_streams, labels);
+  registry->Register("tiro_speech_audio_seconds_total",
+                     "Seconds of audio decoded.", metrics->audio_seconds,
+                     labels);
+  registry->Register("tiro_speech_decoded_frames_total",
+                     "Number of frames decoded.", metrics->decoded_frames,
+                     labels);
+  registry->Register("tiro_speech_decode_seconds_total",
+                     "Seconds spent decoding.", metrics->decode_seconds,
+                     labels);
+  registry->Register("tiro_speech_vad_skipped_audio_seconds_total",
+                     "Seconds of streaming audio not decoded because the VAD "
+                     "found no speech in it.",
+                     metrics->vad_skipped_audio_seconds, labels);
+  registry->Register("tiro_speech_decode_real_time_factor",
+                     "Real-time factor of decoding, per segment.",
+                     metrics->decode_real_time_factor, labels);
+  registry->Register("tiro_speech_format_real_time_factor",
+                     "Real-time factor of formatting, per segment.",
+                     metrics->format_real_time_factor, labels);
+  registry->Register("tiro_speech_punctuate_real_time_factor",
+                     "Real-time factor of punctuation, per segment.",
+                     metrics->punctuate_real_time_factor, labels);
+  registry->Register("tiro_speech_format_seconds",
+                     "Seconds spent formatting a result.",
+                     metrics->format_seconds, labels);
+  registry->Register("tiro_speech_punctuate_seconds",
+                     "Seconds spent punctuating a result.",
+                     metrics->punctuate_seconds, labels);
+  registry->Register("tiro_speech_lattice_states",
+                     "Number of states in the lattices of final results.",
+                     metrics->lattice_states, labels);
+  if (punctuator != nullptr) {
+    registry->Register("tiro_speech_punctuator_batch_size",
+                       "Number of sequences in each punctuation forward pass.",
+                       punctuator->BatchSizeHistogram(), labels);
+    registry->Register(
+        "tiro_speech_punctuator_queue_wait_milliseconds",
+        "Milliseconds sequences waited for their punctuation forward pass.",
+        punctuator->QueueWaitHistogram(), labels);
+  }
+}
+
+std::unique_ptr<VadEngine> CreateVadEngine(const KaldiModel& model) {
+  if (model.nnet_vad_model != nullptr) {
+    return std::make_unique<NnetVad>(model.nnet_vad_model);
+  }
+  return CreateVadEngine(model.config.vad_config.engine_opts,
+                         GetSampleRate(model));
 }
 
 }  // namespace tiro_speech
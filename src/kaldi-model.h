@@ -21,14 +21,19 @@
 #include <online2/online-nnet3-decoding.h>
 
 #include <memory>
+#include <optional>
 #include <string>
 #include <string_view>
 #include <unordered_map>
 
 #include "src/diarization.h"
 #include "src/itn/formatter.h"
+#include "src/histogram.h"
 #include "src/itn/punctuation.h"
+#include "src/metrics.h"
+#include "src/nnet-vad.h"
 #include "src/options.h"
+#include "src/vad.h"
 
 namespace tiro_speech {
 
@@ -58,8 +63,13 @@ struct KaldiModelConfig {
   itn::FormatterConfig formatter_config;
 
   bool diarization_enabled = false;
+  bool diarization_share_features = true;
   XvectorDiarizationDecoderOptions xvector_diarization_config;
 
+  /// Used to skip decoding non-speech parts of streams
+  VadGateOptions vad_config;
+  NnetVadConfig nnet_vad_config;
+
   void Register(OptionsItf* opts) {
     opts->Register("nnet3-rxfilename", &nnet3_rxfilename,
                    "Filename (possibly extended) of nnet3 acoustic model");
@@ -103,13 +113,44 @@ struct KaldiModelConfig {
     opts->Register("diarization-enabled", &diarization_enabled,
                    "Enable diarization support. Requires model files and "
                    "proper configs under 'diarization'.");
+    opts->Register("diarization-share-features", &diarization_share_features,
+                   "Derive the diarization MFCCs from the ASR features, when "
+                   "possible, instead of computing them separately.");
     ParseOptions xvector_diarization_opts{"diarization", opts};
     xvector_diarization_config.Register(&xvector_diarization_opts);
+
+    ParseOptions vad_opts{"vad", opts};
+    vad_config.Register(&vad_opts);
+    ParseOptions nnet_vad_opts{"nnet", &vad_opts};
+    nnet_vad_config.Register(&nnet_vad_opts);
   }
 
   void Check() const;
 };
 
+/**
+ * Runtime metrics of a model, updated by the Recognizers using it. Real-time
+ * factors are observed per segment, i.e. the time spent on a stage divided by
+ * the duration of the segment's audio.
+ */
+struct ModelMetrics {
+  ModelMetrics();
+
+  Gauge active_streams;
+  Counter audio_seconds;
+  Counter decoded_frames;
+  Counter decode_seconds;
+  /// Streaming audio that wasn't decoded because the VAD found no speech in it
+  Counter vad_skipped_audio_seconds;
+  Histogram decode_real_time_factor;
+  Histogram format_real_time_factor;
+  Histogram punctuate_real_time_factor;
+  Histogram format_seconds;
+  Histogram punctuate_seconds;
+  /// Number of states in the lattices of final results
+  Histogram lattice_states;
+};
+
 /**
  * KaldiModel encapsulates necessary and shareable model
  * resources and configuration.
@@ -130,6 +171,13 @@ struct KaldiModel {
    */
   static std::shared_ptr<KaldiModel> Read(const std::string_view model_path);
 
+  /**
+   * Register the metrics of this model, and of its punctuator, with \p
+   * registry. They are labelled with \p name.
+   */
+  void RegisterMetrics(const std::string& name,
+                       MetricsRegistry* registry) const;
+
   kaldi::TransitionModel trans_model;
   kaldi::nnet3::AmNnetSimple am_nnet;
   std::shared_ptr<DecodingGraph> decoding_graph;
@@ -153,10 +201,27 @@ struct KaldiModel {
   std::shared_ptr<itn::ElectraPunctuator> punctuator;
   std::shared_ptr<itn::Formatter> formatter;
   std::shared_ptr<XvectorDiarizationDecoderInfo> diarization_info;
+  /// Maps ASR input features to diarization MFCCs, if that is possible and
+  /// diarization-share-features is set
+  std::optional<kaldi::Matrix<float>> diarization_feature_transform;
+  /// Only loaded if vad.engine=nnet
+  std::shared_ptr<NnetVadModel> nnet_vad_model;
+
+  /// Shared, so it can be updated through a const KaldiModel
+  std::shared_ptr<ModelMetrics> metrics;
+
+  /// Paths, sizes and modification times of the model files, which changes
+  /// whenever any of them does. Used to invalidate cached results.
+  std::string fingerprint;
 };
 
 std::shared_ptr<KaldiModel> CreateKaldiModel(const std::string_view model_path);
 
+/**
+ * Create a VAD engine for a single stream, as configured for \p model.
+ */
+std::unique_ptr<VadEngine> CreateVadEngine(const KaldiModel& model);
+
 struct ModelId {
   std::string language_code;
   std::string model_name;
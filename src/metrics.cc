@@ -0,0 +1,339 @@
+// Copyright 2021 Tiro ehf.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "src/metrics.h"
+
+#include <fmt/format.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+
+#include "src/logging.h"
+
+namespace tiro_speech {
+
+namespace {
+
+constexpr int kPollTimeoutMs = 200;
+constexpr std::size_t kMaxRequestSize = 8192;
+
+const char* TypeName(MetricType type) {
+  switch (type) {
+    case MetricType::kCounter:
+      return "counter";
+    case MetricType::kGauge:
+      return "gauge";
+    case MetricType::kHistogram:
+      return "histogram";
+  }
+  return "untyped";
+}
+
+std::string FormatValue(double value) {
+  if (std::isnan(value)) {
+    return "NaN";
+  }
+  if (std::isinf(value)) {
+    return value > 0 ? "+Inf" : "-Inf";
+  }
+  return fmt::format("{}", value);
+}
+
+std::string EscapeLabelValue(const std::string& value) {
+  std::string escaped;
+  escaped.reserve(value.size());
+  for (char c : value) {
+    switch (c) {
+      case '\\':
+        escaped += "\\\\";
+        break;
+      case '"':
+        escaped += "\\\"";
+        break;
+      case '\n':
+        escaped += "\\n";
+        break;
+      default:
+        escaped += c;
+    }
+  }
+  return escaped;
+}
+
+/**
+ * E.g. {model="is-IS",le="0.5"}, or nothing if there are no labels.
+ */
+std::string FormatLabels(const MetricsRegistry::Labels& labels,
+                         const std::string& le = "") {
+  if (labels.empty() && le.empty()) {
+    return "";
+  }
+  std::string formatted = "{";
+  for (const auto& [name, value] : labels) {
+    if (formatted.size() > 1) {
+      formatted += ',';
+    }
+    formatted += fmt::format("{}=\"{}\"", name, EscapeLabelValue(value));
+  }
+  if (!le.empty()) {
+    if (formatted.size() > 1) {
+      formatted += ',';
+    }
+    formatted += fmt::format("le=\"{}\"", le);
+  }
+  formatted += '}';
+  return formatted;
+}
+
+bool WriteAll(int fd, const std::string& data) {
+  std::size_t written = 0;
+  while (written < data.size()) {
+    const ssize_t n = ::send(fd, data.data() + written, data.size() - written,
+                             MSG_NOSIGNAL);
+    if (n <= 0) {
+      return false;
+    }
+    written += n;
+  }
+  return true;
+}
+
+}  // namespace
+
+Counter::Counter() {
+  for (Shard& shard : shards_) {
+    shard.value.store(0.0, std::memory_order_relaxed);
+  }
+}
+
+void Counter::Add(double value) {
+  AtomicAdd(shards_[ThisThreadMetricShard()].value, value);
+}
+
+double Counter::Get() const {
+  double value = 0.0;
+  for (const Shard& shard : shards_) {
+    value += shard.value.load(std::memory_order_relaxed);
+  }
+  return value;
+}
+
+void MetricsRegistry::Register(const std::string& name, const std::string& help,
+                               const Counter& counter, const Labels& labels) {
+  Add(name, help, MetricType::kCounter, &counter, labels);
+}
+
+void MetricsRegistry::Register(const std::string& name, const std::string& help,
+                               const Gauge& gauge, const Labels& labels) {
+  Add(name, help, MetricType::kGauge, &gauge, labels);
+}
+
+void MetricsRegistry::Register(const std::string& name, const std::string& help,
+                               const Histogram& histogram,
+                               const Labels& labels) {
+  Add(name, help, MetricType::kHistogram, &histogram, labels);
+}
+
+void MetricsRegistry::Register(const std::string& name, const std::string& help,
+                               MetricType type, std::function<double()> value,
+                               const Labels& labels) {
+  if (type == MetricType::kHistogram) {
+    throw std::invalid_argument{
+        fmt::format("Metric '{}' can't be a histogram", name)};
+  }
+  Add(name, help, type, std::move(value), labels);
+}
+
+void MetricsRegistry::Add(const std::string& name, const std::string& help,
+                          MetricType type, Source source,
+                          const Labels& labels) {
+  std::lock_guard<std::mutex> lock{mutex_};
+  auto [it, inserted] = families_.try_emplace(name, Family{help, type, {}});
+  if (!inserted && it->second.type != type) {
+    throw std::invalid_argument{
+        fmt::format("Metric '{}' is already registered as a {}", name,
+                    TypeName(it->second.type))};
+  }
+  it->second.series.emplace_back(labels, std::move(source));
+}
+
+std::string MetricsRegistry::Collect() const {
+  std::lock_guard<std::mutex> lock{mutex_};
+  std::string out;
+  for (const auto& [name, family] : families_) {
+    out += fmt::format("# HELP {} {}\n# TYPE {} {}\n", name, family.help, name,
+                       TypeName(family.type));
+    for (const auto& [labels, source] : family.series) {
+      if (const auto* histogram = std::get_if<const Histogram*>(&source)) {
+        const Histogram::Snapshot snapshot = (*histogram)->Get();
+        for (std::size_t idx = 0; idx < snapshot.cumulative_counts.size();
+             ++idx) {
+          const double upper_bound =
+              idx < snapshot.upper_bounds.size()
+                  ? snapshot.upper_bounds[idx]
+                  : std::numeric_limits<double>::infinity();
+          out += fmt::format("{}_bucket{} {}\n", name,
+                             FormatLabels(labels, FormatValue(upper_bound)),
+                             snapshot.cumulative_counts[idx]);
+        }
+        out += fmt::format("{}_sum{} {}\n", name, FormatLabels(labels),
+                           FormatValue(snapshot.sum));
+        out += fmt::format("{}_count{} {}\n", name, FormatLabels(labels),
+                           snapshot.count);
+        continue;
+      }
+
+      double value = 0.0;
+      if (const auto* counter = std::get_if<const Counter*>(&source)) {
+        value = (*counter)->Get();
+      } else if (const auto* gauge = std::get_if<const Gauge*>(&source)) {
+        value = (*gauge)->Get();
+      } else {
+        value = std::get<std::function<double()>>(source)();
+      }
+      out += fmt::format("{}{} {}\n", name, FormatLabels(labels),
+                         FormatValue(value));
+    }
+  }
+  return out;
+}
+
+double ProcessResidentMemoryBytes() {
+  // The second field of statm is the number of resident pages
+  std::ifstream statm{"/proc/self/statm"};
+  long size_pages = 0;
+  long resident_pages = 0;
+  if (!(statm >> size_pages >> resident_pages)) {
+    return 0.0;
+  }
+  return static_cast<double>(resident_pages) * ::sysconf(_SC_PAGESIZE);
+}
+
+MetricsHttpServer::MetricsHttpServer(const MetricsRegistry& registry,
+                                     const std::string& listen_address)
+    : registry_{registry} {
+  const std::size_t colon = listen_address.rfind(':');
+  if (colon == std::string::npos) {
+    throw std::runtime_error{
+        fmt::format("Expected host:port, got '{}'", listen_address)};
+  }
+  const std::string host = listen_address.substr(0, colon);
+  const std::string port = listen_address.substr(colon + 1);
+
+  addrinfo hints{};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  addrinfo* addresses = nullptr;
+  if (int err = ::getaddrinfo(host.empty() ? nullptr : host.c_str(),
+                              port.c_str(), &hints, &addresses);
+      err != 0) {
+    throw std::runtime_error{fmt::format("Could not resolve '{}': {}",
+                                         listen_address, gai_strerror(err))};
+  }
+  for (addrinfo* address = addresses; address != nullptr;
+       address = address->ai_next) {
+    listen_fd_ = ::socket(address->ai_family, address->ai_socktype,
+                          address->ai_protocol);
+    if (listen_fd_ < 0) {
+      continue;
+    }
+    const int reuse = 1;
+    ::setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof reuse);
+    if (::bind(listen_fd_, address->ai_addr, address->ai_addrlen) == 0 &&
+        ::listen(listen_fd_, SOMAXCONN) == 0) {
+      break;
+    }
+    ::close(listen_fd_);
+    listen_fd_ = -1;
+  }
+  ::freeaddrinfo(addresses);
+  if (listen_fd_ < 0) {
+    throw std::runtime_error{fmt::format("Could not listen on '{}': {}",
+                                         listen_address, std::strerror(errno))};
+  }
+
+  TIRO_SPEECH_INFO("Serving metrics at http://{}/metrics", listen_address);
+  worker_ = std::thread{&MetricsHttpServer::Serve, this};
+}
+
+MetricsHttpServer::~MetricsHttpServer() {
+  stopped_ = true;
+  worker_.join();
+  ::close(listen_fd_);
+}
+
+void MetricsHttpServer::Serve() {
+  while (!stopped_) {
+    pollfd listen_poll{listen_fd_, POLLIN, 0};
+    if (::poll(&listen_poll, 1, kPollTimeoutMs) <= 0) {
+      continue;
+    }
+    const int fd = ::accept(listen_fd_, nullptr, nullptr);
+    if (fd < 0) {
+      continue;
+    }
+    try {
+      HandleConnection(fd);
+    } catch (const std::exception& e) {
+      TIRO_SPEECH_WARN("Failed serving metrics: {}", e.what());
+    }
+    ::close(fd);
+  }
+}
+
+void MetricsHttpServer::HandleConnection(int fd) {
+  std::string request;
+  char buffer[1024];
+  while (request.find("\r\n\r\n") == std::string::npos &&
+         request.size() < kMaxRequestSize) {
+    pollfd conn_poll{fd, POLLIN, 0};
+    if (::poll(&conn_poll, 1, kPollTimeoutMs) <= 0) {
+      return;
+    }
+    const ssize_t n = ::recv(fd, buffer, sizeof buffer, 0);
+    if (n <= 0) {
+      return;
+    }
+    request.append(buffer, n);
+  }
+
+  const std::string request_line = request.substr(0, request.find("\r\n"));
+  std::string status = "200 OK";
+  std::string content_type = "text/plain; version=0.0.4; charset=utf-8";
+  std::string body;
+  if (request_line.rfind("GET /metrics ", 0) == 0 ||
+      request_line.rfind("GET /metrics?", 0) == 0) {
+    body = registry_.Collect();
+  } else if (request_line.rfind("GET ", 0) == 0) {
+    status = "404 Not Found";
+    body = "Not found, metrics are at /metrics\n";
+  } else {
+    status = "405 Method Not Allowed";
+    body = "Only GET is supported\n";
+  }
+  WriteAll(fd, fmt::format("HTTP/1.0 {}\r\nContent-Type: {}\r\n"
+                           "Content-Length: {}\r\nConnection: close\r\n\r\n",
+                           status, content_type, body.size()) +
+                   body);
+}
+
+}  // namespace tiro_speech
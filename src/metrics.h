@@ -0,0 +1,174 @@
+// Copyright 2021 Tiro ehf.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef TIRO_SPEECH_SRC_METRICS_H_
+#define TIRO_SPEECH_SRC_METRICS_H_
+
+#include <array>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include "src/histogram.h"
+#include "src/utils.h"
+
+namespace tiro_speech {
+
+/** \class Counter
+ * \brief A thread safe, monotonically increasing count
+ *
+ * Add() is lock free and only touches the calling thread's shard.
+ */
+class Counter {
+ public:
+  Counter();
+
+  /**
+   * \p value has to be non-negative.
+   */
+  void Add(double value = 1.0);
+
+  double Get() const;
+
+ private:
+  struct alignas(64) Shard {
+    std::atomic<double> value;
+  };
+
+  std::array<Shard, kNumMetricShards> shards_;
+};
+
+/** \class Gauge
+ * \brief A thread safe value that can go up and down
+ */
+class Gauge {
+ public:
+  void Set(double value) { value_.store(value, std::memory_order_relaxed); }
+
+  void Add(double value) { AtomicAdd(value_, value); }
+
+  double Get() const { return value_.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<double> value_{0.0};
+};
+
+/**
+ * Increments a gauge for as long as it lives, e.g. to count active streams.
+ */
+class ScopedGaugeIncrement : no_copy_or_move {
+ public:
+  explicit ScopedGaugeIncrement(Gauge* gauge) : gauge_{gauge} {
+    gauge_->Add(1.0);
+  }
+
+  ~ScopedGaugeIncrement() { gauge_->Add(-1.0); }
+
+ private:
+  Gauge* gauge_;
+};
+
+enum class MetricType { kCounter, kGauge, kHistogram };
+
+/** \class MetricsRegistry
+ * \brief Metrics exported in the Prometheus text format
+ *
+ * The registry doesn't own the metrics, they are owned by whatever updates
+ * them, e.g. a model or a service, and have to outlive the registry. Metrics
+ * of the same name are a single metric family, distinguished by their labels,
+ * and have to be of the same type.
+ */
+class MetricsRegistry {
+ public:
+  using Labels = std::vector<std::pair<std::string, std::string>>;
+
+  void Register(const std::string& name, const std::string& help,
+                const Counter& counter, const Labels& labels = {});
+  void Register(const std::string& name, const std::string& help,
+                const Gauge& gauge, const Labels& labels = {});
+  void Register(const std::string& name, const std::string& help,
+                const Histogram& histogram, const Labels& labels = {});
+
+  /**
+   * Register a counter or gauge whose value is computed by \p value when the
+   * metrics are collected.
+   */
+  void Register(const std::string& name, const std::string& help,
+                MetricType type, std::function<double()> value,
+                const Labels& labels = {});
+
+  /**
+   * Current values of all metrics in the Prometheus text exposition format.
+   * Thread safe.
+   */
+  std::string Collect() const;
+
+ private:
+  using Source = std::variant<const Counter*, const Gauge*, const Histogram*,
+                              std::function<double()>>;
+
+  struct Family {
+    std::string help;
+    MetricType type;
+    std::vector<std::pair<Labels, Source>> series;
+  };
+
+  void Add(const std::string& name, const std::string& help, MetricType type,
+           Source source, const Labels& labels);
+
+  mutable std::mutex mutex_;
+  std::map<std::string, Family> families_;
+};
+
+/**
+ * Resident set size of this process, or 0 if it is unknown.
+ */
+double ProcessResidentMemoryBytes();
+
+/** \class MetricsHttpServer
+ * \brief Serves the metrics of a registry at http://<address>/metrics
+ *
+ * A minimal HTTP/1.0 server for Prometheus to scrape, which answers one
+ * request at a time on its own thread.
+ */
+class MetricsHttpServer : no_copy_or_move {
+ public:
+  /**
+   * Listen on \p listen_address, i.e. host:port. Throws std::runtime_error if
+   * that fails.
+   */
+  MetricsHttpServer(const MetricsRegistry& registry,
+                    const std::string& listen_address);
+
+  ~MetricsHttpServer();
+
+ private:
+  void Serve();
+
+  void HandleConnection(int fd);
+
+  const MetricsRegistry& registry_;
+  int listen_fd_ = -1;
+  std::atomic<bool> stopped_{false};
+  std::thread worker_;
+};
+
+}  // namespace tiro_speech
+
+#endif  // TIRO_SPEECH_SRC_METRICS_H_
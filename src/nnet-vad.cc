@@ -0,0 +1,139 @@
+// Copyright 2021 Tiro ehf.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "src/nnet-vad.h"
+
+#include <exception>
+#include <stdexcept>
+#include <utility>
+
+#include "src/logging.h"
+
+namespace tiro_speech {
+
+NnetVadModel::NnetVadModel(const NnetVadConfig& opts, int sample_rate,
+                           int frame_len_ms)
+    : opts_{opts},
+      frame_len_samples_{(frame_len_ms * sample_rate) / 1000},
+      module_{torch::jit::load(opts.pytorch_jit_model_filename)} {
+  module_.eval();
+  worker_ = std::thread{&NnetVadModel::ProcessBatches, this};
+}
+
+NnetVadModel::~NnetVadModel() {
+  {
+    std::lock_guard<std::mutex> lock{mutex_};
+    stopped_ = true;
+  }
+  cond_.notify_all();
+  worker_.join();
+}
+
+std::vector<float> NnetVadModel::SpeechProbabilities(
+    const VectorBase& waveform) {
+  const std::int64_t n_frames = waveform.Dim() / frame_len_samples_;
+  if (n_frames == 0) {
+    return {};
+  }
+
+  // Copy, since the waveform may be gone by the time the batch is run
+  torch::Tensor frames =
+      torch::from_blob(const_cast<float*>(waveform.Data()),
+                       {n_frames, frame_len_samples_}, torch::kFloat32)
+          .div(32768.0f);
+
+  std::future<torch::Tensor> result;
+  {
+    std::lock_guard<std::mutex> lock{mutex_};
+    Request& request = pending_.emplace_back(Request{std::move(frames), {}});
+    result = request.probabilities.get_future();
+    num_pending_frames_ += n_frames;
+  }
+  cond_.notify_all();
+
+  torch::Tensor probabilities = result.get();
+  return {probabilities.data_ptr<float>(),
+          probabilities.data_ptr<float>() + probabilities.numel()};
+}
+
+void NnetVadModel::ProcessBatches() {
+  const std::chrono::microseconds max_delay{opts_.max_batch_delay_us};
+  while (true) {
+    std::vector<Request> batch;
+    {
+      std::unique_lock<std::mutex> lock{mutex_};
+      cond_.wait(lock, [this] { return stopped_ || !pending_.empty(); });
+      if (pending_.empty()) {
+        return;
+      }
+      // Give other streams a chance to add their frames to this batch
+      cond_.wait_for(lock, max_delay, [this] {
+        return stopped_ || num_pending_frames_ >= opts_.max_batch_size;
+      });
+      std::int64_t n_frames = 0;
+      while (!pending_.empty() &&
+             (batch.empty() || n_frames + pending_.front().frames.size(0) <=
+                                   opts_.max_batch_size)) {
+        n_frames += pending_.front().frames.size(0);
+        batch.push_back(std::move(pending_.front()));
+        pending_.pop_front();
+      }
+      num_pending_frames_ -= n_frames;
+    }
+
+    try {
+      std::vector<torch::Tensor> inputs;
+      inputs.reserve(batch.size());
+      std::int64_t n_frames = 0;
+      for (const Request& request : batch) {
+        inputs.push_back(request.frames);
+        n_frames += request.frames.size(0);
+      }
+      torch::NoGradGuard no_grad;
+      torch::Tensor probabilities = module_.forward({torch::cat(inputs)})
+                                        .toTensor()
+                                        .to(torch::kFloat32)
+                                        .reshape({-1})
+                                        .contiguous();
+      if (probabilities.numel() != n_frames) {
+        throw std::runtime_error{
+            "VAD model didn't output a single probability per frame"};
+      }
+      std::int64_t offset = 0;
+      for (Request& request : batch) {
+        const std::int64_t n = request.frames.size(0);
+        request.probabilities.set_value(
+            probabilities.narrow(0, offset, n).clone());
+        offset += n;
+      }
+    } catch (const std::exception& e) {
+      TIRO_SPEECH_ERROR("VAD forward pass failed: {}", e.what());
+      for (Request& request : batch) {
+        request.probabilities.set_exception(std::current_exception());
+      }
+    }
+  }
+}
+
+std::vector<bool> NnetVad::DetectSpeech(const VectorBase& waveform) {
+  const std::vector<float> probabilities =
+      model_->SpeechProbabilities(waveform);
+  std::vector<bool> vad_decisions;
+  vad_decisions.reserve(probabilities.size());
+  for (float p : probabilities) {
+    vad_decisions.push_back(p >= model_->Options().speech_threshold);
+  }
+  return vad_decisions;
+}
+
+}  // namespace tiro_speech
@@ -0,0 +1,121 @@
+// Copyright 2021 Tiro ehf.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef TIRO_SPEECH_SRC_NNET_VAD_H_
+#define TIRO_SPEECH_SRC_NNET_VAD_H_
+
+#include <torch/script.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "src/options.h"
+#include "src/utils.h"
+#include "src/vad.h"
+
+namespace tiro_speech {
+
+struct NnetVadConfig {
+  std::string pytorch_jit_model_filename = "";
+  float speech_threshold = 0.5f;
+  int max_batch_size = 256;
+  int max_batch_delay_us = 2000;
+
+  void Register(OptionsItf* opts) {
+    opts->Register("pytorch-jit-model", &pytorch_jit_model_filename,
+                   "Traced PyTorch/TorchScript VAD model. It should map a "
+                   "float tensor of frames (N x samples per frame, in "
+                   "[-1; 1]) to N speech probabilities.");
+    opts->Register("speech-threshold", &speech_threshold,
+                   "Frames with a speech probability at or above this are "
+                   "classified as speech.");
+    opts->Register("max-batch-size", &max_batch_size,
+                   "Max number of frames in a single forward pass.");
+    opts->Register("max-batch-delay-us", &max_batch_delay_us,
+                   "How long to wait for frames from other streams before "
+                   "running a forward pass.");
+  }
+};
+
+/** \class NnetVadModel
+ * \brief A neural VAD shared by all streams of a model
+ *
+ * Frames from concurrent callers are collected into a single batch, so a
+ * server with many open streams runs one forward pass for all of them instead
+ * of one per stream. A batch is run as soon as it has \c max_batch_size frames
+ * or \c max_batch_delay_us after its first frame arrived.
+ */
+class NnetVadModel : no_copy_or_move {
+ public:
+  NnetVadModel(const NnetVadConfig& opts, int sample_rate, int frame_len_ms);
+
+  ~NnetVadModel();
+
+  const NnetVadConfig& Options() const { return opts_; }
+
+  int NumSamplesPerFrame() const { return frame_len_samples_; }
+
+  /**
+   * Speech probability for each full frame in \p waveform. Blocks until the
+   * batch containing the frames has been processed. Thread safe.
+   */
+  std::vector<float> SpeechProbabilities(const VectorBase& waveform);
+
+ private:
+  struct Request {
+    torch::Tensor frames;
+    std::promise<torch::Tensor> probabilities;
+  };
+
+  void ProcessBatches();
+
+  const NnetVadConfig opts_;
+  const int frame_len_samples_;
+  torch::jit::Module module_;
+
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::deque<Request> pending_;
+  std::int64_t num_pending_frames_ = 0;
+  bool stopped_ = false;
+  std::thread worker_;
+};
+
+/**
+ * VadEngine for a single stream, backed by a shared NnetVadModel.
+ */
+class NnetVad : public VadEngine {
+ public:
+  explicit NnetVad(std::shared_ptr<NnetVadModel> model)
+      : model_{std::move(model)} {}
+
+  int NumSamplesPerFrame() const override {
+    return model_->NumSamplesPerFrame();
+  }
+
+  std::vector<bool> DetectSpeech(const VectorBase& waveform) override;
+
+ private:
+  std::shared_ptr<NnetVadModel> model_;
+};
+
+}  // namespace tiro_speech
+
+#endif  // TIRO_SPEECH_SRC_NNET_VAD_H_
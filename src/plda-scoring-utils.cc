@@ -199,4 +199,116 @@ Matrix<BaseFloat> ScorePlda(const PldaConfig &plda_config, Plda this_plda,
   return scores;
 }
 
+PldaScorer::PldaScorer(const PldaConfig &plda_config, const Plda &plda,
+                       const Matrix<BaseFloat> &whitening_matrix,
+                       const Vector<BaseFloat> &centering_vector,
+                       float target_energy)
+    : plda_config_(plda_config), plda_(plda), target_energy_(target_energy) {
+  int32 dim = centering_vector.Dim(), num_rows = whitening_matrix.NumRows(),
+        num_cols = whitening_matrix.NumCols();
+  if (num_cols != dim && num_cols != dim + 1) {
+    KALDI_ERR << "Dimension mismatch: centering vector has dimension " << dim
+              << " and whitening matrix has " << num_cols << " columns.";
+  }
+  // W (x - c) + b = W x + (b - W c)
+  whitening_linear_ = whitening_matrix.Range(0, num_rows, 0, dim);
+  whitening_offset_.Resize(num_rows);
+  if (num_cols == dim + 1) {
+    whitening_offset_.CopyColFromMat(whitening_matrix, dim);
+  }
+  whitening_offset_.AddMatVec(-1.0, whitening_linear_, kNoTrans,
+                              centering_vector, 1.0);
+}
+
+Matrix<BaseFloat> PldaScorer::Score(
+    const std::vector<Vector<BaseFloat>> &ivectors) const {
+  int32 num_ivectors = ivectors.size();
+  Matrix<BaseFloat> ivector_mat(num_ivectors, whitening_linear_.NumCols());
+  for (int32 i = 0; i < num_ivectors; i++) {
+    ivector_mat.Row(i).CopyFromVec(ivectors[i]);
+  }
+
+  Matrix<BaseFloat> whitened(num_ivectors, whitening_linear_.NumRows());
+  whitened.CopyRowsFromVec(whitening_offset_);
+  whitened.AddMatMat(1.0, ivector_mat, kNoTrans, whitening_linear_, kTrans,
+                     1.0);
+  // Same as IvectorNormalizeLength()
+  for (int32 i = 0; i < num_ivectors; i++) {
+    BaseFloat ratio = whitened.Row(i).Norm(2.0) / sqrt(whitened.NumCols());
+    if (ratio == 0.0) {
+      KALDI_WARN << "Zero iVector";
+    } else {
+      whitened.Row(i).Scale(1.0 / ratio);
+    }
+  }
+
+  Matrix<BaseFloat> pca_transform;
+  if (EstPca(whitened, target_energy_, &pca_transform)) {
+    Matrix<BaseFloat> whitened_pca;
+    ApplyPca(whitened, pca_transform, &whitened_pca);
+    PldaParams this_plda(plda_);
+    this_plda.ApplyTransform(Matrix<double>(pca_transform));
+    return ScoreTransformed(this_plda, Matrix<double>(whitened_pca));
+  }
+  return ScoreTransformed(plda_, Matrix<double>(whitened));
+}
+
+Matrix<BaseFloat> PldaScorer::ScoreTransformed(
+    const PldaParams &plda, const Matrix<double> &ivectors) const {
+  int32 num_ivectors = ivectors.NumRows(), dim = plda.Dim();
+  const Vector<double> &psi = plda.Psi();
+
+  // Plda::TransformIvector() for all i-vectors at once
+  Matrix<double> transformed(num_ivectors, dim);
+  transformed.CopyRowsFromVec(plda.Offset());
+  transformed.AddMatMat(1.0, ivectors, kNoTrans, plda.Transform(), kTrans,
+                        1.0);
+  Matrix<double> transformed_sq(transformed);
+  transformed_sq.ApplyPow(2.0);
+  if (plda_config_.normalize_length) {
+    Vector<double> inv_covar(dim);
+    inv_covar.Set(1.0);
+    if (!plda_config_.simple_length_norm) {
+      inv_covar.AddVec(1.0, psi);
+      inv_covar.InvertElements();
+    }
+    Vector<double> normalization_factors(num_ivectors);
+    normalization_factors.AddMatVec(1.0 / dim, transformed_sq, kNoTrans,
+                                    inv_covar, 0.0);
+    normalization_factors.ApplyPow(-0.5);
+    transformed.MulRowsVec(normalization_factors);
+    transformed_sq.CopyFromMat(transformed);
+    transformed_sq.ApplyPow(2.0);
+  }
+
+  // Plda::LogLikelihoodRatio() with a single training example u and test
+  // example v expands to
+  //   c + sum_k (a_k / g_k) u_k v_k
+  //     - 1/2 sum_k (a_k^2 / g_k) u_k^2 - 1/2 sum_k (1 / g_k - 1 / w_k) v_k^2
+  // with a = psi / (psi + 1), g = 1 + a and w = 1 + psi, so the whole score
+  // matrix is a single matrix product plus row and column terms.
+  Vector<double> cross_scale(dim), train_scale(dim), test_scale(dim);
+  double constant = 0.0;
+  for (int32 k = 0; k < dim; k++) {
+    double a = psi(k) / (psi(k) + 1.0), g = 1.0 + a, w = 1.0 + psi(k);
+    cross_scale(k) = a / g;
+    train_scale(k) = -0.5 * a * a / g;
+    test_scale(k) = -0.5 * (1.0 / g - 1.0 / w);
+    constant += -0.5 * (Log(g) - Log(w));
+  }
+  Vector<double> train_terms(num_ivectors), test_terms(num_ivectors);
+  train_terms.AddMatVec(1.0, transformed_sq, kNoTrans, train_scale, 0.0);
+  test_terms.AddMatVec(1.0, transformed_sq, kNoTrans, test_scale, 0.0);
+
+  Matrix<double> transformed_scaled(transformed);
+  transformed_scaled.MulColsVec(cross_scale);
+  Matrix<double> scores(num_ivectors, num_ivectors);
+  scores.AddMatMat(1.0, transformed_scaled, kNoTrans, transformed, kTrans,
+                   0.0);
+  scores.AddVecToCols(1.0, train_terms);
+  scores.AddVecToRows(1.0, test_terms);
+  scores.Add(constant);
+  return Matrix<BaseFloat>(scores);
+}
+
 }  // namespace kaldi
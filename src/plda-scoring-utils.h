@@ -53,13 +53,48 @@ void IvectorNormalizeLength(std::vector<Vector<BaseFloat>> &ivectors,
                             bool scaleup = true, bool normalize = true);
 
 /// Computes PLDA scores from pairs of {x,i}-vectors.  These scores are in the
-/// form of an affinity matrix.
+/// form of an affinity matrix.  This scores one pair at a time and is kept as a
+/// reference for PldaScorer.
 Matrix<BaseFloat> ScorePlda(const PldaConfig &plda_config, Plda this_plda,
                             Matrix<BaseFloat> whitening_matrix,
                             Vector<BaseFloat> centering_vector,
                             const std::vector<Vector<BaseFloat>> &ivectors,
                             float target_energy = 0.9f);
 
+/// Plda with read access to its parameters.
+class PldaParams : public Plda {
+ public:
+  explicit PldaParams(const Plda &plda) : Plda(plda) {}
+
+  const Matrix<double> &Transform() const { return transform_; }
+  const Vector<double> &Offset() const { return offset_; }
+  const Vector<double> &Psi() const { return psi_; }
+};
+
+/// Computes the same scores as ScorePlda(), but with the recording independent
+/// transforms precomputed, and with all pairs scored at once with a few matrix
+/// products.  Only the PCA transform, if any, is estimated per call.
+class PldaScorer {
+ public:
+  PldaScorer(const PldaConfig &plda_config, const Plda &plda,
+             const Matrix<BaseFloat> &whitening_matrix,
+             const Vector<BaseFloat> &centering_vector,
+             float target_energy = 0.9f);
+
+  Matrix<BaseFloat> Score(const std::vector<Vector<BaseFloat>> &ivectors) const;
+
+ private:
+  Matrix<BaseFloat> ScoreTransformed(const PldaParams &plda,
+                                     const Matrix<double> &ivectors) const;
+
+  PldaConfig plda_config_;
+  PldaParams plda_;
+  // Centering and whitening as a single affine transform
+  Matrix<BaseFloat> whitening_linear_;
+  Vector<BaseFloat> whitening_offset_;
+  float target_energy_;
+};
+
 }  // namespace kaldi
 
 #endif  // TIRO_SPEECH_SRC_PLDA_SCORING_UTILS_H_
@@ -13,25 +13,52 @@ T ThreadSafeQueue<T>::blocking_pop() {
   cv_.wait(lk, [this] { return !queue_.empty(); });
   T ret = std::move(queue_.front());
   queue_.pop();
+  lk.unlock();
+  not_full_cv_.notify_one();
   return ret;
 }
 
 template <typename T>
-void ThreadSafeQueue<T>::push(const T& t) {
+bool ThreadSafeQueue<T>::try_pop(T* t) {
+  std::unique_lock<std::mutex> lk{m_};
+  if (queue_.empty()) {
+    return false;
+  }
+  *t = std::move(queue_.front());
+  queue_.pop();
+  lk.unlock();
+  not_full_cv_.notify_one();
+  return true;
+}
+
+template <typename T>
+bool ThreadSafeQueue<T>::push(const T& t) {
+  return push(T{t});
+}
+
+template <typename T>
+bool ThreadSafeQueue<T>::push(T&& t) {
   {
-    std::lock_guard<std::mutex> lock{m_};
-    queue_.push(t);
+    std::unique_lock<std::mutex> lk{m_};
+    not_full_cv_.wait(lk, [this] {
+      return closed_ || max_size_ == 0 || queue_.size() < max_size_;
+    });
+    if (closed_) {
+      return false;
+    }
+    queue_.push(std::forward<T>(t));
   }
   cv_.notify_one();
+  return true;
 }
 
 template <typename T>
-void ThreadSafeQueue<T>::push(T&& t) {
+void ThreadSafeQueue<T>::close() {
   {
     std::lock_guard<std::mutex> lock{m_};
-    queue_.push(std::forward<T>(t));
+    closed_ = true;
   }
-  cv_.notify_one();
+  not_full_cv_.notify_all();
 }
 
 }  // end namespace tiro_speech
@@ -2,6 +2,7 @@
 #define TIRO_SPEECH_SRC_QUEUE_H_
 
 #include <condition_variable>
+#include <cstddef>
 #include <mutex>
 #include <queue>
 
@@ -11,21 +12,40 @@ namespace tiro_speech {
  * \brief  Simple thread safe queue with a blocking pop.
  *
  * \detail  This is useful for when we hava seperate Reader thread supplying a
- *          Processor thread with data.
+ *          Processor thread with data. If \p max_size is non-zero push()
+ *          blocks while the queue holds that many items, so a Reader can't
+ *          get arbitrarily far ahead of its Processor.
  */
 template <typename T>
 class ThreadSafeQueue {
  public:
-  ThreadSafeQueue() = default;
+  explicit ThreadSafeQueue(std::size_t max_size = 0) : max_size_{max_size} {}
   ~ThreadSafeQueue() = default;
   T blocking_pop();
-  void push(const T& t);
-  void push(T&& t);
+
+  /// Pop into \p t if the queue isn't empty, without waiting
+  bool try_pop(T* t);
+
+  /**
+   * Returns false, without adding \p t, if the queue is closed. That includes
+   * a push() blocked on a full queue when it is closed.
+   */
+  bool push(const T& t);
+  bool push(T&& t);
+
+  /**
+   * Called by a Processor that won't pop anymore, so the Reader doesn't block
+   * on it. Items already in the queue can still be popped.
+   */
+  void close();
 
  private:
+  const std::size_t max_size_;
   std::queue<T> queue_;
+  bool closed_ = false;
   std::mutex m_;
   std::condition_variable cv_;
+  std::condition_variable not_full_cv_;
 };
 
 }  // namespace tiro_speech
@@ -31,10 +31,12 @@
 #include <cassert>
 #include <chrono>
 #include <exception>
+#include <iterator>
 #include <memory>
 #include <sstream>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include "src/base.h"
 #include "src/itn/formatter.h"
@@ -44,6 +46,12 @@ namespace tiro_speech {
 
 namespace {
 
+double SecondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>{std::chrono::steady_clock::now() -
+                                       start}
+      .count();
+}
+
 void RescoreLattice(kaldi::CompactLattice* mutatable_clat,
                     const kaldi::ConstArpaLm& const_arpa_lm) {
   assert(mutatable_clat != nullptr);
@@ -71,7 +79,8 @@ Recognizer::Recognizer(const KaldiModel& model,
 
 Recognizer::Recognizer(const KaldiModel& model,
                        const KaldiModel::AdaptationState& adaptation_state,
-                       std::vector<AlignedWord> left_context)
+                       std::vector<AlignedWord> left_context,
+                       std::vector<int> left_context_pieces)
     : model_{model},
       adaptation_state_{adaptation_state},
       feature_pipeline_{model_.feature_info},
@@ -81,10 +90,17 @@ Recognizer::Recognizer(const KaldiModel& model,
       decoder_{model.decoder_config, model.trans_model, *model.decodable_info,
                *model.decoding_graph, &feature_pipeline_},
       sample_rate_{GetSampleRate(model_.feature_info)},
-      left_context_{std::move(left_context)} {
+      left_context_{std::move(left_context)},
+      left_context_pieces_{std::move(left_context_pieces)} {
   for (const AlignedWord& ali : left_context_) {
     left_context_words_.push_back(ali.word_symbol);
   }
+  if (model_.formatter != nullptr &&
+      model_.formatter->Options().incremental_interim_results) {
+    interim_formatter_ = std::make_unique<itn::IncrementalFormatter>(
+        *model_.formatter,
+        model_.formatter->Options().incremental_context_words);
+  }
 }
 
 void Recognizer::SetAdaptationState(
@@ -108,6 +124,8 @@ void Recognizer::WriteAdaptationState(std::ostream& os, bool binary) {
 }
 
 void Recognizer::Decode(const VectorBase& waveform, bool flush) {
+  const auto start = std::chrono::steady_clock::now();
+  const std::int32_t num_frames_decoded = decoder_.NumFramesDecoded();
   feature_pipeline_.AcceptWaveform(sample_rate_, waveform);
 
   if (flush) {
@@ -124,6 +142,15 @@ void Recognizer::Decode(const VectorBase& waveform, bool flush) {
     feature_pipeline_.IvectorFeature()->UpdateFrameWeights(delta_weights_);
   }
   decoder_.AdvanceDecoding();
+
+  const double audio_seconds = waveform.Dim() / sample_rate_;
+  const double decode_seconds = SecondsSince(start);
+  segment_audio_seconds_ += audio_seconds;
+  segment_decode_seconds_ += decode_seconds;
+  model_.metrics->audio_seconds.Add(audio_seconds);
+  model_.metrics->decode_seconds.Add(decode_seconds);
+  model_.metrics->decoded_frames.Add(decoder_.NumFramesDecoded() -
+                                     num_frames_decoded);
 }
 
 bool Recognizer::HasEndpoint(bool single_utterance) {
@@ -200,22 +227,38 @@ bool Recognizer::GetResults(int32_t max_alternatives,
 
   if (model_.formatter != nullptr) {
     TIRO_SPEECH_DEBUG("Formatting best aligned hypothesis");
-    *best_aligned = model_.formatter->FormatWords(*best_aligned);
+    const auto start = std::chrono::steady_clock::now();
+    if (!end_of_utt && interim_formatter_ != nullptr) {
+      *best_aligned = interim_formatter_->FormatWords(*best_aligned);
+    } else {
+      *best_aligned = model_.formatter->FormatWords(*best_aligned);
+      if (interim_formatter_ != nullptr) {
+        interim_formatter_->Reset();
+      }
+    }
+    const double format_seconds = SecondsSince(start);
+    segment_format_seconds_ += format_seconds;
+    model_.metrics->format_seconds.Observe(format_seconds);
   }
 
   std::vector<std::string> first_word_symbols;
+  std::vector<std::int64_t> first_word_ids;
   for (const auto& aligned_word : *best_aligned) {
     first_word_symbols.push_back(aligned_word.word_symbol);
+    first_word_ids.push_back(aligned_word.word_id);
   }
 
   if (punctuate && model_.punctuator != nullptr) {
+    const auto start = std::chrono::steady_clock::now();
     std::vector<std::string> left_context_symbols;
     for (const AlignedWord& ali : left_context_) {
       left_context_symbols.push_back(ali.word_symbol);
     }
 
+    std::vector<int> next_left_context_pieces;
     first_word_symbols = model_.punctuator->PunctuateWithContext(
-        first_word_symbols, left_context_symbols, /* capitalize */ true);
+        first_word_symbols, left_context_symbols, left_context_pieces_,
+        &next_left_context_pieces, /* capitalize */ true, first_word_ids);
 
     // TODO(rkjaran): Figure out when to append punctuation at the end, which
     //                is something the model never (?) does.
@@ -223,30 +266,68 @@ bool Recognizer::GetResults(int32_t max_alternatives,
       itn::Capitalize(first_word_symbols.at(0));
     }
 
-    // The first transcript and best_aligned should be the same string
+    // The first transcript and best_aligned should be the same string. The
+    // punctuated words generally aren't word symbols.
     for (std::size_t sym_idx = 0; sym_idx < best_aligned->size(); ++sym_idx) {
       (*best_aligned)[sym_idx].word_symbol = first_word_symbols[sym_idx];
+      (*best_aligned)[sym_idx].word_id = -1;
     }
     if (end_of_utt && !best_aligned->empty()) {
       left_context_ = *best_aligned;
+      left_context_pieces_ = std::move(next_left_context_pieces);
     }
+    const double punctuate_seconds = SecondsSince(start);
+    segment_punctuate_seconds_ += punctuate_seconds;
+    model_.metrics->punctuate_seconds.Observe(punctuate_seconds);
+  }
+
+  if (end_of_utt && segment_audio_seconds_ > 0.0) {
+    ModelMetrics& metrics = *model_.metrics;
+    metrics.decode_real_time_factor.Observe(segment_decode_seconds_ /
+                                            segment_audio_seconds_);
+    if (model_.formatter != nullptr) {
+      metrics.format_real_time_factor.Observe(segment_format_seconds_ /
+                                              segment_audio_seconds_);
+    }
+    if (punctuate && model_.punctuator != nullptr) {
+      metrics.punctuate_real_time_factor.Observe(segment_punctuate_seconds_ /
+                                                 segment_audio_seconds_);
+    }
+    segment_audio_seconds_ = 0.0;
+    segment_decode_seconds_ = 0.0;
+    segment_format_seconds_ = 0.0;
+    segment_punctuate_seconds_ = 0.0;
   }
 
   transcripts->push_back(Join(first_word_symbols, " "));
 
+  std::vector<std::vector<std::string>> alternatives;
   for (size_t idx = 1; idx < lats.size(); ++idx) {
     std::vector<int32> words;
     if (!fst::GetLinearSymbolSequence<kaldi::LatticeArc, int32>(
             lats[idx], /* alignment */ nullptr, &words, /* weight */ nullptr)) {
       return false;
     }
-    std::vector<std::string> word_symbols{};
+    std::vector<std::string>& word_symbols = alternatives.emplace_back();
     for (const auto word_id : words) {
       if (word_id == 0) continue;
       word_symbols.push_back(model_.word_syms->Find(word_id));
     }
+  }
 
-    transcripts->push_back(Join(word_symbols, " "));
+  // The other alternatives are formatted together, so they are consistent
+  // with the first one
+  if (model_.formatter != nullptr && !alternatives.empty()) {
+    TIRO_SPEECH_DEBUG("Formatting {} alternatives", alternatives.size());
+    std::vector<std::string> formatted =
+        model_.formatter->FormatAlternatives(alternatives);
+    transcripts->insert(transcripts->end(),
+                        std::make_move_iterator(formatted.begin()),
+                        std::make_move_iterator(formatted.end()));
+  } else {
+    for (const auto& word_symbols : alternatives) {
+      transcripts->push_back(Join(word_symbols, " "));
+    }
   }
   return true;
 }
@@ -259,6 +340,9 @@ std::vector<kaldi::Lattice> Recognizer::GetShortestPaths(
   if (decoder_.NumFramesDecoded() == 0) return {};
 
   decoder_.GetLattice(end_of_utt, &clat);
+  if (end_of_utt) {
+    model_.metrics->lattice_states.Observe(clat.NumStates());
+  }
 
   if (constarpa_rescoring && model_.const_arpa_valid) {
     TIRO_SPEECH_DEBUG("Rescoring with ConstArpaLM.");
@@ -285,6 +369,10 @@ const std::vector<AlignedWord>& Recognizer::GetLeftContext() const {
   return left_context_;
 }
 
+const std::vector<int>& Recognizer::GetLeftContextPieces() const {
+  return left_context_pieces_;
+}
+
 bool GetWordAlignments(const KaldiModel& model, const kaldi::Lattice& lat,
                        std::vector<AlignedWord>* word_alignments) {
   word_alignments->clear();
@@ -310,7 +398,7 @@ bool GetWordAlignments(const KaldiModel& model, const kaldi::Lattice& lat,
     auto start_time = FramesToMillis(model, begin_times[i]);
     auto duration = FramesToMillis(model, lengths[i]);
     word_alignments->emplace_back(start_time, duration,
-                                  model.word_syms->Find(words[i]));
+                                  model.word_syms->Find(words[i]), words[i]);
   }
   return word_alignments->size() > 0;
 }
@@ -45,7 +45,8 @@ class Recognizer final {
 
   Recognizer(const KaldiModel& model,
              const KaldiModel::AdaptationState& adaptation_state,
-             std::vector<AlignedWord> left_context);
+             std::vector<AlignedWord> left_context,
+             std::vector<int> left_context_pieces = {});
 
   void SetAdaptationState(const KaldiModel::AdaptationState& adaptation_state);
 
@@ -123,6 +124,21 @@ class Recognizer final {
    */
   const std::vector<AlignedWord>& GetLeftContext() const;
 
+  /**
+   * Punctuation model word pieces at the end of the active left context,
+   * which the punctuator sees before the words of the next segment. Like
+   * GetLeftContext() it is passed on to the next Recognizer.
+   */
+  const std::vector<int>& GetLeftContextPieces() const;
+
+  /**
+   * The input features of the front-end, e.g. MFCCs, without i-vectors.
+   * Frames are added by Decode().
+   */
+  kaldi::OnlineFeatureInterface* InputFeature() {
+    return feature_pipeline_.InputFeature();
+  }
+
  private:
   const KaldiModel& model_;
   mutable KaldiModel::AdaptationState adaptation_state_;
@@ -133,7 +149,16 @@ class Recognizer final {
   float sample_rate_;
   std::vector<AlignedWord> left_context_{};
   std::vector<std::string> left_context_words_{};
+  std::vector<int> left_context_pieces_{};
   std::int32_t frame_offset_{0};
+  // Formats interim results, if enabled in the formatter options
+  std::unique_ptr<itn::IncrementalFormatter> interim_formatter_;
+  // Time spent on each stage of the current segment, for the real-time factors
+  // in ModelMetrics
+  double segment_audio_seconds_ = 0.0;
+  double segment_decode_seconds_ = 0.0;
+  double segment_format_seconds_ = 0.0;
+  double segment_punctuate_seconds_ = 0.0;
 };
 
 /**\brief Attempt to do word time alignment on the lattice lat.
@@ -27,6 +27,7 @@
 #include "src/base.h"
 #include "src/kaldi-model.h"
 #include "src/logging.h"
+#include "src/metrics.h"
 #include "src/recognizer.h"
 #include "src/utils.h"
 
@@ -124,6 +125,17 @@ void SpeechServer::Start() {
   for (const auto& model_pair : models_) {
     speech_service->RegisterModel(model_pair.first, model_pair.second);
   }
+  if (info_.Options().result_cache_config.Enabled()) {
+    speech_service->EnableResultCache(info_.Options().result_cache_config);
+  }
+  if (!info_.Options().metrics_listen_address.empty()) {
+    speech_service->RegisterMetrics(&metrics_registry_);
+    metrics_registry_.Register("process_resident_memory_bytes",
+                               "Resident memory size in bytes.",
+                               MetricType::kGauge, ProcessResidentMemoryBytes);
+    metrics_server_ = std::make_unique<MetricsHttpServer>(
+        metrics_registry_, info_.Options().metrics_listen_address);
+  }
   services_.push_back(std::make_unique<tiro_speech::GoogleCloudSpeechProxy>(
       speech_service.get()));
   services_.push_back(std::move(speech_service));
@@ -19,10 +19,12 @@
 #include <memory>
 #include <string>
 
+#include "src/api/result-cache.h"
 #include "src/api/services.h"
 #include "src/base.h"
 #include "src/kaldi-model.h"
 #include "src/logging.h"
+#include "src/metrics.h"
 #include "src/options.h"
 #include "src/recognizer.h"
 
@@ -40,6 +42,13 @@ struct SpeechServerOptions {
   /// Decoder config that gets applied to all KaldiModels
   kaldi::LatticeFasterDecoderConfig decoder_config;
 
+  /// Disabled unless result-cache-max-entries or result-cache-disk-cache-dir
+  /// are set
+  RecognizeResultCacheOptions result_cache_config;
+
+  /// Metrics aren't served if this is empty
+  std::string metrics_listen_address = "";
+
   void Register(OptionsItf* opts) {
     opts->Register("listen-address", &listen_address,
                    "Listen on address hostname:port");
@@ -58,6 +67,13 @@ struct SpeechServerOptions {
 
     ParseOptions decoder_po{"decoder", opts};
     decoder_config.Register(&decoder_po);
+
+    ParseOptions result_cache_po{"result-cache", opts};
+    result_cache_config.Register(&result_cache_po);
+
+    opts->Register("metrics-listen-address", &metrics_listen_address,
+                   "Serve Prometheus metrics at http://hostname:port/metrics. "
+                   "Disabled if empty.");
   }
 
   void Check() const {
@@ -141,6 +157,10 @@ class SpeechServer {
   const SpeechServerInfo& info_;
   std::vector<std::unique_ptr<grpc::Service>> services_;
   std::unique_ptr<grpc::Server> rpc_server_;
+  // Declared last, so the metrics server stops before anything it reads from
+  // is destroyed
+  MetricsRegistry metrics_registry_;
+  std::unique_ptr<MetricsHttpServer> metrics_server_;
 };
 
 }  // namespace tiro_speech
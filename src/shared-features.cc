@@ -0,0 +1,136 @@
+// Copyright 2021 Tiro ehf.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "src/shared-features.h"
+
+#include <feat/feature-fbank.h>
+#include <feat/mel-computations.h>
+#include <matrix/matrix-functions.h>
+
+namespace tiro_speech {
+
+namespace {
+
+bool SameFraming(const kaldi::FrameExtractionOptions& a,
+                 const kaldi::FrameExtractionOptions& b) {
+  return a.samp_freq == b.samp_freq && a.frame_shift_ms == b.frame_shift_ms &&
+         a.frame_length_ms == b.frame_length_ms && a.dither == b.dither &&
+         a.preemph_coeff == b.preemph_coeff &&
+         a.remove_dc_offset == b.remove_dc_offset &&
+         a.window_type == b.window_type &&
+         a.round_to_power_of_two == b.round_to_power_of_two &&
+         a.blackman_coeff == b.blackman_coeff && a.snip_edges == b.snip_edges;
+}
+
+bool SameMelBanks(const kaldi::MelBanksOptions& a,
+                  const kaldi::MelBanksOptions& b) {
+  return a.num_bins == b.num_bins && a.low_freq == b.low_freq &&
+         a.high_freq == b.high_freq && a.vtln_low == b.vtln_low &&
+         a.vtln_high == b.vtln_high && a.htk_mode == b.htk_mode;
+}
+
+kaldi::Vector<float> LifterCoeffs(const kaldi::MfccOptions& opts) {
+  kaldi::Vector<float> coeffs(opts.num_ceps);
+  if (opts.cepstral_lifter != 0.0) {
+    kaldi::ComputeLifterCoeffs(opts.cepstral_lifter, &coeffs);
+  } else {
+    coeffs.Set(1.0);
+  }
+  return coeffs;
+}
+
+/// MFCCs are lifted DCTs of log mel energies, so fewer coefficients are just
+/// the first ones with a different lifter.
+std::optional<kaldi::Matrix<float>> MfccFromMfcc(
+    const kaldi::MfccOptions& asr_opts, const kaldi::MfccOptions& mfcc_opts,
+    std::int32_t asr_dim) {
+  if (!SameFraming(asr_opts.frame_opts, mfcc_opts.frame_opts) ||
+      !SameMelBanks(asr_opts.mel_opts, mfcc_opts.mel_opts) ||
+      asr_opts.num_ceps < mfcc_opts.num_ceps ||
+      asr_opts.use_energy != mfcc_opts.use_energy ||
+      asr_opts.energy_floor != mfcc_opts.energy_floor ||
+      asr_opts.raw_energy != mfcc_opts.raw_energy || asr_opts.htk_compat ||
+      mfcc_opts.htk_compat) {
+    return std::nullopt;
+  }
+  const kaldi::Vector<float> asr_lifter = LifterCoeffs(asr_opts);
+  const kaldi::Vector<float> lifter = LifterCoeffs(mfcc_opts);
+  kaldi::Matrix<float> transform(mfcc_opts.num_ceps, asr_dim);
+  for (std::int32_t i = 0; i < mfcc_opts.num_ceps; ++i) {
+    transform(i, i) = lifter(i) / asr_lifter(i);
+  }
+  return transform;
+}
+
+std::optional<kaldi::Matrix<float>> MfccFromFbank(
+    const kaldi::FbankOptions& asr_opts, const kaldi::MfccOptions& mfcc_opts,
+    std::int32_t asr_dim) {
+  if (!SameFraming(asr_opts.frame_opts, mfcc_opts.frame_opts) ||
+      !SameMelBanks(asr_opts.mel_opts, mfcc_opts.mel_opts) ||
+      !asr_opts.use_log_fbank || !asr_opts.use_power ||
+      (mfcc_opts.use_energy &&
+       (!asr_opts.use_energy ||
+        asr_opts.energy_floor != mfcc_opts.energy_floor ||
+        asr_opts.raw_energy != mfcc_opts.raw_energy)) ||
+      asr_opts.htk_compat || mfcc_opts.htk_compat) {
+    return std::nullopt;
+  }
+  // Log mel energies come after the energy, if any
+  const std::int32_t num_bins = mfcc_opts.mel_opts.num_bins;
+  const std::int32_t offset = asr_opts.use_energy ? 1 : 0;
+  kaldi::Matrix<float> dct(num_bins, num_bins);
+  kaldi::ComputeDctMatrix(&dct);
+  const kaldi::Vector<float> lifter = LifterCoeffs(mfcc_opts);
+  kaldi::Matrix<float> transform(mfcc_opts.num_ceps, asr_dim);
+  for (std::int32_t i = 0; i < mfcc_opts.num_ceps; ++i) {
+    transform.Row(i).Range(offset, num_bins).AddVec(lifter(i), dct.Row(i));
+  }
+  if (mfcc_opts.use_energy) {
+    transform.Row(0).SetZero();
+    transform(0, 0) = 1.0;
+  }
+  return transform;
+}
+
+}  // namespace
+
+std::optional<kaldi::Matrix<float>> MfccDerivation(
+    const kaldi::OnlineNnet2FeaturePipelineInfo& asr_info,
+    const kaldi::MfccOptions& mfcc_opts) {
+  if (asr_info.feature_type == "mfcc") {
+    return MfccFromMfcc(asr_info.mfcc_opts, mfcc_opts,
+                        asr_info.mfcc_opts.num_ceps);
+  }
+  if (asr_info.feature_type == "fbank") {
+    const kaldi::FbankOptions& fbank_opts = asr_info.fbank_opts;
+    return MfccFromFbank(fbank_opts, mfcc_opts,
+                         fbank_opts.mel_opts.num_bins +
+                             (fbank_opts.use_energy ? 1 : 0));
+  }
+  return std::nullopt;
+}
+
+void OnlineDerivedFeature::AcceptFeatures(
+    const kaldi::MatrixBase<float>& feats) {
+  // Appended features such as pitch are ignored
+  const kaldi::SubMatrix<float> used_feats{feats, 0, feats.NumRows(), 0,
+                                           transform_.NumCols()};
+  kaldi::Matrix<float> derived(feats.NumRows(), Dim(), kaldi::kUndefined);
+  derived.AddMatMat(1.0, used_feats, kaldi::kNoTrans, transform_,
+                    kaldi::kTrans, 0.0);
+  for (std::int32_t frame = 0; frame < derived.NumRows(); ++frame) {
+    features_.PushBack(new kaldi::Vector<float>{derived.Row(frame)});
+  }
+}
+
+}  // namespace tiro_speech
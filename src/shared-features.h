@@ -0,0 +1,89 @@
+// Copyright 2021 Tiro ehf.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef TIRO_SPEECH_SRC_SHARED_FEATURES_H_
+#define TIRO_SPEECH_SRC_SHARED_FEATURES_H_
+
+#include <feat/feature-mfcc.h>
+#include <feat/online-feature.h>
+#include <matrix/matrix-lib.h>
+#include <online2/online-nnet2-feature-pipeline.h>
+
+#include <cstdint>
+#include <optional>
+#include <utility>
+
+namespace tiro_speech {
+
+/**
+ * Linear map from the input features of the ASR front-end described by
+ * \p asr_info to MFCCs with \p mfcc_opts, if there is one.
+ *
+ * There is one if both use the same framing, mel banks and energy options,
+ * and the ASR features are either MFCCs with at least as many coefficients or
+ * log mel filterbanks. The MFCCs of a frame x of ASR features are then T x.
+ * Pitch features appended to the ASR features are ignored.
+ */
+std::optional<kaldi::Matrix<float>> MfccDerivation(
+    const kaldi::OnlineNnet2FeaturePipelineInfo& asr_info,
+    const kaldi::MfccOptions& mfcc_opts);
+
+/** \class OnlineDerivedFeature
+ * \brief Online features derived from the features of another front-end
+ *
+ * This lets two consumers share the framing and FFTs of a single front-end,
+ * see MfccDerivation().
+ */
+class OnlineDerivedFeature : public kaldi::OnlineFeatureInterface {
+ public:
+  /**
+   * \param transform     Linear map from input features to output features
+   * \param frame_shift_seconds  Frame shift of the input features
+   * \param max_feature_vectors  If > 0 only this many of the latest frames
+   *                             are kept
+   */
+  OnlineDerivedFeature(kaldi::Matrix<float> transform,
+                       float frame_shift_seconds,
+                       std::int32_t max_feature_vectors = -1)
+      : transform_{std::move(transform)},
+        frame_shift_seconds_{frame_shift_seconds},
+        features_{max_feature_vectors} {}
+
+  void AcceptFeatures(const kaldi::MatrixBase<float>& feats);
+
+  void InputFinished() { input_finished_ = true; }
+
+  std::int32_t Dim() const override { return transform_.NumRows(); }
+
+  bool IsLastFrame(std::int32_t frame) const override {
+    return input_finished_ && frame == NumFramesReady() - 1;
+  }
+
+  float FrameShiftInSeconds() const override { return frame_shift_seconds_; }
+
+  std::int32_t NumFramesReady() const override { return features_.Size(); }
+
+  void GetFrame(std::int32_t frame, kaldi::VectorBase<float>* feat) override {
+    feat->CopyFromVec(*features_.At(frame));
+  }
+
+ private:
+  kaldi::Matrix<float> transform_;
+  float frame_shift_seconds_;
+  kaldi::RecyclingVector features_;
+  bool input_finished_ = false;
+};
+
+}  // namespace tiro_speech
+
+#endif  // TIRO_SPEECH_SRC_SHARED_FEATURES_H_
@@ -13,9 +13,13 @@
 // limitations under the License.
 #include "src/vad.h"
 
+#include <fmt/format.h>
+
 #include <algorithm>
 #include <cassert>
+#include <cmath>
 #include <stdexcept>
+#include <utility>
 #include <vector>
 
 namespace tiro_speech {
@@ -66,18 +70,39 @@ bool VoiceActivityDetector::ValidRateAndFrameLength(int rate,
 
 VoiceActivityDetector::~VoiceActivityDetector() { WebRtcVad_Free(vad_handle_); }
 
-Vad::Vad(int sample_rate, int frame_len_ms)
+bool VadEngine::HasSpeech(const VectorBase& waveform) {
+  if (NumSamplesPerFrame() > waveform.Dim()) {
+    // TODO(rkjaran): If received number of samples doesn't fit a frame we just
+    //       classify it as speech. This should probably be fixed in the
+    //       AudioSource...
+    return true;
+  }
+  const std::vector<bool> vad_decisions = DetectSpeech(waveform);
+  return std::find(vad_decisions.cbegin(), vad_decisions.cend(), true) !=
+         vad_decisions.cend();
+}
+
+Vad::Vad(int sample_rate, int frame_len_ms, int mode)
     : sample_rate_{sample_rate},
       frame_len_samples_{(frame_len_ms * sample_rate) / 1000},
-      vad_{1} {
+      vad_{mode} {
   if (!vad_.ValidRateAndFrameLength(sample_rate_, frame_len_samples_)) {
     throw std::runtime_error{"Invalid rate and frame length"};
   }
 }
 
+std::vector<bool> Vad::DetectSpeech(const VectorBase& waveform) {
+  std::vector<int16_t> samples(waveform.Dim());
+  for (int i = 0; i < waveform.Dim(); ++i) {
+    samples[i] = static_cast<int16_t>(waveform(i));
+  }
+  return DetectSpeech(samples.data(), samples.size());
+}
+
 std::vector<bool> Vad::DetectSpeech(const int16_t* data, std::size_t data_sz) {
   std::size_t n_frames = data_sz / frame_len_samples_;
-  std::vector<bool> vad_decisions(n_frames);
+  std::vector<bool> vad_decisions;
+  vad_decisions.reserve(n_frames);
   auto* audio_samples = data;
 
   for (size_t i = 0; i < n_frames * frame_len_samples_;
@@ -93,9 +118,6 @@ std::vector<bool> Vad::DetectSpeech(const int16_t* data, std::size_t data_sz) {
 
 bool Vad::HasSpeech(const int16_t* data, std::size_t data_sz) {
   if (static_cast<std::size_t>(frame_len_samples_) > data_sz) {
-    // TODO(rkjaran): If received number of samples doesn't fit a frame we just
-    //       classify it as speech. This should probably be fixed in the
-    //       AudioSource...
     return true;
   }
   const std::vector<bool> vad_decisions = DetectSpeech(data, data_sz);
@@ -108,12 +130,118 @@ bool Vad::HasSpeech(const std::vector<int16_t>& data) {
   return HasSpeech(&data[0], data.size());
 }
 
-bool Vad::HasSpeech(const VectorBase& waveform) {
-  std::vector<int16_t> samples(waveform.Dim());
-  for (int i = 0; i < waveform.Dim(); ++i) {
-    samples[i] = static_cast<int16_t>(waveform(i));
+EnergyVad::EnergyVad(int sample_rate, int frame_len_ms, float threshold_db)
+    : frame_len_samples_{(frame_len_ms * sample_rate) / 1000},
+      threshold_db_{threshold_db},
+      noise_floor_rise_db_{kNoiseFloorRiseDbPerSecond * frame_len_ms / 1000},
+      noise_floor_db_{kMinSpeechEnergyDb} {
+  if (frame_len_samples_ <= 0) {
+    throw std::runtime_error{"Invalid rate and frame length"};
   }
-  return HasSpeech(samples);
+}
+
+std::vector<bool> EnergyVad::DetectSpeech(const VectorBase& waveform) {
+  const int n_frames = waveform.Dim() / frame_len_samples_;
+  std::vector<bool> vad_decisions;
+  vad_decisions.reserve(n_frames);
+  for (int i = 0; i < n_frames; ++i) {
+    const auto frame =
+        waveform.Range(i * frame_len_samples_, frame_len_samples_);
+    const float energy_db =
+        10.0f * std::log10(kaldi::VecVec(frame, frame) / frame_len_samples_ +
+                           1.0f);
+    if (energy_db < noise_floor_db_) {
+      noise_floor_db_ = energy_db;
+    } else {
+      noise_floor_db_ += noise_floor_rise_db_;
+    }
+    vad_decisions.push_back(energy_db > kMinSpeechEnergyDb &&
+                            energy_db > noise_floor_db_ + threshold_db_);
+  }
+  return vad_decisions;
+}
+
+std::unique_ptr<VadEngine> CreateVadEngine(const VadEngineOptions& opts,
+                                           int sample_rate) {
+  if (opts.engine == "webrtc") {
+    return std::make_unique<Vad>(sample_rate, opts.frame_len_ms,
+                                 opts.webrtc_mode);
+  }
+  if (opts.engine == "energy") {
+    return std::make_unique<EnergyVad>(sample_rate, opts.frame_len_ms,
+                                       opts.energy_threshold_db);
+  }
+  throw std::invalid_argument{
+      fmt::format("Can't create VAD engine '{}' without a model", opts.engine)};
+}
+
+VadGate::VadGate(int sample_rate, const VadGateOptions& opts)
+    : VadGate{CreateVadEngine(opts.engine_opts, sample_rate), sample_rate,
+              opts} {}
+
+VadGate::VadGate(std::unique_ptr<VadEngine> engine, int sample_rate,
+                 const VadGateOptions& opts)
+    : opts_{opts},
+      preroll_samples_max_{opts.preroll_ms * sample_rate / 1000},
+      hangover_samples_{opts.hangover_ms * sample_rate / 1000},
+      engine_{std::move(engine)} {}
+
+bool VadGate::Accept(const VectorBase& waveform, Vector* out) {
+  released_preroll_samples_ = 0;
+  if (open_ && !opts_.continuous) {
+    out->Resize(waveform.Dim(), kaldi::kUndefined);
+    out->CopyFromVec(waveform);
+    return true;
+  }
+
+  if (engine_->HasSpeech(waveform)) {
+    trailing_nonspeech_samples_ = 0;
+  } else {
+    trailing_nonspeech_samples_ += waveform.Dim();
+  }
+
+  if (open_ && trailing_nonspeech_samples_ <= hangover_samples_) {
+    out->Resize(waveform.Dim(), kaldi::kUndefined);
+    out->CopyFromVec(waveform);
+    return true;
+  }
+
+  if (!open_ && trailing_nonspeech_samples_ == 0) {
+    // Only the tail end of the pre-roll buffer is released
+    open_ = true;
+    released_preroll_samples_ =
+        std::min(preroll_samples_, preroll_samples_max_);
+    out->Resize(released_preroll_samples_ + waveform.Dim(), kaldi::kUndefined);
+    int skip = preroll_samples_ - released_preroll_samples_;
+    int pos = 0;
+    for (const Vector& buffered : preroll_) {
+      const int n = buffered.Dim() - std::min(skip, buffered.Dim());
+      if (n > 0) {
+        out->Range(pos, n).CopyFromVec(buffered.Range(buffered.Dim() - n, n));
+        pos += n;
+      }
+      skip -= buffered.Dim() - n;
+    }
+    out->Range(pos, waveform.Dim()).CopyFromVec(waveform);
+    preroll_.clear();
+    preroll_samples_ = 0;
+    return true;
+  }
+
+  open_ = false;
+  preroll_.emplace_back(waveform);
+  preroll_samples_ += waveform.Dim();
+  while (!preroll_.empty() &&
+         preroll_samples_ - preroll_.front().Dim() >= preroll_samples_max_) {
+    preroll_samples_ -= preroll_.front().Dim();
+    preroll_.pop_front();
+  }
+  return false;
+}
+
+void VadGate::Close() {
+  open_ = false;
+  trailing_nonspeech_samples_ = 0;
 }
 
 }  // end namespace tiro_speech
@@ -16,9 +16,12 @@
 
 #include <matrix/kaldi-vector.h>
 
+#include <deque>
+#include <memory>
 #include <string>
 #include <vector>
 
+#include "src/options.h"
 #include "webrtc/common_audio/vad/include/webrtc_vad.h"
 
 namespace tiro_speech {
@@ -86,28 +89,184 @@ class VoiceActivityDetector {
   VadInst* vad_handle_;
 };
 
-class Vad {
+/**
+ * Interface for frame level voice activity detection.
+ *
+ * Waveforms are expected to be at the sample rate the engine was created for,
+ * with samples in the 16 bit integer range.
+ */
+class VadEngine {
+ public:
+  virtual ~VadEngine() = default;
+
+  virtual int NumSamplesPerFrame() const = 0;
+
+  /**
+   * Returns a speech decision for each full frame in \p waveform. Trailing
+   * samples that don't fill a frame are ignored.
+   */
+  virtual std::vector<bool> DetectSpeech(const VectorBase& waveform) = 0;
+
+  /**
+   * True if any frame in \p waveform contains speech. Waveforms shorter than a
+   * single frame are classified as speech.
+   */
+  bool HasSpeech(const VectorBase& waveform);
+};
+
+/**
+ * The WebRTC GMM based VAD
+ */
+class Vad : public VadEngine {
  public:
   // Sample rate must be one of {8000, 16000, 32000, 48000} and frame_len_ms
-  // must be 10, 30 or 50 milliseconds
-  explicit Vad(int sample_rate, int frame_len_ms);
+  // must be 10, 20 or 30 milliseconds. See VoiceActivityDetector::set_mode()
+  // for a description of mode.
+  explicit Vad(int sample_rate, int frame_len_ms, int mode = 1);
+
+  int NumSamplesPerFrame() const override { return frame_len_samples_; }
 
-  int NumSamplesPerFrame() { return frame_len_samples_; }
+  std::vector<bool> DetectSpeech(const VectorBase& waveform) override;
 
   std::vector<bool> DetectSpeech(const int16_t* data, std::size_t data_sz);
 
+  using VadEngine::HasSpeech;
+
   bool HasSpeech(const int16_t* data, std::size_t data_sz);
 
   bool HasSpeech(const std::vector<int16_t>& data);
 
-  bool HasSpeech(const VectorBase& waveform);
-
  private:
   const int sample_rate_;
   const int frame_len_samples_;
   tiro_speech::VoiceActivityDetector vad_;
 };
 
+/**
+ * Classifies frames as speech if their energy is a certain margin above an
+ * estimate of the noise floor. The noise floor follows the minimum frame energy
+ * down immediately and drifts slowly upwards otherwise.
+ */
+class EnergyVad : public VadEngine {
+ public:
+  EnergyVad(int sample_rate, int frame_len_ms, float threshold_db);
+
+  int NumSamplesPerFrame() const override { return frame_len_samples_; }
+
+  std::vector<bool> DetectSpeech(const VectorBase& waveform) override;
+
+ private:
+  // Frames quieter than this are never speech, regardless of the noise floor
+  static constexpr float kMinSpeechEnergyDb = 30.0f;
+  static constexpr float kNoiseFloorRiseDbPerSecond = 3.0f;
+
+  const int frame_len_samples_;
+  const float threshold_db_;
+  const float noise_floor_rise_db_;
+  float noise_floor_db_;
+};
+
+struct VadEngineOptions {
+  std::string engine = "webrtc";
+  int frame_len_ms = 30;
+  int webrtc_mode = 1;
+  float energy_threshold_db = 12.0f;
+
+  void Register(OptionsItf* opts) {
+    opts->Register("engine", &engine,
+                   "VAD engine to use. One of 'webrtc', 'energy' or 'nnet'.");
+    opts->Register("frame-len-ms", &frame_len_ms,
+                   "VAD frame length in milliseconds (10, 20 or 30).");
+    opts->Register("webrtc-mode", &webrtc_mode,
+                   "Aggressiveness of the WebRTC VAD (0, 1, 2 or 3). Higher "
+                   "modes are more restrictive in reporting speech.");
+    opts->Register("energy-threshold-db", &energy_threshold_db,
+                   "How far above the noise floor frames have to be for the "
+                   "energy VAD to classify them as speech.");
+  }
+};
+
+/**
+ * Create the VAD engine described by \p opts. Throws std::invalid_argument for
+ * engines that need a model, i.e. 'nnet', see CreateVadEngine(const
+ * KaldiModel&).
+ */
+std::unique_ptr<VadEngine> CreateVadEngine(const VadEngineOptions& opts,
+                                           int sample_rate);
+
+struct VadGateOptions {
+  VadEngineOptions engine_opts;
+  int preroll_ms = 300;
+  int hangover_ms = 1500;
+  bool continuous = false;
+
+  void Register(OptionsItf* opts) {
+    engine_opts.Register(opts);
+    opts->Register("preroll-ms", &preroll_ms,
+                   "Milliseconds of non-speech audio preceding detected "
+                   "speech that are decoded along with it.");
+    opts->Register("hangover-ms", &hangover_ms,
+                   "Milliseconds of non-speech audio after speech before the "
+                   "gate closes again.");
+    opts->Register("continuous", &continuous,
+                   "Keep gating after speech has started, i.e. close the gate "
+                   "again after hangover-ms of non-speech. By default the gate "
+                   "stays open once opened until Close() is called.");
+  }
+};
+
+/** \class VadGate
+ * \brief Decides which parts of an audio stream are worth decoding
+ *
+ * The gate opens when the VAD detects speech and stays open until Close() is
+ * called. If \c continuous is set it also closes by itself after \c
+ * hangover_ms of non-speech. Audio received while the gate is closed is kept in
+ * a pre-roll buffer of at most \c preroll_ms, which is released in front of
+ * the chunk that opens the gate, so that the start of the first word isn't cut
+ * off.
+ *
+ * Decisions are made per chunk, i.e. a chunk is speech if any of its frames is.
+ */
+class VadGate {
+ public:
+  VadGate(int sample_rate, const VadGateOptions& opts);
+
+  VadGate(std::unique_ptr<VadEngine> engine, int sample_rate,
+          const VadGateOptions& opts);
+
+  /**
+   * Process the next chunk of audio, \p waveform. If this returns true the
+   * gate is open and \p out is set to the audio that should be decoded, i.e.
+   * \p waveform preceded by any pre-roll released by this call. Otherwise \p
+   * waveform is buffered as pre-roll and \p out is left untouched.
+   */
+  bool Accept(const VectorBase& waveform, Vector* out);
+
+  bool IsOpen() const { return open_; }
+
+  /// Number of pre-roll samples released by the last call to Accept()
+  int ReleasedPrerollSamples() const { return released_preroll_samples_; }
+
+  /**
+   * Close the gate so the next chunk has to contain speech to open it. Any
+   * buffered pre-roll is kept.
+   */
+  void Close();
+
+ private:
+  const VadGateOptions opts_;
+  const int preroll_samples_max_;
+  const int hangover_samples_;
+  std::unique_ptr<VadEngine> engine_;
+
+  bool open_ = false;
+  int trailing_nonspeech_samples_ = 0;
+  int released_preroll_samples_ = 0;
+
+  std::deque<Vector> preroll_;
+  int preroll_samples_ = 0;
+};
+
 }  // end namespace tiro_speech
 
 #endif  // TIRO_SPEECH_SRC_VAD_H_
@@ -0,0 +1,19 @@
+// Copyright 2021 Tiro ehf.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Same as @catch2//:catch2_with_main, except that it's compiled with
+// CATCH_CONFIG_ENABLE_BENCHMARKING (see BUILD.bazel), which has to be the same
+// for the main TU and the tests.
+#define CATCH_CONFIG_MAIN
+#include <catch2/catch.hpp>
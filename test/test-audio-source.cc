@@ -13,12 +13,49 @@
 // limitations under the License.
 
 #include <catch2/catch.hpp>
+#include <cstdint>
+#include <stdexcept>
 #include <string>
+
 #include "src/audio/audio-source.h"
+#include "src/audio/audio.h"
 #include "src/utils.h"
 
 using namespace tiro_speech;
 
+namespace {
+
+std::string LittleEndian(std::uint32_t value, int num_bytes) {
+  std::string bytes;
+  for (int idx = 0; idx < num_bytes; ++idx) {
+    bytes += static_cast<char>((value >> (8 * idx)) & 0xff);
+  }
+  return bytes;
+}
+
+std::string Chunk(const std::string& id, const std::string& contents) {
+  std::string chunk = id + LittleEndian(contents.size(), 4) + contents;
+  if (contents.size() % 2 != 0) {
+    chunk += '\0';
+  }
+  return chunk;
+}
+
+std::string FmtContents(int format_tag, int num_channels, int sample_rate,
+                        int bits_per_sample) {
+  const int block_align = num_channels * bits_per_sample / 8;
+  return LittleEndian(format_tag, 2) + LittleEndian(num_channels, 2) +
+         LittleEndian(sample_rate, 4) +
+         LittleEndian(sample_rate * block_align, 4) +
+         LittleEndian(block_align, 2) + LittleEndian(bits_per_sample, 2);
+}
+
+std::string Riff(const std::string& chunks) {
+  return "RIFF" + LittleEndian(4 + chunks.size(), 4) + "WAVE" + chunks;
+}
+
+}  // namespace
+
 TEST_CASE("Constructing ContentAudioSource works for LINEAR16",
           "[server][audio-source]") {
   const std::string wav_name = "test/only_speech_16000hz.wav";
@@ -110,3 +147,88 @@ TEST_CASE("ContentAudioSource can resample LINEAR16 data",
     }
   }
 }
+
+TEST_CASE("Multichannel LINEAR16 content can be split per channel",
+          "[server][audio-source]") {
+  const std::string mono = ReadWaveFile("test/only_speech_16000hz.wav");
+  // Left channel is the speech, right channel is silence
+  std::string stereo(2 * mono.size(), '\0');
+  for (std::size_t i = 0; i + 1 < mono.size(); i += 2) {
+    stereo[2 * i] = mono[i];
+    stereo[2 * i + 1] = mono[i + 1];
+  }
+
+  AudioSourceInfo info;
+  info.encoding = AudioEncoding::LINEAR16;
+  info.sample_rate_hertz = 16000;
+  ContentAudioSource mono_source{info, mono, 16000};
+
+  SECTION("SplitLinear16Channels deinterleaves and returns bytes consumed") {
+    std::vector<std::string> channels;
+    REQUIRE(SplitLinear16Channels(stereo + "x", 2, &channels) ==
+            stereo.size());
+    REQUIRE(channels.size() == 2);
+    REQUIRE(channels[0] == mono.substr(0, stereo.size() / 2));
+    REQUIRE(channels[1] == std::string(stereo.size() / 2, '\0'));
+  }
+
+  SECTION("Each channel gets its own audio source") {
+    info.num_channels = 2;
+    auto sources = CreateAudioSourcesPerChannel(info, stereo, 16000);
+    REQUIRE(sources.size() == 2);
+    REQUIRE(sources[0]->Full().ApproxEqual(mono_source.Full()));
+    REQUIRE(sources[1]->Full().Dim() == mono_source.Full().Dim());
+    REQUIRE(sources[1]->Full().Max() == 0.0f);
+  }
+
+  SECTION("ContentAudioSource mixes down multichannel content") {
+    info.num_channels = 2;
+    ContentAudioSource mixed_source{info, stereo, 16000};
+    Vector expected{mono_source.Full()};
+    expected.Scale(0.5f);
+    REQUIRE(mixed_source.Full().ApproxEqual(expected));
+  }
+}
+
+TEST_CASE("WAV headers are parsed chunk by chunk", "[server][audio-source]") {
+  const std::string samples(100, 'x');
+  WavHeader header;
+
+  SECTION("Canonical 44 byte header") {
+    const std::string wav = Riff(Chunk("fmt ", FmtContents(1, 1, 16000, 16)) +
+                                 Chunk("data", samples));
+    REQUIRE(ParseWavHeader(wav, &header));
+    REQUIRE(header.format_tag == kWavFormatPcm);
+    REQUIRE(header.num_channels == 1);
+    REQUIRE(header.sample_rate_hertz == 16000);
+    REQUIRE(header.bits_per_sample == 16);
+    REQUIRE(header.data_offset == 44);
+    REQUIRE(header.data_size == samples.size());
+  }
+
+  SECTION("Other chunks and WAVE_FORMAT_EXTENSIBLE") {
+    // cbSize, valid bits, channel mask and the PCM sub format GUID
+    const std::string extensible =
+        FmtContents(0xfffe, 2, 8000, 16) + LittleEndian(22, 2) +
+        LittleEndian(16, 2) + LittleEndian(3, 4) + LittleEndian(1, 2) +
+        std::string(14, '\0');
+    const std::string wav =
+        Riff(Chunk("LIST", "INFOISFT odd") + Chunk("fmt ", extensible) +
+             Chunk("fact", LittleEndian(50, 4)) + Chunk("data", samples));
+    REQUIRE(ParseWavHeader(wav, &header));
+    REQUIRE(header.format_tag == kWavFormatPcm);
+    REQUIRE(header.num_channels == 2);
+    REQUIRE(header.sample_rate_hertz == 8000);
+    REQUIRE(wav.substr(header.data_offset) == samples);
+  }
+
+  SECTION("Raw samples and malformed headers") {
+    REQUIRE_FALSE(ParseWavHeader(samples, &header));
+    REQUIRE_THROWS_AS(ParseWavHeader(Riff(Chunk("data", samples)), &header),
+                      std::invalid_argument);
+    REQUIRE_THROWS_AS(
+        ParseWavHeader(Riff(Chunk("fmt ", FmtContents(1, 1, 16000, 16))),
+                       &header),
+        std::invalid_argument);
+  }
+}
@@ -0,0 +1,472 @@
+// Copyright 2021 Tiro ehf.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <cassert>
+#include <catch2/catch.hpp>
+#include <cstdint>
+#include <cstdlib>
+#include <future>
+#include <map>
+#include <memory>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include "src/diarization.h"
+#include "src/plda-scoring-utils.h"
+
+using namespace tiro_speech;
+
+namespace {
+
+constexpr int kXvectorDim = 16;
+
+/**
+ * \p num_per_speaker random x-vectors for each of \p num_speakers speakers
+ */
+std::vector<kaldi::Matrix<double>> MakeSpeakerXvectors(int num_speakers,
+                                                       int num_per_speaker) {
+  std::vector<kaldi::Matrix<double>> speakers;
+  for (int speaker = 0; speaker < num_speakers; ++speaker) {
+    kaldi::Vector<double> center(kXvectorDim);
+    center.SetRandn();
+    center.Scale(3.0);
+    kaldi::Matrix<double> xvectors(num_per_speaker, kXvectorDim);
+    xvectors.SetRandn();
+    xvectors.AddVecToRows(1.0, center);
+    speakers.push_back(xvectors);
+  }
+  return speakers;
+}
+
+struct PldaScoringInputs {
+  kaldi::Plda plda;
+  kaldi::Matrix<float> whitening_matrix;
+  kaldi::Vector<float> centering_vector;
+  std::vector<kaldi::Vector<float>> xvectors;
+};
+
+void EstimateToyPlda(kaldi::Plda* plda) {
+  kaldi::PldaStats stats;
+  for (const auto& xvectors : MakeSpeakerXvectors(50, 10)) {
+    stats.AddSamples(1.0, xvectors);
+  }
+  stats.Sort();
+  kaldi::PldaEstimator estimator{stats};
+  estimator.Estimate(kaldi::PldaEstimationConfig{}, plda);
+}
+
+void MakePldaScoringInputs(int num_xvectors, PldaScoringInputs* inputs) {
+  EstimateToyPlda(&inputs->plda);
+  inputs->whitening_matrix.Resize(kXvectorDim, kXvectorDim + 1);
+  inputs->whitening_matrix.SetRandn();
+  inputs->centering_vector.Resize(kXvectorDim);
+  inputs->centering_vector.SetRandn();
+  inputs->xvectors.clear();
+  for (const auto& speaker : MakeSpeakerXvectors(4, num_xvectors / 4)) {
+    for (int i = 0; i < speaker.NumRows(); ++i) {
+      inputs->xvectors.emplace_back(speaker.Row(i));
+    }
+  }
+}
+
+/**
+ * X-vectors of \p num_speakers speakers taking turns in random order, with
+ * the true speaker of each in \p labels
+ */
+void MakeConversation(int num_speakers, int num_xvectors,
+                      std::vector<kaldi::Vector<float>>* xvectors,
+                      std::vector<int>* labels) {
+  const auto speakers =
+      MakeSpeakerXvectors(num_speakers, num_xvectors / num_speakers);
+  labels->clear();
+  for (int speaker = 0; speaker < num_speakers; ++speaker) {
+    labels->insert(labels->end(), num_xvectors / num_speakers, speaker);
+  }
+  std::mt19937 rng{42};
+  std::shuffle(labels->begin(), labels->end(), rng);
+  std::vector<int> next_row(num_speakers, 0);
+  xvectors->clear();
+  for (int speaker : *labels) {
+    xvectors->emplace_back(speakers[speaker].Row(next_row[speaker]++));
+  }
+}
+
+/**
+ * PLDA scorer without whitening or centering
+ */
+kaldi::PldaScorer MakeToyPldaScorer() {
+  kaldi::Plda plda;
+  EstimateToyPlda(&plda);
+  kaldi::Matrix<float> whitening_matrix(kXvectorDim, kXvectorDim);
+  whitening_matrix.SetUnit();
+  return kaldi::PldaScorer{kaldi::PldaConfig{}, plda, whitening_matrix,
+                           kaldi::Vector<float>(kXvectorDim)};
+}
+
+/**
+ * Whether \p spk_ids partitions the x-vectors the same way as \p labels
+ */
+bool SamePartition(const std::vector<std::int32_t>& spk_ids,
+                   const std::vector<int>& labels) {
+  std::map<std::int32_t, int> spk_to_label;
+  std::map<int, std::int32_t> label_to_spk;
+  for (std::size_t i = 0; i < labels.size(); ++i) {
+    if (spk_to_label.emplace(spk_ids[i], labels[i]).first->second !=
+            labels[i] ||
+        label_to_spk.emplace(labels[i], spk_ids[i]).first->second !=
+            spk_ids[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Random VAD decisions for \p hours of audio, alternating between 1 to 5
+ * seconds of speech and 0.1 to 2 seconds of silence
+ */
+kaldi::Vector<float> MakeVadDecisions(int hours) {
+  constexpr int kFramesPerHour = 100 * 60 * 60;
+  std::mt19937 rng{42};
+  std::uniform_int_distribution<int> speech_frames{100, 500};
+  std::uniform_int_distribution<int> silence_frames{10, 200};
+  kaldi::Vector<float> voiced(hours * kFramesPerHour);
+  for (int n = silence_frames(rng); n < voiced.Dim();) {
+    const int end = std::min(voiced.Dim(), n + speech_frames(rng));
+    for (; n < end; ++n) {
+      voiced(n) = 1.0f;
+    }
+    n += silence_frames(rng);
+  }
+  return voiced;
+}
+
+/**
+ * The original frame by frame implementation of SegmentByVad()
+ */
+std::vector<std::pair<std::int32_t, std::int32_t>> SegmentByVadReference(
+    const kaldi::Vector<float>& voiced, float silence_proportion) {
+  auto& A = voiced;
+  auto N = voiced.Dim();
+  kaldi::Vector<float> S(N);
+  kaldi::Vector<float> E(N + 1);
+
+  for (auto n = 0; n < N; ++n) {
+    if (A(n) == 0) {
+      if (n > 0 && !kaldi::ApproxEqual(A(n - 1), 0)) {
+        E(n) = 1;
+      }
+    } else {
+      if (n == 0 || kaldi::ApproxEqual(A(n - 1), 0)) {
+        S(n) = 1;
+      }
+    }
+  }
+  if (!kaldi::ApproxEqual(A(N - 1), 0)) {
+    E(N) = 1;
+  }
+
+  std::int32_t num_nonsil_frames = 0;
+  bool in_segment = false;
+
+  std::vector<std::int32_t> active_frames;
+  for (std::int32_t n = 0; n <= N; ++n) {
+    if (n < N && kaldi::ApproxEqual(S(n), 1)) {
+      in_segment = true;
+      active_frames.push_back(n);
+    }
+    if (kaldi::ApproxEqual(E(n), 1)) {
+      in_segment = false;
+    }
+    if (n < N) {
+      if (in_segment) {
+        num_nonsil_frames++;
+      }
+    }
+  }
+
+  std::int32_t target_segment_frames =
+      num_nonsil_frames / (1.0 - silence_proportion);
+  std::int32_t num_segment_frames = num_nonsil_frames;
+  while (num_segment_frames < target_segment_frames) {
+    bool changed = false;
+    for (std::size_t i = 0; i < active_frames.size(); ++i) {
+      auto n = active_frames[i];
+      if (kaldi::ApproxEqual(E(n), 1) && n < N &&
+          !kaldi::ApproxEqual(S(n), 1)) {
+        E(n) = 0;
+        E(n + 1) = 1;
+        active_frames[i] = n + 1;
+        num_segment_frames++;
+        changed = true;
+      }
+      if (n < N && kaldi::ApproxEqual(S(n), 1) && n > 0 &&
+          !kaldi::ApproxEqual(E(n), 1)) {
+        S(n) = 0;
+        S(n - 1) = 1;
+        active_frames[i] = n - 1;
+        num_segment_frames++;
+        changed = true;
+      }
+      if (num_segment_frames == target_segment_frames) {
+        break;
+      }
+    }
+    if (!changed) {
+      break;
+    }
+  }
+
+  std::vector<std::pair<std::int32_t, std::int32_t>> voiced_segments;
+  for (std::int32_t n = 0; n < N; ++n) {
+    assert(!(E(n) == 1 && S(n) != 1));
+    if (S(n) == 1) {
+      std::int32_t p;
+      for (p = n + 1; p < N && !kaldi::ApproxEqual(E(p), 1); ++p) {
+        assert(S(p) == 0);
+      }
+      assert(E(p) == 1);
+      voiced_segments.emplace_back(n, p);
+      if (p < N && kaldi::ApproxEqual(S(p), 1)) {
+        n = p - 1;
+      } else {
+        n = p;
+      }
+    }
+  }
+  return voiced_segments;
+}
+
+}  // namespace
+
+TEST_CASE("PLDA score matrix matches pairwise scoring", "[diarization]") {
+  const float target_energy = GENERATE(0.9f, 1.0f);
+  PldaScoringInputs inputs;
+  MakePldaScoringInputs(20, &inputs);
+  const kaldi::PldaConfig plda_config;
+
+  const kaldi::Matrix<float> expected = kaldi::ScorePlda(
+      plda_config, kaldi::Plda{inputs.plda}, inputs.whitening_matrix,
+      inputs.centering_vector, inputs.xvectors, target_energy);
+  const kaldi::PldaScorer scorer{plda_config, inputs.plda,
+                                 inputs.whitening_matrix,
+                                 inputs.centering_vector, target_energy};
+  const kaldi::Matrix<float> scores = scorer.Score(inputs.xvectors);
+  REQUIRE(scores.NumRows() == expected.NumRows());
+  REQUIRE(scores.NumCols() == expected.NumCols());
+  REQUIRE(scores.ApproxEqual(expected, 1e-4));
+}
+
+TEST_CASE("PLDA scoring", "[diarization][.benchmark]") {
+  PldaScoringInputs inputs;
+  MakePldaScoringInputs(500, &inputs);
+  const kaldi::PldaConfig plda_config;
+  const kaldi::PldaScorer scorer{plda_config, inputs.plda,
+                                 inputs.whitening_matrix,
+                                 inputs.centering_vector};
+
+  BENCHMARK("Pairwise") {
+    return kaldi::ScorePlda(plda_config, kaldi::Plda{inputs.plda},
+                            inputs.whitening_matrix, inputs.centering_vector,
+                            inputs.xvectors);
+  };
+  BENCHMARK("Score matrix") { return scorer.Score(inputs.xvectors); };
+}
+
+namespace {
+
+/**
+ * X-vector model from TIRO_SPEECH_XVECTOR_NNET and
+ * TIRO_SPEECH_XVECTOR_EXTRACT_CONFIG, or nullptr if they aren't set
+ */
+std::unique_ptr<XvectorNnet> ReadTestXvectorNnet() {
+  const char* nnet_filename = std::getenv("TIRO_SPEECH_XVECTOR_NNET");
+  const char* config_filename =
+      std::getenv("TIRO_SPEECH_XVECTOR_EXTRACT_CONFIG");
+  if (nnet_filename == nullptr || config_filename == nullptr) {
+    return nullptr;
+  }
+  XvectorNnetOptions opts;
+  opts.nnet_rxfilename = nnet_filename;
+  opts.extract_config_rxfilename = config_filename;
+  opts.chunk_size = 150;
+  return std::make_unique<XvectorNnet>(opts);
+}
+
+/// Segments of 0.5 to 4 seconds, most of them split into several chunks
+std::vector<kaldi::Matrix<float>> MakeRandomSegments(const XvectorNnet& nnet) {
+  std::mt19937 rng{42};
+  std::uniform_int_distribution<int> num_frames{50, 400};
+  std::vector<kaldi::Matrix<float>> segments;
+  for (int i = 0; i < 32; ++i) {
+    kaldi::Matrix<float> segment(num_frames(rng), nnet.InputDim());
+    segment.SetRandn();
+    segments.push_back(segment);
+  }
+  return segments;
+}
+
+std::vector<const kaldi::MatrixBase<float>*> SegmentPtrs(
+    const std::vector<kaldi::Matrix<float>>& segments) {
+  std::vector<const kaldi::MatrixBase<float>*> segment_ptrs;
+  for (const auto& segment : segments) {
+    segment_ptrs.push_back(&segment);
+  }
+  return segment_ptrs;
+}
+
+std::vector<kaldi::Vector<float>> ComputeOneAtATime(
+    const XvectorNnet& nnet,
+    const std::vector<kaldi::Matrix<float>>& segments) {
+  std::vector<kaldi::Vector<float>> xvectors;
+  for (const auto& segment : segments) {
+    xvectors.push_back(nnet.Compute(segment));
+  }
+  return xvectors;
+}
+
+/// Run ComputeBatch() on \p segment_ptrs on \p num_threads threads at once
+std::vector<std::vector<kaldi::Vector<float>>> ComputeBatchConcurrently(
+    const XvectorNnet& nnet,
+    const std::vector<const kaldi::MatrixBase<float>*>& segment_ptrs,
+    int num_threads) {
+  std::vector<std::future<std::vector<kaldi::Vector<float>>>> results;
+  for (int i = 0; i < num_threads; ++i) {
+    results.push_back(std::async(std::launch::async, [&]() {
+      return nnet.ComputeBatch(segment_ptrs);
+    }));
+  }
+  std::vector<std::vector<kaldi::Vector<float>>> xvectors;
+  for (auto& result : results) {
+    xvectors.push_back(result.get());
+  }
+  return xvectors;
+}
+
+}  // namespace
+
+// Set TIRO_SPEECH_XVECTOR_NNET and TIRO_SPEECH_XVECTOR_EXTRACT_CONFIG to an
+// x-vector model to run this
+TEST_CASE("Batched x-vector extraction matches unbatched", "[diarization]") {
+  const std::unique_ptr<XvectorNnet> nnet = ReadTestXvectorNnet();
+  if (nnet == nullptr) {
+    WARN("No x-vector model set, skipping");
+    return;
+  }
+  const std::vector<kaldi::Matrix<float>> segments = MakeRandomSegments(*nnet);
+  const std::vector<const kaldi::MatrixBase<float>*> segment_ptrs =
+      SegmentPtrs(segments);
+
+  const std::vector<kaldi::Vector<float>> expected =
+      ComputeOneAtATime(*nnet, segments);
+  const std::vector<kaldi::Vector<float>> batched =
+      nnet->ComputeBatch(segment_ptrs);
+  REQUIRE(batched.size() == expected.size());
+  for (std::size_t i = 0; i < expected.size(); ++i) {
+    REQUIRE(batched[i].ApproxEqual(expected[i], 1e-3));
+  }
+  for (const auto& xvectors :
+       ComputeBatchConcurrently(*nnet, segment_ptrs, 4)) {
+    REQUIRE(xvectors.size() == expected.size());
+    for (std::size_t i = 0; i < expected.size(); ++i) {
+      REQUIRE(xvectors[i].ApproxEqual(expected[i], 1e-3));
+    }
+  }
+}
+
+// Set TIRO_SPEECH_XVECTOR_NNET and TIRO_SPEECH_XVECTOR_EXTRACT_CONFIG to an
+// x-vector model to run this
+TEST_CASE("Batched x-vector extraction", "[diarization][.benchmark]") {
+  const std::unique_ptr<XvectorNnet> nnet = ReadTestXvectorNnet();
+  if (nnet == nullptr) {
+    WARN("No x-vector model set, skipping");
+    return;
+  }
+  const std::vector<kaldi::Matrix<float>> segments = MakeRandomSegments(*nnet);
+  const std::vector<const kaldi::MatrixBase<float>*> segment_ptrs =
+      SegmentPtrs(segments);
+
+  BENCHMARK("One segment at a time") {
+    return ComputeOneAtATime(*nnet, segments);
+  };
+  BENCHMARK("Batched") { return nnet->ComputeBatch(segment_ptrs); };
+  BENCHMARK("Batched, 4 threads") {
+    return ComputeBatchConcurrently(*nnet, segment_ptrs, 4);
+  };
+}
+
+TEST_CASE("SegmentByVad pads segments like the frame by frame version",
+          "[diarization]") {
+  std::mt19937 rng{42};
+  std::bernoulli_distribution voiced_dist{0.6};
+  for (int i = 0; i < 200; ++i) {
+    kaldi::Vector<float> voiced(1 + i % 80);
+    for (int n = 0; n < voiced.Dim(); ++n) {
+      voiced(n) = voiced_dist(rng) ? 1.0f : 0.0f;
+    }
+    if (voiced.Sum() == 0) {
+      continue;
+    }
+    for (float silence_proportion : {0.0f, 0.2f, 0.5f}) {
+      REQUIRE(SegmentByVad(voiced, silence_proportion) ==
+              SegmentByVadReference(voiced, silence_proportion));
+    }
+  }
+}
+
+TEST_CASE("Windowed clustering finds the same speakers", "[diarization]") {
+  const kaldi::PldaScorer scorer = MakeToyPldaScorer();
+  std::vector<kaldi::Vector<float>> xvectors;
+  std::vector<int> labels;
+  MakeConversation(3, 120, &xvectors, &labels);
+
+  REQUIRE(SamePartition(ClusterXvectors(scorer, xvectors, 3), labels));
+
+  XvectorClusteringOptions opts;
+  opts.window_segments = 25;
+  opts.window_clusters = 6;
+  REQUIRE(SamePartition(ClusterXvectors(scorer, xvectors, 3, opts), labels));
+}
+
+TEST_CASE("Diarization of long recordings", "[diarization][.benchmark]") {
+  const kaldi::PldaScorer scorer = MakeToyPldaScorer();
+  XvectorClusteringOptions windowed_opts;
+  windowed_opts.window_segments = 500;
+
+  for (int hours : {1, 4, 8}) {
+    const kaldi::Vector<float> voiced = MakeVadDecisions(hours);
+    BENCHMARK(fmt::format("SegmentByVad, {} h", hours)) {
+      return SegmentByVad(voiced);
+    };
+
+    // About 1000 segments per hour
+    std::vector<kaldi::Vector<float>> xvectors;
+    std::vector<int> labels;
+    MakeConversation(8, 1000 * hours, &xvectors, &labels);
+    if (hours == 1) {
+      BENCHMARK("SegmentByVad, frame by frame, 1 h") {
+        return SegmentByVadReference(voiced, 0.2f);
+      };
+      BENCHMARK("Dense clustering, 1 h") {
+        return ClusterXvectors(scorer, xvectors, 8);
+      };
+    }
+    BENCHMARK(fmt::format("Windowed clustering, {} h", hours)) {
+      return ClusterXvectors(scorer, xvectors, 8, windowed_opts);
+    };
+  }
+}
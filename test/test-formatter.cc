@@ -251,3 +251,169 @@ TEST_CASE("Formatter can actually format stuff", "[fst][itn]") {
 
   REQUIRE_THAT(formatted_osfrv, Catch::Matchers::Equals(expected_osfrv));
 }
+
+TEST_CASE("Formatter passes through words it can't rewrite", "[fst][itn]") {
+  using namespace tiro_speech;
+  using namespace tiro_speech::itn;
+
+  FormatterConfig opts;
+  opts.rewrite_fst_filename = "ITN.fst";
+  Formatter formatter{opts};
+
+  const std::vector<AlignedWord> words{{0ms, 180ms, "hún"},
+                                       {180ms, 149ms, "hafi"},
+                                       {329ms, 149ms, "ekki"},
+                                       {478ms, 330ms, "fengið"}};
+  REQUIRE_FALSE(formatter.MayRewrite(words));
+  REQUIRE_THAT(formatter.FormatWords(words), Catch::Matchers::Equals(words));
+  REQUIRE_FALSE(formatter.MayRewrite({}));
+
+  std::vector<AlignedWord> with_number = words;
+  with_number.push_back({808ms, 240ms, "fimmtíu"});
+  REQUIRE(formatter.MayRewrite(with_number));
+  const std::vector<AlignedWord> formatted = formatter.FormatWords(with_number);
+  REQUIRE(formatted.size() == with_number.size());
+  REQUIRE(formatted.back().word_symbol == "50");
+}
+
+TEST_CASE("Formatter formats everything if its trigger automaton is too big",
+          "[fst][itn]") {
+  using namespace tiro_speech;
+  using namespace tiro_speech::itn;
+
+  FormatterConfig opts;
+  opts.rewrite_fst_filename = "ITN.fst";
+  opts.trigger_max_states = 1;
+  Formatter formatter{opts};
+
+  const std::vector<AlignedWord> words{{0ms, 180ms, "hún"},
+                                       {180ms, 149ms, "hafi"}};
+  REQUIRE(formatter.MayRewrite(words));
+  REQUIRE_THAT(formatter.FormatWords(words), Catch::Matchers::Equals(words));
+}
+
+TEST_CASE("Timing read off the shortest path matches timing by composition",
+          "[fst][itn]") {
+  using namespace tiro_speech;
+  using namespace tiro_speech::itn;
+  using Arc = fst::StdArc;
+
+  std::unique_ptr<fst::StdFst> rewrite_fst{fst::StdFst::Read("ITN.fst")};
+  REQUIRE(rewrite_fst != nullptr);
+
+  const std::vector<std::vector<AlignedWord>> utterances{
+      {{1180780ms, 390ms, "núll"},
+       {1181170ms, 240ms, "fimmtíu"},
+       {1181409ms, 299ms, "milljónir"},
+       {1181709ms, 149ms, "króna"},
+       {1181890ms, 180ms, "á"},
+       {1182069ms, 539ms, "ári,"}},
+      {{1178590ms, 1140ms, "og"},
+       {1180780ms, 390ms, "svo"},
+       {1181170ms, 240ms, "framvegis"}},
+      {{0ms, 300ms, "klukkan"},
+       {300ms, 200ms, "fimm"},
+       {500ms, 250ms, "tuttugu"},
+       {750ms, 100ms, "til"},
+       {850ms, 200ms, "sex"}},
+      {}};
+
+  for (const auto& words : utterances) {
+    CAPTURE(words.size());
+    auto words_byte_fst = ConvertToTropicalByteFst(words);
+    fst::ArcSort(&words_byte_fst, fst::OLabelCompare<Arc>{});
+    fst::VectorFst<Arc> candidates_fst{};
+    fst::Compose(words_byte_fst, *rewrite_fst, &candidates_fst);
+    fst::VectorFst<Arc> shortest_fst{};
+    fst::ShortestPath(candidates_fst, &shortest_fst);
+
+    // The double composition FormatWords() used to do
+    fst::TimingFst shortest_timing_fst{};
+    fst::ArcMap(shortest_fst, &shortest_timing_fst,
+                fst::WeightConvertMapper<Arc, fst::TimingArc>{});
+    fst::TimingFst timing_symbol_fst = ConvertToByteFst(words);
+    fst::ArcSort(&timing_symbol_fst, fst::OLabelCompare<fst::TimingArc>{});
+    fst::TimingFst timing_byte_fst{};
+    fst::Compose(timing_symbol_fst, shortest_timing_fst, &timing_byte_fst);
+
+    REQUIRE_THAT(Convert(shortest_fst, words),
+                 Catch::Matchers::Equals(Convert(timing_byte_fst)));
+  }
+}
+
+TEST_CASE("IncrementalFormatter formats a growing hypothesis", "[fst][itn]") {
+  using namespace tiro_speech;
+  using namespace tiro_speech::itn;
+
+  FormatterConfig opts;
+  opts.rewrite_fst_filename = "ITN.fst";
+  Formatter formatter{opts};
+  IncrementalFormatter incremental_formatter{formatter,
+                                             opts.incremental_context_words};
+
+  const std::vector<std::string> symbols{
+      "hún",   "hafi",      "ekki",  "fengið", "eina", "einustu",
+      "krónu", "göngudeildarþjónusta", "núll", "fimmtíu", "milljónir",
+      "króna", "á",         "ári",   "og",     "svo",  "framvegis",
+      "en",    "hún",       "hafi",  "ekki",   "fengið"};
+  std::vector<AlignedWord> words;
+  for (std::size_t idx = 0; idx < symbols.size(); ++idx) {
+    const std::chrono::milliseconds start_time{300 * idx};
+    words.push_back({start_time, 250ms, symbols[idx]});
+
+    CAPTURE(words.size());
+    REQUIRE_THAT(incremental_formatter.FormatWords(words),
+                 Catch::Matchers::Equals(formatter.FormatWords(words)));
+  }
+
+  SECTION("A changed word is reformatted") {
+    words[10].word_symbol = "þúsund";
+    REQUIRE_THAT(incremental_formatter.FormatWords(words),
+                 Catch::Matchers::Equals(formatter.FormatWords(words)));
+  }
+
+  SECTION("Reset starts over") {
+    incremental_formatter.Reset();
+    const std::vector<AlignedWord> other{{0ms, 250ms, "og"},
+                                         {300ms, 250ms, "svo"},
+                                         {600ms, 250ms, "framvegis"}};
+    REQUIRE_THAT(incremental_formatter.FormatWords(other),
+                 Catch::Matchers::Equals(formatter.FormatWords(other)));
+  }
+}
+
+TEST_CASE("Formatter formats alternatives like single hypotheses",
+          "[fst][itn]") {
+  using namespace tiro_speech;
+  using namespace tiro_speech::itn;
+
+  FormatterConfig opts;
+  opts.rewrite_fst_filename = "ITN.fst";
+  Formatter formatter{opts};
+
+  const std::vector<std::vector<std::string>> alternatives{
+      {"núll", "fimmtíu", "milljónir", "króna", "á", "ári"},
+      {"núll", "fimmtíu", "milljónir", "krónur", "á", "ári"},
+      {"hún", "hafi", "ekki", "fengið"},
+      {"og", "svo", "framvegis"},
+      {"og", "svo", "fram"},
+      {"núll", "fimmtíu", "milljónir", "króna", "á", "ári"},
+      {}};
+
+  const std::vector<std::string> formatted =
+      formatter.FormatAlternatives(alternatives);
+  REQUIRE(formatted.size() == alternatives.size());
+  for (std::size_t idx = 0; idx < alternatives.size(); ++idx) {
+    std::vector<AlignedWord> words;
+    for (const auto& word : alternatives[idx]) {
+      words.push_back({0ms, 0ms, word});
+    }
+    std::string expected;
+    for (const auto& word : formatter.FormatWords(words)) {
+      expected += (expected.empty() ? "" : " ") + word.word_symbol;
+    }
+    CAPTURE(idx);
+    REQUIRE(formatted[idx] == expected);
+  }
+  REQUIRE(formatted[3] == "o.s.frv.");
+}
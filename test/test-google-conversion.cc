@@ -0,0 +1,99 @@
+// Copyright 2021 Tiro ehf.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <catch2/catch.hpp>
+#include <string>
+
+#include "src/api/google-conversion.h"
+
+using namespace tiro_speech;
+
+namespace {
+
+google::cloud::speech::v1::RecognizeRequest MakeGoogleRequest(
+    std::size_t content_size) {
+  google::cloud::speech::v1::RecognizeRequest request;
+  auto* config = request.mutable_config();
+  config->set_encoding(google::cloud::speech::v1::RecognitionConfig::LINEAR16);
+  config->set_sample_rate_hertz(16000);
+  config->set_language_code("is-IS");
+  config->set_max_alternatives(3);
+  config->set_enable_word_time_offsets(true);
+  config->set_enable_automatic_punctuation(true);
+  config->mutable_diarization_config()->set_enable_speaker_diarization(true);
+  config->mutable_diarization_config()->set_min_speaker_count(3);
+  request.mutable_audio()->set_content(std::string(content_size, '\x7f'));
+  return request;
+}
+
+}  // namespace
+
+TEST_CASE("Google RecognizeRequests are converted without copying audio",
+          "[api][google]") {
+  auto request = MakeGoogleRequest(32000);
+  const char* content_data = request.audio().content().data();
+
+  tiro::speech::v1alpha::RecognizeRequest converted;
+  ConvertRecognizeRequest(&request, &converted);
+
+  const auto& config = converted.config();
+  REQUIRE(config.encoding() ==
+          tiro::speech::v1alpha::RecognitionConfig::LINEAR16);
+  REQUIRE(config.sample_rate_hertz() == 16000);
+  REQUIRE(config.language_code() == "is-IS");
+  REQUIRE(config.max_alternatives() == 3);
+  REQUIRE(config.enable_word_time_offsets());
+  REQUIRE(config.enable_automatic_punctuation());
+  REQUIRE(config.diarization_config().enable_speaker_diarization());
+  REQUIRE(config.diarization_config().min_speaker_count() == 3);
+
+  REQUIRE(converted.audio().content().size() == 32000);
+  REQUIRE(converted.audio().content().data() == content_data);
+  REQUIRE(request.audio().content().empty());
+
+  SECTION("URIs are converted as well") {
+    google::cloud::speech::v1::RecognizeRequest uri_request;
+    uri_request.mutable_audio()->set_uri("https://example.com/audio.mp3");
+    tiro::speech::v1alpha::RecognizeRequest converted_uri;
+    ConvertRecognizeRequest(&uri_request, &converted_uri);
+    REQUIRE(converted_uri.audio().uri() == "https://example.com/audio.mp3");
+  }
+}
+
+TEST_CASE("Benchmark Google RecognizeRequest conversion",
+          "[api][google][.benchmark]") {
+  // 16 kHz LINEAR16, i.e. 32000 bytes per second
+  for (const auto& [name, n_seconds] :
+       {std::pair{"30 s", 30}, std::pair{"5 min", 300},
+        std::pair{"30 min", 1800}}) {
+    auto request = MakeGoogleRequest(32000 * n_seconds);
+
+    BENCHMARK(std::string{"Serialize and parse "} + name) {
+      tiro::speech::v1alpha::RecognizeRequest converted;
+      converted.ParseFromString(request.SerializeAsString());
+      return converted.audio().content().size();
+    };
+
+    BENCHMARK(std::string{"ConvertRecognizeRequest "} + name) {
+      google::protobuf::Arena arena;
+      auto* converted = google::protobuf::Arena::CreateMessage<
+          tiro::speech::v1alpha::RecognizeRequest>(&arena);
+      ConvertRecognizeRequest(&request, converted);
+      const auto size = converted->audio().content().size();
+      // Put the content back for the next run
+      request.mutable_audio()->mutable_content()->swap(
+          *converted->mutable_audio()->mutable_content());
+      return size;
+    };
+  }
+}
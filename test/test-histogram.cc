@@ -0,0 +1,57 @@
+// Copyright 2021 Tiro ehf.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <catch2/catch.hpp>
+#include <cstdint>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "src/histogram.h"
+
+using namespace tiro_speech;
+
+TEST_CASE("Histogram counts values in cumulative buckets", "[histogram]") {
+  Histogram histogram{{1.0, 5.0, 10.0}};
+  for (double value : {0.5, 1.0, 3.0, 7.0, 20.0}) {
+    histogram.Observe(value);
+  }
+
+  const Histogram::Snapshot snapshot = histogram.Get();
+  REQUIRE(snapshot.upper_bounds == std::vector<double>{1.0, 5.0, 10.0});
+  REQUIRE(snapshot.cumulative_counts == std::vector<std::uint64_t>{2, 3, 4, 5});
+  REQUIRE(snapshot.count == 5);
+  REQUIRE(snapshot.sum == Approx(31.5));
+
+  REQUIRE_THROWS_AS((Histogram{{2.0, 1.0}}), std::invalid_argument);
+  REQUIRE_THROWS_AS(
+      Histogram{std::vector<double>(Histogram::kMaxBuckets + 1, 1.0)},
+      std::invalid_argument);
+}
+
+TEST_CASE("Histogram can be observed concurrently", "[histogram]") {
+  Histogram histogram{{1.0}};
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; ++i) {
+    threads.emplace_back([&histogram] {
+      for (int j = 0; j < 1000; ++j) {
+        histogram.Observe(j % 2);
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  REQUIRE(histogram.Get().count == 4000);
+  REQUIRE(histogram.Get().cumulative_counts.front() == 4000);
+}
@@ -0,0 +1,89 @@
+// Copyright 2021 Tiro ehf.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <catch2/catch.hpp>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "src/histogram.h"
+#include "src/metrics.h"
+
+using namespace tiro_speech;
+
+TEST_CASE("Counters sum the values added from all threads", "[metrics]") {
+  Counter counter;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 8; ++i) {
+    threads.emplace_back([&counter] {
+      for (int j = 0; j < 1000; ++j) {
+        counter.Add(0.5);
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  REQUIRE(counter.Get() == Approx(4000.0));
+}
+
+TEST_CASE("Gauges go up and down", "[metrics]") {
+  Gauge gauge;
+  gauge.Set(3.0);
+  {
+    ScopedGaugeIncrement increment{&gauge};
+    REQUIRE(gauge.Get() == Approx(4.0));
+  }
+  REQUIRE(gauge.Get() == Approx(3.0));
+}
+
+TEST_CASE("Metrics are collected in the Prometheus text format",
+          "[metrics]") {
+  Counter requests;
+  requests.Add(2.0);
+  Histogram latency{{0.1, 1.0}};
+  latency.Observe(0.05);
+  latency.Observe(0.5);
+  latency.Observe(5.0);
+
+  MetricsRegistry registry;
+  registry.Register("requests_total", "Number of requests.", requests,
+                    {{"method", "Recognize"}});
+  registry.Register("latency_seconds", "Request latency.", latency,
+                    {{"model", "a\"b"}});
+  registry.Register("temperature", "Current temperature.", MetricType::kGauge,
+                    [] { return 1.5; });
+
+  const std::string collected = registry.Collect();
+  REQUIRE(collected.find("# HELP requests_total Number of requests.\n"
+                         "# TYPE requests_total counter\n"
+                         "requests_total{method=\"Recognize\"} 2\n") !=
+          std::string::npos);
+  const std::string labels = R"(model="a\"b")";
+  REQUIRE(collected.find(
+              "# TYPE latency_seconds histogram\n"
+              "latency_seconds_bucket{" + labels + ",le=\"0.1\"} 1\n"
+              "latency_seconds_bucket{" + labels + ",le=\"1\"} 2\n"
+              "latency_seconds_bucket{" + labels + ",le=\"+Inf\"} 3\n"
+              "latency_seconds_sum{" + labels + "} 5.55\n"
+              "latency_seconds_count{" + labels + "} 3\n") !=
+          std::string::npos);
+  REQUIRE(collected.find("temperature 1.5\n") != std::string::npos);
+
+  SECTION("A metric name can't be reused for another type") {
+    Gauge gauge;
+    REQUIRE_THROWS_AS(registry.Register("requests_total", "", gauge),
+                      std::invalid_argument);
+  }
+}
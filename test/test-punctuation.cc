@@ -11,9 +11,14 @@
 // WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
 // See the License for the specific language governing permissions and
 // limitations under the License.
+#include <fst/symbol-table.h>
+
 #include <catch2/catch.hpp>
+#include <cstdint>
 #include <cstdlib>
 #include <filesystem>
+#include <future>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -280,3 +285,184 @@ TEST_CASE("ElectraPuntuator can handle input with punctuation tokens",
 
   REQUIRE_THAT(punctuated_words, Catch::Equals(expected_words));
 }
+
+TEST_CASE("ElectraPunctuator batches concurrent requests", "[itn]") {
+  using namespace tiro_speech;
+  using namespace tiro_speech::itn;
+
+  ElectraPunctuatorConfig opts{};
+  opts.pytorch_jit_model_filename =
+      std::filesystem::path{std::getenv("TEST_SRCDIR")} /
+      "clarin_electra_punctuation_model_traced/file/traced_electra.pt";
+  opts.word_piece_opts.vocab_filename =
+      std::filesystem::path{std::getenv("TEST_SRCDIR")} /
+      "clarin_electra_punctuation_vocab/file/vocab.txt";
+  opts.max_batch_delay_us = 200000;
+
+  ElectraPunctuator punctuator{opts};
+
+  const std::vector<std::vector<std::string>> inputs{
+      {"þú", "ert", "mitt", "sólskin", "mitt", "eina", "sólskin", "þú",
+       "gleður", "mig", "þegar", "heimilin", "gránar"},
+      {"eftirlit", "í", "gangi", "ég", "segi", "það", "er", "lögregluliðin"},
+      {"hann", "bætir", "við", "ég", "inn", "á", "covid", "síðunni"},
+      {"hann", "bætir", "við", "ég", "inn", "á", "covid", "síðunni"}};
+
+  std::vector<std::vector<std::string>> expected;
+  for (const auto& words : inputs) {
+    expected.push_back(punctuator.Punctuate(words, /* capitalize */ true));
+  }
+  const std::uint64_t num_batches_before =
+      punctuator.BatchSizeHistogram().Get().count;
+
+  std::vector<std::future<std::vector<std::string>>> results;
+  for (const auto& words : inputs) {
+    results.push_back(std::async(std::launch::async, [&] {
+      return punctuator.Punctuate(words, /* capitalize */ true);
+    }));
+  }
+  for (std::size_t idx = 0; idx < inputs.size(); ++idx) {
+    REQUIRE_THAT(results[idx].get(), Catch::Equals(expected[idx]));
+  }
+
+  // The two sequences of the same length share a forward pass
+  const std::uint64_t num_batches =
+      punctuator.BatchSizeHistogram().Get().count - num_batches_before;
+  REQUIRE(num_batches < inputs.size());
+  REQUIRE(punctuator.QueueWaitHistogram().Get().count == 2 * inputs.size());
+}
+
+TEST_CASE("ElectraPunctuator punctuates long inputs in windows", "[itn]") {
+  using namespace tiro_speech;
+  using namespace tiro_speech::itn;
+
+  ElectraPunctuatorConfig opts{};
+  opts.pytorch_jit_model_filename =
+      std::filesystem::path{std::getenv("TEST_SRCDIR")} /
+      "clarin_electra_punctuation_model_traced/file/traced_electra.pt";
+  opts.word_piece_opts.vocab_filename =
+      std::filesystem::path{std::getenv("TEST_SRCDIR")} /
+      "clarin_electra_punctuation_vocab/file/vocab.txt";
+
+  const std::vector<std::string> sentence{
+      "þú", "ert",    "mitt", "sólskin", "mitt",     "eina",  "sólskin",
+      "þú", "gleður", "mig",  "þegar",   "heimilin", "gránar"};
+
+  SECTION("Inputs that fit in one window are unchanged") {
+    ElectraPunctuator punctuator{opts};
+    const auto expected = punctuator.Punctuate(sentence);
+    opts.max_sequence_length = 64;
+    ElectraPunctuator windowed_punctuator{opts};
+    REQUIRE_THAT(windowed_punctuator.Punctuate(sentence),
+                 Catch::Equals(expected));
+  }
+
+  SECTION("Every word of a long input gets punctuated once") {
+    std::vector<std::string> words;
+    for (int i = 0; i < 60; ++i) {
+      words.insert(words.end(), sentence.begin(), sentence.end());
+    }
+    for (int max_sequence_length : {16, 512}) {
+      opts.max_sequence_length = max_sequence_length;
+      opts.window_overlap = max_sequence_length / 4;
+      ElectraPunctuator punctuator{opts};
+      const std::vector<std::string> punctuated = punctuator.Punctuate(words);
+      REQUIRE(punctuated.size() == words.size());
+      for (std::size_t idx = 0; idx < words.size(); ++idx) {
+        CAPTURE(idx);
+        REQUIRE(punctuated[idx].rfind(words[idx], 0) == 0);
+        REQUIRE(punctuated[idx].size() <= words[idx].size() + 1);
+      }
+    }
+  }
+}
+
+TEST_CASE("ElectraPunctuator uses pre-tokenized word symbols", "[itn]") {
+  using namespace tiro_speech;
+  using namespace tiro_speech::itn;
+
+  ElectraPunctuatorConfig opts{};
+  opts.pytorch_jit_model_filename =
+      std::filesystem::path{std::getenv("TEST_SRCDIR")} /
+      "clarin_electra_punctuation_model_traced/file/traced_electra.pt";
+  opts.word_piece_opts.vocab_filename =
+      std::filesystem::path{std::getenv("TEST_SRCDIR")} /
+      "clarin_electra_punctuation_vocab/file/vocab.txt";
+
+  const std::vector<std::string> sentence{
+      "þú", "ert",    "mitt", "sólskin", "mitt",     "eina",  "sólskin",
+      "þú", "gleður", "mig",  "þegar",   "heimilin", "gránar"};
+  auto word_syms = std::make_shared<fst::SymbolTable>();
+  word_syms->AddSymbol("<eps>");
+  for (const std::string& word : sentence) {
+    word_syms->AddSymbol(word);
+  }
+
+  ElectraPunctuator punctuator{opts};
+  ElectraPunctuator pretokenized_punctuator{opts, word_syms};
+
+  // "2018–20" is not a word symbol, so it is tokenized on the fly
+  std::vector<std::string> words = sentence;
+  words.insert(words.begin() + 7, "2018–20");
+  REQUIRE_THAT(pretokenized_punctuator.Punctuate(sentence),
+               Catch::Equals(punctuator.Punctuate(sentence)));
+  REQUIRE_THAT(pretokenized_punctuator.Punctuate(words, /* capitalize */ true),
+               Catch::Equals(punctuator.Punctuate(words, true)));
+
+  // Word ids, e.g. from a lattice, skip the symbol table lookup
+  std::vector<std::int64_t> word_ids;
+  for (const std::string& word : words) {
+    word_ids.push_back(word_syms->Find(word));
+  }
+  REQUIRE(word_ids[7] < 0);
+  REQUIRE_THAT(pretokenized_punctuator.Punctuate(words, true, word_ids),
+               Catch::Equals(punctuator.Punctuate(words, true)));
+}
+
+TEST_CASE("ElectraPunctuator sees a bounded left context", "[itn]") {
+  using namespace tiro_speech;
+  using namespace tiro_speech::itn;
+
+  ElectraPunctuatorConfig opts{};
+  opts.pytorch_jit_model_filename =
+      std::filesystem::path{std::getenv("TEST_SRCDIR")} /
+      "clarin_electra_punctuation_model_traced/file/traced_electra.pt";
+  opts.word_piece_opts.vocab_filename =
+      std::filesystem::path{std::getenv("TEST_SRCDIR")} /
+      "clarin_electra_punctuation_vocab/file/vocab.txt";
+  opts.max_left_context_pieces = 8;
+
+  ElectraPunctuator punctuator{opts};
+
+  const std::vector<std::string> first{"þú", "ert", "mitt", "sólskin", "mitt",
+                                       "eina", "sólskin"};
+  const std::vector<std::string> second{"þú", "gleður", "mig", "þegar",
+                                        "heimilin", "gránar"};
+
+  std::vector<int> context_pieces;
+  const std::vector<std::string> punctuated_first =
+      punctuator.PunctuateWithContext(first, {}, {}, &context_pieces,
+                                      /* capitalize */ true);
+  REQUIRE_THAT(punctuated_first,
+               Catch::Equals(punctuator.Punctuate(first, true)));
+  REQUIRE_FALSE(context_pieces.empty());
+  REQUIRE(context_pieces.size() <= 8);
+
+  std::vector<int> next_context_pieces;
+  const std::vector<std::string> punctuated_second =
+      punctuator.PunctuateWithContext(second, punctuated_first, context_pieces,
+                                      &next_context_pieces, true);
+  REQUIRE(punctuated_second.size() == second.size());
+  for (std::size_t idx = 0; idx < second.size(); ++idx) {
+    CAPTURE(idx);
+    REQUIRE(punctuated_second[idx].size() <= second[idx].size() + 1);
+  }
+  REQUIRE(next_context_pieces.size() <= 8);
+
+  SECTION("The first word is capitalized after the end of a sentence") {
+    const std::vector<std::string> punctuated =
+        punctuator.PunctuateWithContext(second, {"sólskin."}, context_pieces,
+                                        nullptr, true);
+    REQUIRE(punctuated[0].rfind("Þú", 0) == 0);
+  }
+}
@@ -0,0 +1,270 @@
+// Copyright 2021 Tiro ehf.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <catch2/catch.hpp>
+#include <cstdint>
+#include <istream>
+#include <limits>
+#include <mutex>
+#include <regex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "src/audio/audio-source.h"
+#include "src/audio/range-fetcher.h"
+#include "src/utils.h"
+
+using namespace tiro_speech;
+
+namespace {
+
+/**
+ * Minimal HTTP/1.1 server that serves a single resource on 127.0.0.1, one
+ * thread per connection, optionally honouring Range requests.
+ */
+class LocalHttpServer {
+ public:
+  LocalHttpServer(std::string body, bool accept_ranges)
+      : body_{std::move(body)}, accept_ranges_{accept_ranges} {
+    listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    REQUIRE(bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr),
+                 sizeof(addr)) == 0);
+    REQUIRE(listen(listen_fd_, 16) == 0);
+    socklen_t addr_len = sizeof(addr);
+    getsockname(listen_fd_, reinterpret_cast<sockaddr*>(&addr), &addr_len);
+    port_ = ntohs(addr.sin_port);
+
+    accept_thread_ = std::thread{[this]() {
+      for (;;) {
+        int fd = accept(listen_fd_, nullptr, nullptr);
+        if (fd < 0) {
+          break;
+        }
+        std::lock_guard<std::mutex> lock{mutex_};
+        connection_threads_.emplace_back([this, fd]() { Serve(fd); });
+      }
+    }};
+  }
+
+  ~LocalHttpServer() {
+    shutdown(listen_fd_, SHUT_RDWR);
+    close(listen_fd_);
+    accept_thread_.join();
+    std::lock_guard<std::mutex> lock{mutex_};
+    for (auto& t : connection_threads_) {
+      t.join();
+    }
+  }
+
+  std::string Url() const {
+    return "http://127.0.0.1:" + std::to_string(port_) + "/audio";
+  }
+
+  int NumRangeRequests() const { return num_range_requests_; }
+
+ private:
+  std::string body_;
+  bool accept_ranges_;
+  int listen_fd_;
+  int port_;
+  std::atomic<int> num_range_requests_{0};
+  std::mutex mutex_;
+  std::thread accept_thread_;
+  std::vector<std::thread> connection_threads_;
+
+  void Serve(int fd) {
+    std::string request;
+    char buf[1024];
+    while (request.find("\r\n\r\n") == std::string::npos) {
+      ssize_t n = recv(fd, buf, sizeof(buf), 0);
+      if (n <= 0) {
+        close(fd);
+        return;
+      }
+      request.append(buf, n);
+    }
+
+    std::int64_t begin = 0;
+    std::int64_t end = body_.size();
+    std::string status = "200 OK";
+    std::string headers;
+    std::smatch match;
+    const std::regex range_re{"Range: bytes=(\\d+)-(\\d*)", std::regex::icase};
+    if (accept_ranges_) {
+      headers += "Accept-Ranges: bytes\r\n";
+      if (std::regex_search(request, match, range_re)) {
+        num_range_requests_++;
+        begin = std::stoll(match[1]);
+        if (match[2].length() > 0) {
+          end = std::min<std::int64_t>(std::stoll(match[2]) + 1, end);
+        }
+        status = "206 Partial Content";
+        headers += "Content-Range: bytes " + std::to_string(begin) + "-" +
+                   std::to_string(end - 1) + "/" +
+                   std::to_string(body_.size()) + "\r\n";
+      }
+    }
+    const std::string response_head =
+        "HTTP/1.1 " + status + "\r\nContent-Length: " +
+        std::to_string(end - begin) + "\r\n" + headers +
+        "Content-Type: application/octet-stream\r\nConnection: close\r\n\r\n";
+    // Clients may hang up early, so don't let SIGPIPE kill the test
+    if (send(fd, response_head.data(), response_head.size(), MSG_NOSIGNAL) >
+        0) {
+      for (std::int64_t sent = begin; sent < end;) {
+        ssize_t n = send(fd, body_.data() + sent, end - sent, MSG_NOSIGNAL);
+        if (n <= 0) {
+          break;
+        }
+        sent += n;
+      }
+    }
+    close(fd);
+  }
+};
+
+}  // namespace
+
+TEST_CASE("Byte ranges cover the whole resource", "[audio-source][http]") {
+  REQUIRE(SplitIntoByteRanges(0, 4, 10).empty());
+  REQUIRE(SplitIntoByteRanges(5, 4, 10) == std::vector<ByteRange>{{0, 5}});
+
+  for (std::int64_t size : {10, 99, 100, 101, 12345}) {
+    auto ranges = SplitIntoByteRanges(size, 4, 10);
+    REQUIRE(!ranges.empty());
+    REQUIRE(ranges.size() <= 4);
+    REQUIRE(ranges.front().first == 0);
+    REQUIRE(ranges.back().second == size);
+    for (std::size_t i = 1; i < ranges.size(); ++i) {
+      REQUIRE(ranges[i].first == ranges[i - 1].second);
+    }
+  }
+}
+
+TEST_CASE("RangeFetcher fetches resources from a local HTTP server",
+          "[audio-source][http]") {
+  const std::string content = GetFileContents("test/example.mp3");
+  REQUIRE(!content.empty());
+
+  SECTION("Seekable resources are fetched in parallel ranges") {
+    LocalHttpServer server{content, /* accept_ranges */ true};
+    RangeFetcher fetcher{server.Url()};
+    REQUIRE(fetcher.SupportsRanges());
+    REQUIRE(fetcher.Size() == static_cast<std::int64_t>(content.size()));
+    REQUIRE(fetcher.Fetch(4, content.size() / 8) == content);
+    // libavformat asks for "bytes=0-" on the probing request as well
+    REQUIRE(server.NumRangeRequests() == 4);
+  }
+
+  SECTION("Other resources are read sequentially") {
+    LocalHttpServer server{content, /* accept_ranges */ false};
+    RangeFetcher fetcher{server.Url()};
+    REQUIRE(!fetcher.SupportsRanges());
+    REQUIRE(fetcher.Fetch(4, content.size() / 8) == content);
+    REQUIRE(server.NumRangeRequests() == 0);
+  }
+}
+
+TEST_CASE("ParallelUriAudioSource decodes the same audio as content",
+          "[audio-source][http]") {
+  const std::string content = GetFileContents("test/example.mp3");
+  LocalHttpServer server{content, /* accept_ranges */ true};
+
+  ContentAudioSource content_source{
+      AudioSourceInfo{AudioSourceInfo::Type::kContent, AudioEncoding::MP3,
+                      16000},
+      content};
+  ParallelUriAudioSource uri_source{
+      AudioSourceInfo{AudioSourceInfo::Type::kUri, AudioEncoding::MP3, 16000},
+      server.Url(), 16000, /* max_connections */ 4,
+      /* min_range_size */ 1024};
+  REQUIRE(!uri_source.HasMoreChunks());
+  uri_source.Open();
+  REQUIRE(uri_source.HasMoreChunks());
+  REQUIRE(uri_source.IsStreamed());
+  REQUIRE(uri_source.Full().ApproxEqual(content_source.Full()));
+  REQUIRE(!uri_source.HasMoreChunks());
+}
+
+TEST_CASE("RangeStreamBuf reads ranges in order", "[audio-source][http]") {
+  const std::string content = GetFileContents("test/example.mp3");
+  LocalHttpServer server{content, /* accept_ranges */ true};
+  const std::int64_t range_size = content.size() / 16;
+
+  RangeStreamBuf buf{RangeFetcher{server.Url()}, /* max_connections */ 2,
+                     range_size};
+  std::istream is{&buf};
+  is.exceptions(std::ios::badbit);
+  std::string read;
+  char piece[1000];
+  while (is.read(piece, sizeof(piece)) || is.gcount() > 0) {
+    read.append(piece, is.gcount());
+  }
+  REQUIRE(read == content);
+  REQUIRE(server.NumRangeRequests() ==
+          static_cast<int>(SplitIntoByteRanges(content.size(),
+                                               std::numeric_limits<int>::max(),
+                                               range_size)
+                               .size()));
+}
+
+TEST_CASE("ParallelUriAudioSource streams LINEAR16 WAV files",
+          "[audio-source][http]") {
+  constexpr int kNumChannels = 2;
+  constexpr int kSampleRate = 8000;
+  constexpr int kNumFrames = 3 * kSampleRate;
+  std::string samples;
+  for (int i = 0; i < kNumFrames * kNumChannels; ++i) {
+    const std::int16_t sample = (i * 37) % 2000 - 1000;
+    samples.push_back(static_cast<char>(sample & 0xff));
+    samples.push_back(static_cast<char>((sample >> 8) & 0xff));
+  }
+  auto little_endian = [](std::uint32_t value, int num_bytes) {
+    std::string bytes;
+    for (int idx = 0; idx < num_bytes; ++idx) {
+      bytes.push_back(static_cast<char>((value >> (8 * idx)) & 0xff));
+    }
+    return bytes;
+  };
+  const std::string fmt =
+      little_endian(kWavFormatPcm, 2) + little_endian(kNumChannels, 2) +
+      little_endian(kSampleRate, 4) +
+      little_endian(kSampleRate * 2 * kNumChannels, 4) +
+      little_endian(2 * kNumChannels, 2) + little_endian(16, 2);
+  const std::string wav = "RIFF" + little_endian(36 + samples.size(), 4) +
+                          "WAVEfmt " + little_endian(fmt.size(), 4) + fmt +
+                          "data" + little_endian(samples.size(), 4) + samples;
+  LocalHttpServer server{wav, /* accept_ranges */ true};
+
+  const AudioSourceInfo info{AudioSourceInfo::Type::kUri,
+                             AudioEncoding::LINEAR16, kSampleRate,
+                             kNumChannels};
+  ContentAudioSource content_source{info, samples, 16000};
+  ParallelUriAudioSource uri_source{info, server.Url(), 16000,
+                                    /* max_connections */ 2,
+                                    /* min_range_size */ 4096};
+  uri_source.Open();
+  REQUIRE(uri_source.Full().ApproxEqual(content_source.Full()));
+  REQUIRE(server.NumRangeRequests() > 2);
+}
@@ -0,0 +1,173 @@
+// Copyright 2021 Tiro ehf.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <catch2/catch.hpp>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <string>
+
+#include "src/api/result-cache.h"
+
+using namespace tiro_speech;
+using tiro::speech::v1alpha::RecognizeRequest;
+using tiro::speech::v1alpha::RecognizeResponse;
+
+namespace {
+
+RecognizeRequest MakeRequest(const std::string& content) {
+  RecognizeRequest request;
+  auto* config = request.mutable_config();
+  config->set_encoding(tiro::speech::v1alpha::RecognitionConfig::LINEAR16);
+  config->set_sample_rate_hertz(16000);
+  config->set_language_code("is-IS");
+  request.mutable_audio()->set_content(content);
+  return request;
+}
+
+RecognizeResponse MakeResponse(const std::string& transcript) {
+  RecognizeResponse response;
+  response.add_results()->add_alternatives()->set_transcript(transcript);
+  return response;
+}
+
+std::filesystem::path TestCacheDir() {
+  std::filesystem::path cache_dir = std::filesystem::temp_directory_path();
+  if (const char* tmpdir = std::getenv("TEST_TMPDIR"); tmpdir != nullptr) {
+    cache_dir = tmpdir;
+  }
+  cache_dir /= "result-cache";
+  std::filesystem::remove_all(cache_dir);
+  return cache_dir;
+}
+
+}  // namespace
+
+TEST_CASE("Result cache keys depend on audio and config", "[api][cache]") {
+  RecognizeResultCacheOptions opts;
+  opts.max_entries = 10;
+  RecognizeResultCache cache{opts};
+
+  RecognizeRequest request = MakeRequest("abcd");
+  const std::string key = cache.Key(request, "model-a");
+  REQUIRE(key.size() == 64);
+  REQUIRE(cache.Key(MakeRequest("abcd"), "model-a") == key);
+  REQUIRE(cache.Key(MakeRequest("abce"), "model-a") != key);
+  REQUIRE(cache.Key(request, "model-b") != key);
+
+  RecognizeRequest punctuated = request;
+  punctuated.mutable_config()->set_enable_automatic_punctuation(true);
+  REQUIRE(cache.Key(punctuated, "model-a") != key);
+
+  RecognizeRequest with_offsets = request;
+  with_offsets.mutable_config()->set_enable_word_time_offsets(true);
+  REQUIRE(cache.Key(with_offsets, "model-a") != key);
+
+  RecognizeResultCacheOptions tagged_opts = opts;
+  tagged_opts.version_tag = "v2";
+  REQUIRE(RecognizeResultCache{tagged_opts}.Key(request, "model-a") != key);
+
+  SECTION("URI requests are only cached if enabled") {
+    RecognizeRequest uri_request = MakeRequest("");
+    uri_request.mutable_audio()->set_uri("https://example.com/a.mp3");
+    REQUIRE(cache.Key(uri_request, "model-a").empty());
+
+    RecognizeResultCacheOptions uri_opts = opts;
+    uri_opts.cache_uri_requests = true;
+    const std::string uri_key =
+        RecognizeResultCache{uri_opts}.Key(uri_request, "model-a");
+    REQUIRE_FALSE(uri_key.empty());
+    REQUIRE(uri_key != key);
+  }
+}
+
+TEST_CASE("Result cache evicts least recently used entries", "[api][cache]") {
+  RecognizeResultCacheOptions opts;
+  opts.max_entries = 2;
+  RecognizeResultCache cache{opts};
+
+  cache.Insert("a", MakeResponse("a"));
+  cache.Insert("b", MakeResponse("b"));
+
+  RecognizeResponse response;
+  REQUIRE(cache.Lookup("a", &response));
+  REQUIRE(response.results(0).alternatives(0).transcript() == "a");
+
+  // "b" is now the least recently used entry
+  cache.Insert("c", MakeResponse("c"));
+  REQUIRE_FALSE(cache.Lookup("b", &response));
+  REQUIRE(cache.Lookup("a", &response));
+  REQUIRE(cache.Lookup("c", &response));
+  REQUIRE(response.results(0).alternatives(0).transcript() == "c");
+
+  REQUIRE(cache.Hits() == 3);
+  REQUIRE(cache.Misses() == 1);
+}
+
+TEST_CASE("Result cache entries persist on disk", "[api][cache]") {
+  const std::filesystem::path cache_dir = TestCacheDir();
+
+  RecognizeResultCacheOptions opts;
+  opts.disk_cache_dir = cache_dir.string();
+  {
+    RecognizeResultCache cache{opts};
+    cache.Insert("a", MakeResponse("persisted"));
+  }
+
+  RecognizeResultCache cache{opts};
+  RecognizeResponse response;
+  REQUIRE(cache.Lookup("a", &response));
+  REQUIRE(response.results(0).alternatives(0).transcript() == "persisted");
+  REQUIRE_FALSE(cache.Lookup("b", &response));
+
+  std::filesystem::remove_all(cache_dir);
+}
+
+TEST_CASE("Result cache evicts least recently used entries from disk",
+          "[api][cache]") {
+  const std::filesystem::path cache_dir = TestCacheDir();
+
+  RecognizeResultCacheOptions opts;
+  opts.disk_cache_dir = cache_dir.string();
+  opts.disk_max_megabytes = 1;
+  // Lookups only refresh entries on disk if they miss in memory
+  opts.max_entries = 0;
+  RecognizeResultCache cache{opts};
+  // Three of these fit in a megabyte, but not four
+  const std::string transcript(300 << 10, 'x');
+
+  // Modification times record the last use. Set them explicitly, so "b" is
+  // the oldest regardless of the file system's timestamp resolution.
+  const auto now = std::filesystem::file_time_type::clock::now();
+  const auto minutes_ago = [&now](int minutes) {
+    return now - std::chrono::minutes{minutes};
+  };
+  for (const std::string key : {"a", "b", "c"}) {
+    cache.Insert(key, MakeResponse(transcript));
+  }
+  std::filesystem::last_write_time(cache_dir / "a.pb", minutes_ago(30));
+  std::filesystem::last_write_time(cache_dir / "b.pb", minutes_ago(20));
+  std::filesystem::last_write_time(cache_dir / "c.pb", minutes_ago(10));
+
+  // Refreshes "a", which leaves "b" as the least recently used entry
+  RecognizeResponse response;
+  REQUIRE(cache.Lookup("a", &response));
+  cache.Insert("d", MakeResponse(transcript));
+
+  REQUIRE(std::filesystem::exists(cache_dir / "a.pb"));
+  REQUIRE_FALSE(std::filesystem::exists(cache_dir / "b.pb"));
+  REQUIRE(std::filesystem::exists(cache_dir / "c.pb"));
+  REQUIRE(std::filesystem::exists(cache_dir / "d.pb"));
+
+  std::filesystem::remove_all(cache_dir);
+}
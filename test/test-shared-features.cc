@@ -0,0 +1,176 @@
+// Copyright 2021 Tiro ehf.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <feat/feature-fbank.h>
+#include <feat/feature-mfcc.h>
+#include <feat/online-feature.h>
+#include <online2/online-nnet2-feature-pipeline.h>
+
+#include <catch2/catch.hpp>
+#include <optional>
+
+#include "src/audio/audio.h"
+#include "src/shared-features.h"
+
+using namespace tiro_speech;
+
+namespace {
+
+constexpr float kSampleRate = 16000;
+
+Vector ReadTestWaveform() {
+  Vector waveform;
+  Linear16BytesToWaveVector(ReadWaveFile("test/only_speech_16000hz.wav"),
+                            &waveform);
+  return waveform;
+}
+
+kaldi::Matrix<float> AllFrames(kaldi::OnlineFeatureInterface* features) {
+  kaldi::Matrix<float> frames(features->NumFramesReady(), features->Dim());
+  for (int row = 0; row < frames.NumRows(); ++row) {
+    kaldi::SubVector<float> frame{frames, row};
+    features->GetFrame(row, &frame);
+  }
+  return frames;
+}
+
+kaldi::Matrix<float> ComputeFeatures(kaldi::OnlineBaseFeature* features,
+                                     const Vector& waveform) {
+  features->AcceptWaveform(kSampleRate, waveform);
+  features->InputFinished();
+  return AllFrames(features);
+}
+
+kaldi::Matrix<float> DeriveFeatures(const kaldi::Matrix<float>& transform,
+                                    const kaldi::Matrix<float>& asr_feats) {
+  OnlineDerivedFeature derived{transform, 0.01f};
+  derived.AcceptFeatures(asr_feats);
+  derived.InputFinished();
+  return AllFrames(&derived);
+}
+
+void SetMelBanks(kaldi::FrameExtractionOptions* frame_opts,
+                 kaldi::MelBanksOptions* mel_opts) {
+  frame_opts->dither = 0.0f;
+  mel_opts->num_bins = 40;
+  mel_opts->low_freq = 20;
+  mel_opts->high_freq = -400;
+}
+
+kaldi::MfccOptions HiresMfccOptions() {
+  kaldi::MfccOptions opts;
+  SetMelBanks(&opts.frame_opts, &opts.mel_opts);
+  opts.num_ceps = 40;
+  return opts;
+}
+
+kaldi::MfccOptions DiarizationMfccOptions() {
+  kaldi::MfccOptions opts;
+  SetMelBanks(&opts.frame_opts, &opts.mel_opts);
+  opts.num_ceps = 23;
+  return opts;
+}
+
+}  // namespace
+
+TEST_CASE("Diarization MFCCs are derived from hires MFCCs",
+          "[shared-features]") {
+  const bool use_energy = GENERATE(false, true);
+  kaldi::OnlineNnet2FeaturePipelineInfo asr_info;
+  asr_info.feature_type = "mfcc";
+  asr_info.mfcc_opts = HiresMfccOptions();
+  asr_info.mfcc_opts.use_energy = use_energy;
+  kaldi::MfccOptions mfcc_opts = DiarizationMfccOptions();
+  mfcc_opts.use_energy = use_energy;
+
+  const std::optional<kaldi::Matrix<float>> transform =
+      MfccDerivation(asr_info, mfcc_opts);
+  REQUIRE(transform.has_value());
+
+  const Vector waveform = ReadTestWaveform();
+  kaldi::OnlineMfcc asr_mfcc{asr_info.mfcc_opts};
+  kaldi::OnlineMfcc mfcc{mfcc_opts};
+  const kaldi::Matrix<float> expected = ComputeFeatures(&mfcc, waveform);
+  const kaldi::Matrix<float> derived =
+      DeriveFeatures(*transform, ComputeFeatures(&asr_mfcc, waveform));
+  REQUIRE(derived.NumRows() == expected.NumRows());
+  REQUIRE(derived.NumCols() == expected.NumCols());
+  REQUIRE(derived.ApproxEqual(expected, 1e-4));
+}
+
+TEST_CASE("Diarization MFCCs are derived from log filterbanks",
+          "[shared-features]") {
+  const bool use_energy = GENERATE(false, true);
+  kaldi::OnlineNnet2FeaturePipelineInfo asr_info;
+  asr_info.feature_type = "fbank";
+  SetMelBanks(&asr_info.fbank_opts.frame_opts, &asr_info.fbank_opts.mel_opts);
+  asr_info.fbank_opts.use_energy = use_energy;
+  kaldi::MfccOptions mfcc_opts = DiarizationMfccOptions();
+  mfcc_opts.use_energy = use_energy;
+
+  const std::optional<kaldi::Matrix<float>> transform =
+      MfccDerivation(asr_info, mfcc_opts);
+  REQUIRE(transform.has_value());
+
+  const Vector waveform = ReadTestWaveform();
+  kaldi::OnlineFbank asr_fbank{asr_info.fbank_opts};
+  kaldi::OnlineMfcc mfcc{mfcc_opts};
+  const kaldi::Matrix<float> expected = ComputeFeatures(&mfcc, waveform);
+  const kaldi::Matrix<float> derived =
+      DeriveFeatures(*transform, ComputeFeatures(&asr_fbank, waveform));
+  REQUIRE(derived.ApproxEqual(expected, 1e-4));
+}
+
+TEST_CASE("MFCCs aren't derived from incompatible front-ends",
+          "[shared-features]") {
+  kaldi::OnlineNnet2FeaturePipelineInfo asr_info;
+  asr_info.feature_type = "mfcc";
+  asr_info.mfcc_opts = HiresMfccOptions();
+
+  kaldi::MfccOptions fewer_bins = DiarizationMfccOptions();
+  fewer_bins.mel_opts.num_bins = 30;
+  REQUIRE_FALSE(MfccDerivation(asr_info, fewer_bins).has_value());
+
+  kaldi::MfccOptions other_shift = DiarizationMfccOptions();
+  other_shift.frame_opts.frame_shift_ms = 15;
+  REQUIRE_FALSE(MfccDerivation(asr_info, other_shift).has_value());
+
+  kaldi::MfccOptions more_ceps = HiresMfccOptions();
+  more_ceps.num_ceps = 41;
+  REQUIRE_FALSE(MfccDerivation(asr_info, more_ceps).has_value());
+
+  asr_info.feature_type = "plp";
+  REQUIRE_FALSE(
+      MfccDerivation(asr_info, DiarizationMfccOptions()).has_value());
+}
+
+TEST_CASE("Shared front-end cost per request",
+          "[shared-features][.benchmark]") {
+  kaldi::OnlineNnet2FeaturePipelineInfo asr_info;
+  asr_info.feature_type = "mfcc";
+  asr_info.mfcc_opts = HiresMfccOptions();
+  const kaldi::MfccOptions mfcc_opts = DiarizationMfccOptions();
+  const kaldi::Matrix<float> transform = *MfccDerivation(asr_info, mfcc_opts);
+  const Vector waveform = ReadTestWaveform();
+
+  BENCHMARK("ASR and diarization MFCCs computed separately") {
+    kaldi::OnlineMfcc asr_mfcc{asr_info.mfcc_opts};
+    kaldi::OnlineMfcc mfcc{mfcc_opts};
+    ComputeFeatures(&asr_mfcc, waveform);
+    return ComputeFeatures(&mfcc, waveform);
+  };
+  BENCHMARK("Diarization MFCCs derived from ASR MFCCs") {
+    kaldi::OnlineMfcc asr_mfcc{asr_info.mfcc_opts};
+    return DeriveFeatures(transform, ComputeFeatures(&asr_mfcc, waveform));
+  };
+}
@@ -0,0 +1,251 @@
+// Copyright 2021 Tiro ehf.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <catch2/catch.hpp>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "src/audio/audio.h"
+#include "src/nnet-vad.h"
+#include "src/utils.h"
+#include "src/vad.h"
+
+using namespace tiro_speech;
+
+namespace {
+
+constexpr int kSampleRate = 16000;
+
+/**
+ * Speech interleaved with white noise at each of \p noise_levels, labelled per
+ * sample. A noise level of 0 is digital silence.
+ */
+void MakeLabelledAudio(const std::vector<float>& noise_levels,
+                       Vector* waveform, std::vector<bool>* labels) {
+  Vector speech;
+  Linear16BytesToWaveVector(ReadWaveFile("test/only_speech_16000hz.wav"),
+                            &speech);
+  std::mt19937 rng{42};
+  std::vector<Vector> segments;
+  std::vector<bool> segment_labels;
+  for (float noise_level : noise_levels) {
+    Vector non_speech{2 * kSampleRate};
+    if (noise_level > 0.0f) {
+      std::normal_distribution<float> noise{0.0f, noise_level};
+      for (int i = 0; i < non_speech.Dim(); ++i) {
+        non_speech(i) = noise(rng);
+      }
+    }
+    segments.push_back(non_speech);
+    segment_labels.push_back(false);
+    segments.push_back(speech);
+    segment_labels.push_back(true);
+  }
+
+  int dim = 0;
+  for (const Vector& segment : segments) {
+    dim += segment.Dim();
+  }
+  waveform->Resize(dim);
+  labels->clear();
+  for (std::size_t i = 0; i < segments.size(); ++i) {
+    waveform->Range(labels->size(), segments[i].Dim())
+        .CopyFromVec(segments[i]);
+    labels->insert(labels->end(), segments[i].Dim(), segment_labels[i]);
+  }
+}
+
+struct VadAccuracy {
+  double false_rejection_rate;
+  double false_acceptance_rate;
+};
+
+/**
+ * A frame is labelled as speech if its first sample is.
+ */
+VadAccuracy EvaluateVad(VadEngine* engine, const VectorBase& waveform,
+                        const std::vector<bool>& labels) {
+  const std::vector<bool> decisions = engine->DetectSpeech(waveform);
+  int n_speech = 0, n_non_speech = 0, n_rejected = 0, n_accepted = 0;
+  for (std::size_t i = 0; i < decisions.size(); ++i) {
+    if (labels[i * engine->NumSamplesPerFrame()]) {
+      n_speech++;
+      n_rejected += decisions[i] ? 0 : 1;
+    } else {
+      n_non_speech++;
+      n_accepted += decisions[i] ? 1 : 0;
+    }
+  }
+  return {static_cast<double>(n_rejected) / std::max(n_speech, 1),
+          static_cast<double>(n_accepted) / std::max(n_non_speech, 1)};
+}
+
+}  // namespace
+
+TEST_CASE("VadGate skips silence and releases pre-roll", "[vad]") {
+  constexpr int kChunkSamples = 4800;  // 300 ms
+
+  Vector speech;
+  Linear16BytesToWaveVector(ReadWaveFile("test/only_speech_16000hz.wav"),
+                            &speech);
+  REQUIRE(speech.Dim() > kChunkSamples);
+  const Vector silence{kChunkSamples};
+
+  VadGateOptions opts;
+  opts.preroll_ms = 400;
+  opts.hangover_ms = 600;
+  opts.continuous = true;
+  VadGate gate{kSampleRate, opts};
+
+  Vector out;
+  for (int i = 0; i < 5; ++i) {
+    REQUIRE_FALSE(gate.Accept(silence, &out));
+  }
+  REQUIRE_FALSE(gate.IsOpen());
+
+  const auto speech_chunk = speech.Range(0, kChunkSamples);
+  REQUIRE(gate.Accept(speech_chunk, &out));
+  REQUIRE(gate.IsOpen());
+  REQUIRE(gate.ReleasedPrerollSamples() == 400 * kSampleRate / 1000);
+  REQUIRE(out.Dim() == gate.ReleasedPrerollSamples() + kChunkSamples);
+
+  SECTION("Gate stays open during hangover and closes after it") {
+    REQUIRE(gate.Accept(silence, &out));
+    REQUIRE(gate.ReleasedPrerollSamples() == 0);
+    REQUIRE(out.Dim() == kChunkSamples);
+    REQUIRE(gate.Accept(silence, &out));
+    REQUIRE_FALSE(gate.Accept(silence, &out));
+    REQUIRE_FALSE(gate.IsOpen());
+  }
+
+  SECTION("Gate never closes by itself unless continuous") {
+    VadGateOptions non_continuous_opts;
+    REQUIRE_FALSE(non_continuous_opts.continuous);
+    VadGate non_continuous_gate{kSampleRate, non_continuous_opts};
+    REQUIRE(non_continuous_gate.Accept(speech_chunk, &out));
+    for (int i = 0; i < 5; ++i) {
+      REQUIRE(non_continuous_gate.Accept(silence, &out));
+    }
+    non_continuous_gate.Close();
+    REQUIRE_FALSE(non_continuous_gate.Accept(silence, &out));
+  }
+}
+
+TEST_CASE("Energy VAD separates speech from silence", "[vad]") {
+  Vector waveform;
+  std::vector<bool> labels;
+  // Loud noise passes for speech until the noise floor has caught up with it,
+  // so only silence and faint noise are used here
+  MakeLabelledAudio({0.0f, 30.0f}, &waveform, &labels);
+
+  EnergyVad vad{kSampleRate, 30, 12.0f};
+  REQUIRE_FALSE(vad.HasSpeech(Vector{kSampleRate}));
+
+  const VadAccuracy accuracy = EvaluateVad(&vad, waveform, labels);
+  REQUIRE(accuracy.false_rejection_rate < 0.5);
+  REQUIRE(accuracy.false_acceptance_rate < 0.1);
+}
+
+TEST_CASE("VAD engine accuracy and cost", "[vad][.benchmark]") {
+  Vector waveform;
+  std::vector<bool> labels;
+  MakeLabelledAudio({0.0f, 30.0f, 300.0f, 1000.0f}, &waveform, &labels);
+
+  std::vector<std::pair<std::string, VadEngineOptions>> configs;
+  for (int mode = 0; mode <= 3; ++mode) {
+    VadEngineOptions opts;
+    opts.webrtc_mode = mode;
+    configs.emplace_back(fmt::format("webrtc mode {}", mode), opts);
+  }
+  for (float threshold_db : {6.0f, 12.0f, 18.0f}) {
+    VadEngineOptions opts;
+    opts.engine = "energy";
+    opts.energy_threshold_db = threshold_db;
+    configs.emplace_back(fmt::format("energy {} dB", threshold_db), opts);
+  }
+
+  auto evaluate = [&](const std::string& name, VadEngine* engine) {
+    BENCHMARK(name) { return engine->DetectSpeech(waveform); };
+  };
+
+  for (const auto& [name, opts] : configs) {
+    std::unique_ptr<VadEngine> engine = CreateVadEngine(opts, kSampleRate);
+    evaluate(name, engine.get());
+  }
+
+  // Set TIRO_SPEECH_NNET_VAD_MODEL to a TorchScript VAD to include it
+  if (const char* model_filename = std::getenv("TIRO_SPEECH_NNET_VAD_MODEL");
+      model_filename != nullptr) {
+    NnetVadConfig nnet_opts;
+    nnet_opts.pytorch_jit_model_filename = model_filename;
+    NnetVad engine{std::make_shared<NnetVadModel>(nnet_opts, kSampleRate, 30)};
+    evaluate("nnet", &engine);
+  }
+}
+
+TEST_CASE("Continuous VadGate skips most of mostly silent audio", "[vad]") {
+  // Speech followed by 20 seconds of faint noise, a few times over
+  Vector speech;
+  Linear16BytesToWaveVector(ReadWaveFile("test/only_speech_16000hz.wav"),
+                            &speech);
+  std::mt19937 rng{42};
+  std::normal_distribution<float> noise{0.0f, 30.0f};
+  const int period = speech.Dim() + 20 * kSampleRate;
+  Vector waveform{4 * period};
+  for (int offset = 0; offset < waveform.Dim(); offset += period) {
+    waveform.Range(offset, speech.Dim()).CopyFromVec(speech);
+    for (int i = offset + speech.Dim(); i < offset + period; ++i) {
+      waveform(i) = noise(rng);
+    }
+  }
+
+  // Chunks are fed the same way as StreamingRecognize does, which starts a
+  // new segment each time the gate closes
+  constexpr int kChunkSamples = kSampleRate / 10;
+  auto count_passed = [&](const VadGateOptions& opts, int* num_segments) {
+    VadGate gate{kSampleRate, opts};
+    int passed_samples = 0;
+    *num_segments = 0;
+    for (int offset = 0; offset < waveform.Dim(); offset += kChunkSamples) {
+      const auto chunk = waveform.Range(
+          offset, std::min(kChunkSamples, waveform.Dim() - offset));
+      const bool was_open = gate.IsOpen();
+      Vector out;
+      if (gate.Accept(chunk, &out)) {
+        passed_samples += out.Dim();
+        *num_segments += was_open ? 0 : 1;
+      }
+    }
+    return passed_samples;
+  };
+
+  VadGateOptions opts;
+  opts.engine_opts.engine = "energy";
+  int num_segments = 0;
+  // Without continuous gating everything after the first speech is decoded
+  REQUIRE(count_passed(opts, &num_segments) > waveform.Dim() - period);
+  REQUIRE(num_segments == 1);
+
+  opts.continuous = true;
+  const int passed_samples = count_passed(opts, &num_segments);
+  REQUIRE(num_segments >= 4);
+  REQUIRE(passed_samples >= 4 * speech.Dim());
+  REQUIRE(passed_samples < waveform.Dim() / 2);
+}
@@ -0,0 +1,53 @@
+// Copyright 2021 Tiro ehf.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <catch2/catch.hpp>
+#include <string>
+
+#include "src/api/validation.h"
+
+using namespace tiro_speech;
+
+namespace {
+
+tiro::speech::v1alpha::RecognitionConfig MakeConfig(int audio_channel_count) {
+  tiro::speech::v1alpha::RecognitionConfig config;
+  config.set_encoding(tiro::speech::v1alpha::RecognitionConfig::LINEAR16);
+  config.set_sample_rate_hertz(16000);
+  config.set_language_code("is-IS");
+  config.set_audio_channel_count(audio_channel_count);
+  return config;
+}
+
+bool HasError(const MessageValidationStatus& errors, const std::string& field) {
+  for (const auto& [error_field, message] : errors) {
+    if (error_field == field) {
+      return true;
+    }
+  }
+  return false;
+}
+
+}  // namespace
+
+TEST_CASE("audio_channel_count is validated", "[api][validation]") {
+  // 0 is the default and means a single channel
+  for (int count : {0, 1, kMaxAudioChannelCount}) {
+    INFO("audio_channel_count = " << count);
+    REQUIRE_FALSE(HasError(Validate(MakeConfig(count)), "audio_channel_count"));
+  }
+  for (int count : {-1, kMaxAudioChannelCount + 1}) {
+    INFO("audio_channel_count = " << count);
+    REQUIRE(HasError(Validate(MakeConfig(count)), "audio_channel_count"));
+  }
+}
@@ -12,11 +12,96 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 #include <catch2/catch.hpp>
+#include <fstream>
+#include <random>
 #include <string>
+#include <unordered_set>
 #include <vector>
 
 #include "src/itn/wordpiece.h"
 
+namespace {
+
+/**
+ * The greedy longest-match-first algorithm from BERT, which
+ * WordPieceTokenizer should be equivalent to.
+ */
+std::vector<std::string> ReferenceTokenize(
+    const std::unordered_set<std::string>& vocab,
+    const std::vector<std::string>& words) {
+  std::vector<std::string> word_pieces;
+  for (const std::string& word : words) {
+    if (word.size() > 100) {
+      word_pieces.push_back("[UNK]");
+      continue;
+    }
+    std::vector<std::string> sub_tokens;
+    std::size_t start = 0;
+    while (start < word.size()) {
+      std::size_t end = word.size();
+      std::string piece;
+      for (; start < end; --end) {
+        std::string substr = word.substr(start, end - start);
+        if (start > 0) {
+          substr = "##" + substr;
+        }
+        if (vocab.count(substr) == 1) {
+          piece = substr;
+          break;
+        }
+      }
+      if (piece.empty()) {
+        break;
+      }
+      sub_tokens.push_back(piece);
+      start = end;
+    }
+    if (start < word.size()) {
+      word_pieces.push_back("[UNK]");
+    } else {
+      word_pieces.insert(word_pieces.end(), sub_tokens.begin(),
+                         sub_tokens.end());
+    }
+  }
+  return word_pieces;
+}
+
+std::vector<std::string> ReadVocab(const std::string& filename) {
+  std::ifstream vocab_file{filename};
+  std::vector<std::string> vocab;
+  for (std::string line; std::getline(vocab_file, line);) {
+    vocab.push_back(line);
+  }
+  return vocab;
+}
+
+/**
+ * Words made of random word pieces from \p vocab, some with a random byte
+ * thrown in so they may not be tokenizable.
+ */
+std::vector<std::string> RandomWords(const std::vector<std::string>& vocab,
+                                     std::size_t n_words) {
+  std::mt19937 rng{42};
+  std::uniform_int_distribution<std::size_t> piece_dist{0, vocab.size() - 1};
+  std::uniform_int_distribution<int> n_pieces_dist{1, 4};
+  std::uniform_int_distribution<int> byte_dist{0, 255};
+  std::vector<std::string> words;
+  for (std::size_t i = 0; i < n_words; ++i) {
+    std::string word;
+    for (int n = n_pieces_dist(rng); n > 0; --n) {
+      const std::string& piece = vocab[piece_dist(rng)];
+      word += piece.rfind("##", 0) == 0 ? piece.substr(2) : piece;
+    }
+    if (i % 10 == 0) {
+      word.insert(word.size() / 2, 1, static_cast<char>(byte_dist(rng)));
+    }
+    words.push_back(std::move(word));
+  }
+  return words;
+}
+
+}  // namespace
+
 TEST_CASE("WordPieceTokenizer", "[itn]") {
   using namespace tiro_speech::itn;
   WordPieceTokenizerConfig opts;
@@ -69,3 +154,67 @@ TEST_CASE("WordPieceTokenizer", "[itn]") {
                  Catch::Matchers::Equals(expected_words));
   }
 }
+
+TEST_CASE("WordPieceTokenizer matches greedy longest match", "[itn]") {
+  using namespace tiro_speech::itn;
+  WordPieceTokenizerConfig opts;
+  opts.vocab_filename = "test/wordpiece-vocab.txt";
+  WordPieceTokenizer tokenizer{opts};
+
+  const std::vector<std::string> vocab_list = ReadVocab(opts.vocab_filename);
+  REQUIRE_FALSE(vocab_list.empty());
+  const std::unordered_set<std::string> vocab{vocab_list.begin(),
+                                              vocab_list.end()};
+
+  std::vector<std::string> words{"",
+                                 "Anna",
+                                 "túlkar",
+                                 "##varna",
+                                 "sóttvarnalæknis",
+                                 "\xff\xfe",
+                                 "[UNK]",
+                                 std::string(100, 'a'),
+                                 std::string(101, 'a')};
+  const std::vector<std::string> random_words = RandomWords(vocab_list, 5000);
+  words.insert(words.end(), random_words.begin(), random_words.end());
+
+  const std::vector<std::string> expected = ReferenceTokenize(vocab, words);
+  REQUIRE_THAT(tokenizer.Tokenize(words), Catch::Matchers::Equals(expected));
+  REQUIRE_THAT(tokenizer.TokenizeToIds(words),
+               Catch::Matchers::Equals(tokenizer.TokensToIds(expected)));
+
+  SECTION("Tokenizing a word appends to the buffer") {
+    std::vector<WordPieceTokenizer::Id> ids{42};
+    tokenizer.TokenizeToIds("sóttvarnalæknis", &ids);
+    tokenizer.TokenizeToIds("\xff", &ids);
+    const std::vector<WordPieceTokenizer::Id> expected_ids{42, 4244, 11035,
+                                                           13326, 1};
+    REQUIRE_THAT(ids, Catch::Matchers::Equals(expected_ids));
+  }
+}
+
+TEST_CASE("WordPieceTokenizer speed", "[itn][.benchmark]") {
+  using namespace tiro_speech::itn;
+  WordPieceTokenizerConfig opts;
+  opts.vocab_filename = "test/wordpiece-vocab.txt";
+  WordPieceTokenizer tokenizer{opts};
+
+  const std::vector<std::string> vocab_list = ReadVocab(opts.vocab_filename);
+  const std::unordered_set<std::string> vocab{vocab_list.begin(),
+                                              vocab_list.end()};
+  const std::vector<std::string> words = RandomWords(vocab_list, 10000);
+
+  BENCHMARK("Greedy longest match with substrings") {
+    return ReferenceTokenize(vocab, words);
+  };
+  BENCHMARK("Tokenize") { return tokenizer.Tokenize(words); };
+  BENCHMARK("TokenizeToIds") { return tokenizer.TokenizeToIds(words); };
+  std::vector<WordPieceTokenizer::Id> ids;
+  BENCHMARK("TokenizeToIds with a reused buffer") {
+    ids.clear();
+    for (const std::string& word : words) {
+      tokenizer.TokenizeToIds(word, &ids);
+    }
+    return ids.size();
+  };
+}